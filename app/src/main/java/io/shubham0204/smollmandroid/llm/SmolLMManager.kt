@@ -16,6 +16,7 @@
 
 package io.shubham0204.smollmandroid.llm
 
+import android.content.Context
 import android.util.Log
 import io.shubham0204.smollm.SmolLM
 import io.shubham0204.smollmandroid.data.AppDB
@@ -27,6 +28,7 @@ import kotlinx.coroutines.Job
 import kotlinx.coroutines.launch
 import kotlinx.coroutines.withContext
 import org.koin.core.annotation.Single
+import java.io.File
 import java.util.concurrent.atomic.AtomicBoolean
 import java.util.concurrent.locks.ReentrantLock
 import kotlin.concurrent.withLock
@@ -36,9 +38,13 @@ private const val LOGTAG = "[SmolLMManager-Kt]"
 private val LOGD: (String) -> Unit = { Log.d(LOGTAG, it) }
 
 @Single
-class SmolLMManager(private val appDB: AppDB) {
+class SmolLMManager(private val appDB: AppDB, context: Context) {
     private val instance = SmolLM()
 
+    // directory where snapshots of the KV cache are stored, restoring a snapshot
+    // skips decoding the messages of a chat (or a shared system prompt) again
+    private val snapshotsDir = File(context.cacheDir, "kv-snapshots").apply { mkdirs() }.absolutePath
+
     // Use ReentrantLock for thread-safe state management without suspending
     private val stateLock = ReentrantLock()
 
@@ -101,6 +107,13 @@ class SmolLMManager(private val appDB: AppDB) {
                             }
                         }
 
+                        try {
+                            val numRestoredTokens = instance.restoreSnapshot(snapshotsDir)
+                            LOGD("Restored $numRestoredTokens tokens from a KV cache snapshot")
+                        } catch (e: IllegalStateException) {
+                            LOGD("Error restoring KV cache snapshot: ${e.message}")
+                        }
+
                         withContext(Dispatchers.Main) {
                             isInstanceLoaded.set(true)
                             onSuccess()
@@ -181,6 +194,12 @@ class SmolLMManager(private val appDB: AppDB) {
                         appDB.addAssistantMessage(currentChat.id, response)
                     }
 
+                    try {
+                        instance.saveSnapshot(snapshotsDir)
+                    } catch (e: IllegalStateException) {
+                        LOGD("Error saving KV cache snapshot: ${e.message}")
+                    }
+
                     withContext(Dispatchers.Main) {
                         isInferenceOn = false
                         onSuccess(
@@ -0,0 +1,50 @@
+// Helpers shared by the host benchmarks
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <nlohmann/json.hpp>
+#include <sys/resource.h>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+inline double
+elapsedMs(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// nearest-rank percentile, `values` is sorted
+inline double
+percentile(const std::vector<double>& values, double p) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    size_t rank = static_cast<size_t>(p / 100.0 * static_cast<double>(values.size()) + 0.5);
+    return values[std::min(std::max(rank, static_cast<size_t>(1)), values.size()) - 1];
+}
+
+inline json
+summarize(std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    double sum = 0.0;
+    for (double value : values) {
+        sum += value;
+    }
+    return { { "count", values.size() },
+             { "mean", values.empty() ? 0.0 : sum / static_cast<double>(values.size()) },
+             { "p50", percentile(values, 50) },
+             { "p95", percentile(values, 95) },
+             { "p99", percentile(values, 99) },
+             { "max", values.empty() ? 0.0 : values.back() } };
+}
+
+inline long
+peakRssKb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
@@ -0,0 +1,245 @@
+// Replays chat transcripts through LLMInference, the same code path as the app, and reports
+// the latencies a user perceives as JSON: time-to-first-token, per-token latency percentiles,
+// prefill and decode throughput, model load time, peak RSS and the time spent in each stage of the pipeline.
+//
+// A transcript file is a JSON array of conversations:
+//   [{ "name": "...", "system": "...", "messages": [{ "role": "user", "content": "..." }, ...] }]
+// Every user message is sent as a query, in order. Recorded assistant messages are skipped,
+// the responses generated by the model are kept in the conversation instead, so the prompts
+// of later turns depend on the model (use a temperature of 0 for reproducible runs).
+#include "LLMInference.h"
+#include "benchmark_utils.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+struct BenchmarkArgs {
+    std::string modelPath;
+    std::string transcriptsPath;
+    std::string outputPath;
+    int         nThreads    = 4;
+    long        contextSize = 4096;
+    int         nBatch      = 0;
+    int         maxTokens   = 128;
+    float       temperature = 0.0f;
+    uint32_t    seed        = 42;
+};
+
+struct TurnMetrics {
+    std::string conversation;
+    int         turn             = 0;
+    int         promptTokens     = 0;
+    int         reusedTokens     = 0;
+    int         generatedTokens  = 0;
+    double      ttftMs           = 0.0;
+    double      prefillMs        = 0.0;
+    double      decodeMs         = 0.0;
+    bool        reachedMaxTokens = false;
+};
+
+static void
+printUsage(const char* program) {
+    fprintf(stderr,
+            "usage: %s -m MODEL.gguf -t TRANSCRIPTS.json [-o RESULTS.json] [--threads N] [--ctx N] [--batch N]\n"
+            "          [--max-tokens N] [--temperature T] [--seed N]\n",
+            program);
+}
+
+static bool
+parseArgs(int argc, char** argv, BenchmarkArgs& args) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        const char* value = argv[++i];
+        if (arg == "-m" || arg == "--model") {
+            args.modelPath = value;
+        } else if (arg == "-t" || arg == "--transcripts") {
+            args.transcriptsPath = value;
+        } else if (arg == "-o" || arg == "--output") {
+            args.outputPath = value;
+        } else if (arg == "--threads") {
+            args.nThreads = std::atoi(value);
+        } else if (arg == "--ctx") {
+            args.contextSize = std::atol(value);
+        } else if (arg == "--batch") {
+            args.nBatch = std::atoi(value);
+        } else if (arg == "--max-tokens") {
+            args.maxTokens = std::atoi(value);
+        } else if (arg == "--temperature") {
+            args.temperature = static_cast<float>(std::atof(value));
+        } else if (arg == "--seed") {
+            args.seed = static_cast<uint32_t>(std::atol(value));
+        } else {
+            return false;
+        }
+    }
+    return !args.modelPath.empty() && !args.transcriptsPath.empty() && args.maxTokens > 0;
+}
+
+// Sends `query` and generates the response, the latency of every generated token after
+// the first is appended to `tokenLatenciesMs`
+static TurnMetrics
+runTurn(LLMInference& llm, const std::string& query, int maxTokens, std::vector<double>& tokenLatenciesMs) {
+    using clock = std::chrono::steady_clock;
+    TurnMetrics metrics;
+
+    clock::time_point start = clock::now();
+    llm.startCompletion(query.c_str());
+    clock::time_point prefillStart = clock::now();
+    while (llm.prefill() < 1.0f) {
+    }
+    clock::time_point prefillEnd = clock::now();
+    metrics.prefillMs            = elapsedMs(prefillStart, prefillEnd);
+    metrics.promptTokens         = llm.getNumPromptTokens();
+    metrics.reusedTokens         = llm.getNumReusedTokens();
+
+    clock::time_point tokenStart = prefillEnd;
+    while (true) {
+        std::string       piece    = llm.completionLoop();
+        clock::time_point tokenEnd = clock::now();
+        if (piece == "[EOG]") {
+            break;
+        }
+        if (metrics.generatedTokens == 0) {
+            metrics.ttftMs = elapsedMs(start, tokenEnd);
+        } else {
+            double latencyMs = elapsedMs(tokenStart, tokenEnd);
+            tokenLatenciesMs.push_back(latencyMs);
+            metrics.decodeMs += latencyMs;
+        }
+        tokenStart = tokenEnd;
+        if (++metrics.generatedTokens == maxTokens) {
+            // keeps the partial response in the conversation, as the app does when it is stopped
+            llm.stopCompletion();
+            metrics.reachedMaxTokens = true;
+            break;
+        }
+    }
+    return metrics;
+}
+
+int
+main(int argc, char** argv) {
+    BenchmarkArgs args;
+    if (!parseArgs(argc, argv, args)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    std::ifstream transcriptsFile(args.transcriptsPath);
+    if (!transcriptsFile) {
+        fprintf(stderr, "could not open %s\n", args.transcriptsPath.c_str());
+        return 1;
+    }
+    json transcripts = json::parse(transcriptsFile);
+
+    SamplerParams samplerParams;
+    samplerParams.temperature = args.temperature;
+    samplerParams.seed        = args.seed;
+
+    std::vector<TurnMetrics> turns;
+    std::vector<double>      loadMs;
+    std::vector<double>      tokenLatenciesMs;
+    // time spent in each stage of the pipeline, summed over the conversations
+    StageMetrics stageTotals[(size_t) InferenceStage::Count];
+    for (const json& conversation : transcripts) {
+        std::string name = conversation.value("name", "conversation " + std::to_string(loadMs.size()));
+
+        // a new instance per conversation, so that every conversation starts with an empty KV cache
+        auto         loadStart = std::chrono::steady_clock::now();
+        LLMInference llm;
+        llm.loadModel(args.modelPath.c_str(), samplerParams, true, args.contextSize, nullptr, args.nThreads, true,
+                      false, args.nBatch, 0, 0, -1, GGML_TYPE_F16, GGML_TYPE_F16, LLAMA_FLASH_ATTN_TYPE_AUTO, 0,
+                      false, false, nullptr);
+        loadMs.push_back(elapsedMs(loadStart, std::chrono::steady_clock::now()));
+
+        std::string systemPrompt = conversation.value("system", "");
+        if (!systemPrompt.empty()) {
+            llm.addChatMessage(systemPrompt.c_str(), "system");
+        }
+        int turn = 0;
+        for (const json& message : conversation.at("messages")) {
+            if (message.at("role") != "user") {
+                continue;
+            }
+            TurnMetrics metrics  = runTurn(llm, message.at("content").get<std::string>(), args.maxTokens,
+                                           tokenLatenciesMs);
+            metrics.conversation = name;
+            metrics.turn         = turn++;
+            turns.push_back(metrics);
+            fprintf(stderr, "%s #%d: %d prompt tokens, %d generated, TTFT %.1f ms\n", name.c_str(), metrics.turn,
+                    metrics.promptTokens, metrics.generatedTokens, metrics.ttftMs);
+        }
+        InferenceMetricsSnapshot snapshot = llm.getMetrics();
+        for (size_t s = 0; s < (size_t) InferenceStage::Count; s++) {
+            stageTotals[s].count += snapshot.stages[s].count;
+            stageTotals[s].totalUs += snapshot.stages[s].totalUs;
+        }
+    }
+
+    static const char* stageNames[] = { "template", "tokenize", "prefill", "decode", "sample", "detokenize" };
+    json               stagesJson;
+    for (size_t s = 0; s < (size_t) InferenceStage::Count; s++) {
+        stagesJson[stageNames[s]] = { { "count", stageTotals[s].count },
+                                      { "total_ms", (double) stageTotals[s].totalUs / 1000.0 } };
+    }
+
+    json                turnsJson = json::array();
+    std::vector<double> ttftMs;
+    double              prefillTokens = 0.0, prefillMs = 0.0, decodeTokens = 0.0, decodeMs = 0.0;
+    for (const TurnMetrics& metrics : turns) {
+        turnsJson.push_back({ { "conversation", metrics.conversation },
+                              { "turn", metrics.turn },
+                              { "prompt_tokens", metrics.promptTokens },
+                              { "reused_tokens", metrics.reusedTokens },
+                              { "generated_tokens", metrics.generatedTokens },
+                              { "reached_max_tokens", metrics.reachedMaxTokens },
+                              { "ttft_ms", metrics.ttftMs },
+                              { "prefill_ms", metrics.prefillMs },
+                              { "decode_ms", metrics.decodeMs } });
+        ttftMs.push_back(metrics.ttftMs);
+        prefillTokens += metrics.promptTokens - metrics.reusedTokens;
+        prefillMs += metrics.prefillMs;
+        decodeTokens += std::max(metrics.generatedTokens - 1, 0);
+        decodeMs += metrics.decodeMs;
+    }
+
+    json results = {
+        { "llama_cpp", { { "build", LLAMA_BUILD_NUMBER }, { "commit", LLAMA_COMMIT } } },
+        { "config",
+          { { "model", args.modelPath },
+            { "transcripts", args.transcriptsPath },
+            { "threads", args.nThreads },
+            { "context_size", args.contextSize },
+            { "batch_size", args.nBatch },
+            { "max_tokens", args.maxTokens },
+            { "temperature", args.temperature },
+            { "seed", args.seed } } },
+        { "summary",
+          { { "load_ms", summarize(loadMs) },
+            { "ttft_ms", summarize(ttftMs) },
+            { "token_latency_ms", summarize(tokenLatenciesMs) },
+            // prompt tokens decoded (excluding the ones reused from the KV cache) per second of prefill
+            { "prefill_tokens_per_s", prefillMs > 0.0 ? prefillTokens * 1000.0 / prefillMs : 0.0 },
+            // tokens generated after the first one per second of decoding
+            { "decode_tokens_per_s", decodeMs > 0.0 ? decodeTokens * 1000.0 / decodeMs : 0.0 },
+            { "peak_rss_mb", static_cast<double>(peakRssKb()) / 1024.0 } } },
+        { "stages", stagesJson },
+        { "turns", turnsJson }
+    };
+
+    std::string output = results.dump(2);
+    if (args.outputPath.empty()) {
+        printf("%s\n", output.c_str());
+    } else {
+        std::ofstream outputFile(args.outputPath);
+        outputFile << output << '\n';
+    }
+    return 0;
+}
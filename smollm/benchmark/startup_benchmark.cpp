@@ -0,0 +1,206 @@
+// Measures how long a user waits for a model after selecting it: the time until loadModel() returns
+// (model-ready) and the time-to-first-token of the first query, with and without the prefetch of
+// the weights and the warmup decode of LLMInference::loadModel().
+//
+// Every configuration is run with a cold start, where the model file is evicted from the page cache
+// before loading, and with a warm start, where the file is still cached from the previous load.
+// The eviction uses posix_fadvise(POSIX_FADV_DONTNEED), the fraction of the file resident in memory
+// before each load is reported to check that it took effect.
+#include "LLMInference.h"
+#include "benchmark_utils.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <fstream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+struct BenchmarkArgs {
+    std::string modelPath;
+    std::string outputPath;
+    std::string prompt      = "Write a haiku about the sea.";
+    int         nThreads    = 4;
+    long        contextSize = 2048;
+    int         repetitions = 3;
+};
+
+struct StartupMetrics {
+    double modelReadyMs = 0.0;
+    double ttftMs       = 0.0;
+    // fraction of the pages of the model file in the page cache before loading
+    double residentFraction = 0.0;
+};
+
+static void
+printUsage(const char* program) {
+    fprintf(stderr,
+            "usage: %s -m MODEL.gguf [-o RESULTS.json] [--threads N] [--ctx N] [--repetitions N] [--prompt TEXT]\n",
+            program);
+}
+
+static bool
+parseArgs(int argc, char** argv, BenchmarkArgs& args) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        const char* value = argv[++i];
+        if (arg == "-m" || arg == "--model") {
+            args.modelPath = value;
+        } else if (arg == "-o" || arg == "--output") {
+            args.outputPath = value;
+        } else if (arg == "--threads") {
+            args.nThreads = std::atoi(value);
+        } else if (arg == "--ctx") {
+            args.contextSize = std::atol(value);
+        } else if (arg == "--repetitions") {
+            args.repetitions = std::atoi(value);
+        } else if (arg == "--prompt") {
+            args.prompt = value;
+        } else {
+            return false;
+        }
+    }
+    return !args.modelPath.empty() && args.repetitions > 0;
+}
+
+static bool
+evictFromPageCache(const std::string& path) {
+#if defined(POSIX_FADV_DONTNEED)
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    bool evicted = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+    close(fd);
+    return evicted;
+#else
+    return false;
+#endif
+}
+
+static double
+residentFraction(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return 0.0;
+    }
+    struct stat fileStat;
+    fstat(fd, &fileStat);
+    size_t fileSize = (size_t) fileStat.st_size;
+    void*  mapping  = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return 0.0;
+    }
+    size_t                     pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    size_t                     nPages   = (fileSize + pageSize - 1) / pageSize;
+    std::vector<unsigned char> pages(nPages);
+#if defined(__APPLE__)
+    mincore(mapping, fileSize, reinterpret_cast<char*>(pages.data()));
+#else
+    mincore(mapping, fileSize, pages.data());
+#endif
+    munmap(mapping, fileSize);
+    size_t resident = 0;
+    for (unsigned char page : pages) {
+        resident += page & 1;
+    }
+    return nPages > 0 ? (double) resident / (double) nPages : 0.0;
+}
+
+// Loads the model and sends the prompt, the instance is destroyed before returning,
+// so that the next run starts without a mapping of the model file
+static StartupMetrics
+runStartup(const BenchmarkArgs& args, bool prefetch, bool warmup) {
+    using clock = std::chrono::steady_clock;
+    StartupMetrics metrics;
+    metrics.residentFraction = residentFraction(args.modelPath);
+
+    SamplerParams samplerParams;
+    samplerParams.temperature = 0.0f;
+
+    clock::time_point loadStart = clock::now();
+    LLMInference      llm;
+    llm.loadModel(args.modelPath.c_str(), samplerParams, true, args.contextSize, nullptr, args.nThreads, true, false,
+                  0, 0, 0, -1, GGML_TYPE_F16, GGML_TYPE_F16, LLAMA_FLASH_ATTN_TYPE_AUTO, 0, prefetch, warmup,
+                  nullptr);
+    clock::time_point queryStart = clock::now();
+    metrics.modelReadyMs         = elapsedMs(loadStart, queryStart);
+
+    llm.startCompletion(args.prompt.c_str());
+    while (llm.prefill() < 1.0f) {
+    }
+    llm.completionLoop();
+    metrics.ttftMs = elapsedMs(queryStart, clock::now());
+    llm.stopCompletion();
+    return metrics;
+}
+
+int
+main(int argc, char** argv) {
+    BenchmarkArgs args;
+    if (!parseArgs(argc, argv, args)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    json results = json::array();
+    for (int config = 0; config < 4; config++) {
+        bool prefetch = config & 1;
+        bool warmup   = config & 2;
+        for (bool cold : { true, false }) {
+            std::vector<double> modelReadyMs, ttftMs, readyToFirstTokenMs, resident;
+            for (int i = 0; i < args.repetitions; i++) {
+                if (cold && !evictFromPageCache(args.modelPath)) {
+                    fprintf(stderr, "could not evict %s from the page cache\n", args.modelPath.c_str());
+                }
+                if (!cold && i == 0) {
+                    // reads the whole file into the page cache, the cold runs only read the pages they used
+                    runStartup(args, true, false);
+                }
+                StartupMetrics metrics = runStartup(args, prefetch, warmup);
+                modelReadyMs.push_back(metrics.modelReadyMs);
+                ttftMs.push_back(metrics.ttftMs);
+                readyToFirstTokenMs.push_back(metrics.modelReadyMs + metrics.ttftMs);
+                resident.push_back(metrics.residentFraction);
+                fprintf(stderr, "prefetch=%d warmup=%d %s: model ready %.1f ms, TTFT %.1f ms (%.0f%% resident)\n",
+                        prefetch, warmup, cold ? "cold" : "warm", metrics.modelReadyMs, metrics.ttftMs,
+                        metrics.residentFraction * 100.0);
+            }
+            results.push_back({ { "prefetch", prefetch },
+                                { "warmup", warmup },
+                                { "start", cold ? "cold" : "warm" },
+                                { "resident_fraction_before_load", summarize(resident) },
+                                { "model_ready_ms", summarize(modelReadyMs) },
+                                { "ttft_ms", summarize(ttftMs) },
+                                // from selecting the model to the first token of the first query
+                                { "ready_to_first_token_ms", summarize(readyToFirstTokenMs) } });
+        }
+    }
+
+    json output = {
+        { "llama_cpp", { { "build", LLAMA_BUILD_NUMBER }, { "commit", LLAMA_COMMIT } } },
+        { "config",
+          { { "model", args.modelPath },
+            { "threads", args.nThreads },
+            { "context_size", args.contextSize },
+            { "repetitions", args.repetitions },
+            { "prompt", args.prompt } } },
+        { "results", results },
+        { "peak_rss_mb", static_cast<double>(peakRssKb()) / 1024.0 }
+    };
+    std::string outputStr = output.dump(2);
+    if (args.outputPath.empty()) {
+        printf("%s\n", outputStr.c_str());
+    } else {
+        std::ofstream outputFile(args.outputPath);
+        outputFile << outputStr << '\n';
+    }
+    return 0;
+}
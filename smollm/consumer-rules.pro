@@ -0,0 +1,3 @@
+# methods of the callback invoked by the native generation thread through JNI
+-keep interface io.shubham0204.smollm.SmolLM$GenerationCallback { *; }
+-keep class * implements io.shubham0204.smollm.SmolLM$GenerationCallback { *; }
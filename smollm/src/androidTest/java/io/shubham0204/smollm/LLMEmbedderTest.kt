@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2025 Shubham Panchal
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package io.shubham0204.smollm
+
+import androidx.test.ext.junit.runners.AndroidJUnit4
+import kotlinx.coroutines.test.runTest
+import org.junit.After
+import org.junit.Before
+import org.junit.Test
+import org.junit.runner.RunWith
+import java.nio.FloatBuffer
+import kotlin.math.abs
+
+@RunWith(AndroidJUnit4::class)
+class LLMEmbedderTest {
+    private val modelPath = "/data/local/tmp/all-minilm-l6-v2-q8_0.gguf"
+    private val texts =
+        listOf(
+            "The cat sits on the mat.",
+            "A cat is sitting on a mat.",
+            "Stock markets fell sharply on Monday.",
+        )
+    private val embedder = LLMEmbedder()
+
+    @Before
+    fun setup() = runTest { embedder.load(modelPath) }
+
+    @Test
+    fun embed_returnsNormalizedEmbeddings() =
+        runTest {
+            val dim = embedder.getEmbeddingDim()
+            val embeddings = embedder.embed(texts)
+            assert(embeddings.capacity() == texts.size * dim)
+            for (i in texts.indices) {
+                val norm = dot(embeddings, i * dim, embeddings, i * dim, dim)
+                assert(abs(norm - 1f) < 1e-3f)
+            }
+            // similar sentences are closer than unrelated ones
+            val similar = dot(embeddings, 0, embeddings, dim, dim)
+            val unrelated = dot(embeddings, 0, embeddings, 2 * dim, dim)
+            assert(similar > unrelated)
+        }
+
+    @Test
+    fun embed_batchMatchesSingleTexts() =
+        runTest {
+            val dim = embedder.getEmbeddingDim()
+            val batched = embedder.embed(texts)
+            for (i in texts.indices) {
+                val single = embedder.embed(listOf(texts[i]))
+                assert(dot(batched, i * dim, single, 0, dim) > 0.999f)
+            }
+        }
+
+    private fun dot(a: FloatBuffer, aOffset: Int, b: FloatBuffer, bOffset: Int, dim: Int): Float =
+        (0 until dim).sumOf { (a[aOffset + it] * b[bOffset + it]).toDouble() }.toFloat()
+
+    @After
+    fun close() {
+        embedder.close()
+    }
+}
@@ -17,12 +17,17 @@
 package io.shubham0204.smollm
 
 import androidx.test.ext.junit.runners.AndroidJUnit4
+import kotlinx.coroutines.async
+import kotlinx.coroutines.awaitAll
+import kotlinx.coroutines.flow.first
 import kotlinx.coroutines.flow.toList
 import kotlinx.coroutines.test.runTest
 import org.junit.After
+import org.json.JSONObject
 import org.junit.Before
 import org.junit.Test
 import org.junit.runner.RunWith
+import java.io.File
 
 @RunWith(AndroidJUnit4::class)
 class SmolLMTest {
@@ -67,6 +72,14 @@ class SmolLMTest {
             assert(responseTokens.isNotEmpty())
         }
 
+    @Test
+    fun getResponse_AsChunkedFlow_works() =
+        runTest {
+            val responseChunks = smolLM.getResponseAsChunkedFlow(query, maxTokens = 64).toList()
+            assert(responseChunks.isNotEmpty())
+            assert(responseChunks.none { it == "[EOG]" })
+        }
+
     @Test
     fun getResponseAsFlowGenerationSpeed_works() =
         runTest {
@@ -77,6 +90,126 @@ class SmolLMTest {
             assert(speedAfterPrediction > 0)
         }
 
+    @Test
+    fun promptPrefix_isReusedAcrossQueries() =
+        runTest {
+            smolLM.getResponseAsFlow(query).toList()
+            smolLM.getResponseAsFlow(query).toList()
+            assert(smolLM.getNumReusedTokens() > 0)
+        }
+
+    @Test
+    fun speculativeDecoding_works() =
+        runTest {
+            // the model is used as its own draft model, so most draft tokens should be accepted
+            val model = SmolLM()
+            model.load(
+                modelPath,
+                SmolLM.InferenceParams(
+                    minP,
+                    temperature,
+                    contextSize = 2048,
+                    chatTemplate = chatTemplate,
+                    draftModelPath = modelPath,
+                    numDraftTokens = 4,
+                ),
+            )
+            val responseTokens = model.getResponseAsFlow(query).toList()
+            assert(responseTokens.isNotEmpty())
+            assert(model.getDraftAcceptanceRate() > 0f)
+            model.close()
+        }
+
+    @Test
+    fun promptLookupDecoding_works() =
+        runTest {
+            val model = SmolLM()
+            model.load(
+                modelPath,
+                SmolLM.InferenceParams(
+                    minP,
+                    temperature,
+                    contextSize = 2048,
+                    chatTemplate = chatTemplate,
+                    promptLookupNgramSize = 3,
+                ),
+            )
+            val text = "SmolChat runs small language models on Android devices with llama.cpp."
+            val response = model.getResponse("Repeat the following sentence exactly: $text")
+            assert(response.isNotEmpty())
+            assert(model.getDraftAcceptanceRate() > 0f)
+            model.close()
+        }
+
+    @Test
+    fun parallelSessions_work() =
+        runTest {
+            val model = SmolLM()
+            model.load(
+                modelPath,
+                SmolLM.InferenceParams(
+                    minP,
+                    temperature,
+                    contextSize = 2048,
+                    chatTemplate = chatTemplate,
+                    numParallelSequences = 2,
+                ),
+            )
+            val sessions = List(2) { model.createSession().apply { addSystemPrompt(systemPrompt) } }
+            // the responses of both sessions are decoded in the same batches
+            val responses =
+                sessions
+                    .map { session -> async { session.getResponseAsFlow(query, maxTokens = 64).toList() } }
+                    .awaitAll()
+            assert(responses.all { it.isNotEmpty() })
+            assert(sessions.all { it.getResponseGenerationSpeed() > 0f })
+            sessions.forEach { it.close() }
+            model.close()
+        }
+
+    @Test
+    fun restoreSnapshot_skipsPrefill() =
+        runTest {
+            val snapshotsDir = File.createTempFile("kv-snapshots", "").apply {
+                delete()
+                mkdirs()
+            }
+            smolLM.getResponseAsFlow(query).toList()
+            assert(smolLM.saveSnapshot(snapshotsDir.absolutePath).isNotEmpty())
+
+            // a new instance with the same system prompt restores the snapshot
+            val model = SmolLM()
+            model.load(
+                modelPath,
+                SmolLM.InferenceParams(minP, temperature, contextSize = 0, chatTemplate = chatTemplate),
+            )
+            model.addSystemPrompt(systemPrompt)
+            assert(model.restoreSnapshot(snapshotsDir.absolutePath) > 0)
+            model.getResponseAsFlow(query).toList()
+            assert(model.getNumReusedTokens() > 0)
+            model.close()
+            snapshotsDir.deleteRecursively()
+        }
+
+    @Test
+    fun contextShift_continuesGeneration() =
+        runTest {
+            // a small context is filled by a few turns, the oldest turns are evicted
+            val model = SmolLM()
+            model.load(
+                modelPath,
+                SmolLM.InferenceParams(minP, temperature, contextSize = 256, chatTemplate = chatTemplate),
+            )
+            model.addSystemPrompt(systemPrompt)
+            repeat(4) {
+                val response = model.getResponseAsChunkedFlow("Write a story about a fox.", maxTokens = 96).toList()
+                assert(response.isNotEmpty())
+            }
+            assert(model.getNumEvictedTokens() > 0)
+            assert(model.getContextLengthUsed() <= 256)
+            model.close()
+        }
+
     @Test
     fun getContextSize_works() =
         runTest {
@@ -86,6 +219,85 @@ class SmolLMTest {
             assert(contextSize == 8192L)
         }
 
+    @Test
+    fun load_withPrefetchAndWarmup_reportsProgress() =
+        runTest {
+            val model = SmolLM()
+            val progress = mutableListOf<Pair<SmolLM.LoadStage, Float>>()
+            model.load(
+                modelPath,
+                SmolLM.InferenceParams(
+                    minP,
+                    temperature,
+                    contextSize = 2048,
+                    chatTemplate = chatTemplate,
+                    prefetchWeights = true,
+                    warmup = true,
+                ),
+                onProgress = { stage, fraction -> progress.add(stage to fraction) },
+            )
+            // the stages are reported in order, each one until it completes
+            val stages = progress.map { it.first }.distinct()
+            assert(stages == SmolLM.LoadStage.entries)
+            assert(progress.last() == (SmolLM.LoadStage.WARMUP to 1.0f))
+            assert(progress.filter { it.first == SmolLM.LoadStage.PREFETCH }.last().second == 1.0f)
+            // the warmup token is not left in the context
+            assert(model.getContextLengthUsed() == 0)
+            assert(model.getResponseAsFlow(query).toList().isNotEmpty())
+            model.close()
+        }
+
+    @Test
+    fun stopSequencesAndTimeLimit_endTheResponse() =
+        runTest {
+            val model = SmolLM()
+            model.load(
+                modelPath,
+                SmolLM.InferenceParams(
+                    minP,
+                    temperature,
+                    contextSize = 2048,
+                    chatTemplate = chatTemplate,
+                    stopSequences = listOf(" ", "\n"),
+                ),
+            )
+            // the response ends before the first space or newline, which are not emitted
+            val response = model.getResponse("Write a story about a fox.")
+            assert(response.none { it == ' ' || it == '\n' })
+            val chunkedResponse = model.getResponseAsChunkedFlow(query, maxTokens = 64).toList()
+            assert(chunkedResponse.joinToString("").none { it == ' ' || it == '\n' })
+
+            model.setStopSequences(emptyList())
+            val start = System.currentTimeMillis()
+            model.getResponseAsChunkedFlow("Write a long story about a fox.", maxTimeMillis = 500).toList()
+            assert(System.currentTimeMillis() - start < 3000)
+            model.close()
+        }
+
+    @Test
+    fun ggufScan_readsMetadataAndUsesCache() =
+        runTest {
+            val cacheFile = File.createTempFile("gguf-metadata", ".cache")
+            cacheFile.delete()
+            val paths = listOf(modelPath, "/data/local/tmp/does-not-exist.gguf")
+            val scanned = GGUFReader.scan(paths, cacheFile)
+            val metadata = scanned[0]
+            println(metadata)
+            assert(metadata.error == null)
+            assert(metadata.architecture == "llama")
+            assert(metadata.quantization == "Q8_0")
+            assert(metadata.contextLength == 8192L)
+            assert(metadata.parameterCount in 300_000_000L..400_000_000L)
+            assert(metadata.weightBytes in 1L until metadata.fileSize)
+            assert(metadata.kvCacheBytesPerToken > 0L)
+            assert(scanned[1].error != null)
+
+            // the second scan reads the metadata from the cache
+            assert(cacheFile.exists())
+            assert(GGUFReader.scan(paths, cacheFile)[0] == metadata)
+            cacheFile.delete()
+        }
+
     @Test
     fun benchmarkModel_works() =
         runTest {
@@ -99,6 +311,176 @@ class SmolLMTest {
             assert(result.trim().isNotEmpty())
         }
 
+    @Test
+    fun prefillBatchSize_benchmark() =
+        runTest {
+            val longQuery = summarizeQuery(nSentences = 300)
+            // (4096, 512) corresponds to the previous single-shot prefill with n_batch = n_ctx
+            for ((batchSize, microBatchSize) in listOf(4096 to 512, 512 to 512, 128 to 128)) {
+                val model =
+                    loadBenchModel(
+                        benchParams.copy(contextSize = 4096, batchSize = batchSize, microBatchSize = microBatchSize),
+                    )
+                resetPeakRss()
+                val start = System.nanoTime()
+                model.getResponseAsFlow(longQuery).first()
+                val ttftMillis = (System.nanoTime() - start) / 1_000_000
+                println(
+                    "n_batch = $batchSize, n_ubatch = $microBatchSize, " +
+                        "TTFT = $ttftMillis ms, peak RSS = ${readPeakRssKb()} kB"
+                )
+                model.close()
+            }
+        }
+
+    @Test
+    fun prefetchAndWarmup_benchmark() =
+        runTest {
+            // the model file stays in the page cache between the loads, so these are warm starts,
+            // cold starts are measured by smollm/benchmark/startup_benchmark
+            for ((prefetch, warmup) in listOf(false to false, true to false, false to true, true to true)) {
+                val loadStart = System.nanoTime()
+                val model =
+                    loadBenchModel(benchParams.copy(contextSize = 2048, prefetchWeights = prefetch, warmup = warmup))
+                val queryStart = System.nanoTime()
+                model.getResponseAsFlow(query).first()
+                val end = System.nanoTime()
+                println(
+                    "prefetch = $prefetch, warmup = $warmup, " +
+                        "model ready = ${(queryStart - loadStart) / 1_000_000} ms, " +
+                        "TTFT = ${(end - queryStart) / 1_000_000} ms"
+                )
+                model.close()
+            }
+        }
+
+    @Test
+    fun jsonSchemaConstraint_benchmark() =
+        runTest {
+            val model = loadBenchModel(benchParams.copy(contextSize = 1024))
+            val extractionQuery =
+                "Extract the name and the age of the person as JSON: Alice is 29 years old and lives in Paris."
+            val schema =
+                SmolLM.ResponseConstraint.JsonSchema(
+                    """{"type": "object", "properties": {"name": {"type": "string"},
+                    |"age": {"type": "integer"}}, "required": ["name", "age"]}""".trimMargin(),
+                )
+            model.getResponse(extractionQuery)
+            val unconstrainedSpeed = model.getResponseGenerationSpeed()
+            // the second response uses the compiled grammar cached by the first
+            val responseMillis =
+                List(2) {
+                    val start = System.nanoTime()
+                    val response = model.getResponse(extractionQuery, schema)
+                    val json = JSONObject(response)
+                    assert(json.has("name") && json.has("age"))
+                    (System.nanoTime() - start) / 1_000_000
+                }
+            val constrainedSpeed = model.getResponseGenerationSpeed()
+            println(
+                "unconstrained = $unconstrainedSpeed tok/s, JSON schema = $constrainedSpeed tok/s, " +
+                    "response time = ${responseMillis[0]} ms (compiled), ${responseMillis[1]} ms (cached)"
+            )
+            model.close()
+        }
+
+    @Test
+    fun samplerCost_benchmark() =
+        runTest {
+            // default chain (top-k and min-p pre-filter) with penalties and DRY enabled
+            val model =
+                loadBenchModel(
+                    benchParams.copy(contextSize = 512, repeatPenalty = 1.1f, dryMultiplier = 0.8f, seed = 42),
+                )
+            for (nVocab in listOf(32_000, 64_000, 128_000, 256_000)) {
+                val result = model.benchSampler(nVocab, nIterations = 200)
+                println(result)
+                assert(result.trim().isNotEmpty())
+            }
+            model.close()
+        }
+
+    @Test
+    fun kvCacheType_benchmark() =
+        runTest {
+            val longQuery = summarizeQuery(nSentences = 200)
+            for (kvType in SmolLM.KVCacheType.entries) {
+                val model =
+                    loadBenchModel(
+                        benchParams.copy(
+                            contextSize = 4096,
+                            keyCacheType = kvType,
+                            valueCacheType = kvType,
+                            flashAttention = true,
+                        ),
+                    )
+                resetPeakRss()
+                model.getResponseAsChunkedFlow(longQuery, maxTokens = 128).toList()
+                println(
+                    "KV type = $kvType, tg = ${model.getResponseGenerationSpeed()} tok/s, " +
+                        "peak RSS = ${readPeakRssKb()} kB"
+                )
+                model.close()
+            }
+        }
+
+    @Test
+    fun kvCacheMemoryBudget_reducesContextSize() =
+        runTest {
+            val model = loadBenchModel(benchParams.copy(contextSize = 8192, kvCacheMemoryBudget = 32L * 1024 * 1024))
+            val contextSize = model.getContextSize()
+            assert(contextSize in 256L until 8192L)
+            model.close()
+        }
+
+    @Test
+    fun getMetrics_recordsEveryStage() =
+        runTest {
+            smolLM.resetMetrics()
+            smolLM.setTraceEnabled(true)
+            smolLM.getResponseAsChunkedFlow(query, maxTokens = 32).toList()
+            val metrics = smolLM.getMetrics()
+            println(metrics)
+            for (stage in
+                listOf(metrics.template, metrics.tokenize, metrics.prefill, metrics.decode, metrics.sample)) {
+                assert(stage.count > 0)
+                assert(stage.p50Micros <= stage.p99Micros && stage.p99Micros <= stage.maxMicros)
+            }
+            assert(metrics.generatedTokens in 1L..32L)
+            assert(metrics.detokenize.count == metrics.generatedTokens)
+            assert(metrics.prefillTokens > 0)
+
+            val traceFile = File.createTempFile("trace", ".json")
+            smolLM.dumpTrace(traceFile.absolutePath)
+            assert(JSONObject(traceFile.readText()).getJSONArray("traceEvents").length() > 0)
+            traceFile.delete()
+
+            smolLM.resetMetrics()
+            assert(smolLM.getMetrics().decode.count == 0L)
+        }
+
+    // parameters of the benchmarks, each of which loads a model per configuration it compares
+    private val benchParams =
+        SmolLM.InferenceParams(minP, temperature, storeChats = false, chatTemplate = chatTemplate)
+
+    private suspend fun loadBenchModel(params: SmolLM.InferenceParams): SmolLM =
+        SmolLM().apply { load(modelPath, params) }
+
+    private fun summarizeQuery(nSentences: Int): String =
+        "Summarize the following text. " + "The quick brown fox jumps over the lazy dog. ".repeat(nSentences)
+
+    private fun resetPeakRss() {
+        // writing '5' to clear_refs resets VmHWM, not permitted on all devices
+        runCatching { File("/proc/self/clear_refs").writeText("5") }
+    }
+
+    private fun readPeakRssKb(): Long =
+        File("/proc/self/status")
+            .readLines()
+            .first { it.startsWith("VmHWM") }
+            .filter { it.isDigit() }
+            .toLong()
+
     @After
     fun close() {
         smolLM.close()
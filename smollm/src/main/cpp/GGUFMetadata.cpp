@@ -0,0 +1,591 @@
+#include "GGUFMetadata.h"
+#include "gguf.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+
+// the header is read in chunks of this size, most files need a few chunks for the vocabulary
+static constexpr size_t READ_BUFFER_SIZE = 256 * 1024;
+// bounds on the lengths read from the file, a larger length means the file is corrupted
+static constexpr uint64_t MAX_KEY_LENGTH    = 64 * 1024;
+static constexpr uint64_t MAX_STRING_LENGTH = 4 * 1024 * 1024;
+// integer arrays up to this length are read (e.g. the head count of each layer), longer ones are skipped
+static constexpr uint64_t MAX_READ_ARRAY_LENGTH = 4096;
+static constexpr uint32_t MAX_TENSOR_DIMS       = 4;
+
+// reads a file sequentially through a buffer, skipping over data without reading it when possible
+class GGUFStream {
+    int               _fd;
+    uint64_t          _fileSize;
+    uint64_t          _pos = 0;
+    std::vector<char> _buffer;
+    uint64_t          _bufferStart = 0;
+    size_t            _bufferSize  = 0;
+
+    void
+    _fill() {
+        if (_pos >= _fileSize) {
+            throw std::runtime_error("unexpected end of file");
+        }
+        ssize_t bytesRead;
+        do {
+            bytesRead = pread(_fd, _buffer.data(), _buffer.size(), (off_t) _pos);
+        } while (bytesRead < 0 && errno == EINTR);
+        if (bytesRead <= 0) {
+            throw std::runtime_error(std::string("could not read the file: ") + std::strerror(errno));
+        }
+        _bufferStart = _pos;
+        _bufferSize  = (size_t) bytesRead;
+    }
+
+  public:
+    GGUFStream(int fd, uint64_t fileSize) : _fd(fd), _fileSize(fileSize), _buffer(READ_BUFFER_SIZE) {}
+
+    uint64_t
+    position() const {
+        return _pos;
+    }
+
+    uint64_t
+    remaining() const {
+        return _fileSize - _pos;
+    }
+
+    void
+    read(void* data, size_t size) {
+        if (size > remaining()) {
+            throw std::runtime_error("unexpected end of file");
+        }
+        char* bytes = static_cast<char*>(data);
+        while (size > 0) {
+            if (_pos < _bufferStart || _pos >= _bufferStart + _bufferSize) {
+                _fill();
+            }
+            size_t offset = (size_t) (_pos - _bufferStart);
+            size_t length = std::min(size, _bufferSize - offset);
+            memcpy(bytes, _buffer.data() + offset, length);
+            bytes += length;
+            _pos += length;
+            size -= length;
+        }
+    }
+
+    template <typename T>
+    T
+    read() {
+        T value;
+        read(&value, sizeof(T));
+        return value;
+    }
+
+    void
+    skip(uint64_t size) {
+        if (size > remaining()) {
+            throw std::runtime_error("unexpected end of file");
+        }
+        _pos += size;
+    }
+
+    std::string
+    readString(uint64_t maxLength) {
+        uint64_t length = read<uint64_t>();
+        if (length > maxLength || length > remaining()) {
+            throw std::runtime_error("invalid string length " + std::to_string(length));
+        }
+        std::string value(length, '\0');
+        read(value.data(), length);
+        return value;
+    }
+
+    void
+    skipString() {
+        skip(read<uint64_t>());
+    }
+};
+
+// size of a value of `type`, 0 for strings and arrays
+static size_t
+scalarSize(uint32_t type) {
+    switch (type) {
+    case GGUF_TYPE_UINT8:
+    case GGUF_TYPE_INT8:
+    case GGUF_TYPE_BOOL:
+        return 1;
+    case GGUF_TYPE_UINT16:
+    case GGUF_TYPE_INT16:
+        return 2;
+    case GGUF_TYPE_UINT32:
+    case GGUF_TYPE_INT32:
+    case GGUF_TYPE_FLOAT32:
+        return 4;
+    case GGUF_TYPE_UINT64:
+    case GGUF_TYPE_INT64:
+    case GGUF_TYPE_FLOAT64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+// reads a scalar of `type`, returns false (after skipping it) if it is not an integer.
+// Negative values are read as 0
+static bool
+readInteger(GGUFStream& stream, uint32_t type, uint64_t& value) {
+    switch (type) {
+    case GGUF_TYPE_UINT8:
+    case GGUF_TYPE_BOOL:
+        value = stream.read<uint8_t>();
+        return true;
+    case GGUF_TYPE_INT8:
+        value = (uint64_t) std::max<int8_t>(stream.read<int8_t>(), 0);
+        return true;
+    case GGUF_TYPE_UINT16:
+        value = stream.read<uint16_t>();
+        return true;
+    case GGUF_TYPE_INT16:
+        value = (uint64_t) std::max<int16_t>(stream.read<int16_t>(), 0);
+        return true;
+    case GGUF_TYPE_UINT32:
+        value = stream.read<uint32_t>();
+        return true;
+    case GGUF_TYPE_INT32:
+        value = (uint64_t) std::max<int32_t>(stream.read<int32_t>(), 0);
+        return true;
+    case GGUF_TYPE_UINT64:
+        value = stream.read<uint64_t>();
+        return true;
+    case GGUF_TYPE_INT64:
+        value = (uint64_t) std::max<int64_t>(stream.read<int64_t>(), 0);
+        return true;
+    default:
+        stream.skip(scalarSize(type));
+        return false;
+    }
+}
+
+// names of the llama_ftype values stored in `general.file_type`
+static const std::pair<uint64_t, const char*> FILE_TYPE_NAMES[] = {
+    { 0, "F32" }, { 1, "F16" }, { 2, "Q4_0" }, { 3, "Q4_1" }, { 7, "Q8_0" }, { 8, "Q5_0" }, { 9, "Q5_1" },
+    { 10, "Q2_K" }, { 11, "Q3_K_S" }, { 12, "Q3_K_M" }, { 13, "Q3_K_L" }, { 14, "Q4_K_S" }, { 15, "Q4_K_M" },
+    { 16, "Q5_K_S" }, { 17, "Q5_K_M" }, { 18, "Q6_K" }, { 19, "IQ2_XXS" }, { 20, "IQ2_XS" }, { 21, "Q2_K_S" },
+    { 22, "IQ3_XS" }, { 23, "IQ3_XXS" }, { 24, "IQ1_S" }, { 25, "IQ4_NL" }, { 26, "IQ3_S" }, { 27, "IQ3_M" },
+    { 28, "IQ2_S" }, { 29, "IQ2_M" }, { 30, "IQ4_XS" }, { 31, "IQ1_M" }, { 32, "BF16" }, { 36, "TQ1_0" },
+    { 37, "TQ2_0" }, { 38, "MXFP4_MOE" }
+};
+
+static const char*
+fileTypeName(uint64_t fileType) {
+    // LLAMA_FTYPE_GUESSED is set if the type was not declared by the converter
+    fileType &= ~(uint64_t) 1024;
+    for (const auto& [value, name] : FILE_TYPE_NAMES) {
+        if (value == fileType) {
+            return name;
+        }
+    }
+    return nullptr;
+}
+
+static bool
+statFile(const std::string& path, uint64_t& size, int64_t& mtimeNs) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+    size    = (uint64_t) st.st_size;
+    mtimeNs = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+static void
+parseHeader(GGUFStream& stream, GGUFMetadata& metadata) {
+    char magic[4];
+    stream.read(magic, sizeof(magic));
+    if (memcmp(magic, GGUF_MAGIC, sizeof(magic)) != 0) {
+        throw std::runtime_error("not a GGUF file");
+    }
+    uint32_t version = stream.read<uint32_t>();
+    if (version < 2 || version > GGUF_VERSION) {
+        // version 1 used 32-bit counts, a byte-swapped version is a big-endian file
+        throw std::runtime_error("unsupported GGUF version " + std::to_string(version));
+    }
+    uint64_t nTensors = stream.read<uint64_t>();
+    uint64_t nKeys    = stream.read<uint64_t>();
+    // every key and tensor takes at least 8 bytes for its name
+    if (nTensors > stream.remaining() / 8 || nKeys > stream.remaining() / 8) {
+        throw std::runtime_error("invalid no. of tensors or keys");
+    }
+
+    // integer values (or the largest value of short integer arrays), resolved once the architecture is known
+    std::unordered_map<std::string, uint64_t> integers;
+    uint64_t                                  nVocabTokens = 0;
+    for (uint64_t i = 0; i < nKeys; i++) {
+        std::string key  = stream.readString(MAX_KEY_LENGTH);
+        uint32_t    type = stream.read<uint32_t>();
+        if (type == GGUF_TYPE_STRING) {
+            if (key == "general.architecture") {
+                metadata.architecture = stream.readString(MAX_STRING_LENGTH);
+            } else if (key == "general.name") {
+                metadata.name = stream.readString(MAX_STRING_LENGTH);
+            } else if (key == "tokenizer.chat_template") {
+                metadata.chatTemplate = stream.readString(MAX_STRING_LENGTH);
+            } else {
+                stream.skipString();
+            }
+        } else if (type == GGUF_TYPE_ARRAY) {
+            uint32_t elementType = stream.read<uint32_t>();
+            uint64_t count       = stream.read<uint64_t>();
+            if (key == "tokenizer.ggml.tokens") {
+                nVocabTokens = count;
+            }
+            if (elementType == GGUF_TYPE_STRING) {
+                // the vocabulary, only the lengths of the strings are read
+                if (count > stream.remaining() / 8) {
+                    throw std::runtime_error("invalid array length for " + key);
+                }
+                for (uint64_t j = 0; j < count; j++) {
+                    stream.skipString();
+                }
+                continue;
+            }
+            size_t elementSize = scalarSize(elementType);
+            if (elementSize == 0 || count > stream.remaining() / elementSize) {
+                throw std::runtime_error("invalid array for " + key);
+            }
+            if (count > MAX_READ_ARRAY_LENGTH) {
+                stream.skip(count * elementSize);
+                continue;
+            }
+            uint64_t maxValue  = 0;
+            bool     isInteger = true;
+            for (uint64_t j = 0; j < count; j++) {
+                uint64_t value;
+                isInteger = readInteger(stream, elementType, value);
+                maxValue  = isInteger ? std::max(maxValue, value) : maxValue;
+            }
+            if (isInteger && count > 0) {
+                integers[key] = maxValue;
+            }
+        } else {
+            if (scalarSize(type) == 0) {
+                throw std::runtime_error("invalid type " + std::to_string(type) + " for " + key);
+            }
+            uint64_t value;
+            if (readInteger(stream, type, value)) {
+                integers[key] = value;
+            }
+        }
+    }
+
+    auto hparam = [&](const char* suffix) -> uint64_t {
+        auto entry = integers.find(metadata.architecture + "." + suffix);
+        return entry == integers.end() ? 0 : entry->second;
+    };
+    metadata.contextLength     = hparam("context_length");
+    metadata.blockCount        = hparam("block_count");
+    metadata.embeddingLength   = hparam("embedding_length");
+    metadata.feedForwardLength = hparam("feed_forward_length");
+    metadata.headCount         = hparam("attention.head_count");
+    metadata.headCountKv       = hparam("attention.head_count_kv");
+    metadata.keyLength         = hparam("attention.key_length");
+    metadata.valueLength       = hparam("attention.value_length");
+    metadata.vocabSize         = hparam("vocab_size");
+    if (metadata.headCountKv == 0) {
+        metadata.headCountKv = metadata.headCount;
+    }
+    if (metadata.headCount > 0) {
+        uint64_t headDim     = metadata.embeddingLength / metadata.headCount;
+        metadata.keyLength   = metadata.keyLength > 0 ? metadata.keyLength : headDim;
+        metadata.valueLength = metadata.valueLength > 0 ? metadata.valueLength : headDim;
+    }
+    if (metadata.vocabSize == 0) {
+        metadata.vocabSize = nVocabTokens;
+    }
+    // keys and values of every layer stored as F16
+    metadata.kvBytesPerToken =
+        metadata.blockCount * metadata.headCountKv * (metadata.keyLength + metadata.valueLength) * 2;
+
+    // the tensor infos follow the keys, only their shapes and types are read
+    std::unordered_map<uint32_t, uint64_t> elementsPerType;
+    for (uint64_t i = 0; i < nTensors; i++) {
+        stream.skipString();
+        uint32_t nDims = stream.read<uint32_t>();
+        if (nDims > MAX_TENSOR_DIMS) {
+            throw std::runtime_error("invalid no. of dimensions " + std::to_string(nDims));
+        }
+        uint64_t nElements = 1;
+        for (uint32_t d = 0; d < nDims; d++) {
+            uint64_t dim = stream.read<uint64_t>();
+            if (dim != 0 && nElements > UINT64_MAX / dim) {
+                throw std::runtime_error("invalid tensor shape");
+            }
+            nElements *= dim;
+        }
+        uint32_t type = stream.read<uint32_t>();
+        stream.skip(sizeof(uint64_t));
+        metadata.parameterCount += nElements;
+        elementsPerType[type] += nElements;
+    }
+
+    // the tensor data starts at the next multiple of the alignment
+    auto     alignmentEntry = integers.find(GGUF_KEY_GENERAL_ALIGNMENT);
+    uint64_t alignment = alignmentEntry == integers.end() ? GGUF_DEFAULT_ALIGNMENT : alignmentEntry->second;
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        throw std::runtime_error("invalid alignment " + std::to_string(alignment));
+    }
+    uint64_t dataOffset  = (stream.position() + alignment - 1) / alignment * alignment;
+    metadata.weightBytes = metadata.fileSize > dataOffset ? metadata.fileSize - dataOffset : 0;
+
+    auto        fileType = integers.find("general.file_type");
+    const char* typeName = fileType == integers.end() ? nullptr : fileTypeName(fileType->second);
+    if (typeName != nullptr) {
+        metadata.quantization = typeName;
+    } else if (!elementsPerType.empty()) {
+        auto dominant = std::max_element(elementsPerType.begin(), elementsPerType.end(),
+                                         [](const auto& a, const auto& b) { return a.second < b.second; });
+        if (dominant->first < GGML_TYPE_COUNT) {
+            metadata.quantization = ggml_type_name((ggml_type) dominant->first);
+        }
+    }
+}
+
+GGUFMetadata
+readGGUFMetadata(const std::string& path) {
+    GGUFMetadata metadata;
+    metadata.path = path;
+    int fd        = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        metadata.error = std::string("could not open the file: ") + std::strerror(errno);
+        return metadata;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        metadata.error = std::string("could not stat the file: ") + std::strerror(errno);
+        close(fd);
+        return metadata;
+    }
+    metadata.fileSize = (uint64_t) st.st_size;
+    metadata.mtimeNs  = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    // the header is read once from the start of the file
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    try {
+        GGUFStream stream(fd, metadata.fileSize);
+        parseHeader(stream, metadata);
+    } catch (const std::exception& e) {
+        metadata.error = e.what();
+    }
+    close(fd);
+    return metadata;
+}
+
+// Cache file: magic, version and no. of entries, followed by the entries. Each entry holds the
+// strings of GGUFMetadata (as a uint32 length and the bytes) and then its integer fields
+static constexpr char     CACHE_MAGIC[8] = { 'S', 'M', 'O', 'L', 'G', 'G', 'U', 'F' };
+static constexpr uint32_t CACHE_VERSION  = 1;
+
+// guards the cache files of this process, the file itself is replaced atomically
+static std::mutex cacheMutex;
+
+static void
+appendString(std::string& data, const std::string& value) {
+    uint32_t length = (uint32_t) value.size();
+    data.append(reinterpret_cast<const char*>(&length), sizeof(length));
+    data.append(value);
+}
+
+template <typename T>
+static void
+appendValue(std::string& data, T value) {
+    data.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// reads values from the contents of the cache file, `ok` is false once a read goes out of bounds
+struct CacheReader {
+    const std::string& data;
+    size_t             offset = 0;
+    bool               ok     = true;
+
+    template <typename T>
+    T
+    value() {
+        T result{};
+        if (offset + sizeof(T) > data.size()) {
+            ok = false;
+            return result;
+        }
+        memcpy(&result, data.data() + offset, sizeof(T));
+        offset += sizeof(T);
+        return result;
+    }
+
+    std::string
+    string() {
+        uint32_t length = value<uint32_t>();
+        if (!ok || length > data.size() - offset) {
+            ok = false;
+            return "";
+        }
+        std::string result = data.substr(offset, length);
+        offset += length;
+        return result;
+    }
+};
+
+// the strings and integers of an entry, in the order they are stored in the cache file
+template <typename Metadata, typename StringFn, typename IntegerFn>
+static void
+forEachField(Metadata& metadata, StringFn onString, IntegerFn onInteger) {
+    onString(metadata.path);
+    onString(metadata.architecture);
+    onString(metadata.name);
+    onString(metadata.quantization);
+    onString(metadata.chatTemplate);
+    onInteger(metadata.fileSize);
+    onInteger(metadata.mtimeNs);
+    onInteger(metadata.contextLength);
+    onInteger(metadata.blockCount);
+    onInteger(metadata.embeddingLength);
+    onInteger(metadata.feedForwardLength);
+    onInteger(metadata.headCount);
+    onInteger(metadata.headCountKv);
+    onInteger(metadata.keyLength);
+    onInteger(metadata.valueLength);
+    onInteger(metadata.vocabSize);
+    onInteger(metadata.parameterCount);
+    onInteger(metadata.weightBytes);
+    onInteger(metadata.kvBytesPerToken);
+}
+
+// returns the entries of the cache file keyed by their path, an unreadable or corrupted file is treated as empty
+static std::unordered_map<std::string, GGUFMetadata>
+loadCache(const std::string& cachePath) {
+    std::unordered_map<std::string, GGUFMetadata> entries;
+    FILE*                                         file = fopen(cachePath.c_str(), "rb");
+    if (file == nullptr) {
+        return entries;
+    }
+    std::string data;
+    char        chunk[65536];
+    size_t      n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        data.append(chunk, n);
+    }
+    fclose(file);
+
+    CacheReader reader{ data };
+    char        magic[8];
+    for (char& c : magic) {
+        c = reader.value<char>();
+    }
+    uint32_t version  = reader.value<uint32_t>();
+    uint32_t nEntries = reader.value<uint32_t>();
+    if (!reader.ok || memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0 || version != CACHE_VERSION) {
+        return entries;
+    }
+    for (uint32_t i = 0; i < nEntries; i++) {
+        GGUFMetadata metadata;
+        forEachField(
+            metadata, [&](std::string& value) { value = reader.string(); },
+            [&](auto& value) { value = reader.value<std::remove_reference_t<decltype(value)>>(); });
+        if (!reader.ok) {
+            entries.clear();
+            return entries;
+        }
+        entries[metadata.path] = std::move(metadata);
+    }
+    return entries;
+}
+
+static void
+saveCache(const std::string& cachePath, const std::unordered_map<std::string, GGUFMetadata>& entries) {
+    std::string data(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    appendValue(data, CACHE_VERSION);
+    appendValue(data, (uint32_t) entries.size());
+    for (const auto& [path, metadata] : entries) {
+        forEachField(
+            metadata, [&](const std::string& value) { appendString(data, value); },
+            [&](const auto& value) { appendValue(data, value); });
+    }
+    // written to a temporary file and renamed, so that a reader never sees a partial file
+    std::string tmpPath = cachePath + ".tmp";
+    FILE*       file    = fopen(tmpPath.c_str(), "wb");
+    if (file == nullptr) {
+        return;
+    }
+    bool written = fwrite(data.data(), 1, data.size(), file) == data.size();
+    if (fclose(file) != 0 || !written || rename(tmpPath.c_str(), cachePath.c_str()) != 0) {
+        unlink(tmpPath.c_str());
+    }
+}
+
+std::vector<GGUFMetadata>
+scanGGUFFiles(const std::vector<std::string>& paths, const std::string& cachePath, size_t nThreads) {
+    std::vector<GGUFMetadata>                     results(paths.size());
+    std::unordered_map<std::string, GGUFMetadata> cache;
+    if (!cachePath.empty()) {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        cache = loadCache(cachePath);
+    }
+
+    // files that are not in the cache, or were modified since they were cached
+    std::vector<size_t> misses;
+    for (size_t i = 0; i < paths.size(); i++) {
+        uint64_t size;
+        int64_t  mtimeNs;
+        auto     entry = cache.find(paths[i]);
+        if (entry != cache.end() && statFile(paths[i], size, mtimeNs) && entry->second.fileSize == size &&
+            entry->second.mtimeNs == mtimeNs) {
+            results[i] = entry->second;
+        } else {
+            misses.push_back(i);
+        }
+    }
+    if (misses.empty()) {
+        return results;
+    }
+
+    // the files are read by `nThreads` threads including the calling thread, each taking the next file
+    std::atomic<size_t> next{ 0 };
+    auto                worker = [&]() {
+        size_t k;
+        while ((k = next.fetch_add(1)) < misses.size()) {
+            results[misses[k]] = readGGUFMetadata(paths[misses[k]]);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < std::min(std::max(nThreads, (size_t) 1), misses.size()); t++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    if (!cachePath.empty()) {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        // merged with the entries written since the cache was loaded, entries of deleted files are dropped
+        std::unordered_map<std::string, GGUFMetadata> entries = loadCache(cachePath);
+        for (size_t i : misses) {
+            // files that could not be read (e.g. being downloaded) are read again by the next scan
+            if (results[i].error.empty()) {
+                entries[results[i].path] = results[i];
+            }
+        }
+        for (auto it = entries.begin(); it != entries.end();) {
+            struct stat st;
+            it = stat(it->first.c_str(), &st) == 0 ? std::next(it) : entries.erase(it);
+        }
+        saveCache(cachePath, entries);
+    }
+    return results;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// summary of a GGUF model file, read from its header without loading the tensors
+struct GGUFMetadata {
+    std::string path;
+    // empty if the file could be read, otherwise the reason it could not
+    std::string error;
+
+    uint64_t fileSize = 0;
+    // modification time of the file in nanoseconds, part of the key of the cache
+    int64_t mtimeNs = 0;
+
+    std::string architecture;
+    std::string name;
+    // llama.cpp file type (e.g. Q4_K_M), or the most common tensor type if the file does not declare one
+    std::string quantization;
+    std::string chatTemplate;
+
+    // hyperparameters of the architecture, 0 if the file does not declare them.
+    // For values that vary per layer, the largest value is reported
+    uint64_t contextLength     = 0;
+    uint64_t blockCount        = 0;
+    uint64_t embeddingLength   = 0;
+    uint64_t feedForwardLength = 0;
+    uint64_t headCount         = 0;
+    uint64_t headCountKv       = 0;
+    uint64_t keyLength         = 0;
+    uint64_t valueLength       = 0;
+    uint64_t vocabSize         = 0;
+
+    // sum of the no. of elements of all tensors
+    uint64_t parameterCount = 0;
+    // size of the tensor data section, the memory taken by the weights when the file is mapped
+    uint64_t weightBytes = 0;
+    // size of the keys and values of a token in an F16 KV cache, 0 for architectures without attention
+    uint64_t kvBytesPerToken = 0;
+};
+
+// Reads the metadata of the GGUF file at `path` with buffered reads of its header. Large arrays (the
+// vocabulary) are skipped without being stored, and the tensor data is never read. Errors are
+// reported in GGUFMetadata::error instead of being thrown
+GGUFMetadata readGGUFMetadata(const std::string& path);
+
+// Reads the metadata of all `paths` with `nThreads` threads, in the order of `paths`. If `cachePath`
+// is not empty, files whose path, size and modification time match an entry of the cache file are
+// not read again, and the cache file is updated with the files read
+std::vector<GGUFMetadata> scanGGUFFiles(const std::vector<std::string>& paths, const std::string& cachePath,
+                                        size_t nThreads);
@@ -1,41 +1,68 @@
-#include "gguf.h"
+#include "GGUFMetadata.h"
+#include <algorithm>
 #include <jni.h>
 #include <string>
+#include <thread>
 
-extern "C" JNIEXPORT jlong JNICALL
-Java_io_shubham0204_smollm_GGUFReader_getGGUFContextNativeHandle(JNIEnv* env, jobject thiz, jstring modelPath) {
-    jboolean         isCopy        = true;
-    const char*      modelPathCStr = env->GetStringUTFChars(modelPath, &isCopy);
-    gguf_init_params initParams    = { .no_alloc = true, .ctx = nullptr };
-    gguf_context*    ggufContext   = gguf_init_from_file(modelPathCStr, initParams);
-    env->ReleaseStringUTFChars(modelPath, modelPathCStr);
-    return reinterpret_cast<jlong>(ggufContext);
-}
+// no. of string and long values per file in the arrays filled by scanFiles()
+static constexpr int NUM_STRINGS_PER_FILE = 5;
+static constexpr int NUM_LONGS_PER_FILE   = 14;
 
-extern "C" JNIEXPORT jlong JNICALL
-Java_io_shubham0204_smollm_GGUFReader_getContextSize(JNIEnv* env, jobject thiz, jlong nativeHandle) {
-    gguf_context* ggufContext       = reinterpret_cast<gguf_context*>(nativeHandle);
-    int64_t       architectureKeyId = gguf_find_key(ggufContext, "general.architecture");
-    if (architectureKeyId == -1)
-        return -1;
-    std::string architecture       = gguf_get_val_str(ggufContext, architectureKeyId);
-    std::string contextLengthKey   = architecture + ".context_length";
-    int64_t     contextLengthKeyId = gguf_find_key(ggufContext, contextLengthKey.c_str());
-    if (contextLengthKeyId == -1)
-        return -1;
-    uint32_t contextLength = gguf_get_val_u32(ggufContext, contextLengthKeyId);
-    return contextLength;
-}
+// Reads the metadata of `modelPaths` with `nThreads` threads (0 for one per core), using the cache
+// file at `cachePath` if it is not null. For file i, the strings (architecture, name, quantization,
+// chat template, error) are returned at [5 * i, 5 * i + 5) and the integers of GGUFMetadata are
+// written to `longs` at [14 * i, 14 * i + 14), in the order they are declared, from `fileSize`
+extern "C" JNIEXPORT jobjectArray JNICALL
+Java_io_shubham0204_smollm_GGUFReader_scanFiles(JNIEnv* env, jobject thiz, jobjectArray modelPaths, jstring cachePath,
+                                                jint nThreads, jlongArray longs) {
+    jsize                    nPaths = env->GetArrayLength(modelPaths);
+    std::vector<std::string> paths(nPaths);
+    for (jsize i = 0; i < nPaths; i++) {
+        auto        path     = (jstring) env->GetObjectArrayElement(modelPaths, i);
+        const char* pathCstr = env->GetStringUTFChars(path, nullptr);
+        paths[i]             = pathCstr;
+        env->ReleaseStringUTFChars(path, pathCstr);
+        env->DeleteLocalRef(path);
+    }
+    std::string cachePathStr;
+    if (cachePath != nullptr) {
+        const char* cachePathCstr = env->GetStringUTFChars(cachePath, nullptr);
+        cachePathStr              = cachePathCstr;
+        env->ReleaseStringUTFChars(cachePath, cachePathCstr);
+    }
+    size_t threads = nThreads > 0 ? (size_t) nThreads : std::max(std::thread::hardware_concurrency(), 1u);
+
+    std::vector<GGUFMetadata> results = scanGGUFFiles(paths, cachePathStr, threads);
 
-extern "C" JNIEXPORT jstring JNICALL
-Java_io_shubham0204_smollm_GGUFReader_getChatTemplate(JNIEnv* env, jobject thiz, jlong nativeHandle) {
-    gguf_context* ggufContext       = reinterpret_cast<gguf_context*>(nativeHandle);
-    int64_t       chatTemplateKeyId = gguf_find_key(ggufContext, "tokenizer.chat_template");
-    std::string   chatTemplate;
-    if (chatTemplateKeyId == -1) {
-        chatTemplate = "";
-    } else {
-        chatTemplate = gguf_get_val_str(ggufContext, chatTemplateKeyId);
+    std::vector<jlong> values(results.size() * NUM_LONGS_PER_FILE);
+    jobjectArray strings = env->NewObjectArray(nPaths * NUM_STRINGS_PER_FILE, env->FindClass("java/lang/String"),
+                                               nullptr);
+    for (size_t i = 0; i < results.size(); i++) {
+        const GGUFMetadata& metadata = results[i];
+        const std::string*  fileStrings[NUM_STRINGS_PER_FILE] = { &metadata.architecture, &metadata.name,
+                                                                  &metadata.quantization, &metadata.chatTemplate,
+                                                                  &metadata.error };
+        for (int s = 0; s < NUM_STRINGS_PER_FILE; s++) {
+            jstring value = env->NewStringUTF(fileStrings[s]->c_str());
+            env->SetObjectArrayElement(strings, (jsize) (i * NUM_STRINGS_PER_FILE + s), value);
+            env->DeleteLocalRef(value);
+        }
+        jlong* out = values.data() + i * NUM_LONGS_PER_FILE;
+        out[0]     = (jlong) metadata.fileSize;
+        out[1]     = (jlong) metadata.mtimeNs;
+        out[2]     = (jlong) metadata.contextLength;
+        out[3]     = (jlong) metadata.blockCount;
+        out[4]     = (jlong) metadata.embeddingLength;
+        out[5]     = (jlong) metadata.feedForwardLength;
+        out[6]     = (jlong) metadata.headCount;
+        out[7]     = (jlong) metadata.headCountKv;
+        out[8]     = (jlong) metadata.keyLength;
+        out[9]     = (jlong) metadata.valueLength;
+        out[10]    = (jlong) metadata.vocabSize;
+        out[11]    = (jlong) metadata.parameterCount;
+        out[12]    = (jlong) metadata.weightBytes;
+        out[13]    = (jlong) metadata.kvBytesPerToken;
     }
-    return env->NewStringUTF(chatTemplate.c_str());
-}
\ No newline at end of file
+    env->SetLongArrayRegion(longs, 0, (jsize) values.size(), values.data());
+    return strings;
+}
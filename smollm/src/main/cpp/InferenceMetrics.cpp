@@ -0,0 +1,169 @@
+#include "InferenceMetrics.h"
+#include "ggml.h"
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+
+static const char* STAGE_NAMES[] = { "template", "tokenize", "prefill", "decode", "sample", "detokenize" };
+
+// the bucket of `us`: values below 4 have their own bucket, larger values fall in one of
+// 4 equal-width buckets between consecutive powers of two
+static size_t
+bucketIndex(uint64_t us) {
+    us = std::min(us, ((uint64_t) 1 << 40) - 1);
+    if (us < 4) {
+        return (size_t) us;
+    }
+    int msb = 63 - __builtin_clzll(us);
+    return (size_t) (4 * (msb - 1)) + (size_t) ((us >> (msb - 2)) & 3);
+}
+
+// the largest value that falls in the bucket `index`
+static uint64_t
+bucketUpperBound(size_t index) {
+    if (index < 4) {
+        return index;
+    }
+    int      msb   = (int) (index / 4) + 1;
+    uint64_t lower = (4 + (uint64_t) (index % 4)) << (msb - 2);
+    return lower + ((uint64_t) 1 << (msb - 2)) - 1;
+}
+
+void
+InferenceMetrics::record(InferenceStage stage, int64_t startUs, int64_t durationUs) {
+    uint64_t   us        = (uint64_t) std::max(durationUs, (int64_t) 0);
+    Histogram& histogram = _histograms[(size_t) stage];
+    histogram.totalUs.fetch_add(us, std::memory_order_relaxed);
+    histogram.buckets[bucketIndex(us)].fetch_add(1, std::memory_order_relaxed);
+    uint64_t maxUs = histogram.maxUs.load(std::memory_order_relaxed);
+    while (us > maxUs && !histogram.maxUs.compare_exchange_weak(maxUs, us, std::memory_order_relaxed)) {
+    }
+
+    if (_traceEnabled.load(std::memory_order_relaxed)) {
+        TraceEvent event = { stage, (uint32_t) std::hash<std::thread::id>{}(std::this_thread::get_id()), startUs,
+                             (int64_t) us };
+        std::lock_guard<std::mutex> lock(_traceMutex);
+        if (_traceEvents.size() < _maxTraceEvents) {
+            _traceEvents.push_back(event);
+        } else if (_maxTraceEvents > 0) {
+            _traceEvents[_traceStart] = event;
+            _traceStart               = (_traceStart + 1) % _maxTraceEvents;
+        }
+    }
+}
+
+void
+InferenceMetrics::addPrefillTokens(uint64_t nTokens) {
+    _prefillTokens.fetch_add(nTokens, std::memory_order_relaxed);
+}
+
+void
+InferenceMetrics::addGeneratedTokens(uint64_t nTokens) {
+    _generatedTokens.fetch_add(nTokens, std::memory_order_relaxed);
+}
+
+void
+InferenceMetrics::addDecodedTokens(uint64_t nTokens) {
+    _decodedTokens.fetch_add(nTokens, std::memory_order_relaxed);
+}
+
+InferenceMetricsSnapshot
+InferenceMetrics::snapshot() const {
+    InferenceMetricsSnapshot snapshot;
+    for (size_t s = 0; s < (size_t) InferenceStage::Count; s++) {
+        const Histogram& histogram = _histograms[s];
+        StageMetrics&    stage     = snapshot.stages[s];
+        uint64_t         counts[NUM_BUCKETS];
+        uint64_t         total = 0;
+        for (size_t i = 0; i < NUM_BUCKETS; i++) {
+            counts[i] = histogram.buckets[i].load(std::memory_order_relaxed);
+            total += counts[i];
+        }
+        stage.count   = total;
+        stage.totalUs = histogram.totalUs.load(std::memory_order_relaxed);
+        stage.maxUs   = histogram.maxUs.load(std::memory_order_relaxed);
+        if (total == 0) {
+            continue;
+        }
+        // nearest-rank percentiles over the buckets
+        uint64_t  ranks[3]       = { (total * 50 + 99) / 100, (total * 95 + 99) / 100, (total * 99 + 99) / 100 };
+        uint64_t* percentiles[3] = { &stage.p50Us, &stage.p95Us, &stage.p99Us };
+        uint64_t  cumulative     = 0;
+        size_t    p              = 0;
+        for (size_t i = 0; i < NUM_BUCKETS && p < 3; i++) {
+            cumulative += counts[i];
+            while (p < 3 && cumulative >= ranks[p]) {
+                *percentiles[p++] = std::min(bucketUpperBound(i), stage.maxUs);
+            }
+        }
+    }
+    snapshot.prefillTokens   = _prefillTokens.load(std::memory_order_relaxed);
+    snapshot.generatedTokens = _generatedTokens.load(std::memory_order_relaxed);
+    snapshot.decodedTokens   = _decodedTokens.load(std::memory_order_relaxed);
+    return snapshot;
+}
+
+void
+InferenceMetrics::reset() {
+    for (Histogram& histogram : _histograms) {
+        histogram.totalUs.store(0, std::memory_order_relaxed);
+        histogram.maxUs.store(0, std::memory_order_relaxed);
+        for (auto& bucket : histogram.buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+    _prefillTokens.store(0, std::memory_order_relaxed);
+    _generatedTokens.store(0, std::memory_order_relaxed);
+    _decodedTokens.store(0, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(_traceMutex);
+    _traceEvents.clear();
+    _traceStart = 0;
+}
+
+void
+InferenceMetrics::setTraceEnabled(bool enabled, size_t maxEvents) {
+    std::lock_guard<std::mutex> lock(_traceMutex);
+    _traceEvents.clear();
+    _traceEvents.shrink_to_fit();
+    _traceStart     = 0;
+    _maxTraceEvents = enabled ? maxEvents : 0;
+    if (enabled) {
+        _traceEvents.reserve(std::min(maxEvents, (size_t) 4096));
+    }
+    _traceEnabled.store(enabled && maxEvents > 0, std::memory_order_relaxed);
+}
+
+void
+InferenceMetrics::dumpTrace(const std::string& path) const {
+    FILE* file = fopen(path.c_str(), "w");
+    if (file == nullptr) {
+        throw std::runtime_error("could not open " + path + ": " + std::strerror(errno));
+    }
+    std::lock_guard<std::mutex> lock(_traceMutex);
+    fprintf(file, "{\"traceEvents\":[");
+    for (size_t i = 0; i < _traceEvents.size(); i++) {
+        // oldest first
+        const TraceEvent& event = _traceEvents[(_traceStart + i) % _traceEvents.size()];
+        fprintf(file,
+                "%s\n{\"name\":\"%s\",\"cat\":\"smollm\",\"ph\":\"X\",\"ts\":%" PRId64 ",\"dur\":%" PRId64
+                ",\"pid\":1,\"tid\":%" PRIu32 "}",
+                i == 0 ? "" : ",", STAGE_NAMES[(size_t) event.stage], event.startUs, event.durationUs,
+                event.threadId);
+    }
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    if (fclose(file) != 0) {
+        throw std::runtime_error("could not write " + path + ": " + std::strerror(errno));
+    }
+}
+
+ScopedStageTimer::ScopedStageTimer(InferenceMetrics& metrics, InferenceStage stage)
+    : _metrics(metrics), _stage(stage), _startUs(ggml_time_us()) {}
+
+ScopedStageTimer::~ScopedStageTimer() {
+    _metrics.record(_stage, _startUs, ggml_time_us() - _startUs);
+}
@@ -0,0 +1,107 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// stages of the inference pipeline timed by InferenceMetrics, the order is part of the layout
+// returned by InferenceMetrics::snapshot()
+enum class InferenceStage { Template, Tokenize, Prefill, Decode, Sample, Detokenize, Count };
+
+// latency distribution of a stage, in microseconds
+struct StageMetrics {
+    uint64_t count   = 0;
+    uint64_t totalUs = 0;
+    uint64_t maxUs   = 0;
+    // upper bounds of the histogram buckets holding the percentiles, at most 25% above the exact values
+    uint64_t p50Us = 0;
+    uint64_t p95Us = 0;
+    uint64_t p99Us = 0;
+};
+
+struct InferenceMetricsSnapshot {
+    StageMetrics stages[(size_t) InferenceStage::Count];
+    // tokens decoded by prefill(), excluding the ones reused from the KV cache
+    uint64_t prefillTokens = 0;
+    // tokens returned by completionLoop() or generate()
+    uint64_t generatedTokens = 0;
+    // tokens decoded by the model, including the prompt and the verified drafts
+    uint64_t decodedTokens = 0;
+};
+
+// Always-on timers and counters for the stages of the inference pipeline. Recording a sample is a
+// few relaxed atomic increments into a log-linear histogram, so the metrics can be read from
+// another thread while a response is generated, without locking the generation loop.
+// Optionally, every sample is also kept as a trace event, see setTraceEnabled()
+class InferenceMetrics {
+  public:
+    // buckets of the histogram: 4 linear buckets per power of two, up to 2^40 microseconds
+    static constexpr size_t NUM_BUCKETS = 156;
+
+    // Records a sample of `durationUs` microseconds for `stage`, that started at `startUs`
+    // (from ggml_time_us())
+    void record(InferenceStage stage, int64_t startUs, int64_t durationUs);
+
+    void addPrefillTokens(uint64_t nTokens);
+
+    void addGeneratedTokens(uint64_t nTokens);
+
+    void addDecodedTokens(uint64_t nTokens);
+
+    // Returns the metrics accumulated since the last reset(). The counters are read one by one,
+    // a sample recorded concurrently may be reflected in some of them only
+    InferenceMetricsSnapshot snapshot() const;
+
+    void reset();
+
+    // Keeps every sample recorded from now on as a trace event (up to `maxEvents`, the oldest
+    // events are dropped afterwards), or discards the events if `enabled` is false
+    void setTraceEnabled(bool enabled, size_t maxEvents = 100000);
+
+    // Writes the trace events as a Chrome trace (JSON Trace Event Format) to `path`, which can be
+    // opened in Perfetto or chrome://tracing. Throws std::runtime_error if the file cannot be written
+    void dumpTrace(const std::string& path) const;
+
+  private:
+    struct Histogram {
+        std::atomic<uint64_t> totalUs{ 0 };
+        std::atomic<uint64_t> maxUs{ 0 };
+        std::atomic<uint64_t> buckets[NUM_BUCKETS] = {};
+    };
+
+    struct TraceEvent {
+        InferenceStage stage;
+        uint32_t       threadId;
+        int64_t        startUs;
+        int64_t        durationUs;
+    };
+
+    Histogram             _histograms[(size_t) InferenceStage::Count];
+    std::atomic<uint64_t> _prefillTokens{ 0 };
+    std::atomic<uint64_t> _generatedTokens{ 0 };
+    std::atomic<uint64_t> _decodedTokens{ 0 };
+
+    // checked before taking `_traceMutex`, so that recording without tracing does not lock
+    std::atomic<bool>       _traceEnabled{ false };
+    mutable std::mutex      _traceMutex;
+    std::vector<TraceEvent> _traceEvents;
+    // index of the oldest event once `_traceEvents` is full and used as a ring buffer
+    size_t _traceStart     = 0;
+    size_t _maxTraceEvents = 0;
+};
+
+// times the enclosing scope as a sample of `stage`
+class ScopedStageTimer {
+    InferenceMetrics& _metrics;
+    InferenceStage    _stage;
+    int64_t           _startUs;
+
+  public:
+    ScopedStageTimer(InferenceMetrics& metrics, InferenceStage stage);
+
+    ~ScopedStageTimer();
+
+    ScopedStageTimer(const ScopedStageTimer&)            = delete;
+    ScopedStageTimer& operator=(const ScopedStageTimer&) = delete;
+};
@@ -0,0 +1,127 @@
+#include "LLMEmbedder.h"
+#include "Log.h"
+#include "ModelLoader.h"
+#include "common.h"
+#include <cmath>
+#include <stdexcept>
+
+void
+LLMEmbedder::loadModel(const char* modelPath, int poolingType, int nThreads, long contextSize, int nParallel,
+                       bool useMmap) {
+    LOGi("loading embedding model with"
+         "\n\tmodelPath = %s"
+         "\n\tpoolingType = %d"
+         "\n\tnThreads = %d"
+         "\n\tcontextSize = %li"
+         "\n\tnParallel = %d",
+         modelPath, poolingType, nThreads, contextSize, nParallel);
+
+    // load dynamic backends, once per process
+    loadBackendsOnce();
+
+    llama_model_params model_params = llama_model_default_params();
+    model_params.use_mmap           = useMmap;
+    _model                          = llama_model_load_from_file(modelPath, model_params);
+    if (!_model) {
+        LOGe("failed to load embedding model from %s", modelPath);
+        throw std::runtime_error("loadModel() failed");
+    }
+
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.embeddings           = true;
+    ctx_params.pooling_type         = (enum llama_pooling_type) poolingType;
+    ctx_params.n_ctx                = contextSize > 0 ? contextSize : llama_model_n_ctx_train(_model);
+    // the tokens of a sequence are pooled in a single ubatch, the texts of a batch
+    // are decoded as separate sequences sharing the `n_ctx` cells of a unified KV cache
+    ctx_params.n_batch    = ctx_params.n_ctx;
+    ctx_params.n_ubatch   = ctx_params.n_ctx;
+    ctx_params.n_seq_max  = std::max(nParallel, 1);
+    ctx_params.kv_unified = true;
+    ctx_params.n_threads  = nThreads;
+    ctx_params.no_perf    = true;
+    _ctx                  = llama_init_from_model(_model, ctx_params);
+    if (!_ctx) {
+        throw std::runtime_error("llama_init_from_model() returned null for the embedding model");
+    }
+    enum llama_pooling_type pooling = llama_pooling_type(_ctx);
+    if (pooling == LLAMA_POOLING_TYPE_NONE || pooling == LLAMA_POOLING_TYPE_RANK) {
+        throw std::runtime_error("the pooling type should be one of mean, cls or last");
+    }
+
+    _nEmbd = llama_model_n_embd(_model);
+    _batch = llama_batch_init((int32_t) llama_n_batch(_ctx), 0, 1);
+}
+
+int
+LLMEmbedder::getEmbeddingDim() const {
+    return _nEmbd;
+}
+
+void
+LLMEmbedder::embed(const std::vector<std::string>& texts, float* embeddings) {
+    const llama_vocab* vocab   = llama_model_get_vocab(_model);
+    const size_t       nBatch  = llama_n_batch(_ctx);
+    const size_t       nSeqMax = llama_n_seq_max(_ctx);
+
+    // texts are added to the batch until it is full, either by the no. of tokens or sequences
+    std::vector<int> batchTexts;
+    common_batch_clear(_batch);
+    for (size_t i = 0; i < texts.size(); i++) {
+        std::vector<llama_token> tokens = common_tokenize(vocab, texts[i], true, true);
+        if (tokens.size() > nBatch) {
+            LOGe("text %zu has %zu tokens, truncated to %zu tokens", i, tokens.size(), nBatch);
+            tokens.resize(nBatch);
+        }
+        if (_batch.n_tokens + tokens.size() > nBatch || batchTexts.size() == nSeqMax) {
+            _decodeBatch(batchTexts, embeddings);
+            batchTexts.clear();
+        }
+        llama_seq_id seqId = (llama_seq_id) batchTexts.size();
+        for (size_t pos = 0; pos < tokens.size(); pos++) {
+            common_batch_add(_batch, tokens[pos], (llama_pos) pos, { seqId }, true);
+        }
+        batchTexts.push_back((int) i);
+    }
+    if (!batchTexts.empty()) {
+        _decodeBatch(batchTexts, embeddings);
+    }
+}
+
+void
+LLMEmbedder::_decodeBatch(const std::vector<int>& textIndices, float* embeddings) {
+    // the sequences of the previous batch are not attended to
+    llama_memory_t memory = llama_get_memory(_ctx);
+    if (memory != nullptr) {
+        llama_memory_clear(memory, true);
+    }
+    int32_t status = (llama_model_has_encoder(_model) && !llama_model_has_decoder(_model))
+                         ? llama_encode(_ctx, _batch)
+                         : llama_decode(_ctx, _batch);
+    if (status != 0) {
+        throw std::runtime_error("failed to decode the batch of texts");
+    }
+
+    for (size_t seqId = 0; seqId < textIndices.size(); seqId++) {
+        const float* pooled = llama_get_embeddings_seq(_ctx, (llama_seq_id) seqId);
+        if (pooled == nullptr) {
+            throw std::runtime_error("failed to get the embedding of the sequence");
+        }
+        // L2-normalize, so that the dot product of two embeddings is their cosine similarity
+        double norm = 0.0;
+        for (int i = 0; i < _nEmbd; i++) {
+            norm += (double) pooled[i] * pooled[i];
+        }
+        float  scale = norm > 0.0 ? (float) (1.0 / std::sqrt(norm)) : 0.0f;
+        float* out   = embeddings + (size_t) textIndices[seqId] * _nEmbd;
+        for (int i = 0; i < _nEmbd; i++) {
+            out[i] = pooled[i] * scale;
+        }
+    }
+    common_batch_clear(_batch);
+}
+
+LLMEmbedder::~LLMEmbedder() {
+    llama_batch_free(_batch);
+    llama_free(_ctx);
+    llama_model_free(_model);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "llama.h"
+#include <string>
+#include <vector>
+
+// generates normalized embeddings for texts with a GGUF embedding model
+class LLMEmbedder {
+    llama_context* _ctx   = nullptr;
+    llama_model*   _model = nullptr;
+    llama_batch    _batch = {};
+
+    // dimension of the embeddings produced by the model
+    int _nEmbd = 0;
+
+    void _decodeBatch(const std::vector<int>& textIndices, float* embeddings);
+
+  public:
+    // Loads the embedding model, `poolingType` is one of llama_pooling_type,
+    // LLAMA_POOLING_TYPE_UNSPECIFIED uses the pooling type from the GGUF file
+    void loadModel(const char* modelPath, int poolingType, int nThreads, long contextSize, int nParallel,
+                   bool useMmap);
+
+    int getEmbeddingDim() const;
+
+    // Writes the L2-normalized embeddings of `texts` to `embeddings`, that holds
+    // texts.size() * getEmbeddingDim() floats. Multiple texts are decoded in a single batch
+    void embed(const std::vector<std::string>& texts, float* embeddings);
+
+    ~LLMEmbedder();
+};
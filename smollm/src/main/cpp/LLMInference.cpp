@@ -1,45 +1,121 @@
 #include "LLMInference.h"
-#include <android/log.h>
+#include "Log.h"
+#include "json-schema-to-grammar.h"
+#include <algorithm>
+#include <cmath>
 #include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
 #include <iomanip>
 #include <iostream>
-
-#define TAG "[SmolLMAndroid-Cpp]"
-#define LOGi(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
-#define LOGe(...) __android_log_print(ANDROID_LOG_ERROR, TAG, __VA_ARGS__)
+#include <nlohmann/json.hpp>
+#include <random>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 void
-LLMInference::loadModel(const char *model_path, float minP, float temperature, bool storeChats, long contextSize,
-                        const char *chatTemplate, int nThreads, bool useMmap, bool useMlock) {
+LLMInference::loadModel(const char *model_path, const SamplerParams &samplerParams, bool storeChats, long contextSize,
+                        const char *chatTemplate, int nThreads, bool useMmap, bool useMlock, int nBatch,
+                        int nUBatch, int nParallel, int nSinkTokens, int typeK, int typeV, int flashAttn,
+                        long kvMemoryBudget, bool prefetch, bool warmup,
+                        const ModelLoadProgressCallback& onProgress) {
     LOGi("loading model with"
          "\n\tmodel_path = %s"
-         "\n\tminP = %f"
-         "\n\ttemperature = %f"
          "\n\tstoreChats = %d"
          "\n\tcontextSize = %li"
          "\n\tchatTemplate = %s"
          "\n\tnThreads = %d"
          "\n\tuseMmap = %d"
-         "\n\tuseMlock = %d",
-         model_path, minP, temperature, storeChats, contextSize, chatTemplate, nThreads, useMmap, useMlock);
+         "\n\tuseMlock = %d"
+         "\n\tnBatch = %d"
+         "\n\tnUBatch = %d"
+         "\n\tnParallel = %d"
+         "\n\tnSinkTokens = %d"
+         "\n\ttypeK = %s"
+         "\n\ttypeV = %s"
+         "\n\tflashAttn = %d"
+         "\n\tkvMemoryBudget = %li"
+         "\n\tprefetch = %d"
+         "\n\twarmup = %d",
+         model_path, storeChats, contextSize, chatTemplate, nThreads, useMmap, useMlock, nBatch,
+         nUBatch, nParallel, nSinkTokens, ggml_type_name((ggml_type) typeK), ggml_type_name((ggml_type) typeV),
+         flashAttn, kvMemoryBudget, prefetch, warmup);
+    int64_t loadStartTime = ggml_time_us();
 
-    // load dynamic backends
-    ggml_backend_load_all();
+    // load dynamic backends, once per process
+    loadBackendsOnce();
+
+    // without mmap, llama.cpp reads the whole file into its buffers while loading
+    if (prefetch && useMmap && !prefetchModelFile(model_path, onProgress)) {
+        throw std::runtime_error("loading the model was cancelled");
+    }
 
     // create an instance of llama_model
     llama_model_params model_params = llama_model_default_params();
     model_params.use_mmap = useMmap;
     model_params.use_mlock = useMlock;
+    // set if `onProgress` cancelled the loading
+    struct LoadProgress {
+        const ModelLoadProgressCallback* callback;
+        bool                             cancelled;
+    } loadProgress = { &onProgress, false };
+    if (onProgress) {
+        model_params.progress_callback = [](float progress, void* userData) {
+            auto* loadProgress      = static_cast<LoadProgress*>(userData);
+            loadProgress->cancelled = !(*loadProgress->callback)(ModelLoadStage::Load, progress);
+            return !loadProgress->cancelled;
+        };
+        model_params.progress_callback_user_data = &loadProgress;
+    }
     _model = llama_model_load_from_file(model_path, model_params);
     if (!_model) {
         LOGe("failed to load model from %s", model_path);
-        throw std::runtime_error("loadModel() failed");
+        throw std::runtime_error(loadProgress.cancelled ? "loading the model was cancelled" : "loadModel() failed");
     }
+    struct stat modelStat {};
+    stat(model_path, &modelStat);
+    _modelPath      = model_path;
+    _modelFileSize  = (int64_t) modelStat.st_size;
+    _modelFileMtime = (int64_t) modelStat.st_mtime;
 
     // create an instance of llama_context
     llama_context_params ctx_params = llama_context_default_params();
     ctx_params.n_ctx = contextSize;
-    ctx_params.n_batch = contextSize;
+    // quantized K/V types reduce the size of the KV cache, a quantized V cache
+    // requires flash-attention (LLAMA_FLASH_ATTN_TYPE_AUTO enables it where supported)
+    ctx_params.type_k          = (ggml_type) typeK;
+    ctx_params.type_v          = (ggml_type) typeV;
+    ctx_params.flash_attn_type = (llama_flash_attn_type) flashAttn;
+    _typeK                     = typeK;
+    _typeV                     = typeV;
+    _flashAttn                 = flashAttn;
+    if (kvMemoryBudget > 0) {
+        // the largest context whose KV cache fits in the budget, in multiples of 256
+        // (the context size is padded to 256 by llama.cpp)
+        size_t bytesPerToken = _kvCacheBytesPerToken((ggml_type) typeK, (ggml_type) typeV);
+        long   maxContext    = (long) ((size_t) kvMemoryBudget / bytesPerToken) / 256 * 256;
+        if (maxContext == 0) {
+            throw std::runtime_error("the memory budget is smaller than the KV cache for 256 tokens");
+        }
+        if (contextSize <= 0 || contextSize > maxContext) {
+            ctx_params.n_ctx = std::min(maxContext, (long) llama_model_n_ctx_train(_model));
+        }
+        LOGi("KV cache: %zu bytes per token, context size = %u", bytesPerToken, ctx_params.n_ctx);
+    }
+    // the logical (n_batch) and physical (n_ubatch) batch sizes bound the no. of tokens
+    // decoded in a single llama_decode call and the size of the compute buffers,
+    // the prompt is decoded in chunks of n_batch tokens in prefill()
+    if (nBatch > 0) {
+        ctx_params.n_batch = nBatch;
+    }
+    if (nUBatch > 0) {
+        ctx_params.n_ubatch = std::min(nUBatch, (int) ctx_params.n_batch);
+    }
+    // sequence 0 holds the conversation in `_messages`, sequences 1..nParallel are
+    // used by sessions, all sequences share the `n_ctx` cells of a unified KV cache
+    ctx_params.n_seq_max  = nParallel > 0 ? nParallel + 1 : 1;
+    ctx_params.kv_unified = true;
     ctx_params.n_threads = nThreads;
     ctx_params.no_perf = true; // disable performance metrics
     _ctx = llama_init_from_model(_model, ctx_params);
@@ -48,27 +124,229 @@ LLMInference::loadModel(const char *model_path, float minP, float temperature, b
         throw std::runtime_error("llama_new_context_with_model() returned null");
     }
 
-    // create an instance of llama_sampler
-    llama_sampler_chain_params sampler_params = llama_sampler_chain_default_params();
-    sampler_params.no_perf = true; // disable performance metrics
-    _sampler = llama_sampler_chain_init(sampler_params);
-    llama_sampler_chain_add(_sampler, llama_sampler_init_temp(temperature));
-    llama_sampler_chain_add(_sampler, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    _sampler = _createSampler(samplerParams);
 
-    _formattedMessages = std::vector<char>(llama_n_ctx(_ctx));
+    _formattedMessages.clear();
     _messages.clear();
+    _messagePrefixTokens.clear();
+    if (nParallel > 0) {
+        _sessionsBatch = llama_batch_init((int32_t) llama_n_batch(_ctx), 0, 1);
+    }
 
     if (chatTemplate == nullptr) {
         _chatTemplate = llama_model_chat_template(_model, nullptr);
     } else {
         _chatTemplate = strdup(chatTemplate);
     }
+    // parsing the chat-template is done once for the lifetime of the model
+    _chatTemplates = common_chat_templates_init(_model, _chatTemplate ? _chatTemplate : "");
     this->_storeChats = storeChats;
+    _nSinkTokens      = nSinkTokens;
+
+    if (warmup) {
+        if (onProgress && !onProgress(ModelLoadStage::Warmup, 0.0f)) {
+            throw std::runtime_error("loading the model was cancelled");
+        }
+        _warmup();
+        if (onProgress) {
+            onProgress(ModelLoadStage::Warmup, 1.0f);
+        }
+    }
+    LOGi("model ready in %.1f ms", (ggml_time_us() - loadStartTime) / 1000.0);
+}
+
+void
+LLMInference::_warmup() {
+    // decodes the BOS and EOS tokens, as llama.cpp's common_init_from_params() does, which reads
+    // the weights of every layer (except the experts not selected in MoE models) and runs the
+    // first-time initialization of the compute graph and the backends. Not recorded in the metrics
+    int64_t                  startTime = ggml_time_us();
+    const llama_vocab*       vocab     = llama_model_get_vocab(_model);
+    std::vector<llama_token> tokens;
+    if (llama_vocab_bos(vocab) != LLAMA_TOKEN_NULL) {
+        tokens.push_back(llama_vocab_bos(vocab));
+    }
+    if (llama_vocab_eos(vocab) != LLAMA_TOKEN_NULL) {
+        tokens.push_back(llama_vocab_eos(vocab));
+    }
+    if (tokens.empty()) {
+        tokens.push_back(0);
+    }
+    if (llama_decode(_ctx, llama_batch_get_one(tokens.data(), (int32_t) tokens.size())) != 0) {
+        throw std::runtime_error("llama_decode() failed while warming up the model");
+    }
+    llama_synchronize(_ctx);
+    llama_memory_clear(llama_get_memory(_ctx), true);
+    LOGi("warmup decode took %.1f ms", (ggml_time_us() - startTime) / 1000.0);
+}
+
+size_t
+LLMInference::_kvCacheBytesPerToken(ggml_type typeK, ggml_type typeV) const {
+    // dimensions of the key/value heads, which may differ from n_embd / n_head
+    char arch[64]  = {};
+    char value[32] = {};
+    llama_model_meta_val_str(_model, "general.architecture", arch, sizeof(arch));
+    int64_t nHead     = llama_model_n_head(_model);
+    int64_t nHeadKV   = llama_model_n_head_kv(_model);
+    int64_t nEmbdHead = nHead > 0 ? llama_model_n_embd(_model) / nHead : 0;
+    int64_t nEmbdHeadK = nEmbdHead;
+    int64_t nEmbdHeadV = nEmbdHead;
+    if (llama_model_meta_val_str(_model, (std::string(arch) + ".attention.key_length").c_str(), value,
+                                 sizeof(value)) > 0) {
+        nEmbdHeadK = std::stoll(value);
+    }
+    if (llama_model_meta_val_str(_model, (std::string(arch) + ".attention.value_length").c_str(), value,
+                                 sizeof(value)) > 0) {
+        nEmbdHeadV = std::stoll(value);
+    }
+    // every layer stores a key and a value vector for each KV head,
+    // for models with sliding-window or recurrent layers this is an upper bound
+    size_t bytesPerLayer = ggml_row_size(typeK, nEmbdHeadK * nHeadKV) + ggml_row_size(typeV, nEmbdHeadV * nHeadKV);
+    return std::max((size_t) 1, bytesPerLayer * llama_model_n_layer(_model));
+}
+
+size_t
+LLMInference::getContextSize() const {
+    return llama_n_ctx(_ctx);
+}
+
+llama_sampler*
+LLMInference::_createSampler(const SamplerParams& params) {
+    LOGi("creating sampler with"
+         "\n\ttemperature = %f"
+         "\n\ttopK = %d"
+         "\n\ttopP = %f"
+         "\n\tminP = %f"
+         "\n\ttypicalP = %f"
+         "\n\trepeatPenalty = %f"
+         "\n\tpresencePenalty = %f"
+         "\n\tpenaltyLastN = %d"
+         "\n\tdryMultiplier = %f"
+         "\n\tseed = %u",
+         params.temperature, params.topK, params.topP, params.minP, params.typicalP, params.repeatPenalty,
+         params.presencePenalty, params.penaltyLastN, params.dryMultiplier, params.seed);
+
+    // create an instance of llama_sampler
+    llama_sampler_chain_params sampler_params = llama_sampler_chain_default_params();
+    sampler_params.no_perf                    = true; // disable performance metrics
+    llama_sampler* sampler                    = llama_sampler_chain_init(sampler_params);
+
+    // top-k and min-p run first: they reduce the candidates from the size of the vocabulary
+    // to a few hundred tokens without a softmax, so that the penalties and the samplers
+    // that sort the candidates or normalize their probabilities only touch the retained tokens
+    if (params.topK > 0) {
+        llama_sampler_chain_add(sampler, llama_sampler_init_top_k(params.topK));
+    }
+    if (params.minP > 0.0f) {
+        llama_sampler_chain_add(sampler, llama_sampler_init_min_p(params.minP, 1));
+    }
+    if (params.repeatPenalty != 1.0f || params.presencePenalty != 0.0f) {
+        llama_sampler_chain_add(sampler, llama_sampler_init_penalties(params.penaltyLastN, params.repeatPenalty,
+                                                                      0.0f, params.presencePenalty));
+    }
+    if (params.dryMultiplier > 0.0f) {
+        static const char* dryBreakers[] = { "\n", ":", "\"", "*" };
+        llama_sampler_chain_add(sampler, llama_sampler_init_dry(llama_model_get_vocab(_model),
+                                                                llama_model_n_ctx_train(_model), params.dryMultiplier,
+                                                                params.dryBase, params.dryAllowedLength,
+                                                                params.dryPenaltyLastN, dryBreakers, 4));
+    }
+    if (params.typicalP < 1.0f) {
+        llama_sampler_chain_add(sampler, llama_sampler_init_typical(params.typicalP, 1));
+    }
+    if (params.topP < 1.0f) {
+        llama_sampler_chain_add(sampler, llama_sampler_init_top_p(params.topP, 1));
+    }
+    if (params.temperature <= 0.0f) {
+        llama_sampler_chain_add(sampler, llama_sampler_init_greedy());
+    } else {
+        llama_sampler_chain_add(sampler, llama_sampler_init_temp(params.temperature));
+        llama_sampler_chain_add(sampler, llama_sampler_init_dist(params.seed));
+    }
+    return sampler;
+}
+
+void
+LLMInference::loadDraftModel(const char *modelPath, int nDraft, int nThreads) {
+    LOGi("loading draft model with"
+         "\n\tmodelPath = %s"
+         "\n\tnDraft = %d",
+         modelPath, nDraft);
+    llama_model_params model_params = llama_model_default_params();
+    _draftModel                     = llama_model_load_from_file(modelPath, model_params);
+    if (!_draftModel) {
+        LOGe("failed to load draft model from %s", modelPath);
+        throw std::runtime_error("loadDraftModel() failed");
+    }
+
+    // the draft model proposes token IDs that are verified by the main model,
+    // hence both models should share the same vocabulary
+    const llama_vocab *vocab      = llama_model_get_vocab(_model);
+    const llama_vocab *draftVocab = llama_model_get_vocab(_draftModel);
+    int                nVocab       = llama_vocab_n_tokens(vocab);
+    int                nDraftVocab  = llama_vocab_n_tokens(draftVocab);
+    bool               isCompatible = std::abs(nVocab - nDraftVocab) <= 128 &&
+                        llama_vocab_bos(vocab) == llama_vocab_bos(draftVocab) &&
+                        llama_vocab_eos(vocab) == llama_vocab_eos(draftVocab);
+    for (int i = 5; isCompatible && i < std::min(nVocab, nDraftVocab); i++) {
+        isCompatible = strcmp(llama_vocab_get_text(vocab, i), llama_vocab_get_text(draftVocab, i)) == 0;
+    }
+    if (!isCompatible) {
+        llama_model_free(_draftModel);
+        _draftModel = nullptr;
+        throw std::runtime_error("the vocabulary of the draft model does not match the main model");
+    }
+
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx                = llama_n_ctx(_ctx);
+    ctx_params.n_batch              = llama_n_batch(_ctx);
+    ctx_params.n_ubatch             = llama_n_ubatch(_ctx);
+    ctx_params.n_threads            = nThreads;
+    ctx_params.no_perf              = true;
+    _draftCtx                       = llama_init_from_model(_draftModel, ctx_params);
+    if (!_draftCtx) {
+        llama_model_free(_draftModel);
+        _draftModel = nullptr;
+        throw std::runtime_error("llama_init_from_model() returned null for the draft model");
+    }
+
+    // the draft model proposes its most probable tokens
+    llama_sampler_chain_params sampler_params = llama_sampler_chain_default_params();
+    sampler_params.no_perf                    = true;
+    _draftSampler                             = llama_sampler_chain_init(sampler_params);
+    llama_sampler_chain_add(_draftSampler, llama_sampler_init_greedy());
+
+    _setNumDraftTokens(nDraft);
+    _draftCachedTokens.clear();
+}
+
+void
+LLMInference::enablePromptLookupDecoding(int ngramSize, int nDraft) {
+    LOGi("enabling prompt-lookup decoding with ngramSize = %d, nDraft = %d", ngramSize, nDraft);
+    if (ngramSize < 1) {
+        throw std::runtime_error("ngramSize should be at least 1");
+    }
+    _ngramSize = ngramSize;
+    _ngramIndex.clear();
+    _nNgramIndexed = 0;
+    _setNumDraftTokens(nDraft);
+}
+
+void
+LLMInference::_setNumDraftTokens(int nDraft) {
+    // the verification batch holds the last sampled token and the draft
+    if (nDraft > _nDraft) {
+        llama_batch_free(_specBatch);
+        _specBatch = llama_batch_init(nDraft + 1, 0, 1);
+        _nDraft    = nDraft;
+    }
+    _nDraftedTokens       = 0;
+    _nAcceptedDraftTokens = 0;
 }
 
 void
 LLMInference::addChatMessage(const char *message, const char *role) {
-    _messages.push_back({strdup(role), strdup(message)});
+    _messages.push_back({ role, message });
 }
 
 float
@@ -76,166 +354,1263 @@ LLMInference::getResponseGenerationTime() const {
     return (float) _responseNumTokens / (_responseGenerationTime / 1e6);
 }
 
+float
+LLMInference::getDraftAcceptanceRate() const {
+    return _nDraftedTokens == 0 ? 0.0f : (float) _nAcceptedDraftTokens / (float) _nDraftedTokens;
+}
+
 int
 LLMInference::getContextSizeUsed() const {
     return _nCtxUsed;
 }
 
-bool
-LLMInference::startCompletion(const char *query) {
-    if (!_storeChats) {
-        _formattedMessages.clear();
-        _formattedMessages = std::vector<char>(llama_n_ctx(_ctx));
-    }
-    _responseGenerationTime = 0;
-    _responseNumTokens = 0;
-    addChatMessage(query, "user");
-    // apply the chat-template
-    std::vector<common_chat_msg> messages;
-    for (const llama_chat_message& message : _messages) {
-        common_chat_msg msg;
-        msg.role    = message.role;
-        msg.content = message.content;
-        messages.push_back(msg);
-    }
-    auto templates = common_chat_templates_init(_model, _chatTemplate ? _chatTemplate : "");
+long
+LLMInference::getNumEvictedTokens() const {
+    return _nEvictedTokens;
+}
 
-    common_chat_templates_inputs inputs;
-    inputs.messages = messages;
+int
+LLMInference::getNumReusedTokens() const {
+    return _nReusedTokens;
+}
+
+int
+LLMInference::getNumPromptTokens() const {
+    return (int) _promptTokens.size();
+}
 
-    // Try Jinja rendering first with tools defined to prevent "tojson on Undefined" errors.
-    // If Jinja fails (e.g. unsupported filters like lstrip), fall back to legacy rendering.
-    inputs.use_jinja = true;
+InferenceMetricsSnapshot
+LLMInference::getMetrics() const {
+    return _metrics.snapshot();
+}
+
+void
+LLMInference::resetMetrics() {
+    _metrics.reset();
+}
+
+void
+LLMInference::setTraceEnabled(bool enabled) {
+    _metrics.setTraceEnabled(enabled);
+}
+
+void
+LLMInference::dumpTrace(const char* path) {
+    _metrics.dumpTrace(path);
+}
+
+std::string
+LLMInference::_applyChatTemplate(std::vector<common_chat_msg> &messages, bool addGenerationPrompt, bool &usedJinja) {
+    // the inputs are local as the conversation and the sessions render their templates concurrently,
+    // messages are moved in and out of `inputs.messages` instead of being copied
+    common_chat_templates_inputs inputs;
+    // tools are defined to prevent "tojson on Undefined" errors in Jinja templates
     inputs.chat_template_kwargs["tools"] = "[]";
+    inputs.add_generation_prompt         = addGenerationPrompt;
+    std::swap(inputs.messages, messages);
 
+    // Try Jinja rendering first. If Jinja fails (e.g. unsupported filters like lstrip), fall back to
+    // legacy rendering, the template is not rendered with Jinja again for the lifetime of the model
     std::string prompt;
-    bool usedJinja = true;
+    usedJinja = _useJinja.load();
     try {
-        prompt = common_chat_templates_apply(templates.get(), inputs).prompt;
-    } catch (const std::exception &e) {
-        LOGe("Jinja template failed: %s — retrying with legacy renderer", e.what());
-        inputs.use_jinja = false;
-        inputs.chat_template_kwargs.clear();
-        prompt = common_chat_templates_apply(templates.get(), inputs).prompt;
-        usedJinja = false;
+        if (usedJinja) {
+            try {
+                inputs.use_jinja = true;
+                prompt = common_chat_templates_apply(_chatTemplates.get(), inputs).prompt;
+            } catch (const std::exception &e) {
+                LOGe("Jinja template failed: %s — using the legacy renderer", e.what());
+                _useJinja = false;
+                usedJinja = false;
+            }
+        }
+        if (!usedJinja) {
+            inputs.use_jinja = false;
+            prompt = common_chat_templates_apply(_chatTemplates.get(), inputs).prompt;
+        }
+    } catch (...) {
+        std::swap(inputs.messages, messages);
+        throw;
     }
-    _promptTokens = common_tokenize(llama_model_get_vocab(_model), prompt, true, true);
-
-    // create a llama_batch containing a single sequence
-    // see llama_batch_init for more details
-    _batch = new llama_batch();
-    _batch->token = _promptTokens.data();
-    _batch->n_tokens = _promptTokens.size();
-
-    return usedJinja;
+    std::swap(inputs.messages, messages);
+    return prompt;
 }
 
-// taken from:
-// https://github.com/ggerganov/llama.cpp/blob/master/examples/llama.android/llama/src/main/cpp/llama-android.cpp#L38
 bool
-LLMInference::_isValidUtf8(const char *response) {
-    if (!response) {
-        return true;
+LLMInference::startCompletion(const char *query, const char *grammar, bool isJsonSchema) {
+    _responseGenerationTime = 0;
+    _responseNumTokens = 0;
+    _responseStream.reset(_stopSequences);
+    _responseComplete = false;
+    _setGrammar(grammar, isJsonSchema);
+    addChatMessage(query, "user");
+    bool        usedJinja = true;
+    std::string prompt;
+    {
+        ScopedStageTimer timer(_metrics, InferenceStage::Template);
+        prompt = _applyChatTemplate(_messages, true, usedJinja);
     }
-    const unsigned char *bytes = (const unsigned char *) response;
-    int num;
-    while (*bytes != 0x00) {
-        if ((*bytes & 0x80) == 0x00) {
-            // U+0000 to U+007F
-            num = 1;
-        } else if ((*bytes & 0xE0) == 0xC0) {
-            // U+0080 to U+07FF
-            num = 2;
-        } else if ((*bytes & 0xF0) == 0xE0) {
-            // U+0800 to U+FFFF
-            num = 3;
-        } else if ((*bytes & 0xF8) == 0xF0) {
-            // U+10000 to U+10FFFF
-            num = 4;
+
+    // the previous prompt is usually a prefix of the new prompt (followed by the response and the
+    // new query), only the text after the prefix is tokenized and its tokens appended
+    const llama_vocab* vocab = llama_model_get_vocab(_model);
+    {
+        ScopedStageTimer timer(_metrics, InferenceStage::Tokenize);
+        if (!_formattedMessages.empty() && !_promptTokens.empty() && prompt.size() > _formattedMessages.size() &&
+            prompt.compare(0, _formattedMessages.size(), _formattedMessages) == 0) {
+            std::vector<llama_token> deltaTokens =
+                common_tokenize(vocab, prompt.substr(_formattedMessages.size()), false, true);
+            _promptTokens.insert(_promptTokens.end(), deltaTokens.begin(), deltaTokens.end());
         } else {
-            return false;
+            _promptTokens = common_tokenize(vocab, prompt, true, true);
         }
+    }
+    _formattedMessages = std::move(prompt);
 
-        bytes += 1;
-        for (int i = 1; i < num; ++i) {
-            if ((*bytes & 0xC0) != 0x80) {
-                return false;
-            }
-            bytes += 1;
+    std::lock_guard<std::mutex> lock(_ctxMutex);
+    // find the longest common prefix of the new prompt and the tokens
+    // already present in the KV cache, only the remaining suffix needs to be decoded
+    // at least one token is decoded to obtain the logits for sampling
+    size_t nPast = 0;
+    while (nPast < _cachedTokens.size() && nPast < _promptTokens.size() &&
+           _cachedTokens[nPast] == _promptTokens[nPast]) {
+        nPast++;
+    }
+    if (nPast == _promptTokens.size() && nPast > 0) {
+        nPast--;
+    }
+    if (nPast < _cachedTokens.size()) {
+        // the prompt diverges from the cached tokens,
+        // remove KV entries from the point of divergence
+        llama_memory_t memory = llama_get_memory(_ctx);
+        if (!llama_memory_seq_rm(memory, 0, (llama_pos) nPast, -1)) {
+            // partial removal is not supported by the memory (e.g. recurrent models)
+            llama_memory_seq_rm(memory, 0, -1, -1);
+            nPast = 0;
         }
+        _cachedTokens.resize(nPast);
+        _nNgramIndexed = std::min(_nNgramIndexed, nPast);
     }
-    return true;
+    _nReusedTokens  = (int) nPast;
+    _nPromptDecoded = nPast;
+    _acceptedTokens.clear();
+    LOGi("reusing %zu of %zu prompt tokens from the KV cache", nPast, _promptTokens.size());
+
+    return usedJinja;
 }
 
-std::string
-LLMInference::completionLoop() {
+void
+LLMInference::_decodeTokens(const llama_token *tokens, int nTokens) {
     // check if the length of the inputs to the model
     // have exceeded the context size of the model
-    uint32_t contextSize = llama_n_ctx(_ctx);
+    _reserveContext(nTokens);
     _nCtxUsed = llama_memory_seq_pos_max(llama_get_memory(_ctx), 0) + 1;
-    if (_nCtxUsed + _batch->n_tokens > contextSize) {
+
+    // create a llama_batch containing a single sequence
+    // see llama_batch_get_one for more details
+    llama_batch batch = llama_batch_get_one(const_cast<llama_token *>(tokens), nTokens);
+    if (llama_decode(_ctx, batch) != 0) {
+        throw std::runtime_error("llama_decode() failed");
+    }
+    // tokens in the batch now have their key/value pairs in the KV cache
+    _cachedTokens.insert(_cachedTokens.end(), tokens, tokens + nTokens);
+    _nCtxUsed += nTokens;
+    _metrics.addDecodedTokens(nTokens);
+}
+
+// FNV-1a hash of a sequence of tokens
+static uint64_t
+hashTokens(const llama_token *tokens, size_t nTokens) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < nTokens; i++) {
+        hash ^= (uint32_t) tokens[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+size_t
+LLMInference::_countMessageTokens(size_t nMessages) {
+    // a prefix of the conversation is rendered and tokenized once, afterwards its tokens are
+    // compared with the KV cache through their hash
+    if (nMessages < _messagePrefixTokens.size() && _messagePrefixTokens[nMessages].first > 0) {
+        size_t nTokens = _messagePrefixTokens[nMessages].first;
+        if (nTokens > _cachedTokens.size() ||
+            hashTokens(_cachedTokens.data(), nTokens) != _messagePrefixTokens[nMessages].second) {
+            return 0;
+        }
+        return nTokens;
+    }
+    const llama_vocab*       vocab = llama_model_get_vocab(_model);
+    std::vector<llama_token> tokens;
+    if (nMessages == 0) {
+        // only the BOS token, if the model adds one
+        tokens = common_tokenize(vocab, "", true, true);
+    } else {
+        std::vector<common_chat_msg> messages(_messages.begin(), _messages.begin() + (long) nMessages);
+        bool                         usedJinja;
+        tokens = common_tokenize(vocab, _applyChatTemplate(messages, false, usedJinja), true, true);
+    }
+    if (_messagePrefixTokens.size() <= nMessages) {
+        _messagePrefixTokens.resize(nMessages + 1, { 0, 0 });
+    }
+    _messagePrefixTokens[nMessages] = { tokens.size(), hashTokens(tokens.data(), tokens.size()) };
+    if (tokens.size() > _cachedTokens.size() || !std::equal(tokens.begin(), tokens.end(), _cachedTokens.begin())) {
+        return 0;
+    }
+    return tokens.size();
+}
+
+void
+LLMInference::_reserveContext(int nTokens) {
+    llama_memory_t memory = llama_get_memory(_ctx);
+    const size_t   nCtx   = llama_n_ctx(_ctx);
+    const size_t   nPast  = llama_memory_seq_pos_max(memory, 0) + 1;
+    if (nPast + nTokens <= nCtx) {
+        return;
+    }
+    if (_nSinkTokens < 0 || !llama_memory_can_shift(memory) || nPast != _cachedTokens.size()) {
+        throw std::runtime_error("context size reached");
+    }
+    // at least the tokens that do not fit are evicted, and half of the evictable tokens, so that
+    // evictions are rare
+    size_t nMinDiscard = nPast + nTokens - nCtx;
+
+    // the tokens of the system prompt are always kept
+    size_t nSystem = 0;
+    while (nSystem < _messages.size() && _messages[nSystem].role == "system") {
+        nSystem++;
+    }
+    size_t nSystemTokens = _countMessageTokens(nSystem);
+
+    // prefer evicting whole turns (a user message and the following messages up to the next user
+    // message), which are also removed from `_messages`, so that the next prompt matches the KV cache
+    // and the conversation still alternates between the user and the assistant. The sink tokens are
+    // then the tokens of the system prompt, as sink tokens after it would belong to an evicted turn
+    size_t nKeep            = nSystemTokens;
+    size_t nDiscard         = 0;
+    size_t nEvictedMessages = 0;
+    if (nSystem == 0 || nSystemTokens > 0) {
+        for (size_t n = nSystem + 1; n < _messages.size(); n++) {
+            if (_messages[n].role != "user") {
+                continue;
+            }
+            size_t nMessageTokens = _countMessageTokens(n);
+            if (nMessageTokens == 0) {
+                break;
+            }
+            if (nMessageTokens - nKeep >= std::max(nMinDiscard, (nPast - nKeep) / 2)) {
+                nDiscard         = nMessageTokens - nKeep;
+                nEvictedMessages = n - nSystem;
+                break;
+            }
+        }
+    }
+    // if the turns do not align with the cached tokens (or the remaining turn alone is too long),
+    // tokens after the sink tokens are evicted regardless of the turns, `_messages` is kept
+    if (nEvictedMessages == 0) {
+        nKeep = std::max(nSystemTokens, (size_t) _nSinkTokens);
+        if (nKeep >= nPast) {
+            throw std::runtime_error("context size reached");
+        }
+        nDiscard = std::min(std::max(nMinDiscard, (nPast - nKeep) / 2), nPast - nKeep);
+    }
+    if (nPast - nDiscard + nTokens > nCtx) {
         throw std::runtime_error("context size reached");
     }
 
-    auto start = ggml_time_us();
+    // remove the key/value pairs of the evicted tokens and shift the positions of the remaining
+    // tokens, the retained tokens are not decoded again
+    llama_memory_seq_rm(memory, 0, (llama_pos) nKeep, (llama_pos) (nKeep + nDiscard));
+    llama_memory_seq_add(memory, 0, (llama_pos) (nKeep + nDiscard), -1, -(llama_pos) nDiscard);
+    if (_draftCtx != nullptr && _draftCachedTokens.size() >= nKeep + nDiscard &&
+        std::equal(_cachedTokens.begin(), _cachedTokens.begin() + (long) (nKeep + nDiscard),
+                   _draftCachedTokens.begin())) {
+        llama_memory_t draftMemory = llama_get_memory(_draftCtx);
+        llama_memory_seq_rm(draftMemory, 0, (llama_pos) nKeep, (llama_pos) (nKeep + nDiscard));
+        llama_memory_seq_add(draftMemory, 0, (llama_pos) (nKeep + nDiscard), -1, -(llama_pos) nDiscard);
+        _draftCachedTokens.erase(_draftCachedTokens.begin() + (long) nKeep,
+                                 _draftCachedTokens.begin() + (long) (nKeep + nDiscard));
+    }
+    _cachedTokens.erase(_cachedTokens.begin() + (long) nKeep, _cachedTokens.begin() + (long) (nKeep + nDiscard));
+
+    // the decoded part of the prompt is a prefix of the cached tokens
+    size_t promptEnd = std::min(_promptTokens.size(), nKeep + nDiscard);
+    if (nKeep < promptEnd) {
+        _promptTokens.erase(_promptTokens.begin() + (long) nKeep, _promptTokens.begin() + (long) promptEnd);
+        _nPromptDecoded -= promptEnd - nKeep;
+    }
+    _nReusedTokens = std::min(_nReusedTokens, (int) nKeep);
+    _messages.erase(_messages.begin() + (long) nSystem, _messages.begin() + (long) (nSystem + nEvictedMessages));
+    _messagePrefixTokens.clear();
+    // the next prompt is tokenized again
+    _formattedMessages.clear();
+    _ngramIndex.clear();
+    _nNgramIndexed = 0;
+    _nEvictedTokens += (long) nDiscard;
+    _nCtxUsed = (int) _cachedTokens.size();
+    LOGi("evicted %zu tokens (%zu messages) from the context, keeping %zu tokens", nDiscard, nEvictedMessages,
+         nKeep);
+}
+
+void
+LLMInference::_prefillChunk() {
+    if (_nPromptDecoded < _promptTokens.size()) {
+        ScopedStageTimer timer(_metrics, InferenceStage::Prefill);
+        size_t nChunk = std::min(_promptTokens.size() - _nPromptDecoded, (size_t) llama_n_batch(_ctx));
+        // evicting tokens from the context also removes them from `_promptTokens`
+        _reserveContext((int) nChunk);
+        _decodeTokens(_promptTokens.data() + _nPromptDecoded, (int) nChunk);
+        _nPromptDecoded += nChunk;
+        _metrics.addPrefillTokens(nChunk);
+    }
+}
+
+float
+LLMInference::prefill() {
+    std::lock_guard<std::mutex> lock(_ctxMutex);
+    _prefillChunk();
+    size_t nTotal = _promptTokens.size() - _nReusedTokens;
+    return nTotal == 0 ? 1.0f : (float) (_nPromptDecoded - _nReusedTokens) / (float) nTotal;
+}
+
+// compiled grammars beyond this count are evicted from the cache
+static constexpr size_t MAX_CACHED_GRAMMARS = 8;
+
+void
+LLMInference::_setGrammar(const char *grammar, bool isJsonSchema) {
+    llama_sampler_free(_grammarSampler);
+    _grammarSampler = nullptr;
+    if (grammar == nullptr) {
+        return;
+    }
+
+    // parsing the grammar (and converting the JSON schema) is done once for each grammar,
+    // a clone of the compiled grammar starts from its initial state
+    std::string key   = (isJsonSchema ? "json:" : "gbnf:") + std::string(grammar);
+    auto        entry = _grammarCache.find(key);
+    if (entry == _grammarCache.end()) {
+        std::string gbnf = grammar;
+        if (isJsonSchema) {
+            try {
+                gbnf = json_schema_to_grammar(nlohmann::ordered_json::parse(grammar));
+            } catch (const std::exception &e) {
+                throw std::runtime_error(std::string("invalid JSON schema: ") + e.what());
+            }
+        }
+        llama_sampler *compiled = llama_sampler_init_grammar(llama_model_get_vocab(_model), gbnf.c_str(), "root");
+        if (compiled == nullptr) {
+            throw std::runtime_error("failed to parse the grammar");
+        }
+        if (_grammarCache.size() >= MAX_CACHED_GRAMMARS) {
+            auto evicted = _grammarCache.begin();
+            llama_sampler_free(evicted->second);
+            _grammarCache.erase(evicted);
+        }
+        entry = _grammarCache.emplace(key, compiled).first;
+    }
+    _grammarSampler = llama_sampler_clone(entry->second);
+}
+
+llama_token
+LLMInference::_sampleToken(int32_t idx) {
+    ScopedStageTimer timer(_metrics, InferenceStage::Sample);
+    if (_grammarSampler == nullptr) {
+        return llama_sampler_sample(_sampler, _ctx, idx);
+    }
+
+    const float *logits = llama_get_logits_ith(_ctx, idx);
+    const int    nVocab = llama_vocab_n_tokens(llama_model_get_vocab(_model));
+    auto         fillCandidates = [&]() {
+        _candidates.resize(nVocab);
+        for (llama_token token = 0; token < nVocab; token++) {
+            _candidates[token] = { token, logits[token], 0.0f };
+        }
+        return llama_token_data_array{ _candidates.data(), _candidates.size(), -1, false };
+    };
+
+    // fast path: sample without the grammar and check only the sampled token against it,
+    // most tokens are accepted by the grammar and the grammar is not applied to the vocabulary.
+    // The last stage of the chain (dist or greedy) picks the token with a copy of its state, which
+    // replaces the stage only if the token is accepted, so that a rejected token does not advance
+    // the random state, which advances once per sampled token as without the fast path
+    llama_token_data_array cur_p   = fillCandidates();
+    int                    nStages = llama_sampler_chain_n(_sampler);
+    for (int i = 0; i < nStages - 1; i++) {
+        llama_sampler_apply(llama_sampler_chain_get(_sampler, i), &cur_p);
+    }
+    llama_sampler* trialStage = llama_sampler_clone(llama_sampler_chain_get(_sampler, nStages - 1));
+    llama_sampler_apply(trialStage, &cur_p);
+    llama_token            token    = cur_p.data[cur_p.selected].id;
+    llama_token_data       single   = { token, 1.0f, 0.0f };
+    llama_token_data_array single_p = { &single, 1, -1, false };
+    llama_sampler_apply(_grammarSampler, &single_p);
+    if (single.logit == -INFINITY) {
+        // the token is rejected by the grammar, sample again from the tokens allowed by the grammar
+        llama_sampler_free(trialStage);
+        cur_p = fillCandidates();
+        llama_sampler_apply(_grammarSampler, &cur_p);
+        llama_sampler_apply(_sampler, &cur_p);
+        token = cur_p.data[cur_p.selected].id;
+    } else {
+        llama_sampler_free(llama_sampler_chain_remove(_sampler, nStages - 1));
+        llama_sampler_chain_add(_sampler, trialStage);
+    }
+    llama_sampler_accept(_grammarSampler, token);
+    llama_sampler_accept(_sampler, token);
+    return token;
+}
+
+bool
+LLMInference::_generateNext(std::string &piece) {
+    piece.clear();
+    if (_responseComplete) {
+        return false;
+    }
+    // the logits are sampled before the context is used by the sessions
+    std::lock_guard<std::mutex> lock(_ctxMutex);
+    auto                        start = ggml_time_us();
     // run the model
-    if (llama_decode(_ctx, *_batch) < 0) {
-        throw std::runtime_error("llama_decode() failed");
+    if (_nPromptDecoded < _promptTokens.size()) {
+        // decode the remaining chunks of the prompt, if prefill()
+        // was not called until completion
+        while (_nPromptDecoded < _promptTokens.size()) {
+            _prefillChunk();
+        }
+        _currToken = _sampleToken(-1);
+    } else if (_draftCtx != nullptr || _ngramSize > 0) {
+        // tokens sampled in a single speculative step are returned one at a time
+        if (_acceptedTokens.empty()) {
+            _speculate();
+        }
+        _currToken = _acceptedTokens.front();
+        _acceptedTokens.pop_front();
+    } else {
+        // key, value pairs of all previous tokens have been cached
+        // in the KV cache, only the last predicted token is decoded
+        {
+            ScopedStageTimer timer(_metrics, InferenceStage::Decode);
+            _decodeTokens(&_currToken, 1);
+        }
+        _currToken = _sampleToken(-1);
     }
 
-    // sample a token and check if it is an EOG (end of generation token)
+    // check if the sampled token is an EOG (end of generation token)
     // convert the integer token to its corresponding word-piece
-    _currToken = llama_sampler_sample(_sampler, _ctx, -1);
-    if (llama_vocab_is_eog(llama_model_get_vocab(_model), _currToken)) {
-        addChatMessage(strdup(_response.data()), "assistant");
+    bool isComplete = llama_vocab_is_eog(llama_model_get_vocab(_model), _currToken);
+    if (isComplete) {
+        // the text held back as a partial match of a stop sequence ends the response
+        _responseStream.flush(piece);
+    } else {
+        std::string tokenPiece;
+        {
+            ScopedStageTimer timer(_metrics, InferenceStage::Detokenize);
+            tokenPiece = common_token_to_piece(_ctx, _currToken, true);
+        }
+        _metrics.addGeneratedTokens(1);
+        auto end = ggml_time_us();
+        _responseGenerationTime += (end - start);
+        _responseNumTokens += 1;
+        isComplete = !_responseStream.append(tokenPiece, piece);
+    }
+    _response += piece;
+    if (isComplete) {
+        // tokens accepted after the stop sequence are not used
+        _acceptedTokens.clear();
+        _setGrammar(nullptr, false);
+        addChatMessage(_response.c_str(), "assistant");
         _response.clear();
-        return "[EOG]";
+        _responseComplete = true;
+    }
+    return !isComplete;
+}
+
+void
+LLMInference::_syncDraftCache() {
+    // bring the KV cache of the draft context to the same tokens as the main context
+    size_t nPast = 0;
+    while (nPast < _draftCachedTokens.size() && nPast < _cachedTokens.size() &&
+           _draftCachedTokens[nPast] == _cachedTokens[nPast]) {
+        nPast++;
+    }
+    if (nPast < _draftCachedTokens.size()) {
+        llama_memory_t memory = llama_get_memory(_draftCtx);
+        if (!llama_memory_seq_rm(memory, 0, (llama_pos) nPast, -1)) {
+            llama_memory_seq_rm(memory, 0, -1, -1);
+            nPast = 0;
+        }
+        _draftCachedTokens.resize(nPast);
+    }
+    size_t nBatch = llama_n_batch(_draftCtx);
+    while (nPast < _cachedTokens.size()) {
+        size_t      nChunk = std::min(_cachedTokens.size() - nPast, nBatch);
+        llama_batch batch  = llama_batch_get_one(_cachedTokens.data() + nPast, (int32_t) nChunk);
+        if (llama_decode(_draftCtx, batch) != 0) {
+            throw std::runtime_error("llama_decode() failed for the draft model");
+        }
+        _draftCachedTokens.insert(_draftCachedTokens.end(), _cachedTokens.begin() + (long) nPast,
+                                  _cachedTokens.begin() + (long) (nPast + nChunk));
+        nPast += nChunk;
+    }
+}
+
+std::vector<llama_token>
+LLMInference::_draftTokensFromNgrams() {
+    std::vector<llama_token> draft;
+    const size_t             n = _ngramSize;
+    if (_cachedTokens.size() < n) {
+        return draft;
+    }
+    // index the n-grams of the tokens added to the KV cache since the last lookup,
+    // mapping each n-gram to the index of the token that follows it
+    for (size_t i = std::max(_nNgramIndexed, n); i < _cachedTokens.size(); i++) {
+        _ngramIndex[hashTokens(_cachedTokens.data() + i - n, n)] = i;
+    }
+    _nNgramIndexed = _cachedTokens.size();
+
+    // the last n tokens of the sequence, including the token yet to be decoded
+    std::vector<llama_token> ngram(_cachedTokens.end() - (long) (n - 1), _cachedTokens.end());
+    ngram.push_back(_currToken);
+    auto match = _ngramIndex.find(hashTokens(ngram.data(), n));
+    if (match == _ngramIndex.end()) {
+        return draft;
+    }
+    size_t next = match->second;
+    // the entry may be stale (if the cache was truncated) or a hash collision
+    if (next > _cachedTokens.size() ||
+        !std::equal(ngram.begin(), ngram.end(), _cachedTokens.begin() + (long) (next - n))) {
+        return draft;
+    }
+    size_t nDraft = std::min((size_t) _nDraft, _cachedTokens.size() - next);
+    draft.assign(_cachedTokens.begin() + (long) next, _cachedTokens.begin() + (long) (next + nDraft));
+    return draft;
+}
+
+std::vector<llama_token>
+LLMInference::_draftTokens() {
+    std::vector<llama_token> draft;
+    if (_ngramSize > 0) {
+        draft = _draftTokensFromNgrams();
+    }
+    if (draft.empty() && _draftCtx != nullptr) {
+        draft = _draftTokensFromModel();
+    }
+    return draft;
+}
+
+std::vector<llama_token>
+LLMInference::_draftTokensFromModel() {
+    std::vector<llama_token> draft;
+    const llama_vocab*       draftVocab = llama_model_get_vocab(_draftModel);
+    if (_currToken >= llama_vocab_n_tokens(draftVocab)) {
+        // the token is not present in the vocabulary of the draft model
+        return draft;
+    }
+    _syncDraftCache();
+    uint32_t    contextSize = llama_n_ctx(_draftCtx);
+    llama_token token       = _currToken;
+    while ((int) draft.size() < _nDraft && _draftCachedTokens.size() + 1 < contextSize) {
+        llama_batch batch = llama_batch_get_one(&token, 1);
+        if (llama_decode(_draftCtx, batch) != 0) {
+            break;
+        }
+        _draftCachedTokens.push_back(token);
+        token = llama_sampler_sample(_draftSampler, _draftCtx, -1);
+        if (llama_vocab_is_eog(draftVocab, token)) {
+            break;
+        }
+        draft.push_back(token);
+    }
+    return draft;
+}
+
+void
+LLMInference::_speculate() {
+    _reserveContext(1);
+    std::vector<llama_token> draft = _draftTokens();
+
+    // trim the draft to fit in the context window
+    llama_memory_t memory      = llama_get_memory(_ctx);
+    llama_pos      nPast       = llama_memory_seq_pos_max(memory, 0) + 1;
+    uint32_t       contextSize = llama_n_ctx(_ctx);
+    draft.resize(std::min(draft.size(), (size_t) (contextSize - nPast - 1)));
+
+    // verify the last sampled token and the draft in a single batch,
+    // with logits for every position
+    common_batch_clear(_specBatch);
+    common_batch_add(_specBatch, _currToken, nPast, { 0 }, true);
+    for (size_t i = 0; i < draft.size(); i++) {
+        common_batch_add(_specBatch, draft[i], nPast + 1 + (llama_pos) i, { 0 }, true);
+    }
+    {
+        ScopedStageTimer timer(_metrics, InferenceStage::Decode);
+        if (llama_decode(_ctx, _specBatch) != 0) {
+            throw std::runtime_error("llama_decode() failed");
+        }
     }
-    std::string piece = common_token_to_piece(_ctx, _currToken, true);
-    auto end = ggml_time_us();
-    _responseGenerationTime += (end - start);
-    _responseNumTokens += 1;
-    _cacheResponseTokens += piece;
+    _metrics.addDecodedTokens(_specBatch.n_tokens);
 
-    // re-init the batch with the newly predicted token
-    // key, value pairs of all previous tokens have been cached
-    // in the KV cache
-    _batch->token = &_currToken;
-    _batch->n_tokens = 1;
+    // sample from the main model at each position and accept the draft tokens until the
+    // first mismatch. As the draft is greedy (a one-hot proposal distribution), this is
+    // rejection sampling: a draft token is accepted with the probability the main model
+    // assigns to it, and a mismatching sample is drawn from the residual distribution.
+    // The token sampled after the last accepted draft token is also returned
+    size_t nAccepted = 0;
+    for (size_t i = 0; i <= draft.size(); i++) {
+        llama_token token = _sampleToken((int32_t) i);
+        _acceptedTokens.push_back(token);
+        if (i == draft.size() || token != draft[i]) {
+            break;
+        }
+        nAccepted++;
+    }
+    _nDraftedTokens += (long) draft.size();
+    _nAcceptedDraftTokens += (long) nAccepted;
+
+    // keep KV entries only for the last sampled token and the accepted draft tokens
+    llama_memory_seq_rm(memory, 0, nPast + 1 + (llama_pos) nAccepted, -1);
+    _cachedTokens.push_back(_currToken);
+    _cachedTokens.insert(_cachedTokens.end(), draft.begin(), draft.begin() + (long) nAccepted);
+    _nCtxUsed = nPast + 1 + (int) nAccepted;
+}
+
+std::string
+LLMInference::completionLoop() {
+    std::string piece;
+    // the text completing the response is returned before "[EOG]"
+    if (!_generateNext(piece) && piece.empty()) {
+        return "[EOG]";
+    }
+    return piece;
+}
 
-    if (_isValidUtf8(_cacheResponseTokens.c_str())) {
-        _response += _cacheResponseTokens;
-        std::string valid_utf8_piece = _cacheResponseTokens;
-        _cacheResponseTokens.clear();
-        return valid_utf8_piece;
+void
+LLMInference::generate(int maxTokens, int maxTimeMs, int flushTokens, int flushIntervalMs,
+                       const std::function<void(const std::string &)> &onText) {
+    std::string pending;
+    std::string piece;
+    int         nPendingTokens = 0;
+    int64_t     lastFlushTime  = ggml_time_us();
+    int64_t     deadline       = maxTimeMs > 0 ? lastFlushTime + (int64_t) maxTimeMs * 1000 : 0;
+    bool        reachedEOG     = false;
+    for (int nTokens = 0; maxTokens <= 0 || nTokens < maxTokens; nTokens++) {
+        if (_cancelGeneration.load(std::memory_order_relaxed)) {
+            break;
+        }
+        if (deadline > 0 && ggml_time_us() >= deadline) {
+            break;
+        }
+        bool hasNext = _generateNext(piece);
+        pending += piece;
+        if (!hasNext) {
+            reachedEOG = true;
+            break;
+        }
+        nPendingTokens++;
+        // coalesce pieces to reduce the no. of callbacks
+        int64_t now = ggml_time_us();
+        if (nPendingTokens >= flushTokens || now - lastFlushTime >= (int64_t) flushIntervalMs * 1000) {
+            if (!pending.empty()) {
+                onText(pending);
+                pending.clear();
+            }
+            nPendingTokens = 0;
+            lastFlushTime  = now;
+        }
+    }
+    if (!reachedEOG) {
+        // the response was not added to `_messages` on EOG or a stop sequence,
+        // the text held back as a partial match of a stop sequence is a part of it
+        piece.clear();
+        _responseStream.flush(piece);
+        _response += piece;
+        pending += piece;
+        stopCompletion();
+    }
+    if (!pending.empty()) {
+        onText(pending);
     }
+}
+
+void
+LLMInference::startGeneration(int maxTokens, int maxTimeMs, int flushTokens, int flushIntervalMs,
+                              std::function<void(const std::string &)> onText,
+                              std::function<void(const char *error)> onComplete) {
+    cancelGeneration();
+    _cancelGeneration.store(false);
+    _generationThread = std::thread(
+        [this, maxTokens, maxTimeMs, flushTokens, flushIntervalMs, onText = std::move(onText),
+         onComplete = std::move(onComplete)]() {
+            try {
+                generate(maxTokens, maxTimeMs, flushTokens, flushIntervalMs, onText);
+                onComplete(nullptr);
+            } catch (std::exception &error) {
+                LOGe("generation failed: %s", error.what());
+                onComplete(error.what());
+            }
+        });
+}
 
-    return "";
+void
+LLMInference::cancelGeneration() {
+    _cancelGeneration.store(true);
+    if (_generationThread.joinable()) {
+        if (_generationThread.get_id() == std::this_thread::get_id()) {
+            // called from onComplete, on the generation thread itself
+            _generationThread.detach();
+        } else {
+            _generationThread.join();
+        }
+    }
 }
 
 void
 LLMInference::stopCompletion() {
+    _setGrammar(nullptr, false);
+    std::string heldText;
+    _responseStream.flush(heldText);
+    _response += heldText;
     if (_storeChats) {
         addChatMessage(_response.c_str(), "assistant");
     }
     _response.clear();
 }
 
+void
+LLMInference::setStopSequences(const std::vector<std::string>& stopSequences) {
+    std::lock_guard<std::mutex> lock(_sessionsMutex);
+    bool hasStopSequence = std::any_of(stopSequences.begin(), stopSequences.end(),
+                                       [](const std::string& stopSequence) { return !stopSequence.empty(); });
+    _stopSequences       = hasStopSequence ? std::make_shared<const StopSequenceMatcher>(stopSequences) : nullptr;
+}
+
+LLMSession*
+LLMInference::_getSession(int sessionId) {
+    auto it = _sessions.find(sessionId);
+    if (it == _sessions.end()) {
+        throw std::runtime_error("no session with ID " + std::to_string(sessionId));
+    }
+    return it->second.get();
+}
+
+int
+LLMInference::createSession() {
+    std::lock_guard<std::mutex> lock(_sessionsMutex);
+    // sequence 0 is used by the conversation in `_messages`
+    llama_seq_id nSeqMax = (llama_seq_id) llama_n_seq_max(_ctx);
+    llama_seq_id seqId   = 1;
+    while (seqId < nSeqMax && _sessions.count(seqId) > 0) {
+        seqId++;
+    }
+    if (seqId >= nSeqMax) {
+        throw std::runtime_error("all sequences are in use, increase nParallel in loadModel()");
+    }
+    auto session     = std::make_unique<LLMSession>();
+    session->seqId   = seqId;
+    session->sampler = llama_sampler_clone(_sampler);
+    llama_sampler_reset(session->sampler);
+    _sessions[seqId] = std::move(session);
+    return seqId;
+}
+
+void
+LLMInference::addSessionMessage(int sessionId, const char* message, const char* role) {
+    std::lock_guard<std::mutex> lock(_sessionsMutex);
+    _getSession(sessionId)->messages.push_back({ role, message });
+}
+
+void
+LLMInference::startSessionCompletion(int sessionId, const char* query, int maxTokens, int maxTimeMs,
+                                     std::function<void(const std::string&)> onText,
+                                     std::function<void(const char* error)>  onComplete) {
+    std::unique_lock<std::mutex> lock(_sessionsMutex);
+    LLMSession*                  session = _getSession(sessionId);
+    if (session->isActive) {
+        throw std::runtime_error("the session is already generating a response");
+    }
+    session->messages.push_back({ "user", query });
+    bool        usedJinja;
+    std::string prompt    = _applyChatTemplate(session->messages, true, usedJinja);
+    session->promptTokens = common_tokenize(llama_model_get_vocab(_model), prompt, true, true);
+
+    // as in startCompletion(), only the suffix of the prompt not present in
+    // the KV cache for the sequence of the session is decoded
+    size_t nPast = 0;
+    while (nPast < session->cachedTokens.size() && nPast < session->promptTokens.size() &&
+           session->cachedTokens[nPast] == session->promptTokens[nPast]) {
+        nPast++;
+    }
+    if (nPast == session->promptTokens.size() && nPast > 0) {
+        nPast--;
+    }
+    if (nPast < session->cachedTokens.size()) {
+        std::lock_guard<std::mutex> ctxLock(_ctxMutex);
+        llama_memory_t              memory = llama_get_memory(_ctx);
+        if (!llama_memory_seq_rm(memory, session->seqId, (llama_pos) nPast, -1)) {
+            llama_memory_seq_rm(memory, session->seqId, -1, -1);
+            nPast = 0;
+        }
+        session->cachedTokens.resize(nPast);
+    }
+    session->nPromptDecoded         = nPast;
+    session->maxTokens              = maxTokens;
+    session->deadlineUs             = maxTimeMs > 0 ? ggml_time_us() + (int64_t) maxTimeMs * 1000 : 0;
+    session->onText                 = std::move(onText);
+    session->onComplete             = std::move(onComplete);
+    session->responseGenerationTime = 0;
+    session->responseNumTokens      = 0;
+    session->response.clear();
+    session->stream.reset(_stopSequences);
+    session->isCancelled = false;
+    session->isActive    = true;
+
+    // the scheduler thread is started with the first session completion
+    if (!_schedulerThread.joinable()) {
+        _schedulerThread = std::thread(&LLMInference::_runScheduler, this);
+    }
+    lock.unlock();
+    _schedulerCv.notify_one();
+}
+
+void
+LLMInference::cancelSession(int sessionId) {
+    std::lock_guard<std::mutex> lock(_sessionsMutex);
+    // the response is completed before the next batch is decoded
+    _getSession(sessionId)->isCancelled = true;
+}
+
+float
+LLMInference::getSessionGenerationTime(int sessionId) {
+    std::lock_guard<std::mutex> lock(_sessionsMutex);
+    LLMSession*                 session = _getSession(sessionId);
+    return (float) session->responseNumTokens / (session->responseGenerationTime / 1e6);
+}
+
+void
+LLMInference::closeSession(int sessionId) {
+    std::function<void(const char*)> onComplete;
+    {
+        std::lock_guard<std::mutex> lock(_sessionsMutex);
+        LLMSession*                 session = _getSession(sessionId);
+        if (session->isActive) {
+            onComplete = std::move(session->onComplete);
+        }
+        {
+            std::lock_guard<std::mutex> ctxLock(_ctxMutex);
+            llama_memory_seq_rm(llama_get_memory(_ctx), session->seqId, -1, -1);
+        }
+        llama_sampler_free(session->sampler);
+        _sessions.erase(sessionId);
+    }
+    if (onComplete) {
+        onComplete(nullptr);
+    }
+}
+
+void
+LLMInference::_runScheduler() {
+    const llama_vocab* vocab = llama_model_get_vocab(_model);
+    const uint32_t     nCtx  = llama_n_ctx(_ctx);
+    // callbacks are invoked after releasing `_sessionsMutex`, as they may call the session API
+    std::vector<std::function<void()>> callbacks;
+    while (true) {
+        std::unique_lock<std::mutex> lock(_sessionsMutex);
+        _schedulerCv.wait(lock, [this]() {
+            return _stopScheduler || std::any_of(_sessions.begin(), _sessions.end(),
+                                                 [](const auto& entry) { return entry.second->isActive; });
+        });
+        if (_stopScheduler) {
+            break;
+        }
+
+        auto finish = [&callbacks](LLMSession* session, const char* error) {
+            session->isActive = false;
+            if (error == nullptr) {
+                // the text held back as a partial match of a stop sequence ends the response
+                std::string heldText;
+                session->stream.flush(heldText);
+                if (!heldText.empty()) {
+                    session->response += heldText;
+                    callbacks.push_back([onText = session->onText, heldText]() { onText(heldText); });
+                }
+                session->messages.push_back({ "assistant", session->response });
+            }
+            session->response.clear();
+            std::string errorStr = error ? error : "";
+            callbacks.push_back([onComplete = std::move(session->onComplete), error, errorStr]() {
+                onComplete(error ? errorStr.c_str() : nullptr);
+            });
+        };
+
+        // the batch holds the next token of every session generating a response,
+        // the remaining space is filled with chunks of the prompts being decoded
+        common_batch_clear(_sessionsBatch);
+        int32_t                  nBudget = (int32_t) llama_n_batch(_ctx);
+        std::vector<LLMSession*> batchSessions;
+        int64_t                  now = ggml_time_us();
+        for (auto& [seqId, session] : _sessions) {
+            session->batchIndex = -1;
+            if (!session->isActive) {
+                continue;
+            }
+            if (session->isCancelled || (session->deadlineUs > 0 && now >= session->deadlineUs)) {
+                finish(session.get(), nullptr);
+                continue;
+            }
+            if (session->nPromptDecoded < session->promptTokens.size() || nBudget == 0) {
+                continue;
+            }
+            if (session->cachedTokens.size() + 1 > nCtx) {
+                finish(session.get(), "context size reached");
+                continue;
+            }
+            session->batchIndex = _sessionsBatch.n_tokens;
+            common_batch_add(_sessionsBatch, session->currToken, (llama_pos) session->cachedTokens.size(),
+                             { seqId }, true);
+            session->cachedTokens.push_back(session->currToken);
+            batchSessions.push_back(session.get());
+            nBudget--;
+        }
+        for (auto& [seqId, session] : _sessions) {
+            if (!session->isActive || session->nPromptDecoded == session->promptTokens.size() || nBudget == 0) {
+                continue;
+            }
+            if (session->promptTokens.size() > nCtx) {
+                finish(session.get(), "context size reached");
+                continue;
+            }
+            size_t nChunk = std::min(session->promptTokens.size() - session->nPromptDecoded, (size_t) nBudget);
+            bool   isLast = session->nPromptDecoded + nChunk == session->promptTokens.size();
+            for (size_t i = session->nPromptDecoded; i < session->nPromptDecoded + nChunk; i++) {
+                // logits are only required for the last token of the prompt
+                common_batch_add(_sessionsBatch, session->promptTokens[i], (llama_pos) i, { seqId },
+                                 isLast && i + 1 == session->nPromptDecoded + nChunk);
+            }
+            if (isLast) {
+                session->batchIndex = _sessionsBatch.n_tokens - 1;
+            }
+            session->cachedTokens.insert(session->cachedTokens.end(),
+                                         session->promptTokens.begin() + (long) session->nPromptDecoded,
+                                         session->promptTokens.begin() + (long) (session->nPromptDecoded + nChunk));
+            session->nPromptDecoded += nChunk;
+            batchSessions.push_back(session.get());
+            nBudget -= (int32_t) nChunk;
+        }
+
+        if (_sessionsBatch.n_tokens > 0) {
+            std::lock_guard<std::mutex> ctxLock(_ctxMutex);
+            auto                        start  = ggml_time_us();
+            int32_t                     status = llama_decode(_ctx, _sessionsBatch);
+            if (status != 0) {
+                // no space left in the KV cache (status = 1) or a decoding error,
+                // the sessions in the batch are completed with an error
+                LOGe("llama_decode() returned %d for a batch of %d tokens", status, _sessionsBatch.n_tokens);
+                for (LLMSession* session : batchSessions) {
+                    llama_memory_seq_rm(llama_get_memory(_ctx), session->seqId, -1, -1);
+                    session->cachedTokens.clear();
+                    finish(session, status == 1 ? "KV cache is full" : "llama_decode() failed");
+                }
+                batchSessions.clear();
+            }
+            int64_t decodeTime = ggml_time_us() - start;
+            _metrics.record(InferenceStage::Decode, start, decodeTime);
+            if (!batchSessions.empty()) {
+                _metrics.addDecodedTokens(_sessionsBatch.n_tokens);
+            }
+            for (LLMSession* session : batchSessions) {
+                if (session->batchIndex < 0) {
+                    continue;
+                }
+                {
+                    ScopedStageTimer timer(_metrics, InferenceStage::Sample);
+                    session->currToken = llama_sampler_sample(session->sampler, _ctx, session->batchIndex);
+                }
+                session->responseGenerationTime += decodeTime;
+                if (llama_vocab_is_eog(vocab, session->currToken)) {
+                    finish(session, nullptr);
+                    continue;
+                }
+                session->responseNumTokens++;
+                std::string tokenPiece;
+                {
+                    ScopedStageTimer timer(_metrics, InferenceStage::Detokenize);
+                    tokenPiece = common_token_to_piece(_ctx, session->currToken, true);
+                }
+                _metrics.addGeneratedTokens(1);
+                std::string text;
+                bool        reachedStopSequence = !session->stream.append(tokenPiece, text);
+                if (!text.empty()) {
+                    session->response += text;
+                    callbacks.push_back([onText = session->onText, text = std::move(text)]() { onText(text); });
+                }
+                if (reachedStopSequence ||
+                    (session->maxTokens > 0 && session->responseNumTokens >= session->maxTokens)) {
+                    finish(session, nullptr);
+                }
+            }
+        }
+        lock.unlock();
+        for (const auto& callback : callbacks) {
+            callback();
+        }
+        callbacks.clear();
+    }
+}
+
 LLMInference::~LLMInference() {
-    // free memory held by the message text in messages
-    // (as we had used strdup() to create a malloc'ed copy)
-    for (llama_chat_message &message: _messages) {
-        free(const_cast<char *>(message.role));
-        free(const_cast<char *>(message.content));
+    cancelGeneration();
+    {
+        std::lock_guard<std::mutex> lock(_sessionsMutex);
+        _stopScheduler = true;
+    }
+    _schedulerCv.notify_one();
+    if (_schedulerThread.joinable()) {
+        _schedulerThread.join();
+    }
+    for (auto& [seqId, session] : _sessions) {
+        llama_sampler_free(session->sampler);
+    }
+    _sessions.clear();
+    llama_batch_free(_sessionsBatch);
+    llama_sampler_free(_grammarSampler);
+    for (auto& [key, grammarSampler] : _grammarCache) {
+        llama_sampler_free(grammarSampler);
     }
     llama_free(_ctx);
     llama_model_free(_model);
-    delete _batch;
+    llama_free(_draftCtx);
+    llama_model_free(_draftModel);
+    llama_sampler_free(_draftSampler);
+    llama_batch_free(_specBatch);
     llama_sampler_free(_sampler);
 }
 
+// header of a KV cache snapshot file, followed by
+// `nTokens` tokens and `stateSize` bytes of sequence state
+struct SnapshotHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t modelHash;
+    uint64_t nTokens;
+    uint64_t stateSize;
+};
+
+static constexpr uint32_t SNAPSHOT_MAGIC   = 0x564B4D53; // 'SMKV'
+static constexpr uint32_t SNAPSHOT_VERSION = 2;
+static constexpr char     SNAPSHOT_EXT[]   = ".smolkv";
+// snapshots in a directory beyond this count are deleted, least-recently used first
+static constexpr size_t MAX_SNAPSHOTS = 16;
+
+// read-only memory mapping of a snapshot file
+struct MappedSnapshot {
+    void*                 data   = MAP_FAILED;
+    size_t                size   = 0;
+    const SnapshotHeader* header = nullptr;
+    const llama_token*    tokens = nullptr;
+    const uint8_t*        state  = nullptr;
+
+    bool
+    open(const std::string& path, uint64_t modelHash) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st {};
+        if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(SnapshotHeader)) {
+            size = st.st_size;
+            data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (data == MAP_FAILED) {
+            return false;
+        }
+        header = static_cast<const SnapshotHeader*>(data);
+        if (header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION ||
+            header->modelHash != modelHash ||
+            sizeof(SnapshotHeader) + header->nTokens * sizeof(llama_token) + header->stateSize != size) {
+            return false;
+        }
+        tokens = reinterpret_cast<const llama_token*>(header + 1);
+        state  = reinterpret_cast<const uint8_t*>(tokens + header->nTokens);
+        return true;
+    }
+
+    ~MappedSnapshot() {
+        if (data != MAP_FAILED) {
+            munmap(data, size);
+        }
+    }
+};
+
+uint64_t
+LLMInference::_modelHash() const {
+    // the KV cache layout depends on the model file, the context parameters and the KV cache types
+    char desc[128];
+    llama_model_desc(_model, desc, sizeof(desc));
+    uint64_t values[] = { llama_model_size(_model),
+                          llama_model_n_params(_model),
+                          llama_n_ctx(_ctx),
+                          (uint64_t) llama_vocab_n_tokens(llama_model_get_vocab(_model)),
+                          (uint64_t) _modelFileSize,
+                          (uint64_t) _modelFileMtime,
+                          (uint64_t) _typeK,
+                          (uint64_t) _typeV,
+                          (uint64_t) _flashAttn };
+    uint64_t hash = 14695981039346656037ULL;
+    for (uint64_t value : values) {
+        hash = (hash ^ value) * 1099511628211ULL;
+    }
+    for (const char* c = desc; *c != 0; c++) {
+        hash = (hash ^ (uint8_t) *c) * 1099511628211ULL;
+    }
+    for (char c : _modelPath) {
+        hash = (hash ^ (uint8_t) c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// returns the paths of the snapshot files in `dirPath` created for the model, with the given hash
+static std::vector<std::string>
+listSnapshots(const std::string& dirPath, uint64_t modelHash) {
+    char prefix[32];
+    snprintf(prefix, sizeof(prefix), "%016llx-", (unsigned long long) modelHash);
+    std::vector<std::string> paths;
+    DIR*                     dir = opendir(dirPath.c_str());
+    if (dir == nullptr) {
+        return paths;
+    }
+    while (dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.rfind(prefix, 0) == 0 && name.size() > strlen(SNAPSHOT_EXT) &&
+            name.compare(name.size() - strlen(SNAPSHOT_EXT), std::string::npos, SNAPSHOT_EXT) == 0) {
+            paths.push_back(dirPath + "/" + name);
+        }
+    }
+    closedir(dir);
+    return paths;
+}
+
+std::string
+LLMInference::saveSnapshot(const char* dirPath) {
+    std::lock_guard<std::mutex> lock(_ctxMutex);
+    if (_cachedTokens.empty()) {
+        return "";
+    }
+    uint64_t modelHash = _modelHash();
+    char     fileName[64];
+    snprintf(fileName, sizeof(fileName), "%016llx-%016llx%s", (unsigned long long) modelHash,
+             (unsigned long long) hashTokens(_cachedTokens.data(), _cachedTokens.size()), SNAPSHOT_EXT);
+    std::string path = std::string(dirPath) + "/" + fileName;
+
+    std::vector<uint8_t> state(llama_state_seq_get_size(_ctx, 0));
+    size_t               stateSize = llama_state_seq_get_data(_ctx, state.data(), state.size(), 0);
+    SnapshotHeader       header    = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION, modelHash, _cachedTokens.size(), stateSize };
+
+    // write to a temporary file and rename it, so that a partially written
+    // snapshot is never read
+    std::string tmpPath = path + ".tmp";
+    FILE*       file    = fopen(tmpPath.c_str(), "wb");
+    if (file == nullptr) {
+        throw std::runtime_error("could not create snapshot " + tmpPath);
+    }
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                   fwrite(_cachedTokens.data(), sizeof(llama_token), _cachedTokens.size(), file) ==
+                       _cachedTokens.size() &&
+                   fwrite(state.data(), 1, stateSize, file) == stateSize;
+    written = (fclose(file) == 0) && written;
+    if (!written || rename(tmpPath.c_str(), path.c_str()) != 0) {
+        unlink(tmpPath.c_str());
+        throw std::runtime_error("could not write snapshot " + path);
+    }
+
+    // remove snapshots superseded by the new one (their tokens are a prefix of the saved tokens)
+    // and the least-recently used snapshots beyond MAX_SNAPSHOTS
+    std::vector<std::pair<time_t, std::string>> snapshots;
+    for (const std::string& snapshotPath : listSnapshots(dirPath, modelHash)) {
+        if (snapshotPath == path) {
+            continue;
+        }
+        MappedSnapshot snapshot;
+        if (!snapshot.open(snapshotPath, modelHash) ||
+            (snapshot.header->nTokens <= _cachedTokens.size() &&
+             std::equal(snapshot.tokens, snapshot.tokens + snapshot.header->nTokens, _cachedTokens.begin()))) {
+            unlink(snapshotPath.c_str());
+            continue;
+        }
+        struct stat st {};
+        stat(snapshotPath.c_str(), &st);
+        snapshots.emplace_back(st.st_mtime, snapshotPath);
+    }
+    if (snapshots.size() + 1 > MAX_SNAPSHOTS) {
+        std::sort(snapshots.begin(), snapshots.end());
+        for (size_t i = 0; i < snapshots.size() + 1 - MAX_SNAPSHOTS; i++) {
+            unlink(snapshots[i].second.c_str());
+        }
+    }
+    LOGi("saved snapshot with %zu tokens to %s", _cachedTokens.size(), path.c_str());
+    return path;
+}
+
+int
+LLMInference::restoreSnapshot(const char* dirPath) {
+    // the tokens of the conversation so far, the next prompt begins with these tokens
+    bool                     usedJinja;
+    std::vector<llama_token> tokens =
+        common_tokenize(llama_model_get_vocab(_model), _applyChatTemplate(_messages, false, usedJinja), true, true);
+
+    // find the snapshot sharing the longest prefix with the conversation
+    uint64_t    modelHash = _modelHash();
+    std::string bestPath;
+    size_t      bestPrefix = 0;
+    for (const std::string& snapshotPath : listSnapshots(dirPath, modelHash)) {
+        MappedSnapshot snapshot;
+        if (!snapshot.open(snapshotPath, modelHash)) {
+            continue;
+        }
+        size_t nPrefix = 0;
+        while (nPrefix < snapshot.header->nTokens && nPrefix < tokens.size() &&
+               snapshot.tokens[nPrefix] == tokens[nPrefix]) {
+            nPrefix++;
+        }
+        if (nPrefix > bestPrefix) {
+            bestPrefix = nPrefix;
+            bestPath   = snapshotPath;
+        }
+    }
+    if (bestPrefix == 0) {
+        return 0;
+    }
+
+    MappedSnapshot snapshot;
+    if (!snapshot.open(bestPath, modelHash)) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(_ctxMutex);
+    llama_memory_seq_rm(llama_get_memory(_ctx), 0, -1, -1);
+    _cachedTokens.clear();
+    _nNgramIndexed = 0;
+    if (llama_state_seq_set_data(_ctx, snapshot.state, snapshot.header->stateSize, 0) == 0) {
+        LOGe("failed to restore snapshot %s", bestPath.c_str());
+        llama_memory_seq_rm(llama_get_memory(_ctx), 0, -1, -1);
+        return 0;
+    }
+    // tokens beyond the common prefix are removed by the next startCompletion()
+    _cachedTokens.assign(snapshot.tokens, snapshot.tokens + snapshot.header->nTokens);
+    _nCtxUsed = (int) _cachedTokens.size();
+    // update the modification time, used to evict least-recently used snapshots
+    utimensat(AT_FDCWD, bestPath.c_str(), nullptr, 0);
+    LOGi("restored %zu tokens from snapshot %s", bestPrefix, bestPath.c_str());
+    return (int) bestPrefix;
+}
+
 std::string
 LLMInference::benchModel(int pp, int tg, int pl, int nr) {
+    // the benchmark clears the KV cache, including the sequences of the sessions
+    std::lock_guard<std::mutex> sessionsLock(_sessionsMutex);
+    if (!_sessions.empty()) {
+        throw std::runtime_error("benchModel() cannot be used while sessions are open");
+    }
+    std::lock_guard<std::mutex> lock(_ctxMutex);
     g_batch     = llama_batch_init(pp, 0, pl);
     auto pp_avg = 0.0;
     auto tg_avg = 0.0;
@@ -302,6 +1677,9 @@ LLMInference::benchModel(int pp, int tg, int pl, int nr) {
     }
 
     llama_batch_free(g_batch);
+    // the benchmark cleared the KV cache
+    _cachedTokens.clear();
+    _nNgramIndexed = 0;
 
     pp_avg /= double(nr);
     tg_avg /= double(nr);
@@ -347,3 +1725,48 @@ LLMInference::benchModel(int pp, int tg, int pl, int nr) {
            << tg << " | " << tg_avg << " ± " << tg_std << " |\n";
     return result.str();
 }
+
+std::string
+LLMInference::benchSampler(int nVocab, int nIterations) {
+    // logits drawn from a normal distribution, as a stand-in for the output of the model
+    std::mt19937                    rng(42);
+    std::normal_distribution<float> logitDist(0.0f, 3.0f);
+    std::vector<llama_token_data>   logits(nVocab);
+    for (int i = 0; i < nVocab; i++) {
+        logits[i] = { i, logitDist(rng), 0.0f };
+    }
+
+    llama_sampler_chain_params sampler_params = llama_sampler_chain_default_params();
+    sampler_params.no_perf                    = true;
+    llama_sampler* baseline                   = llama_sampler_chain_init(sampler_params);
+    llama_sampler_chain_add(baseline, llama_sampler_init_temp(0.8f));
+    llama_sampler_chain_add(baseline, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    llama_sampler* sampler = llama_sampler_clone(_sampler);
+
+    std::vector<llama_token_data> candidates(nVocab);
+    auto                          timeSampler = [&](llama_sampler* chain) {
+        int64_t total = 0;
+        for (int i = 0; i < nIterations; i++) {
+            // the copy of the logits is excluded, llama_sampler_sample() also copies them
+            std::copy(logits.begin(), logits.end(), candidates.begin());
+            llama_token_data_array cur_p = { candidates.data(), candidates.size(), -1, false };
+            auto                   start = ggml_time_us();
+            llama_sampler_apply(chain, &cur_p);
+            llama_sampler_accept(chain, cur_p.data[cur_p.selected].id);
+            total += ggml_time_us() - start;
+        }
+        return (double) total / nIterations;
+    };
+    double baselineTime = timeSampler(baseline);
+    double samplerTime  = timeSampler(sampler);
+    llama_sampler_free(baseline);
+    llama_sampler_free(sampler);
+
+    std::stringstream result;
+    result << std::setprecision(4);
+    result << "| sampler | n_vocab | us/token |\n";
+    result << "| --- | --- | --- |\n";
+    result << "| temp + dist | " << nVocab << " | " << baselineTime << " |\n";
+    result << "| configured | " << nVocab << " | " << samplerTime << " |\n";
+    return result.str();
+}
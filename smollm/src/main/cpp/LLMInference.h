@@ -1,63 +1,358 @@
 #pragma once
+#include "InferenceMetrics.h"
+#include "ModelLoader.h"
+#include "ResponseStream.h"
 #include "chat.h"
 #include "common.h"
 #include "llama.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+// parameters of the sampler chain, a value of 0 for `topK`, `minP` and the penalties,
+// or 1 for `topP`, `typicalP` and `repeatPenalty` disables the corresponding sampler
+struct SamplerParams {
+    float    temperature      = 0.8f;
+    int32_t  topK             = 40;
+    float    topP             = 1.0f;
+    float    minP             = 0.1f;
+    float    typicalP         = 1.0f;
+    float    repeatPenalty    = 1.0f;
+    float    presencePenalty  = 0.0f;
+    int32_t  penaltyLastN     = 64;
+    float    dryMultiplier    = 0.0f;
+    float    dryBase          = 1.75f;
+    int32_t  dryAllowedLength = 2;
+    int32_t  dryPenaltyLastN  = -1;
+    uint32_t seed             = LLAMA_DEFAULT_SEED;
+};
+
+// a conversation decoded in its own sequence of the context shared by LLMInference,
+// in parallel with other sessions, see LLMInference::createSession()
+struct LLMSession {
+    llama_seq_id   seqId;
+    llama_sampler* sampler = nullptr;
+
+    std::vector<common_chat_msg> messages;
+    std::vector<llama_token>     promptTokens;
+    size_t                       nPromptDecoded = 0;
+    // tokens whose key/value pairs are present in the KV cache for `seqId`
+    std::vector<llama_token> cachedTokens;
+    // last sampled token, yet to be decoded
+    llama_token currToken;
+    // index of the session's logits in the batch being decoded, -1 if the session has no output
+    int32_t batchIndex = -1;
+
+    bool isActive    = false;
+    bool isCancelled = false;
+    int  maxTokens   = -1;
+    // ggml_time_us() after which the response is completed, 0 for no time limit
+    int64_t deadlineUs = 0;
+
+    std::string                             response;
+    ResponseStream                          stream;
+    std::function<void(const std::string&)> onText;
+    std::function<void(const char* error)>  onComplete;
+
+    // response generation metrics
+    int64_t responseGenerationTime = 0;
+    long    responseNumTokens      = 0;
+};
+
 class LLMInference {
     // llama.cpp-specific types
-    llama_context* _ctx;
-    llama_model*   _model;
-    llama_sampler* _sampler;
+    llama_context* _ctx     = nullptr;
+    llama_model*   _model   = nullptr;
+    llama_sampler* _sampler = nullptr;
     llama_token    _currToken;
-    llama_batch*   _batch;
 
     llama_batch g_batch;
 
+    // the model file and the KV cache parameters, included in _modelHash() as the KV cache
+    // of a snapshot is only valid for the same file and parameters
+    std::string _modelPath;
+    int64_t     _modelFileSize  = 0;
+    int64_t     _modelFileMtime = 0;
+    int         _typeK          = 0;
+    int         _typeV          = 0;
+    int         _flashAttn      = 0;
+
     // container to store user/assistant messages in the chat
-    std::vector<llama_chat_message> _messages;
+    std::vector<common_chat_msg> _messages;
     // stores the string generated after applying
     // the chat-template to all messages in `_messages`
-    std::vector<char> _formattedMessages;
+    std::string _formattedMessages;
     // stores the tokens for the last query
     // appended to `_messages`
     std::vector<llama_token> _promptTokens;
+    // no. of tokens in `_promptTokens` whose key/value pairs are in the KV cache
+    size_t                   _nPromptDecoded = 0;
     const char*              _chatTemplate;
+    // the chat-template parsed once in loadModel()
+    common_chat_templates_ptr _chatTemplates;
+    // false once the Jinja renderer failed for the template, the legacy renderer is used afterwards,
+    // atomic as templates are rendered concurrently by the conversation and the sessions
+    std::atomic<bool> _useJinja{ true };
+
+    // tokens whose key/value pairs are present in the KV cache (sequence 0)
+    // used to skip decoding the common prefix of consecutive prompts
+    std::vector<llama_token> _cachedTokens;
+    // no. of prompt tokens reused from the KV cache for the last query
+    int _nReusedTokens = 0;
 
     // stores the complete response for the given query
     std::string _response;
-    std::string _cacheResponseTokens;
+    // assembles the pieces of the sampled tokens into the text of `_response`
+    ResponseStream _responseStream;
+    // set once the response ended with an EOG token or a stop sequence, until the next startCompletion()
+    bool _responseComplete = false;
+    // stop sequences of the responses of the conversation and the sessions, null if none
+    std::shared_ptr<const StopSequenceMatcher> _stopSequences;
     // whether to cache previous messages in `_messages`
     bool _storeChats;
 
     // response generation metrics
     int64_t _responseGenerationTime = 0;
     long    _responseNumTokens      = 0;
+    // per-stage timers and counters, accumulated across responses and sessions until resetMetrics()
+    InferenceMetrics _metrics;
 
     // length of context window consumed during the conversation
     int _nCtxUsed = 0;
+    // no. of tokens always kept at the start of the context when older tokens are evicted
+    // regardless of the turns, in addition to the system prompt. -1 disables evicting tokens
+    int _nSinkTokens = -1;
+    // no. of tokens evicted from the context of the conversation
+    long _nEvictedTokens = 0;
+    // no. of tokens and hash of the tokens of the chat-template rendered for the first n messages
+    // of `_messages` (at index n), 0 tokens if not computed yet, see _countMessageTokens()
+    std::vector<std::pair<size_t, uint64_t>> _messagePrefixTokens;
+
+    // draft model used for speculative decoding, loaded with loadDraftModel()
+    llama_model*   _draftModel   = nullptr;
+    llama_context* _draftCtx     = nullptr;
+    llama_sampler* _draftSampler = nullptr;
+    // tokens whose key/value pairs are present in the KV cache of `_draftCtx`
+    std::vector<llama_token> _draftCachedTokens;
+    // max. no. of tokens proposed by the draft model or the n-gram lookup in a single step
+    int         _nDraft    = 0;
+    llama_batch _specBatch = {};
+    // n-gram size for prompt-lookup decoding, 0 if disabled
+    int _ngramSize = 0;
+    // maps the hash of each n-gram in `_cachedTokens` to the index following its most recent
+    // occurrence, the tokens after that index are proposed as the draft
+    std::unordered_map<uint64_t, size_t> _ngramIndex;
+    // no. of tokens of `_cachedTokens` whose n-grams are added to `_ngramIndex`
+    size_t _nNgramIndexed = 0;
+    // tokens sampled in the last speculative step, yet to be returned by _generateNext()
+    std::deque<llama_token> _acceptedTokens;
+    // speculative decoding metrics, accumulated since loadDraftModel()
+    long _nDraftedTokens       = 0;
+    long _nAcceptedDraftTokens = 0;
+
+    // native thread running generate(), started with startGeneration()
+    std::thread       _generationThread;
+    std::atomic<bool> _cancelGeneration{ false };
+
+    // grammar sampler constraining the current response, nullptr if the response is unconstrained
+    llama_sampler* _grammarSampler = nullptr;
+    // compiled grammar samplers keyed by the grammar (or the JSON schema) they were created from,
+    // a clone of the cached sampler is used for each response
+    std::unordered_map<std::string, llama_sampler*> _grammarCache;
+    // candidate tokens for sampling with a grammar, reused across tokens
+    std::vector<llama_token_data> _candidates;
+
+    // guards the use of `_ctx`, shared by the conversation in sequence 0 and the sessions
+    std::mutex _ctxMutex;
+
+    // sessions decoded in sequences 1..n_seq_max-1 of `_ctx`, keyed by their sequence ID
+    std::map<llama_seq_id, std::unique_ptr<LLMSession>> _sessions;
+    // guards `_sessions`
+    std::mutex _sessionsMutex;
+    // notifies the scheduler thread when a session becomes active
+    std::condition_variable _schedulerCv;
+    // thread that packs the next tokens of all active sessions in a single batch
+    std::thread _schedulerThread;
+    bool        _stopScheduler = false;
+    llama_batch _sessionsBatch = {};
+
+    std::string _applyChatTemplate(std::vector<common_chat_msg>& messages, bool addGenerationPrompt,
+                                   bool& usedJinja);
+
+    uint64_t _modelHash() const;
+
+    void _decodeTokens(const llama_token* tokens, int nTokens);
+
+    void _prefillChunk();
+
+    size_t _countMessageTokens(size_t nMessages);
+
+    void _reserveContext(int nTokens);
+
+    bool _generateNext(std::string& piece);
+
+    void _syncDraftCache();
+
+    void _setNumDraftTokens(int nDraft);
+
+    std::vector<llama_token> _draftTokensFromModel();
+
+    std::vector<llama_token> _draftTokensFromNgrams();
+
+    std::vector<llama_token> _draftTokens();
+
+    void _speculate();
+
+    void _runScheduler();
+
+    llama_sampler* _createSampler(const SamplerParams& params);
 
-    bool _isValidUtf8(const char* response);
+    size_t _kvCacheBytesPerToken(ggml_type typeK, ggml_type typeV) const;
+
+    void _warmup();
+
+    void _setGrammar(const char* grammar, bool isJsonSchema);
+
+    llama_token _sampleToken(int32_t idx);
+
+    LLMSession* _getSession(int sessionId);
 
   public:
-    void loadModel(const char* modelPath, float minP, float temperature, bool storeChats, long contextSize,
-                   const char* chatTemplate, int nThreads, bool useMmap, bool useMlock);
+    // Loads the model and creates its context. With `prefetch` (and `useMmap`), the weights are read
+    // into the page cache in layer order before the model is loaded, and with `warmup`, a token is
+    // decoded (and removed from the KV cache) before returning, so that the first query does not pay
+    // for page faults and the first-time setup of the backends. `onProgress` (optional) is invoked
+    // on the calling thread and can cancel the loading, which throws std::runtime_error
+    void loadModel(const char* modelPath, const SamplerParams& samplerParams, bool storeChats, long contextSize,
+                   const char* chatTemplate, int nThreads, bool useMmap, bool useMlock, int nBatch, int nUBatch,
+                   int nParallel, int nSinkTokens, int typeK, int typeV, int flashAttn, long kvMemoryBudget,
+                   bool prefetch, bool warmup, const ModelLoadProgressCallback& onProgress);
+
+    // Returns the context size (in tokens), that may be reduced to fit the memory budget
+    size_t getContextSize() const;
+
+    // Loads a smaller model (sharing the vocabulary of the main model) that proposes
+    // `nDraft` tokens per step, which are verified by the main model in a single batch
+    void loadDraftModel(const char* modelPath, int nDraft, int nThreads);
+
+    // Enables prompt-lookup decoding, where up to `nDraft` tokens following an earlier
+    // occurrence of the last `ngramSize` tokens (in the prompt or the response) are
+    // proposed as the draft, without requiring a draft model
+    void enablePromptLookupDecoding(int ngramSize, int nDraft);
 
     std::string benchModel(int pp, int tg, int pl, int nr);
 
+    // Measures the time taken by the sampler chain, and by a `temp` + `dist` chain for comparison,
+    // to sample a token from `nVocab` random logits, averaged over `nIterations`
+    std::string benchSampler(int nVocab, int nIterations);
+
+    // Saves the KV cache of the conversation and the tokens it holds to a snapshot file
+    // in `dirPath`, keyed by the model and the tokens. Returns the path of the snapshot
+    std::string saveSnapshot(const char* dirPath);
+
+    // Restores the snapshot in `dirPath` sharing the longest prefix with the tokens of the
+    // messages added so far, so that the prefix is not decoded again by the next query.
+    // Returns the no. of reusable tokens restored, 0 if no snapshot matches
+    int restoreSnapshot(const char* dirPath);
+
     void addChatMessage(const char* message, const char* role);
 
     float getResponseGenerationTime() const;
 
+    // Returns the fraction of drafted tokens accepted by the main model,
+    // for both, the draft model and prompt-lookup decoding
+    float getDraftAcceptanceRate() const;
+
+    // Returns the no. of tokens of the conversation retained in the context
     int getContextSizeUsed() const;
 
+    // Returns the no. of tokens of the conversation evicted from the context to make room for new tokens
+    long getNumEvictedTokens() const;
+
+    int getNumReusedTokens() const;
+
+    // Returns the no. of tokens of the prompt prepared by the last startCompletion(),
+    // including the tokens reused from the KV cache
+    int getNumPromptTokens() const;
+
+    // Returns the latency histograms of the stages of the pipeline (chat-template, tokenization, prefill,
+    // decode, sampling, detokenization) and the token counters, accumulated since the model was loaded
+    // or resetMetrics() was called. Safe to call while a response is being generated
+    InferenceMetricsSnapshot getMetrics() const;
+
+    void resetMetrics();
+
+    // Records every timed stage as a trace event (up to the last 100000 events), see dumpTrace()
+    void setTraceEnabled(bool enabled);
+
+    // Writes the recorded trace events as a Chrome trace (JSON) to `path`
+    void dumpTrace(const char* path);
+
     // Returns true if Jinja template was used, false if legacy fallback was needed.
-    bool startCompletion(const char* query);
+    // Adds `query` to the messages and prepares the prompt. If `grammar` is not null, the response is
+    // constrained to the GBNF grammar, or to the JSON schema if `isJsonSchema` is true
+    bool startCompletion(const char* query, const char* grammar = nullptr, bool isJsonSchema = false);
+
+    // Decodes the next chunk (of at most n_batch tokens) of the prompt
+    // Returns the fraction of the prompt that has been decoded, 1.0f once the prefill is complete
+    float prefill();
 
+    // Returns the text of the next token of the response, or "[EOG]" once the response is complete.
+    // The text may be empty while the token holds a part of a UTF-8 code point or of a stop sequence
     std::string completionLoop();
 
+    // Runs the decode/sample loop until an EOG token is sampled or a stop sequence is generated,
+    // `maxTokens` tokens are generated (if `maxTokens` > 0), `maxTimeMs` milliseconds have passed
+    // (if `maxTimeMs` > 0) or cancelGeneration() is called.
+    // The generated text is passed to `onText` in chunks, after every `flushTokens` tokens or
+    // `flushIntervalMs` milliseconds, whichever comes first
+    void generate(int maxTokens, int maxTimeMs, int flushTokens, int flushIntervalMs,
+                  const std::function<void(const std::string&)>& onText);
+
+    // Runs generate() on a dedicated native thread, `onComplete` is invoked on the same thread
+    // with an error message (or nullptr) once the generation finishes
+    void startGeneration(int maxTokens, int maxTimeMs, int flushTokens, int flushIntervalMs,
+                         std::function<void(const std::string&)> onText,
+                         std::function<void(const char* error)>  onComplete);
+
+    // Requests the generation thread to stop after the current token and waits for it to finish
+    void cancelGeneration();
+
     void stopCompletion();
 
+    // Sets the strings that complete a response when they are generated, for the conversation and the
+    // sessions. The stop sequence is not included in the response
+    void setStopSequences(const std::vector<std::string>& stopSequences);
+
+    // Creates a session with its own messages, sampler and sequence in the shared context.
+    // The next tokens of all active sessions are decoded in a single batch by a scheduler thread.
+    // Returns the ID of the session
+    int createSession();
+
+    void addSessionMessage(int sessionId, const char* message, const char* role);
+
+    // Starts generating the response to `query` in the session, the generated text is passed to
+    // `onText` and `onComplete` is invoked once the response is complete (as in generate()),
+    // on the scheduler thread
+    void startSessionCompletion(int sessionId, const char* query, int maxTokens, int maxTimeMs,
+                                std::function<void(const std::string&)> onText,
+                                std::function<void(const char* error)>  onComplete);
+
+    // Stops the generation of the session after its current token
+    void cancelSession(int sessionId);
+
+    float getSessionGenerationTime(int sessionId);
+
+    // Removes the session and its tokens from the KV cache
+    void closeSession(int sessionId);
+
     ~LLMInference();
 };
\ No newline at end of file
@@ -0,0 +1,28 @@
+#pragma once
+
+// Logging macros of the native library. On Android the messages go to logcat, on other
+// platforms (the host benchmarks in smollm/benchmark) they are written to stderr.
+
+#define TAG "[SmolLMAndroid-Cpp]"
+
+#if defined(__ANDROID__)
+#include <android/log.h>
+#define LOGi(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
+#define LOGe(...) __android_log_print(ANDROID_LOG_ERROR, TAG, __VA_ARGS__)
+#else
+#include <cstdarg>
+#include <cstdio>
+
+__attribute__((format(printf, 2, 3))) inline void
+logMessage(char level, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "%c %s ", level, TAG);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+#define LOGi(...) logMessage('I', __VA_ARGS__)
+#define LOGe(...) logMessage('E', __VA_ARGS__)
+#endif
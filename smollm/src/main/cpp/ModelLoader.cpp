@@ -0,0 +1,150 @@
+#include "ModelLoader.h"
+#include "Log.h"
+#include "ggml-backend.h"
+#include "gguf.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// bytes touched between two progress updates of prefetchModelFile()
+static constexpr size_t PREFETCH_STEP_BYTES = 16 * 1024 * 1024;
+
+void
+loadBackendsOnce() {
+    static std::once_flag loaded;
+    std::call_once(loaded, [] { ggml_backend_load_all(); });
+}
+
+// a contiguous range of the file holding the tensors of a layer
+struct FileRange {
+    long   layer;
+    size_t start;
+    size_t end;
+};
+
+// position of the tensor `name` in the order of evaluation: the token embeddings and other global
+// tensors first, then the blocks in order, then the output norm and projection
+static long
+evaluationOrder(const char* name) {
+    if (strncmp(name, "blk.", 4) == 0) {
+        return strtol(name + 4, nullptr, 10) + 1;
+    }
+    if (strncmp(name, "output", 6) == 0) {
+        return LONG_MAX;
+    }
+    return 0;
+}
+
+// ranges of the file covering the tensor data, sorted by layer, with the ranges of a layer
+// that are contiguous in the file merged
+static std::vector<FileRange>
+readTensorRanges(const char* path) {
+    gguf_init_params params = { /*no_alloc=*/true, /*ctx=*/nullptr };
+    gguf_context*    gguf   = gguf_init_from_file(path, params);
+    if (gguf == nullptr) {
+        throw std::runtime_error(std::string("could not read the GGUF header of ") + path);
+    }
+    size_t                 dataOffset = gguf_get_data_offset(gguf);
+    int64_t                nTensors   = gguf_get_n_tensors(gguf);
+    std::vector<FileRange> tensors;
+    tensors.reserve(nTensors);
+    for (int64_t i = 0; i < nTensors; i++) {
+        size_t start = dataOffset + gguf_get_tensor_offset(gguf, i);
+        tensors.push_back({ evaluationOrder(gguf_get_tensor_name(gguf, i)), start,
+                            start + gguf_get_tensor_size(gguf, i) });
+    }
+    gguf_free(gguf);
+
+    std::sort(tensors.begin(), tensors.end(), [](const FileRange& a, const FileRange& b) {
+        return a.layer != b.layer ? a.layer < b.layer : a.start < b.start;
+    });
+    std::vector<FileRange> ranges;
+    for (const FileRange& tensor : tensors) {
+        // consecutive tensors are separated by the padding to the alignment of the file,
+        // gaps of up to a page are read with the tensors
+        if (!ranges.empty() && ranges.back().layer == tensor.layer && tensor.start <= ranges.back().end + 4096) {
+            ranges.back().end = std::max(ranges.back().end, tensor.end);
+        } else {
+            ranges.push_back(tensor);
+        }
+    }
+    return ranges;
+}
+
+bool
+prefetchModelFile(const char* path, const ModelLoadProgressCallback& onProgress) {
+    int64_t                startTime = ggml_time_us();
+    std::vector<FileRange> ranges    = readTensorRanges(path);
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        throw std::runtime_error(std::string("could not open ") + path + ": " + strerror(errno));
+    }
+    struct stat fileStat;
+    fstat(fd, &fileStat);
+    size_t fileSize     = (size_t) fileStat.st_size;
+    size_t pageSize     = (size_t) sysconf(_SC_PAGESIZE);
+    size_t physicalSize = (size_t) sysconf(_SC_PHYS_PAGES) * pageSize;
+    if (fileSize > physicalSize / 2) {
+        LOGi("skipping the prefetch of %s, %zu bytes do not fit in the page cache", path, fileSize);
+        close(fd);
+        return true;
+    }
+    // a mapping of our own, the pages read through it stay in the page cache after it is unmapped
+    // and are shared with the mapping created by llama.cpp
+    auto* mapping = static_cast<const uint8_t*>(mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0));
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        throw std::runtime_error(std::string("could not map ") + path + ": " + strerror(errno));
+    }
+
+    size_t totalBytes = 0;
+    for (FileRange& range : ranges) {
+        range.start = range.start / pageSize * pageSize;
+        range.end   = std::min(range.end, fileSize);
+        totalBytes += range.end - range.start;
+    }
+    auto adviseWillNeed = [&](const FileRange& range) {
+        madvise((void*) (mapping + range.start), range.end - range.start, MADV_WILLNEED);
+    };
+
+    // volatile, so that the reads are not optimized out
+    const volatile uint8_t* pages     = mapping;
+    bool                    cancelled = false;
+    size_t                  doneBytes = 0;
+    if (!ranges.empty()) {
+        adviseWillNeed(ranges[0]);
+    }
+    for (size_t i = 0; i < ranges.size() && !cancelled; i++) {
+        if (i + 1 < ranges.size()) {
+            adviseWillNeed(ranges[i + 1]);
+        }
+        for (size_t stepStart = ranges[i].start; stepStart < ranges[i].end && !cancelled;
+             stepStart += PREFETCH_STEP_BYTES) {
+            size_t stepEnd = std::min(stepStart + PREFETCH_STEP_BYTES, ranges[i].end);
+            // reading a byte of each page blocks until the page is in memory
+            for (size_t offset = stepStart; offset < stepEnd; offset += pageSize) {
+                (void) pages[offset];
+            }
+            doneBytes += stepEnd - stepStart;
+            if (onProgress && !onProgress(ModelLoadStage::Prefetch, (float) doneBytes / (float) totalBytes)) {
+                cancelled = true;
+            }
+        }
+    }
+    munmap((void*) mapping, fileSize);
+    LOGi("prefetched %zu bytes in %zu ranges in %.1f ms", doneBytes, ranges.size(),
+         (ggml_time_us() - startTime) / 1000.0);
+    return !cancelled;
+}
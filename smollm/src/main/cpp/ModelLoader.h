@@ -0,0 +1,21 @@
+#pragma once
+#include <functional>
+
+// phases of LLMInference::loadModel(), in the order they run
+enum class ModelLoadStage { Prefetch, Load, Warmup };
+
+// receives the fraction (0 to 1) of `stage` completed, returning false cancels the loading
+using ModelLoadProgressCallback = std::function<bool(ModelLoadStage stage, float progress)>;
+
+// Registers the ggml backends with ggml_backend_load_all() on the first call in the process,
+// later calls (from any thread) return immediately
+void loadBackendsOnce();
+
+// Reads the tensor data of the GGUF file at `path` into the page cache in the order the layers are
+// evaluated (token embeddings, blk.0, blk.1, ..., output), so that the first decode of the model
+// mapped by llama.cpp does not wait for page faults to read the weights from storage. The pages of
+// the next layer are requested with madvise(MADV_WILLNEED) while the current one is read.
+// Files larger than half of the physical memory are skipped, as their first layers would be evicted
+// before they are used. Returns false if `onProgress` cancelled the prefetch, throws
+// std::runtime_error if the file cannot be read
+bool prefetchModelFile(const char* path, const ModelLoadProgressCallback& onProgress);
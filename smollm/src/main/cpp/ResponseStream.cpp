@@ -0,0 +1,160 @@
+#include "ResponseStream.h"
+#include <queue>
+
+// U+FFFD, substituted for invalid UTF-8 sequences
+static const uint8_t REPLACEMENT_CHARACTER[] = { 0xEF, 0xBF, 0xBD };
+
+StopSequenceMatcher::StopSequenceMatcher(const std::vector<std::string>& stopSequences) {
+    // trie of the stop sequences, -1 marks a missing edge
+    _transitions.assign(256, -1);
+    _depths.assign(1, 0);
+    _matchLengths.assign(1, 0);
+    for (const std::string& stopSequence : stopSequences) {
+        int32_t state = ROOT;
+        for (char c : stopSequence) {
+            size_t edge = (size_t) state * 256 + (uint8_t) c;
+            if (_transitions[edge] == -1) {
+                _transitions[edge] = (int32_t) _depths.size();
+                _transitions.resize(_transitions.size() + 256, -1);
+                _depths.push_back(_depths[state] + 1);
+                _matchLengths.push_back(0);
+            }
+            state = _transitions[edge];
+        }
+        _matchLengths[state] = (uint32_t) stopSequence.size();
+    }
+
+    // the missing edges of a state are those of its failure state (the state of the longest proper
+    // suffix of its text present in the trie), which has a smaller depth and is completed first
+    // in the breadth-first order
+    std::vector<int32_t> failures(_depths.size(), ROOT);
+    std::queue<int32_t>  states;
+    for (int byte = 0; byte < 256; byte++) {
+        int32_t& child = _transitions[byte];
+        if (child == -1) {
+            child = ROOT;
+        } else {
+            states.push(child);
+        }
+    }
+    while (!states.empty()) {
+        int32_t state = states.front();
+        states.pop();
+        // a stop sequence ending at the failure state also ends at this state
+        if (_matchLengths[state] == 0) {
+            _matchLengths[state] = _matchLengths[failures[state]];
+        }
+        for (int byte = 0; byte < 256; byte++) {
+            int32_t& child    = _transitions[(size_t) state * 256 + byte];
+            int32_t  fallback = next(failures[state], (uint8_t) byte);
+            if (child == -1) {
+                child = fallback;
+            } else {
+                failures[child] = fallback;
+                states.push(child);
+            }
+        }
+    }
+}
+
+void
+ResponseStream::reset(std::shared_ptr<const StopSequenceMatcher> stopSequences) {
+    _stopSequences = std::move(stopSequences);
+    _state         = StopSequenceMatcher::ROOT;
+    _heldText.clear();
+    _stopped         = false;
+    _codePointLength = 0;
+    _nCodePointBytes = 0;
+}
+
+// no. of bytes of the code point starting with `byte`, 0 if `byte` cannot start a code point
+static int
+codePointLength(uint8_t byte) {
+    if ((byte & 0x80) == 0x00) {
+        return 1;
+    }
+    if ((byte & 0xE0) == 0xC0) {
+        return 2;
+    }
+    if ((byte & 0xF0) == 0xE0) {
+        return 3;
+    }
+    if ((byte & 0xF8) == 0xF0) {
+        return 4;
+    }
+    return 0;
+}
+
+bool
+ResponseStream::_appendCodePoint(const uint8_t* bytes, int nBytes, std::string& text) {
+    if (!_stopSequences) {
+        text.append((const char*) bytes, nBytes);
+        return true;
+    }
+    for (int i = 0; i < nBytes; i++) {
+        _state = _stopSequences->next(_state, bytes[i]);
+        _heldText.push_back((char) bytes[i]);
+        uint32_t matchLength = _stopSequences->matchLength(_state);
+        if (matchLength > 0) {
+            text.append(_heldText, 0, _heldText.size() - matchLength);
+            _heldText.clear();
+            _stopped = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+ResponseStream::append(const std::string& piece, std::string& text) {
+    if (_stopped) {
+        return false;
+    }
+    for (char c : piece) {
+        auto byte = (uint8_t) c;
+        if (_codePointLength > 0) {
+            if ((byte & 0xC0) == 0x80) {
+                _codePoint[_nCodePointBytes++] = byte;
+                if (_nCodePointBytes == _codePointLength) {
+                    _codePointLength = 0;
+                    if (!_appendCodePoint(_codePoint, _nCodePointBytes, text)) {
+                        return false;
+                    }
+                }
+                continue;
+            }
+            // the code point ended before its continuation bytes, `byte` starts the next one
+            _codePointLength = 0;
+            if (!_appendCodePoint(REPLACEMENT_CHARACTER, 3, text)) {
+                return false;
+            }
+        }
+        int length = codePointLength(byte);
+        if (length == 0) {
+            if (!_appendCodePoint(REPLACEMENT_CHARACTER, 3, text)) {
+                return false;
+            }
+        } else if (length == 1) {
+            if (!_appendCodePoint(&byte, 1, text)) {
+                return false;
+            }
+        } else {
+            _codePoint[0]    = byte;
+            _codePointLength = length;
+            _nCodePointBytes = 1;
+        }
+    }
+    // the text before the partial match of a stop sequence (if any) can be emitted
+    size_t nEmitted = _heldText.size() - (_stopSequences ? _stopSequences->partialMatchLength(_state) : 0);
+    text.append(_heldText, 0, nEmitted);
+    _heldText.erase(0, nEmitted);
+    return true;
+}
+
+void
+ResponseStream::flush(std::string& text) {
+    if (!_stopped) {
+        text += _heldText;
+    }
+    reset(_stopSequences);
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Aho-Corasick automaton of a set of stop sequences, stored as a DFA over bytes, so that matching
+// the text of a response takes a single table lookup per byte. Takes 1 KB per byte of the stop
+// sequences. Immutable once built, and shared by the responses of a model
+class StopSequenceMatcher {
+  public:
+    static constexpr int32_t ROOT = 0;
+
+    // Builds the automaton of the non-empty strings of `stopSequences`
+    explicit StopSequenceMatcher(const std::vector<std::string>& stopSequences);
+
+    int32_t
+    next(int32_t state, uint8_t byte) const {
+        return _transitions[(size_t) state * 256 + byte];
+    }
+
+    // Returns the length of the longest suffix of the text matched so far that is a prefix of a
+    // stop sequence, the text that has to be held back until it is known not to be a stop sequence
+    uint32_t
+    partialMatchLength(int32_t state) const {
+        return _depths[state];
+    }
+
+    // Returns the length of the longest stop sequence ending at the last byte matched, 0 if none
+    uint32_t
+    matchLength(int32_t state) const {
+        return _matchLengths[state];
+    }
+
+  private:
+    std::vector<int32_t>  _transitions;
+    std::vector<uint32_t> _depths;
+    std::vector<uint32_t> _matchLengths;
+};
+
+// Turns the pieces of the sampled tokens into the text of a response. The pieces are assembled
+// into UTF-8 code points with a constant amount of work per byte, so that only complete code
+// points are emitted (a token may hold a part of a code point) and invalid bytes are replaced
+// with U+FFFD. The text is matched against the stop sequences as it is generated, a suffix that
+// may be the start of a stop sequence is held back until it is completed or ruled out, so that
+// a stop sequence is never emitted
+class ResponseStream {
+  public:
+    // Starts a new response, matched against the stop sequences of `stopSequences` (if not null)
+    void reset(std::shared_ptr<const StopSequenceMatcher> stopSequences);
+
+    // Appends `piece` to the response and the text that can be emitted to `text`. Returns false if
+    // the response reached a stop sequence, the text before the stop sequence is appended to `text`
+    // and the rest of the response is discarded, further pieces are ignored
+    bool append(const std::string& piece, std::string& text);
+
+    // Appends the text held back as a partial match of a stop sequence to `text`, at the end of a
+    // response. An incomplete code point at the end of the response is dropped
+    void flush(std::string& text);
+
+  private:
+    std::shared_ptr<const StopSequenceMatcher> _stopSequences;
+    int32_t                                    _state = StopSequenceMatcher::ROOT;
+    // text matched against the stop sequences and not yet emitted
+    std::string _heldText;
+    bool        _stopped = false;
+
+    // bytes of the code point being assembled
+    uint8_t _codePoint[4]    = {};
+    int     _codePointLength = 0;
+    int     _nCodePointBytes = 0;
+
+    bool _appendCodePoint(const uint8_t* bytes, int nBytes, std::string& text);
+};
@@ -1,23 +1,153 @@
+#include "LLMEmbedder.h"
 #include "LLMInference.h"
+#include <algorithm>
+#include <cstring>
 #include <jni.h>
 
+// detaches a native thread attached with getThreadEnv() from the JVM, when the thread exits
+struct ThreadDetacher {
+    JavaVM* vm = nullptr;
+
+    ~ThreadDetacher() {
+        if (vm != nullptr) {
+            vm->DetachCurrentThread();
+        }
+    }
+};
+
+// returns the JNIEnv for the current thread, attaching the thread to the JVM if required
+static JNIEnv*
+getThreadEnv(JavaVM* vm) {
+    static thread_local ThreadDetacher detacher;
+    JNIEnv*                            env = nullptr;
+    if (vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) == JNI_EDETACHED) {
+        vm->AttachCurrentThread(&env, nullptr);
+        detacher.vm = vm;
+    }
+    return env;
+}
+
+// callbacks passing generated text to a GenerationCallback through a direct buffer,
+// invoked on native threads
+struct GenerationCallbacks {
+    std::function<void(const std::string&)> onText;
+    std::function<void(const char* error)>  onComplete;
+};
+
+// a chunk holds at least one code point, so the buffer cannot be smaller than the longest UTF-8 code point
+static constexpr jlong MIN_GENERATION_BUFFER_SIZE = 4;
+
+// Throws an IllegalArgumentException and returns false if `buffer` is not a direct buffer
+// that can hold a UTF-8 code point
+static bool
+checkGenerationBuffer(JNIEnv* env, jobject buffer) {
+    if (env->GetDirectBufferAddress(buffer) == nullptr ||
+        env->GetDirectBufferCapacity(buffer) < MIN_GENERATION_BUFFER_SIZE) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"),
+                      "the generation buffer must be a direct buffer of at least 4 bytes");
+        return false;
+    }
+    return true;
+}
+
+static GenerationCallbacks
+createGenerationCallbacks(JNIEnv* env, jobject buffer, jobject callback) {
+    JavaVM* vm = nullptr;
+    env->GetJavaVM(&vm);
+
+    auto*     bufferAddress    = static_cast<char*>(env->GetDirectBufferAddress(buffer));
+    size_t    bufferCapacity   = env->GetDirectBufferCapacity(buffer);
+    jobject   bufferRef        = env->NewGlobalRef(buffer);
+    jobject   callbackRef      = env->NewGlobalRef(callback);
+    jclass    callbackClass    = env->GetObjectClass(callback);
+    jmethodID onTextMethod     = env->GetMethodID(callbackClass, "onText", "(I)V");
+    jmethodID onCompleteMethod = env->GetMethodID(callbackClass, "onComplete", "(Ljava/lang/String;)V");
+
+    GenerationCallbacks callbacks;
+    // the text is copied to the direct buffer and only its length crosses the JNI boundary,
+    // the callback is synchronous, so the same buffer is reused for all chunks
+    callbacks.onText = [=](const std::string& text) {
+        JNIEnv* threadEnv = getThreadEnv(vm);
+        size_t  offset    = 0;
+        while (offset < text.size()) {
+            size_t length = std::min(text.size() - offset, bufferCapacity);
+            // do not split a UTF-8 code point across two chunks
+            while (offset + length < text.size() && length > 0 &&
+                   (static_cast<unsigned char>(text[offset + length]) & 0xC0) == 0x80) {
+                length--;
+            }
+            memcpy(bufferAddress, text.data() + offset, length);
+            threadEnv->CallVoidMethod(callbackRef, onTextMethod, (jint) length);
+            offset += length;
+        }
+    };
+    callbacks.onComplete = [=](const char* error) {
+        JNIEnv* threadEnv = getThreadEnv(vm);
+        jstring errorStr  = error ? threadEnv->NewStringUTF(error) : nullptr;
+        threadEnv->CallVoidMethod(callbackRef, onCompleteMethod, errorStr);
+        if (errorStr != nullptr) {
+            threadEnv->DeleteLocalRef(errorStr);
+        }
+        threadEnv->DeleteGlobalRef(callbackRef);
+        threadEnv->DeleteGlobalRef(bufferRef);
+    };
+    return callbacks;
+}
+
 extern "C" JNIEXPORT jlong JNICALL
 Java_io_shubham0204_smollm_SmolLM_loadModel(JNIEnv* env, jobject thiz, jstring modelPath, jfloat minP,
                                             jfloat temperature, jboolean storeChats, jlong contextSize,
-                                            jstring chatTemplate, jint nThreads, jboolean useMmap, jboolean useMlock) {
+                                            jstring chatTemplate, jint nThreads, jboolean useMmap, jboolean useMlock,
+                                            jint nBatch, jint nUBatch, jint nParallel, jint topK, jfloat topP,
+                                            jfloat typicalP, jfloat repeatPenalty, jfloat presencePenalty,
+                                            jint penaltyLastN, jfloat dryMultiplier, jfloat dryBase,
+                                            jint dryAllowedLength, jint dryPenaltyLastN, jint seed,
+                                            jint nSinkTokens, jint typeK, jint typeV, jint flashAttn,
+                                            jlong kvMemoryBudget, jboolean prefetch, jboolean warmup,
+                                            jobject progressCallback) {
+    SamplerParams samplerParams;
+    samplerParams.temperature      = temperature;
+    samplerParams.topK             = topK;
+    samplerParams.topP             = topP;
+    samplerParams.minP             = minP;
+    samplerParams.typicalP         = typicalP;
+    samplerParams.repeatPenalty    = repeatPenalty;
+    samplerParams.presencePenalty  = presencePenalty;
+    samplerParams.penaltyLastN     = penaltyLastN;
+    samplerParams.dryMultiplier    = dryMultiplier;
+    samplerParams.dryBase          = dryBase;
+    samplerParams.dryAllowedLength = dryAllowedLength;
+    samplerParams.dryPenaltyLastN  = dryPenaltyLastN;
+    // a seed of -1 maps to LLAMA_DEFAULT_SEED (a random seed)
+    samplerParams.seed = (uint32_t) seed;
+
     jboolean    isCopy           = true;
     const char* modelPathCstr    = env->GetStringUTFChars(modelPath, &isCopy);
     auto*       llmInference     = new LLMInference();
     const char* chatTemplateCstr = env->GetStringUTFChars(chatTemplate, &isCopy);
 
+    // the progress is reported on the calling thread, `env` is valid in the callback
+    ModelLoadProgressCallback onProgress;
+    if (progressCallback != nullptr) {
+        jmethodID onProgressMethod = env->GetMethodID(env->GetObjectClass(progressCallback), "onProgress", "(IF)Z");
+        onProgress                 = [=](ModelLoadStage stage, float progress) {
+            jboolean proceed = env->CallBooleanMethod(progressCallback, onProgressMethod, (jint) stage, progress);
+            // an exception thrown by the callback cancels the loading and is rethrown to the caller
+            return !env->ExceptionCheck() && proceed;
+        };
+    }
+
     try {
-        llmInference->loadModel(modelPathCstr, minP, temperature, storeChats, contextSize, chatTemplateCstr, nThreads,
-                                useMmap, useMlock);
+        llmInference->loadModel(modelPathCstr, samplerParams, storeChats, contextSize, chatTemplateCstr, nThreads,
+                                useMmap, useMlock, nBatch, nUBatch, nParallel, nSinkTokens, typeK, typeV,
+                                flashAttn, kvMemoryBudget, prefetch, warmup, onProgress);
     } catch (std::exception& error) {
         env->ReleaseStringUTFChars(modelPath, modelPathCstr);
         env->ReleaseStringUTFChars(chatTemplate, chatTemplateCstr);
         delete llmInference;
-        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error.what());
+        if (!env->ExceptionCheck()) {
+            env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error.what());
+        }
         return 0;
     }
 
@@ -26,6 +156,33 @@ Java_io_shubham0204_smollm_SmolLM_loadModel(JNIEnv* env, jobject thiz, jstring m
     return reinterpret_cast<jlong>(llmInference);
 }
 
+extern "C" JNIEXPORT void JNICALL
+Java_io_shubham0204_smollm_SmolLM_loadDraftModel(JNIEnv* env, jobject thiz, jlong modelPtr, jstring modelPath,
+                                                 jint nDraft, jint nThreads) {
+    jboolean    isCopy        = true;
+    const char* modelPathCstr = env->GetStringUTFChars(modelPath, &isCopy);
+    auto*       llmInference  = reinterpret_cast<LLMInference*>(modelPtr);
+    try {
+        llmInference->loadDraftModel(modelPathCstr, nDraft, nThreads);
+    } catch (std::exception& error) {
+        env->ReleaseStringUTFChars(modelPath, modelPathCstr);
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error.what());
+        return;
+    }
+    env->ReleaseStringUTFChars(modelPath, modelPathCstr);
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_io_shubham0204_smollm_SmolLM_enablePromptLookupDecoding(JNIEnv* env, jobject thiz, jlong modelPtr,
+                                                             jint ngramSize, jint nDraft) {
+    auto* llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    try {
+        llmInference->enablePromptLookupDecoding(ngramSize, nDraft);
+    } catch (std::exception& error) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error.what());
+    }
+}
+
 extern "C" JNIEXPORT void JNICALL
 Java_io_shubham0204_smollm_SmolLM_addChatMessage(JNIEnv* env, jobject thiz, jlong modelPtr, jstring message,
                                                  jstring role) {
@@ -44,12 +201,92 @@ Java_io_shubham0204_smollm_SmolLM_getResponseGenerationSpeed(JNIEnv* env, jobjec
     return llmInference->getResponseGenerationTime();
 }
 
+extern "C" JNIEXPORT jfloat JNICALL
+Java_io_shubham0204_smollm_SmolLM_getDraftAcceptanceRate(JNIEnv* env, jobject thiz, jlong modelPtr) {
+    auto* llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    return llmInference->getDraftAcceptanceRate();
+}
+
 extern "C" JNIEXPORT jint JNICALL
 Java_io_shubham0204_smollm_SmolLM_getContextSizeUsed(JNIEnv* env, jobject thiz, jlong modelPtr) {
     auto* llmInference = reinterpret_cast<LLMInference*>(modelPtr);
     return llmInference->getContextSizeUsed();
 }
 
+extern "C" JNIEXPORT jlong JNICALL
+Java_io_shubham0204_smollm_SmolLM_getNumEvictedTokens(JNIEnv* env, jobject thiz, jlong modelPtr) {
+    auto* llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    return llmInference->getNumEvictedTokens();
+}
+
+extern "C" JNIEXPORT jlong JNICALL
+Java_io_shubham0204_smollm_SmolLM_getContextSize(JNIEnv* env, jobject thiz, jlong modelPtr) {
+    auto* llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    return (jlong) llmInference->getContextSize();
+}
+
+extern "C" JNIEXPORT jint JNICALL
+Java_io_shubham0204_smollm_SmolLM_getNumReusedTokens(JNIEnv* env, jobject thiz, jlong modelPtr) {
+    auto* llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    return llmInference->getNumReusedTokens();
+}
+
+// no. of values per stage in the array returned by getMetrics()
+static constexpr int METRICS_VALUES_PER_STAGE = 6;
+
+// returns the metrics as a single long[]: count, total, max, p50, p95 and p99 (in microseconds) for each
+// InferenceStage in order, followed by the no. of prefill, generated and decoded tokens
+extern "C" JNIEXPORT jlongArray JNICALL
+Java_io_shubham0204_smollm_SmolLM_getMetrics(JNIEnv* env, jobject thiz, jlong modelPtr) {
+    auto*                    llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    InferenceMetricsSnapshot snapshot     = llmInference->getMetrics();
+    constexpr int            nStages      = (int) InferenceStage::Count;
+    jlong                    values[nStages * METRICS_VALUES_PER_STAGE + 3];
+    for (int i = 0; i < nStages; i++) {
+        const StageMetrics& stage = snapshot.stages[i];
+        jlong*              out   = values + i * METRICS_VALUES_PER_STAGE;
+        out[0]                    = (jlong) stage.count;
+        out[1]                    = (jlong) stage.totalUs;
+        out[2]                    = (jlong) stage.maxUs;
+        out[3]                    = (jlong) stage.p50Us;
+        out[4]                    = (jlong) stage.p95Us;
+        out[5]                    = (jlong) stage.p99Us;
+    }
+    values[nStages * METRICS_VALUES_PER_STAGE]     = (jlong) snapshot.prefillTokens;
+    values[nStages * METRICS_VALUES_PER_STAGE + 1] = (jlong) snapshot.generatedTokens;
+    values[nStages * METRICS_VALUES_PER_STAGE + 2] = (jlong) snapshot.decodedTokens;
+
+    jsize      length = (jsize) (sizeof(values) / sizeof(values[0]));
+    jlongArray array  = env->NewLongArray(length);
+    env->SetLongArrayRegion(array, 0, length, values);
+    return array;
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_io_shubham0204_smollm_SmolLM_resetMetrics(JNIEnv* env, jobject thiz, jlong modelPtr) {
+    auto* llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    llmInference->resetMetrics();
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_io_shubham0204_smollm_SmolLM_setTraceEnabled(JNIEnv* env, jobject thiz, jlong modelPtr, jboolean enabled) {
+    auto* llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    llmInference->setTraceEnabled(enabled);
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_io_shubham0204_smollm_SmolLM_dumpTrace(JNIEnv* env, jobject thiz, jlong modelPtr, jstring path) {
+    jboolean    isCopy       = true;
+    const char* pathCstr     = env->GetStringUTFChars(path, &isCopy);
+    auto*       llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    try {
+        llmInference->dumpTrace(pathCstr);
+    } catch (std::exception& error) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error.what());
+    }
+    env->ReleaseStringUTFChars(path, pathCstr);
+}
+
 extern "C" JNIEXPORT void JNICALL
 Java_io_shubham0204_smollm_SmolLM_close(JNIEnv* env, jobject thiz, jlong modelPtr) {
     auto* llmInference = reinterpret_cast<LLMInference*>(modelPtr);
@@ -57,22 +294,36 @@ Java_io_shubham0204_smollm_SmolLM_close(JNIEnv* env, jobject thiz, jlong modelPt
 }
 
 extern "C" JNIEXPORT jboolean JNICALL
-Java_io_shubham0204_smollm_SmolLM_startCompletion(JNIEnv* env, jobject thiz, jlong modelPtr, jstring prompt) {
+Java_io_shubham0204_smollm_SmolLM_startCompletion(JNIEnv* env, jobject thiz, jlong modelPtr, jstring prompt,
+                                                  jstring grammar, jboolean isJsonSchema) {
     jboolean    isCopy       = true;
     const char* promptCstr   = env->GetStringUTFChars(prompt, &isCopy);
+    const char* grammarCstr  = grammar != nullptr ? env->GetStringUTFChars(grammar, &isCopy) : nullptr;
     auto*       llmInference = reinterpret_cast<LLMInference*>(modelPtr);
-    bool usedJinja;
+    bool usedJinja = true;
     try {
-        usedJinja = llmInference->startCompletion(promptCstr);
+        usedJinja = llmInference->startCompletion(promptCstr, grammarCstr, isJsonSchema);
     } catch (std::exception& error) {
-        env->ReleaseStringUTFChars(prompt, promptCstr);
         env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error.what());
-        return JNI_TRUE;
     }
     env->ReleaseStringUTFChars(prompt, promptCstr);
+    if (grammarCstr != nullptr) {
+        env->ReleaseStringUTFChars(grammar, grammarCstr);
+    }
     return usedJinja ? JNI_TRUE : JNI_FALSE;
 }
 
+extern "C" JNIEXPORT jfloat JNICALL
+Java_io_shubham0204_smollm_SmolLM_prefill(JNIEnv* env, jobject thiz, jlong modelPtr) {
+    auto* llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    try {
+        return llmInference->prefill();
+    } catch (std::exception& error) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error.what());
+        return 1.0f;
+    }
+}
+
 extern "C" JNIEXPORT jstring JNICALL
 Java_io_shubham0204_smollm_SmolLM_completionLoop(JNIEnv* env, jobject thiz, jlong modelPtr) {
     auto* llmInference = reinterpret_cast<LLMInference*>(modelPtr);
@@ -85,16 +336,242 @@ Java_io_shubham0204_smollm_SmolLM_completionLoop(JNIEnv* env, jobject thiz, jlon
     }
 }
 
+extern "C" JNIEXPORT void JNICALL
+Java_io_shubham0204_smollm_SmolLM_generate(JNIEnv* env, jobject thiz, jlong modelPtr, jint maxTokens,
+                                           jint maxTimeMs, jint flushTokens, jint flushIntervalMs, jobject buffer,
+                                           jobject callback) {
+    if (!checkGenerationBuffer(env, buffer)) {
+        return;
+    }
+    auto*               llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    GenerationCallbacks callbacks    = createGenerationCallbacks(env, buffer, callback);
+    llmInference->startGeneration(maxTokens, maxTimeMs, flushTokens, flushIntervalMs, callbacks.onText,
+                                  callbacks.onComplete);
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_io_shubham0204_smollm_SmolLM_cancelGeneration(JNIEnv* env, jobject thiz, jlong modelPtr) {
+    auto* llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    llmInference->cancelGeneration();
+}
+
 extern "C" JNIEXPORT void JNICALL
 Java_io_shubham0204_smollm_SmolLM_stopCompletion(JNIEnv* env, jobject thiz, jlong modelPtr) {
     auto* llmInference = reinterpret_cast<LLMInference*>(modelPtr);
     llmInference->stopCompletion();
 }
 
+extern "C" JNIEXPORT void JNICALL
+Java_io_shubham0204_smollm_SmolLM_setStopSequences(JNIEnv* env, jobject thiz, jlong modelPtr,
+                                                   jobjectArray stopSequences) {
+    jsize                    nStopSequences = env->GetArrayLength(stopSequences);
+    std::vector<std::string> stopSequencesVec(nStopSequences);
+    for (jsize i = 0; i < nStopSequences; i++) {
+        auto        stopSequence     = (jstring) env->GetObjectArrayElement(stopSequences, i);
+        const char* stopSequenceCstr = env->GetStringUTFChars(stopSequence, nullptr);
+        stopSequencesVec[i]          = stopSequenceCstr;
+        env->ReleaseStringUTFChars(stopSequence, stopSequenceCstr);
+        env->DeleteLocalRef(stopSequence);
+    }
+    auto* llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    llmInference->setStopSequences(stopSequencesVec);
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_io_shubham0204_smollm_SmolLM_saveSnapshot(JNIEnv* env, jobject thiz, jlong modelPtr, jstring dirPath) {
+    jboolean    isCopy       = true;
+    const char* dirPathCstr  = env->GetStringUTFChars(dirPath, &isCopy);
+    auto*       llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    std::string snapshotPath;
+    try {
+        snapshotPath = llmInference->saveSnapshot(dirPathCstr);
+    } catch (std::exception& error) {
+        env->ReleaseStringUTFChars(dirPath, dirPathCstr);
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error.what());
+        return nullptr;
+    }
+    env->ReleaseStringUTFChars(dirPath, dirPathCstr);
+    return env->NewStringUTF(snapshotPath.c_str());
+}
+
+extern "C" JNIEXPORT jint JNICALL
+Java_io_shubham0204_smollm_SmolLM_restoreSnapshot(JNIEnv* env, jobject thiz, jlong modelPtr, jstring dirPath) {
+    jboolean    isCopy       = true;
+    const char* dirPathCstr  = env->GetStringUTFChars(dirPath, &isCopy);
+    auto*       llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    int         nRestored    = 0;
+    try {
+        nRestored = llmInference->restoreSnapshot(dirPathCstr);
+    } catch (std::exception& error) {
+        env->ReleaseStringUTFChars(dirPath, dirPathCstr);
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error.what());
+        return 0;
+    }
+    env->ReleaseStringUTFChars(dirPath, dirPathCstr);
+    return nRestored;
+}
+
 extern "C" JNIEXPORT jstring JNICALL
 Java_io_shubham0204_smollm_SmolLM_benchModel(JNIEnv* env, jobject /*unused*/, jlong modelPtr, jint pp, jint tg, jint pl,
                                              jint nr) {
+    auto* llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    try {
+        std::string result = llmInference->benchModel(pp, tg, pl, nr);
+        return env->NewStringUTF(result.c_str());
+    } catch (std::exception& error) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error.what());
+        return nullptr;
+    }
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_io_shubham0204_smollm_SmolLM_benchSampler(JNIEnv* env, jobject thiz, jlong modelPtr, jint nVocab,
+                                               jint nIterations) {
+    auto* llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    try {
+        std::string result = llmInference->benchSampler(nVocab, nIterations);
+        return env->NewStringUTF(result.c_str());
+    } catch (std::exception& error) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error.what());
+        return nullptr;
+    }
+}
+
+extern "C" JNIEXPORT jint JNICALL
+Java_io_shubham0204_smollm_SmolLM_createSession(JNIEnv* env, jobject thiz, jlong modelPtr) {
+    auto* llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    try {
+        return llmInference->createSession();
+    } catch (std::exception& error) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error.what());
+        return -1;
+    }
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_io_shubham0204_smollm_SmolLM_addSessionMessage(JNIEnv* env, jobject thiz, jlong modelPtr, jint sessionId,
+                                                    jstring message, jstring role) {
+    jboolean    isCopy       = true;
+    const char* messageCstr  = env->GetStringUTFChars(message, &isCopy);
+    const char* roleCstr     = env->GetStringUTFChars(role, &isCopy);
     auto*       llmInference = reinterpret_cast<LLMInference*>(modelPtr);
-    std::string result       = llmInference->benchModel(pp, tg, pl, nr);
-    return env->NewStringUTF(result.c_str());
+    try {
+        llmInference->addSessionMessage(sessionId, messageCstr, roleCstr);
+    } catch (std::exception& error) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error.what());
+    }
+    env->ReleaseStringUTFChars(message, messageCstr);
+    env->ReleaseStringUTFChars(role, roleCstr);
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_io_shubham0204_smollm_SmolLM_startSessionCompletion(JNIEnv* env, jobject thiz, jlong modelPtr, jint sessionId,
+                                                         jstring query, jint maxTokens, jint maxTimeMs,
+                                                         jobject buffer, jobject callback) {
+    if (!checkGenerationBuffer(env, buffer)) {
+        return;
+    }
+    jboolean            isCopy       = true;
+    const char*         queryCstr    = env->GetStringUTFChars(query, &isCopy);
+    auto*               llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    GenerationCallbacks callbacks    = createGenerationCallbacks(env, buffer, callback);
+    try {
+        llmInference->startSessionCompletion(sessionId, queryCstr, maxTokens, maxTimeMs, callbacks.onText,
+                                             callbacks.onComplete);
+    } catch (std::exception& error) {
+        // the callbacks will not be invoked, release the global references held by them
+        callbacks.onComplete(error.what());
+    }
+    env->ReleaseStringUTFChars(query, queryCstr);
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_io_shubham0204_smollm_SmolLM_cancelSession(JNIEnv* env, jobject thiz, jlong modelPtr, jint sessionId) {
+    auto* llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    try {
+        llmInference->cancelSession(sessionId);
+    } catch (std::exception& error) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error.what());
+    }
+}
+
+extern "C" JNIEXPORT jfloat JNICALL
+Java_io_shubham0204_smollm_SmolLM_getSessionGenerationSpeed(JNIEnv* env, jobject thiz, jlong modelPtr,
+                                                            jint sessionId) {
+    auto* llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    try {
+        return llmInference->getSessionGenerationTime(sessionId);
+    } catch (std::exception& error) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error.what());
+        return 0.0f;
+    }
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_io_shubham0204_smollm_SmolLM_closeSession(JNIEnv* env, jobject thiz, jlong modelPtr, jint sessionId) {
+    auto* llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    try {
+        llmInference->closeSession(sessionId);
+    } catch (std::exception& error) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error.what());
+    }
+}
+
+extern "C" JNIEXPORT jlong JNICALL
+Java_io_shubham0204_smollm_LLMEmbedder_loadModel(JNIEnv* env, jobject thiz, jstring modelPath, jint poolingType,
+                                                 jint nThreads, jlong contextSize, jint nParallel, jboolean useMmap) {
+    jboolean    isCopy        = true;
+    const char* modelPathCstr = env->GetStringUTFChars(modelPath, &isCopy);
+    auto*       llmEmbedder   = new LLMEmbedder();
+    try {
+        llmEmbedder->loadModel(modelPathCstr, poolingType, nThreads, contextSize, nParallel, useMmap);
+    } catch (std::exception& error) {
+        env->ReleaseStringUTFChars(modelPath, modelPathCstr);
+        delete llmEmbedder;
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error.what());
+        return 0;
+    }
+    env->ReleaseStringUTFChars(modelPath, modelPathCstr);
+    return reinterpret_cast<jlong>(llmEmbedder);
+}
+
+extern "C" JNIEXPORT jint JNICALL
+Java_io_shubham0204_smollm_LLMEmbedder_getEmbeddingDim(JNIEnv* env, jobject thiz, jlong embedderPtr) {
+    auto* llmEmbedder = reinterpret_cast<LLMEmbedder*>(embedderPtr);
+    return llmEmbedder->getEmbeddingDim();
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_io_shubham0204_smollm_LLMEmbedder_embed(JNIEnv* env, jobject thiz, jlong embedderPtr, jobjectArray texts,
+                                             jobject buffer) {
+    auto*                    llmEmbedder = reinterpret_cast<LLMEmbedder*>(embedderPtr);
+    jsize                    nTexts      = env->GetArrayLength(texts);
+    std::vector<std::string> textsVec;
+    textsVec.reserve(nTexts);
+    for (jsize i = 0; i < nTexts; i++) {
+        auto        text     = static_cast<jstring>(env->GetObjectArrayElement(texts, i));
+        const char* textCstr = env->GetStringUTFChars(text, nullptr);
+        textsVec.emplace_back(textCstr);
+        env->ReleaseStringUTFChars(text, textCstr);
+        env->DeleteLocalRef(text);
+    }
+    // the embeddings are written directly to the direct buffer
+    auto*  embeddings = static_cast<float*>(env->GetDirectBufferAddress(buffer));
+    size_t capacity   = env->GetDirectBufferCapacity(buffer);
+    if (embeddings == nullptr || capacity < (size_t) nTexts * llmEmbedder->getEmbeddingDim()) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"),
+                      "the buffer should be a direct FloatBuffer holding texts.size * embeddingDim floats");
+        return;
+    }
+    try {
+        llmEmbedder->embed(textsVec, embeddings);
+    } catch (std::exception& error) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error.what());
+    }
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_io_shubham0204_smollm_LLMEmbedder_close(JNIEnv* env, jobject thiz, jlong embedderPtr) {
+    auto* llmEmbedder = reinterpret_cast<LLMEmbedder*>(embedderPtr);
+    delete llmEmbedder;
 }
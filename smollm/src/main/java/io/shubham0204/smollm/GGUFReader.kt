@@ -18,41 +18,142 @@ package io.shubham0204.smollm
 
 import kotlinx.coroutines.Dispatchers
 import kotlinx.coroutines.withContext
+import java.io.File
 
+/**
+ * Reads the metadata of GGUF model files. Only the header of a file is read, with buffered reads
+ * that skip the vocabulary and never touch the tensor data, so listing a library of large models is
+ * fast. The metadata can be cached in a file, keyed by the path, size and modification time of each
+ * model, so that unchanged models are not read again.
+ */
 class GGUFReader {
     companion object {
         init {
             System.loadLibrary("ggufreader")
         }
-    }
 
-    private var nativeHandle: Long = 0L
+        // no. of values per file in the arrays returned by the native scanFiles()
+        private const val NUM_STRINGS_PER_FILE = 5
+        private const val NUM_LONGS_PER_FILE = 14
 
-    suspend fun load(modelPath: String) =
-        withContext(Dispatchers.IO) { nativeHandle = getGGUFContextNativeHandle(modelPath) }
+        /**
+         * Reads the metadata of all [modelPaths] in parallel.
+         *
+         * @param modelPaths The paths of the GGUF files.
+         * @param cacheFile If not null, files that are unchanged since they were cached in this file
+         *   are not read again, and the cache is updated with the files read.
+         * @param numThreads The no. of files read in parallel, 0 for one per CPU core.
+         * @return The metadata of each file, in the order of [modelPaths]. Files that could not be
+         *   read have a non-null [Metadata.error].
+         */
+        suspend fun scan(
+            modelPaths: List<String>,
+            cacheFile: File? = null,
+            numThreads: Int = 0,
+        ): List<Metadata> =
+            withContext(Dispatchers.IO) {
+                GGUFReader().readMetadata(modelPaths, cacheFile, numThreads)
+            }
+    }
 
-    fun getContextSize(): Long? {
-        assert(nativeHandle != 0L) { "Use GGUFReader.load() to initialize the reader" }
-        val contextSize = getContextSize(nativeHandle)
-        return if (contextSize == -1L) {
-            null
-        } else {
-            contextSize
-        }
+    /**
+     * Summary of a GGUF model. Hyperparameters not declared by the file are 0, values that vary
+     * per layer report their largest value.
+     *
+     * @property quantization The llama.cpp file type (e.g. Q4_K_M), or the most common tensor type
+     * @property parameterCount The total no. of elements of the tensors
+     * @property weightBytes The size of the tensor data, the memory taken by the weights
+     * @property kvCacheBytesPerToken The size of the keys and values of a token in an F16 KV cache
+     * @property error The reason the file could not be read, null if it was read
+     */
+    data class Metadata(
+        val path: String,
+        val architecture: String,
+        val name: String,
+        val quantization: String,
+        val chatTemplate: String?,
+        val fileSize: Long,
+        val lastModifiedNanos: Long,
+        val contextLength: Long,
+        val blockCount: Long,
+        val embeddingLength: Long,
+        val feedForwardLength: Long,
+        val headCount: Long,
+        val headCountKv: Long,
+        val keyLength: Long,
+        val valueLength: Long,
+        val vocabSize: Long,
+        val parameterCount: Long,
+        val weightBytes: Long,
+        val kvCacheBytesPerToken: Long,
+        val error: String?,
+    ) {
+        /** Estimates the memory taken by the weights and an F16 KV cache of [contextSize] tokens */
+        fun estimateMemoryBytes(contextSize: Long = contextLength): Long =
+            weightBytes + kvCacheBytesPerToken * contextSize
     }
 
-    fun getChatTemplate(): String? {
-        assert(nativeHandle != 0L) { "Use GGUFReader.load() to initialize the reader" }
-        val chatTemplate = getChatTemplate(nativeHandle)
-        return chatTemplate.ifEmpty { null }
+    private var metadata: Metadata? = null
+
+    suspend fun load(modelPath: String, cacheFile: File? = null) =
+        withContext(Dispatchers.IO) { metadata = readMetadata(listOf(modelPath), cacheFile, 1)[0] }
+
+    /** Returns the metadata of the file read with [load] */
+    fun getMetadata(): Metadata {
+        val metadata = metadata
+        assert(metadata != null) { "Use GGUFReader.load() to initialize the reader" }
+        return metadata!!
     }
 
-    /** Returns the native handle (pointer to gguf_context created on the native side) */
-    private external fun getGGUFContextNativeHandle(modelPath: String): Long
+    fun getContextSize(): Long? = getMetadata().contextLength.takeIf { it > 0L }
+
+    fun getChatTemplate(): String? = getMetadata().chatTemplate
 
-    /** Read the context size (in no. of tokens) from the GGUF file, given the native handle */
-    private external fun getContextSize(nativeHandle: Long): Long
+    private fun readMetadata(
+        modelPaths: List<String>,
+        cacheFile: File?,
+        numThreads: Int,
+    ): List<Metadata> {
+        val longs = LongArray(modelPaths.size * NUM_LONGS_PER_FILE)
+        val strings =
+            scanFiles(modelPaths.toTypedArray(), cacheFile?.absolutePath, numThreads, longs)
+        return modelPaths.mapIndexed { i, path ->
+            val s = i * NUM_STRINGS_PER_FILE
+            val l = i * NUM_LONGS_PER_FILE
+            Metadata(
+                path = path,
+                architecture = strings[s],
+                name = strings[s + 1],
+                quantization = strings[s + 2],
+                chatTemplate = strings[s + 3].ifEmpty { null },
+                fileSize = longs[l],
+                lastModifiedNanos = longs[l + 1],
+                contextLength = longs[l + 2],
+                blockCount = longs[l + 3],
+                embeddingLength = longs[l + 4],
+                feedForwardLength = longs[l + 5],
+                headCount = longs[l + 6],
+                headCountKv = longs[l + 7],
+                keyLength = longs[l + 8],
+                valueLength = longs[l + 9],
+                vocabSize = longs[l + 10],
+                parameterCount = longs[l + 11],
+                weightBytes = longs[l + 12],
+                kvCacheBytesPerToken = longs[l + 13],
+                error = strings[s + 4].ifEmpty { null },
+            )
+        }
+    }
 
-    /** Read the chat template from the GGUF file, given the native handle */
-    private external fun getChatTemplate(nativeHandle: Long): String
+    /**
+     * Reads the metadata of [modelPaths] with [numThreads] threads, using the cache file at
+     * [cachePath] if it is not null. Returns 5 strings per file and writes 14 integers per file to
+     * [longs]
+     */
+    private external fun scanFiles(
+        modelPaths: Array<String>,
+        cachePath: String?,
+        numThreads: Int,
+        longs: LongArray,
+    ): Array<String>
 }
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2025 Shubham Panchal
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package io.shubham0204.smollm
+
+import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.withContext
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+import java.nio.FloatBuffer
+
+/**
+ * Generates embeddings for texts with a GGUF embedding model, using the same native library (and
+ * llama.cpp runtime) as [SmolLM]. The embeddings are L2-normalized, so the dot product of two
+ * embeddings is their cosine similarity, and are returned in a direct [FloatBuffer] that can be
+ * passed to a vector database without copying.
+ */
+class LLMEmbedder {
+    companion object {
+        init {
+            SmolLM.ensureNativeLibraryLoaded()
+        }
+    }
+
+    /** Pooling of the token embeddings of a text into a single embedding */
+    enum class PoolingType(val llamaPoolingType: Int) {
+        /** The pooling type stored in the GGUF file */
+        UNSPECIFIED(-1),
+        MEAN(1),
+        CLS(2),
+        LAST(3),
+    }
+
+    /**
+     * @property poolingType The pooling of the token embeddings. (Default: UNSPECIFIED)
+     * @property numThreads The number of threads to use for inference. (Default: 4)
+     * @property contextSize The maximum number of tokens decoded in a single batch, shared by all
+     *   texts of the batch. Longer texts are truncated. If 0, the training context size of the
+     *   model is used. (Default: 0)
+     * @property maxBatchTexts The maximum number of texts decoded in a single batch, each in its
+     *   own sequence. (Default: 32)
+     * @property useMmap Whether to use memory-mapped file I/O for loading the model. (Default: true)
+     */
+    data class EmbedderParams(
+        val poolingType: PoolingType = PoolingType.UNSPECIFIED,
+        val numThreads: Int = 4,
+        val contextSize: Long = 0L,
+        val maxBatchTexts: Int = 32,
+        val useMmap: Boolean = true,
+    )
+
+    private var nativePtr = 0L
+
+    /**
+     * Loads the GGUF embedding model from the given path
+     *
+     * @throws IllegalStateException if the model could not be loaded, or does not produce pooled
+     *   embeddings
+     */
+    suspend fun load(modelPath: String, params: EmbedderParams = EmbedderParams()) =
+        withContext(Dispatchers.IO) {
+            nativePtr =
+                loadModel(
+                    modelPath,
+                    params.poolingType.llamaPoolingType,
+                    params.numThreads,
+                    params.contextSize,
+                    params.maxBatchTexts,
+                    params.useMmap,
+                )
+        }
+
+    /** Returns the dimension of the embeddings produced by the model */
+    fun getEmbeddingDim(): Int {
+        verifyHandle()
+        return getEmbeddingDim(nativePtr)
+    }
+
+    /**
+     * Returns the embeddings of [texts], computed in batches of multiple texts
+     *
+     * @param buffer A direct [FloatBuffer] holding at least `texts.size * getEmbeddingDim()`
+     *   floats, reused across calls to avoid allocations. A new buffer is allocated if null.
+     * @return The buffer, holding the embedding of the i-th text at offset `i * getEmbeddingDim()`
+     */
+    suspend fun embed(texts: List<String>, buffer: FloatBuffer? = null): FloatBuffer =
+        withContext(Dispatchers.IO) {
+            verifyHandle()
+            val embeddings =
+                buffer
+                    ?: ByteBuffer.allocateDirect(texts.size * getEmbeddingDim() * Float.SIZE_BYTES)
+                        .order(ByteOrder.nativeOrder())
+                        .asFloatBuffer()
+            embed(nativePtr, texts.toTypedArray(), embeddings)
+            embeddings
+        }
+
+    /** Unloads the embedding model and releases resources */
+    fun close() {
+        if (nativePtr != 0L) {
+            close(nativePtr)
+            nativePtr = 0L
+        }
+    }
+
+    private fun verifyHandle() {
+        assert(nativePtr != 0L) { "Model is not loaded. Use LLMEmbedder.load to load the model" }
+    }
+
+    private external fun loadModel(
+        modelPath: String,
+        poolingType: Int,
+        nThreads: Int,
+        contextSize: Long,
+        nParallel: Int,
+        useMmap: Boolean,
+    ): Long
+
+    private external fun getEmbeddingDim(embedderPtr: Long): Int
+
+    private external fun embed(embedderPtr: Long, texts: Array<String>, buffer: FloatBuffer)
+
+    private external fun close(embedderPtr: Long)
+}
@@ -19,11 +19,19 @@ package io.shubham0204.smollm
 import android.os.Build
 import android.util.Log
 import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.channels.ProducerScope
+import kotlinx.coroutines.channels.awaitClose
+import kotlinx.coroutines.channels.trySendBlocking
+import kotlinx.coroutines.currentCoroutineContext
+import kotlinx.coroutines.ensureActive
+import kotlinx.coroutines.isActive
 import kotlinx.coroutines.flow.Flow
+import kotlinx.coroutines.flow.callbackFlow
 import kotlinx.coroutines.flow.flow
 import kotlinx.coroutines.withContext
 import java.io.File
 import java.io.FileNotFoundException
+import java.nio.ByteBuffer
 
 /** This class interacts with the JNI binding and provides a Kotlin API to infer a GGUF LLM model */
 class SmolLM {
@@ -116,10 +124,55 @@ class SmolLM {
         }
 
         private fun supportsArm64V8a(): Boolean = Build.SUPPORTED_ABIS[0].equals("arm64-v8a")
+
+        /**
+         * Does nothing, but accessing the companion object runs the init block which loads the
+         * native library for the CPU features. Used by the classes sharing the native library.
+         */
+        internal fun ensureNativeLibraryLoaded() = Unit
+
+        /**
+         * Size (in bytes) of the direct buffer shared with the native generation thread, at least
+         * 4 bytes (the longest UTF-8 code point), as a chunk holds one or more code points
+         */
+        private const val GENERATION_BUFFER_SIZE = 4096
     }
 
     private var nativePtr = 0L
 
+    /**
+     * Receives the text generated by the native generation thread started with `generate`. The
+     * methods are invoked from the native thread.
+     */
+    private interface GenerationCallback {
+        /** Called with the no. of UTF-8 bytes of the next chunk written to the shared buffer */
+        fun onText(length: Int)
+
+        /** Called once the generation finishes, with an error message if it failed */
+        fun onComplete(error: String?)
+    }
+
+    /**
+     * Receives the progress of `loadModel`, on the thread that called it. Returning false cancels
+     * the loading.
+     */
+    private interface LoadProgressCallback {
+        /** Called with the ordinal of the [LoadStage] and the fraction of the stage completed */
+        fun onProgress(stage: Int, progress: Float): Boolean
+    }
+
+    /** Stages of [load], in the order they run */
+    enum class LoadStage {
+        /** Reading the weights into the page cache, see [InferenceParams.prefetchWeights] */
+        PREFETCH,
+
+        /** Loading the model with llama.cpp */
+        LOAD,
+
+        /** Decoding a token before the model is ready, see [InferenceParams.warmup] */
+        WARMUP,
+    }
+
     /**
      * Provides default values for inference parameters. These values are used when the
      * corresponding parameters are not provided by the user or are not available in the GGUF model
@@ -131,13 +184,20 @@ class SmolLM {
             "{% for message in messages %}{% if loop.first and messages[0]['role'] != 'system' %}{{ '<|im_start|>system You are a helpful AI assistant named SmolLM, trained by Hugging Face<|im_end|> ' }}{% endif %}{{'<|im_start|>' + message['role'] + ' ' + message['content'] + '<|im_end|>' + ' '}}{% endfor %}{% if add_generation_prompt %}{{ '<|im_start|>assistant ' }}{% endif %}"
     }
 
+    /** Data types of the keys and values stored in the KV cache, with their `ggml_type` IDs */
+    enum class KVCacheType(val ggmlType: Int) {
+        F16(1),
+        Q8_0(8),
+        Q4_0(2),
+    }
+
     /**
      * Data class to hold the inference parameters for the LLM.
      *
-     * @property minP The minimum probability for a token to be considered. Also known as top-P
-     *   sampling. (Default: 0.1f)
+     * @property minP The minimum probability for a token to be considered, relative to the
+     *   probability of the most likely token. 0 disables min-p sampling. (Default: 0.1f)
      * @property temperature The temperature for sampling. Higher values make the output more
-     *   random. (Default: 0.8f)
+     *   random. A value of 0 or less selects the most likely token. (Default: 0.8f)
      * @property storeChats Whether to store the chat history in memory. If true, the LLM will
      *   remember previous interactions in the current session. (Default: true)
      * @property contextSize The context size (in tokens) for the LLM. This determines how much of
@@ -151,6 +211,70 @@ class SmolLM {
      *   improve loading times and reduce memory usage. (Default: true)
      * @property useMlock Whether to lock the model in memory. This can prevent the model from being
      *   swapped out to disk, potentially improving performance. (Default: false)
+     * @property batchSize The maximum number of prompt tokens decoded in a single step (n_batch).
+     *   The prompt is decoded in chunks of this size, independent of the context size. (Default:
+     *   512)
+     * @property microBatchSize The physical batch size (n_ubatch) that bounds the size of the
+     *   compute buffers. It is clamped to [batchSize]. (Default: 512)
+     * @property draftModelPath Path to a smaller GGUF model from the same family (sharing the
+     *   vocabulary) used for speculative decoding. If null, speculative decoding is disabled.
+     *   (Default: null)
+     * @property numDraftTokens The number of tokens proposed by the draft model (or the n-gram
+     *   lookup) in each step. (Default: 8)
+     * @property promptLookupNgramSize If greater than 0, enables prompt-lookup decoding: the tokens
+     *   that followed an earlier occurrence of the last `promptLookupNgramSize` tokens, in the
+     *   prompt or the response, are proposed as the draft. This speeds up responses that repeat
+     *   parts of the input (summaries, code edits, RAG answers) without a draft model. (Default: 0)
+     * @property numParallelSequences The maximum number of [Session]s that can be open at once. The
+     *   sessions share the context (and its [contextSize] tokens) with the main conversation, and
+     *   their next tokens are decoded together in a single batch. (Default: 0)
+     * @property topK Only the [topK] most likely tokens are considered for sampling. Together with
+     *   [minP], this runs first in the sampler chain, so that the remaining samplers process a few
+     *   candidates instead of the whole vocabulary. 0 disables top-k sampling. (Default: 40)
+     * @property topP Only the most likely tokens with a cumulative probability of [topP] are
+     *   considered. 1 disables top-p sampling. (Default: 1.0f)
+     * @property typicalP Locally typical sampling parameter, 1 disables it. (Default: 1.0f)
+     * @property repeatPenalty Penalty applied to the tokens present in the last [penaltyLastN]
+     *   tokens, 1 disables it. (Default: 1.0f)
+     * @property presencePenalty Penalty subtracted from the logits of the tokens present in the last
+     *   [penaltyLastN] tokens, 0 disables it. (Default: 0.0f)
+     * @property penaltyLastN The number of last tokens considered for the penalties, -1 for the
+     *   context size. (Default: 64)
+     * @property dryMultiplier Multiplier of the DRY (Don't Repeat Yourself) penalty for tokens that
+     *   extend a repeated sequence, 0 disables DRY. (Default: 0.0f)
+     * @property dryBase The base of the DRY penalty, that grows exponentially with the length of the
+     *   repeated sequence. (Default: 1.75f)
+     * @property dryAllowedLength Repeated sequences up to this length are not penalized by DRY.
+     *   (Default: 2)
+     * @property dryPenaltyLastN The number of last tokens scanned for repetitions by DRY, -1 for the
+     *   context size. (Default: -1)
+     * @property seed The seed for sampling, -1 for a random seed. (Default: -1)
+     * @property contextShift Whether the oldest turns of the conversation are evicted from the
+     *   context when it is full, so that the generation continues without decoding the retained
+     *   tokens again. If false, an [IllegalStateException] is thrown once the context is full.
+     *   (Default: true)
+     * @property numSinkTokens The number of tokens at the start of the context that are never
+     *   evicted, in addition to the system prompt, which serve as attention sinks. Only used when
+     *   the oldest turns cannot be evicted whole, evicting whole turns keeps the system prompt
+     *   alone. (Default: 4)
+     * @property keyCacheType The data type of the keys in the KV cache. [KVCacheType.Q8_0] halves
+     *   the size of the cache compared with [KVCacheType.F16]. (Default: F16)
+     * @property valueCacheType The data type of the values in the KV cache. Quantized types require
+     *   flash-attention. (Default: F16)
+     * @property flashAttention Whether flash-attention is used, null to enable it where it is
+     *   supported. (Default: null)
+     * @property kvCacheMemoryBudget If greater than 0, the maximum size (in bytes) of the KV cache.
+     *   The context size is reduced to the largest size whose KV cache fits in the budget,
+     *   computed from the number of layers and key/value heads of the model. The context size used
+     *   is returned by [getContextSize]. (Default: 0)
+     * @property prefetchWeights Whether the weights are read into memory layer by layer before the
+     *   model is loaded, when [useMmap] is true. Otherwise, the pages of the mapped weights are read
+     *   from storage on the first query, which delays its first token. Skipped for models larger
+     *   than half of the device memory. (Default: false)
+     * @property warmup Whether a token is decoded before [load] returns, so that the first query
+     *   does not pay for the first-time setup of the compute graph and backends. (Default: false)
+     * @property stopSequences Strings that complete a response when they are generated, see
+     *   [setStopSequences]. (Default: empty)
      */
     data class InferenceParams(
         val minP: Float = 0.1f,
@@ -161,6 +285,83 @@ class SmolLM {
         val numThreads: Int = 4,
         val useMmap: Boolean = true,
         val useMlock: Boolean = false,
+        val batchSize: Int = 512,
+        val microBatchSize: Int = 512,
+        val draftModelPath: String? = null,
+        val numDraftTokens: Int = 8,
+        val promptLookupNgramSize: Int = 0,
+        val numParallelSequences: Int = 0,
+        val topK: Int = 40,
+        val topP: Float = 1.0f,
+        val typicalP: Float = 1.0f,
+        val repeatPenalty: Float = 1.0f,
+        val presencePenalty: Float = 0.0f,
+        val penaltyLastN: Int = 64,
+        val dryMultiplier: Float = 0.0f,
+        val dryBase: Float = 1.75f,
+        val dryAllowedLength: Int = 2,
+        val dryPenaltyLastN: Int = -1,
+        val seed: Int = -1,
+        val contextShift: Boolean = true,
+        val numSinkTokens: Int = 4,
+        val keyCacheType: KVCacheType = KVCacheType.F16,
+        val valueCacheType: KVCacheType = KVCacheType.F16,
+        val flashAttention: Boolean? = null,
+        val kvCacheMemoryBudget: Long = 0L,
+        val prefetchWeights: Boolean = false,
+        val warmup: Boolean = false,
+        val stopSequences: List<String> = emptyList(),
+    )
+
+    /**
+     * Constrains the tokens of a response. Compiled grammars are cached by the native library, so
+     * repeated responses with the same constraint do not parse it again.
+     */
+    sealed class ResponseConstraint {
+        /** The response follows the GBNF grammar [gbnf], starting with its `root` rule */
+        data class Grammar(val gbnf: String) : ResponseConstraint()
+
+        /** The response is a JSON value that is valid against the JSON schema [schema] */
+        data class JsonSchema(val schema: String) : ResponseConstraint()
+    }
+
+    /**
+     * Latency distribution of a stage of the inference pipeline, in microseconds. The percentiles
+     * are read from a histogram and are at most 25% above the exact values.
+     */
+    data class StageMetrics(
+        val count: Long,
+        val totalMicros: Long,
+        val maxMicros: Long,
+        val p50Micros: Long,
+        val p95Micros: Long,
+        val p99Micros: Long,
+    )
+
+    /**
+     * Per-stage latencies and token counts of the responses generated since the model was loaded
+     * or [resetMetrics] was called, see [getMetrics]
+     *
+     * @property template Rendering the chat template for the prompt
+     * @property tokenize Tokenizing the rendered prompt
+     * @property prefill Decoding a chunk of the prompt
+     * @property decode Decoding a generated token (or a speculative or session batch)
+     * @property sample Sampling a token from the logits
+     * @property detokenize Converting a sampled token to text
+     * @property prefillTokens Tokens of the prompts decoded, excluding those reused from the KV cache
+     * @property generatedTokens Tokens of the responses
+     * @property decodedTokens Tokens decoded by the model, including the prompts and verified drafts
+     */
+    data class InferenceMetrics(
+        val template: StageMetrics,
+        val tokenize: StageMetrics,
+        val prefill: StageMetrics,
+        val decode: StageMetrics,
+        val sample: StageMetrics,
+        val detokenize: StageMetrics,
+        val prefillTokens: Long,
+        val generatedTokens: Long,
+        val decodedTokens: Long,
     )
 
     /**
@@ -173,10 +374,16 @@ class SmolLM {
      *   If `contextSize` or `chatTemplate` are not provided in `params`, the values from the GGUF
      *   model file will be used. If those are also not available in the model file, then default
      *   values from [DefaultInferenceParams] will be used.
+     * @param onProgress Called on the loading thread with the current [LoadStage] and the fraction
+     *   of the stage completed. Cancelling the coroutine cancels the loading.
      * @return `true` if the model was loaded successfully, `false` otherwise.
      * @throws FileNotFoundException if the model file is not found at the given path.
      */
-    suspend fun load(modelPath: String, params: InferenceParams = InferenceParams()) =
+    suspend fun load(
+        modelPath: String,
+        params: InferenceParams = InferenceParams(),
+        onProgress: ((LoadStage, Float) -> Unit)? = null,
+    ) =
         withContext(Dispatchers.IO) {
             val ggufReader = GGUFReader()
             ggufReader.load(modelPath)
@@ -184,17 +391,72 @@ class SmolLM {
             val modelChatTemplate =
                 ggufReader.getChatTemplate() ?: DefaultInferenceParams.chatTemplate
             nativePtr =
-                loadModel(
-                    modelPath,
-                    params.minP,
-                    params.temperature,
-                    params.storeChats,
-                    params.contextSize ?: modelContextSize,
-                    params.chatTemplate ?: modelChatTemplate,
+                try {
+                    loadModel(
+                        modelPath,
+                        params.minP,
+                        params.temperature,
+                        params.storeChats,
+                        params.contextSize ?: modelContextSize,
+                        params.chatTemplate ?: modelChatTemplate,
+                        params.numThreads,
+                        params.useMmap,
+                        params.useMlock,
+                        params.batchSize,
+                        params.microBatchSize,
+                        params.numParallelSequences,
+                        params.topK,
+                        params.topP,
+                        params.typicalP,
+                        params.repeatPenalty,
+                        params.presencePenalty,
+                        params.penaltyLastN,
+                        params.dryMultiplier,
+                        params.dryBase,
+                        params.dryAllowedLength,
+                        params.dryPenaltyLastN,
+                        params.seed,
+                        if (params.contextShift) params.numSinkTokens else -1,
+                        params.keyCacheType.ggmlType,
+                        params.valueCacheType.ggmlType,
+                        when (params.flashAttention) {
+                            null -> -1
+                            true -> 1
+                            false -> 0
+                        },
+                        params.kvCacheMemoryBudget,
+                        params.prefetchWeights,
+                        params.warmup,
+                        object : LoadProgressCallback {
+                            override fun onProgress(stage: Int, progress: Float): Boolean {
+                                onProgress?.invoke(LoadStage.entries[stage], progress)
+                                return isActive
+                            }
+                        },
+                    )
+                } catch (e: IllegalStateException) {
+                    // thrown if the callback cancelled the loading
+                    ensureActive()
+                    throw e
+                }
+            if (params.draftModelPath != null) {
+                loadDraftModel(
+                    nativePtr,
+                    params.draftModelPath,
+                    params.numDraftTokens,
                     params.numThreads,
-                    params.useMmap,
-                    params.useMlock,
                 )
+            }
+            if (params.promptLookupNgramSize > 0) {
+                enablePromptLookupDecoding(
+                    nativePtr,
+                    params.promptLookupNgramSize,
+                    params.numDraftTokens,
+                )
+            }
+            if (params.stopSequences.isNotEmpty()) {
+                setStopSequences(nativePtr, params.stopSequences.toTypedArray())
+            }
         }
 
     /**
@@ -224,6 +486,17 @@ class SmolLM {
         addChatMessage(nativePtr, message, "assistant")
     }
 
+    /**
+     * Sets the strings that complete a response when they are generated, for the responses of the
+     * conversation and of the [Session]s started after this call. The stop sequence is not included
+     * in the response: text that may be the start of a stop sequence is held back until the
+     * sequence is completed or ruled out. An empty list removes the stop sequences.
+     */
+    fun setStopSequences(stopSequences: List<String>) {
+        verifyHandle()
+        setStopSequences(nativePtr, stopSequences.toTypedArray())
+    }
+
     /**
      * Returns the rate (in tokens per second) at which the LLM generated its last response via
      * `getResponse()`
@@ -233,20 +506,120 @@ class SmolLM {
         return getResponseGenerationSpeed(nativePtr)
     }
 
+    /**
+     * Returns the fraction of tokens proposed by the draft model (or the n-gram lookup) that were
+     * accepted by the model, accumulated since the model was loaded. With speculative decoding, the
+     * rate returned by [getResponseGenerationSpeed] is the effective generation speed. Returns 0 if
+     * speculative decoding is disabled.
+     */
+    fun getDraftAcceptanceRate(): Float {
+        verifyHandle()
+        return getDraftAcceptanceRate(nativePtr)
+    }
+
     /**
      * Returns the number of tokens consumed by the LLM's context window The context of the LLM is
-     * roughly the output of, tokenize(apply_chat_template(messages_in_conversation))
+     * roughly the output of, tokenize(apply_chat_template(messages_in_conversation)). Tokens
+     * evicted from the context (see [InferenceParams.contextShift]) are not included.
      */
     fun getContextLengthUsed(): Int {
         verifyHandle()
         return getContextSizeUsed(nativePtr)
     }
 
+    /**
+     * Returns the context size (in tokens) of the model, which may be smaller than the requested
+     * size if [InferenceParams.kvCacheMemoryBudget] is set
+     */
+    fun getContextSize(): Long {
+        verifyHandle()
+        return getContextSize(nativePtr)
+    }
+
+    /**
+     * Returns the number of tokens of the conversation evicted from the context to make room for
+     * new tokens, see [InferenceParams.contextShift]
+     */
+    fun getNumEvictedTokens(): Long {
+        verifyHandle()
+        return getNumEvictedTokens(nativePtr)
+    }
+
+    /**
+     * Returns the number of prompt tokens of the last query whose key/value pairs were reused from
+     * the KV cache of the previous query, instead of being decoded again
+     */
+    fun getNumReusedTokens(): Int {
+        verifyHandle()
+        return getNumReusedTokens(nativePtr)
+    }
+
+    /**
+     * Returns the latency histograms of each stage of the pipeline and the token counts, accumulated
+     * since the model was loaded or [resetMetrics] was called. The metrics are always recorded and
+     * can be read while a response is being generated.
+     */
+    fun getMetrics(): InferenceMetrics {
+        verifyHandle()
+        val values = getMetrics(nativePtr)
+        val stages =
+            List(6) { i ->
+                val offset = i * 6
+                StageMetrics(
+                    values[offset],
+                    values[offset + 1],
+                    values[offset + 2],
+                    values[offset + 3],
+                    values[offset + 4],
+                    values[offset + 5],
+                )
+            }
+        return InferenceMetrics(
+            stages[0],
+            stages[1],
+            stages[2],
+            stages[3],
+            stages[4],
+            stages[5],
+            prefillTokens = values[36],
+            generatedTokens = values[37],
+            decodedTokens = values[38],
+        )
+    }
+
+    /** Clears the metrics returned by [getMetrics] and the recorded trace events */
+    fun resetMetrics() {
+        verifyHandle()
+        resetMetrics(nativePtr)
+    }
+
+    /**
+     * Records every timed stage as a trace event (up to the last 100000 events) if [enabled], which
+     * can be written with [dumpTrace]. Disabling tracing discards the recorded events.
+     */
+    fun setTraceEnabled(enabled: Boolean) {
+        verifyHandle()
+        setTraceEnabled(nativePtr, enabled)
+    }
+
+    /**
+     * Writes the recorded trace events to [path] in the Chrome trace format (JSON), which can be
+     * opened in Perfetto or chrome://tracing for offline analysis
+     */
+    suspend fun dumpTrace(path: String) =
+        withContext(Dispatchers.IO) {
+            verifyHandle()
+            dumpTrace(nativePtr, path)
+        }
+
     /**
      * Return the LLM response to the given query as an async Flow. This is useful for streaming the
      * response as it is generated by the LLM.
      *
      * @param query The query to ask the LLM.
+     * @param onPrefillProgress Invoked after each chunk of the prompt is decoded, with the fraction
+     *   of the prompt decoded so far. The flow can be cancelled between chunks.
+     * @param constraint If not null, the response is constrained to the grammar or JSON schema.
      * @return A Flow of Strings, where each String is a piece of the response. The flow completes
      *   when the LLM has finished generating the response. The special token "[EOG]" (End Of
      *   Generation) indicates the end of the response.
@@ -256,9 +629,19 @@ class SmolLM {
     var usedJinjaTemplate: Boolean = true
         private set
 
-    fun getResponseAsFlow(query: String): Flow<String> = flow {
+    fun getResponseAsFlow(
+        query: String,
+        onPrefillProgress: ((Float) -> Unit)? = null,
+        constraint: ResponseConstraint? = null,
+    ): Flow<String> = flow {
         verifyHandle()
-        usedJinjaTemplate = startCompletion(nativePtr, query)
+        usedJinjaTemplate = startCompletion(query, constraint)
+        var progress = 0f
+        while (progress < 1f) {
+            currentCoroutineContext().ensureActive()
+            progress = prefill(nativePtr)
+            onPrefillProgress?.invoke(progress)
+        }
         var piece = completionLoop(nativePtr)
         while (piece != "[EOG]") {
             emit(piece)
@@ -267,17 +650,163 @@ class SmolLM {
         stopCompletion(nativePtr)
     }
 
+    /**
+     * Return the LLM response to the given query as an async Flow, like [getResponseAsFlow], but the
+     * decode/sample loop runs on a native thread and the response is delivered in chunks of
+     * multiple tokens, which reduces the JNI calls and String allocations per token.
+     *
+     * @param query The query to ask the LLM.
+     * @param maxTokens The maximum number of tokens to generate, or -1 for no limit.
+     * @param maxTimeMillis The maximum duration (in milliseconds) of the generation, including the
+     *   prefill of the prompt, or -1 for no limit. The response generated so far is kept.
+     * @param flushTokens The number of tokens coalesced into a single chunk.
+     * @param flushIntervalMillis The maximum duration (in milliseconds) for which generated text is
+     *   held before being emitted, even if fewer than [flushTokens] tokens were generated.
+     * @param constraint If not null, the response is constrained to the grammar or JSON schema.
+     * @return A Flow of Strings, where each String is a chunk of the response. The flow completes
+     *   when the LLM has finished generating the response. Cancelling the flow stops the
+     *   generation after the current token.
+     * @throws IllegalStateException if the model is not loaded.
+     */
+    fun getResponseAsChunkedFlow(
+        query: String,
+        maxTokens: Int = -1,
+        maxTimeMillis: Int = -1,
+        flushTokens: Int = 8,
+        flushIntervalMillis: Int = 50,
+        constraint: ResponseConstraint? = null,
+    ): Flow<String> = callbackFlow {
+        verifyHandle()
+        usedJinjaTemplate = startCompletion(query, constraint)
+        val buffer = ByteBuffer.allocateDirect(GENERATION_BUFFER_SIZE)
+        generate(
+            nativePtr,
+            maxTokens,
+            maxTimeMillis,
+            flushTokens,
+            flushIntervalMillis,
+            buffer,
+            sendingGenerationCallback(buffer),
+        )
+        awaitClose { cancelGeneration(nativePtr) }
+    }
+
+    /**
+     * Returns a [GenerationCallback] that decodes the chunks written to [buffer] and sends them to
+     * the flow, closing it when the generation completes
+     */
+    private fun ProducerScope<String>.sendingGenerationCallback(buffer: ByteBuffer) =
+        object : GenerationCallback {
+            override fun onText(length: Int) {
+                buffer.position(0)
+                buffer.limit(length)
+                val chunk = Charsets.UTF_8.decode(buffer).toString()
+                buffer.clear()
+                trySendBlocking(chunk)
+            }
+
+            override fun onComplete(error: String?) {
+                if (error == null) {
+                    close()
+                } else {
+                    close(IllegalStateException(error))
+                }
+            }
+        }
+
+    /**
+     * A conversation with its own messages, sampler and sequence in the context of the model,
+     * created with [createSession]. The responses of all sessions are generated concurrently: a
+     * native scheduler decodes the next token of every active session (and chunks of their
+     * prompts) in a single batch, so that serving N sessions costs far less than N separate
+     * decodes. The main conversation of [SmolLM] is not affected by the sessions.
+     */
+    inner class Session internal constructor(private val sessionId: Int) : AutoCloseable {
+        /** Adds a user message to the messages of the session */
+        fun addUserMessage(message: String) {
+            verifyHandle()
+            addSessionMessage(nativePtr, sessionId, message, "user")
+        }
+
+        /** Adds the system prompt for the session */
+        fun addSystemPrompt(prompt: String) {
+            verifyHandle()
+            addSessionMessage(nativePtr, sessionId, prompt, "system")
+        }
+
+        /** Adds an assistant message (a previous response) to the messages of the session */
+        fun addAssistantMessage(message: String) {
+            verifyHandle()
+            addSessionMessage(nativePtr, sessionId, message, "assistant")
+        }
+
+        /**
+         * Returns the LLM response to the given query as an async Flow. The text is emitted from
+         * the native scheduler thread as it is generated, and the response is added to the
+         * messages of the session once the flow completes. Cancelling the flow stops the
+         * generation after the current batch.
+         *
+         * @param query The query to ask the LLM.
+         * @param maxTokens The maximum number of tokens to generate, or -1 for no limit.
+         * @param maxTimeMillis The maximum duration (in milliseconds) of the generation, including
+         *   the prefill of the prompt, or -1 for no limit.
+         * @throws IllegalStateException if the session is already generating a response.
+         */
+        fun getResponseAsFlow(
+            query: String,
+            maxTokens: Int = -1,
+            maxTimeMillis: Int = -1,
+        ): Flow<String> = callbackFlow {
+            verifyHandle()
+            val buffer = ByteBuffer.allocateDirect(GENERATION_BUFFER_SIZE)
+            startSessionCompletion(
+                nativePtr,
+                sessionId,
+                query,
+                maxTokens,
+                maxTimeMillis,
+                buffer,
+                sendingGenerationCallback(buffer),
+            )
+            awaitClose { cancelSession(nativePtr, sessionId) }
+        }
+
+        /** Returns the rate (in tokens per second) at which the last response was generated */
+        fun getResponseGenerationSpeed(): Float {
+            verifyHandle()
+            return getSessionGenerationSpeed(nativePtr, sessionId)
+        }
+
+        /** Removes the session and its tokens from the context of the model */
+        override fun close() {
+            if (nativePtr != 0L) {
+                closeSession(nativePtr, sessionId)
+            }
+        }
+    }
+
+    /**
+     * Creates a [Session] that is decoded in parallel with other sessions.
+     *
+     * @throws IllegalStateException if [InferenceParams.numParallelSequences] sessions are open.
+     */
+    fun createSession(): Session {
+        verifyHandle()
+        return Session(createSession(nativePtr))
+    }
+
     /**
      * Returns the LLM response to the given query as a String. This function is blocking and will
      * return the complete response.
      *
      * @param query The user's query/prompt for the LLM.
+     * @param constraint If not null, the response is constrained to the grammar or JSON schema.
      * @return The complete response from the LLM.
      * @throws IllegalStateException if the model is not loaded.
      */
-    fun getResponse(query: String): String {
+    fun getResponse(query: String, constraint: ResponseConstraint? = null): String {
         verifyHandle()
-        usedJinjaTemplate = startCompletion(nativePtr, query)
+        usedJinjaTemplate = startCompletion(query, constraint)
         var piece = completionLoop(nativePtr)
         var response = ""
         while (piece != "[EOG]") {
@@ -288,6 +817,36 @@ class SmolLM {
         return response
     }
 
+    /**
+     * Saves the state of the conversation (the KV cache and the tokens it holds) to a snapshot file
+     * in [dirPath]. Snapshots are keyed by the model and the tokens of the conversation; older
+     * snapshots that are a prefix of the new one, and the least-recently used snapshots beyond a
+     * fixed count, are deleted.
+     *
+     * @param dirPath The directory where snapshots are stored.
+     * @return The path of the snapshot file, or an empty string if the KV cache is empty.
+     */
+    suspend fun saveSnapshot(dirPath: String): String =
+        withContext(Dispatchers.IO) {
+            verifyHandle()
+            saveSnapshot(nativePtr, dirPath)
+        }
+
+    /**
+     * Restores the snapshot in [dirPath] that shares the longest prefix with the messages added to
+     * the conversation so far. The restored tokens are not decoded again by the next query, which
+     * skips the prefill for a resumed chat, or for a system prompt shared with a previously saved
+     * chat. This should be called after the messages of the conversation have been added.
+     *
+     * @param dirPath The directory where snapshots are stored.
+     * @return The number of tokens restored, 0 if no snapshot matches the conversation.
+     */
+    suspend fun restoreSnapshot(dirPath: String): Int =
+        withContext(Dispatchers.IO) {
+            verifyHandle()
+            restoreSnapshot(nativePtr, dirPath)
+        }
+
     /**
      * Executes the model and returns a string containing the tok/sec taken by the model to process
      * tokens (tg) and the prompt (pp)
@@ -304,6 +863,19 @@ class SmolLM {
         return benchModel(nativePtr, pp, tg, pl, nr)
     }
 
+    /**
+     * Measures the time taken by the configured sampler chain to sample a token from [nVocab]
+     * random logits, compared with a chain that samples from the full vocabulary
+     *
+     * @param nVocab The size of the vocabulary.
+     * @param nIterations The number of tokens sampled.
+     * @return A markdown table with the average time (in microseconds) per token for both chains.
+     */
+    fun benchSampler(nVocab: Int, nIterations: Int): String {
+        verifyHandle()
+        return benchSampler(nativePtr, nVocab, nIterations)
+    }
+
     /**
      * Unloads the LLM model and releases resources. This method should be called when the SmolLM
      * instance is no longer needed to prevent memory leaks.
@@ -315,6 +887,13 @@ class SmolLM {
         }
     }
 
+    private fun startCompletion(query: String, constraint: ResponseConstraint?): Boolean =
+        when (constraint) {
+            null -> startCompletion(nativePtr, query, null, false)
+            is ResponseConstraint.Grammar -> startCompletion(nativePtr, query, constraint.gbnf, false)
+            is ResponseConstraint.JsonSchema -> startCompletion(nativePtr, query, constraint.schema, true)
+        }
+
     private fun verifyHandle() {
         assert(nativePtr != 0L) { "Model is not loaded. Use SmolLM.create to load the model" }
     }
@@ -329,22 +908,121 @@ class SmolLM {
         nThreads: Int,
         useMmap: Boolean,
         useMlock: Boolean,
+        nBatch: Int,
+        nUBatch: Int,
+        nParallel: Int,
+        topK: Int,
+        topP: Float,
+        typicalP: Float,
+        repeatPenalty: Float,
+        presencePenalty: Float,
+        penaltyLastN: Int,
+        dryMultiplier: Float,
+        dryBase: Float,
+        dryAllowedLength: Int,
+        dryPenaltyLastN: Int,
+        seed: Int,
+        nSinkTokens: Int,
+        typeK: Int,
+        typeV: Int,
+        flashAttn: Int,
+        kvMemoryBudget: Long,
+        prefetch: Boolean,
+        warmup: Boolean,
+        progressCallback: LoadProgressCallback,
     ): Long
 
+    private external fun loadDraftModel(
+        modelPtr: Long,
+        modelPath: String,
+        nDraft: Int,
+        nThreads: Int,
+    )
+
+    private external fun enablePromptLookupDecoding(modelPtr: Long, ngramSize: Int, nDraft: Int)
+
     private external fun addChatMessage(modelPtr: Long, message: String, role: String)
 
     private external fun getResponseGenerationSpeed(modelPtr: Long): Float
 
+    private external fun getDraftAcceptanceRate(modelPtr: Long): Float
+
     private external fun getContextSizeUsed(modelPtr: Long): Int
 
+    private external fun getNumReusedTokens(modelPtr: Long): Int
+
+    private external fun getNumEvictedTokens(modelPtr: Long): Long
+
+    private external fun getContextSize(modelPtr: Long): Long
+
+    private external fun getMetrics(modelPtr: Long): LongArray
+
+    private external fun resetMetrics(modelPtr: Long)
+
+    private external fun setTraceEnabled(modelPtr: Long, enabled: Boolean)
+
+    private external fun dumpTrace(modelPtr: Long, path: String)
+
     private external fun close(modelPtr: Long)
 
     // Returns true if Jinja template was used, false if legacy fallback was needed.
-    private external fun startCompletion(modelPtr: Long, prompt: String): Boolean
+    private external fun startCompletion(
+        modelPtr: Long,
+        prompt: String,
+        grammar: String?,
+        isJsonSchema: Boolean,
+    ): Boolean
+
+    private external fun prefill(modelPtr: Long): Float
 
     private external fun completionLoop(modelPtr: Long): String
 
+    private external fun generate(
+        modelPtr: Long,
+        maxTokens: Int,
+        maxTimeMs: Int,
+        flushTokens: Int,
+        flushIntervalMs: Int,
+        buffer: ByteBuffer,
+        callback: GenerationCallback,
+    )
+
+    private external fun cancelGeneration(modelPtr: Long)
+
     private external fun stopCompletion(modelPtr: Long)
 
+    private external fun setStopSequences(modelPtr: Long, stopSequences: Array<String>)
+
+    private external fun saveSnapshot(modelPtr: Long, dirPath: String): String
+
+    private external fun restoreSnapshot(modelPtr: Long, dirPath: String): Int
+
     private external fun benchModel(modelPtr: Long, pp: Int, tg: Int, pl: Int, nr: Int): String
+
+    private external fun benchSampler(modelPtr: Long, nVocab: Int, nIterations: Int): String
+
+    private external fun createSession(modelPtr: Long): Int
+
+    private external fun addSessionMessage(
+        modelPtr: Long,
+        sessionId: Int,
+        message: String,
+        role: String,
+    )
+
+    private external fun startSessionCompletion(
+        modelPtr: Long,
+        sessionId: Int,
+        query: String,
+        maxTokens: Int,
+        maxTimeMs: Int,
+        buffer: ByteBuffer,
+        callback: GenerationCallback,
+    )
+
+    private external fun cancelSession(modelPtr: Long, sessionId: Int)
+
+    private external fun getSessionGenerationSpeed(modelPtr: Long, sessionId: Int): Float
+
+    private external fun closeSession(modelPtr: Long, sessionId: Int)
 }
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+// `count` vectors of `dim` floats from a standard normal distribution
+inline std::vector<float>
+randomVectors(size_t count, size_t dim, unsigned int seed) {
+    std::mt19937                    rng(seed);
+    std::normal_distribution<float> dist;
+    std::vector<float>              vectors(count * dim);
+    std::generate(vectors.begin(), vectors.end(), [&] { return dist(rng); });
+    return vectors;
+}
+
+// Sentence embeddings are far from uniform, sample them around a few hundred topics
+inline std::vector<float>
+clusteredVectors(size_t count, size_t dim, unsigned int seed) {
+    std::mt19937                    rng(seed);
+    std::normal_distribution<float> dist;
+    std::vector<float>              centroids(256 * dim);
+    std::mt19937                    centroidRng(1234);
+    for (float& value : centroids) {
+        value = dist(centroidRng);
+    }
+    std::uniform_int_distribution<size_t> topic(0, 255);
+    std::vector<float>                    vectors(count * dim);
+    for (size_t i = 0; i < count; i++) {
+        const float* centroid = centroids.data() + topic(rng) * dim;
+        for (size_t j = 0; j < dim; j++) {
+            vectors[i * dim + j] = centroid[j] + 0.75f * dist(rng);
+        }
+    }
+    return vectors;
+}
@@ -0,0 +1,85 @@
+// Measures recall@k and queries/sec of the HNSW index for several efSearch
+// values, with the exhaustive (flat) search as ground truth and baseline.
+#include "VectorDB.h"
+#include "datasets.h"
+#include <benchmark/benchmark.h>
+#include <map>
+#include <memory>
+#include <unordered_set>
+
+static constexpr int    kTopK       = 10;
+static constexpr size_t kDim        = 384;
+static constexpr size_t kNumQueries = 200;
+
+struct Dataset {
+    std::unique_ptr<VectorDB>                 db;
+    std::vector<float>                        queries;
+    std::vector<std::unordered_set<uint32_t>> groundTruth;
+};
+
+// databases are built once per configuration and shared by the benchmarks
+static Dataset&
+getDataset(size_t numRecords, VectorDBIndexType indexType) {
+    static std::map<std::pair<size_t, VectorDBIndexType>, Dataset> datasets;
+    auto                                                           it = datasets.find({ numRecords, indexType });
+    if (it != datasets.end()) {
+        return it->second;
+    }
+    Dataset& dataset = datasets[{ numRecords, indexType }];
+    dataset.db       = std::make_unique<VectorDB>(kDim, indexType);
+    std::vector<float> embeddings = clusteredVectors(numRecords, kDim, 42);
+    for (size_t i = 0; i < numRecords; i++) {
+        dataset.db->insertRecord("", embeddings.data() + i * kDim, kDim);
+    }
+    dataset.queries = clusteredVectors(kNumQueries, kDim, 7);
+    std::vector<VectorDBResult> results;
+    for (size_t q = 0; q < kNumQueries; q++) {
+        dataset.db->exactNearestNeighbor(dataset.queries.data() + q * kDim, kDim, kTopK, results);
+        std::unordered_set<uint32_t> ids;
+        for (const VectorDBResult& result : results) {
+            ids.insert(result.id);
+        }
+        dataset.groundTruth.push_back(std::move(ids));
+    }
+    return dataset;
+}
+
+static void
+runQueries(benchmark::State& state, Dataset& dataset) {
+    std::vector<VectorDBResult> results;
+    size_t                      q = 0, found = 0, total = 0;
+    for (auto _ : state) {
+        size_t queryIndex = q++ % kNumQueries;
+        dataset.db->nearestNeighbor(dataset.queries.data() + queryIndex * kDim, kDim, kTopK, results);
+        state.PauseTiming();
+        for (const VectorDBResult& result : results) {
+            found += dataset.groundTruth[queryIndex].count(result.id);
+        }
+        total += kTopK;
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["recall@10"] = static_cast<double>(found) / total;
+}
+
+static void
+BM_Flat(benchmark::State& state) {
+    runQueries(state, getDataset(state.range(0), VectorDBIndexType::Flat));
+}
+
+static void
+BM_HNSW(benchmark::State& state) {
+    Dataset& dataset = getDataset(state.range(0), VectorDBIndexType::HNSW);
+    dataset.db->setEfSearch(state.range(1));
+    runQueries(state, dataset);
+}
+
+// records, items_per_second is the number of queries/sec
+BENCHMARK(BM_Flat)->Arg(10000)->Arg(100000)->Unit(benchmark::kMicrosecond);
+
+// records x efSearch
+BENCHMARK(BM_HNSW)
+    ->ArgsProduct({ { 10000, 100000 }, { 16, 32, 64, 128, 256 } })
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,92 @@
+// Measures the time to get a queryable database: opening a database file (memory-mapped,
+// no per-record work) against re-inserting every record into an in-memory database, which
+// is what the app had to do on every launch before databases could be persisted.
+#include "VectorDB.h"
+#include "datasets.h"
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <set>
+#include <string>
+
+static constexpr size_t kDim = 384;
+
+static const std::vector<float>&
+getEmbeddings(size_t numRecords) {
+    static std::vector<float> embeddings;
+    if (embeddings.size() < numRecords * kDim) {
+        embeddings = clusteredVectors(numRecords, kDim, 42);
+    }
+    return embeddings;
+}
+
+// the database file is written once per size and index type
+static std::string
+getDatabaseFile(size_t numRecords, VectorDBIndexType indexType) {
+    std::string path = "/tmp/smolvectordb_bench_" + std::to_string(numRecords) + "_" +
+                       std::to_string(static_cast<int>(indexType)) + ".smolvdb";
+    static std::set<std::string> written;
+    if (written.insert(path).second) {
+        std::remove(path.c_str());
+        const std::vector<float>& embeddings = getEmbeddings(numRecords);
+        VectorDB                  db(kDim, indexType, HNSWParams{}, QuantizationParams{}, path);
+        for (size_t i = 0; i < numRecords; i++) {
+            db.insertRecord("record " + std::to_string(i), embeddings.data() + i * kDim, kDim);
+        }
+    }
+    return path;
+}
+
+static void
+BM_Reinsert(benchmark::State& state) {
+    size_t                    numRecords = static_cast<size_t>(state.range(0));
+    auto                      indexType  = static_cast<VectorDBIndexType>(state.range(1));
+    const std::vector<float>& embeddings = getEmbeddings(numRecords);
+    for (auto _ : state) {
+        VectorDB db(kDim, indexType);
+        for (size_t i = 0; i < numRecords; i++) {
+            db.insertRecord("record " + std::to_string(i), embeddings.data() + i * kDim, kDim);
+        }
+        benchmark::DoNotOptimize(db.size());
+    }
+}
+
+static void
+BM_OpenFile(benchmark::State& state) {
+    size_t      numRecords = static_cast<size_t>(state.range(0));
+    auto        indexType  = static_cast<VectorDBIndexType>(state.range(1));
+    std::string path       = getDatabaseFile(numRecords, indexType);
+    for (auto _ : state) {
+        VectorDB db(0, indexType, HNSWParams{}, QuantizationParams{}, path);
+        benchmark::DoNotOptimize(db.size());
+    }
+}
+
+// the first query after opening, which faults in the pages of the file
+static void
+BM_OpenFileAndQuery(benchmark::State& state) {
+    size_t                      numRecords = static_cast<size_t>(state.range(0));
+    auto                        indexType  = static_cast<VectorDBIndexType>(state.range(1));
+    std::string                 path       = getDatabaseFile(numRecords, indexType);
+    std::vector<float>          query      = clusteredVectors(1, kDim, 7);
+    std::vector<VectorDBResult> results;
+    for (auto _ : state) {
+        VectorDB db(0, indexType, HNSWParams{}, QuantizationParams{}, path);
+        db.nearestNeighbor(query.data(), kDim, 10, results);
+        benchmark::DoNotOptimize(results.data());
+    }
+}
+
+static void
+databaseSizes(benchmark::internal::Benchmark* benchmark) {
+    for (int indexType : { static_cast<int>(VectorDBIndexType::Flat), static_cast<int>(VectorDBIndexType::HNSW) }) {
+        benchmark->Args({ 10000, indexType });
+    }
+    benchmark->Args({ 100000, static_cast<int>(VectorDBIndexType::Flat) });
+    benchmark->ArgNames({ "records", "hnsw" })->Unit(benchmark::kMillisecond);
+}
+
+BENCHMARK(BM_Reinsert)->Apply(databaseSizes)->Iterations(1);
+BENCHMARK(BM_OpenFile)->Apply(databaseSizes);
+BENCHMARK(BM_OpenFileAndQuery)->Apply(databaseSizes);
+
+BENCHMARK_MAIN();
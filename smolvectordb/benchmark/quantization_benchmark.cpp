@@ -0,0 +1,120 @@
+// Measures queries/sec, recall@k and embedding memory of int8 and binary
+// quantization with re-ranking, against float32 embeddings as ground truth.
+#include "VectorDB.h"
+#include "datasets.h"
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <unordered_set>
+
+static constexpr int    kTopK       = 10;
+static constexpr size_t kDim        = 384;
+static constexpr size_t kNumQueries = 200;
+
+struct Dataset {
+    std::vector<float>                        queries;
+    std::vector<std::unordered_set<uint32_t>> groundTruth;
+    size_t                                    float32Bytes = 0;
+};
+
+static Dataset&
+getDataset(size_t numRecords) {
+    static std::map<size_t, Dataset> datasets;
+    auto                             it = datasets.find(numRecords);
+    if (it != datasets.end()) {
+        return it->second;
+    }
+    Dataset&           dataset    = datasets[numRecords];
+    std::vector<float> embeddings = clusteredVectors(numRecords, kDim, 42);
+    VectorDB           db(kDim);
+    for (size_t i = 0; i < numRecords; i++) {
+        db.insertRecord("", embeddings.data() + i * kDim, kDim);
+    }
+    dataset.float32Bytes = db.getMemoryUsage();
+    dataset.queries      = clusteredVectors(kNumQueries, kDim, 7);
+    std::vector<VectorDBResult> results;
+    for (size_t q = 0; q < kNumQueries; q++) {
+        db.nearestNeighbor(dataset.queries.data() + q * kDim, kDim, kTopK, results);
+        std::unordered_set<uint32_t> ids;
+        for (const VectorDBResult& result : results) {
+            ids.insert(result.id);
+        }
+        dataset.groundTruth.push_back(std::move(ids));
+    }
+    return dataset;
+}
+
+// quantized databases are built once per configuration, the float32 embeddings go to a temporary file
+static VectorDB&
+getQuantizedDB(size_t numRecords, VectorDBQuantization quantization, int rerankFactor) {
+    static std::map<std::tuple<size_t, VectorDBQuantization>, std::unique_ptr<VectorDB>> databases;
+    auto& db = databases[{ numRecords, quantization }];
+    if (!db) {
+        QuantizationParams params;
+        params.type              = quantization;
+        params.fullPrecisionPath = "/tmp/smolvectordb_bench_" + std::to_string(numRecords) + "_" +
+                                   std::to_string(static_cast<int>(quantization)) + ".f32";
+        db = std::make_unique<VectorDB>(kDim, VectorDBIndexType::Flat, HNSWParams{}, params);
+        std::vector<float> embeddings = clusteredVectors(numRecords, kDim, 42);
+        for (size_t i = 0; i < numRecords; i++) {
+            db->insertRecord("", embeddings.data() + i * kDim, kDim);
+        }
+        std::remove(params.fullPrecisionPath.c_str());
+    }
+    // the file stays readable through the open descriptor, only the re-rank factor changes
+    db->setRerankFactor(rerankFactor);
+    return *db;
+}
+
+static void
+runQueries(benchmark::State& state, VectorDB& db, Dataset& dataset) {
+    std::vector<VectorDBResult> results;
+    size_t                      q = 0, found = 0, total = 0;
+    for (auto _ : state) {
+        size_t queryIndex = q++ % kNumQueries;
+        db.nearestNeighbor(dataset.queries.data() + queryIndex * kDim, kDim, kTopK, results);
+        state.PauseTiming();
+        for (const VectorDBResult& result : results) {
+            found += dataset.groundTruth[queryIndex].count(result.id);
+        }
+        total += kTopK;
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["recall@10"]   = static_cast<double>(found) / total;
+    state.counters["memory(MB)"]  = db.getMemoryUsage() / 1e6;
+    state.counters["compression"] = static_cast<double>(dataset.float32Bytes) / db.getMemoryUsage();
+}
+
+static void
+BM_Float32(benchmark::State& state) {
+    Dataset& dataset = getDataset(state.range(0));
+    VectorDB db(kDim);
+    std::vector<float> embeddings = clusteredVectors(state.range(0), kDim, 42);
+    for (size_t i = 0; i < static_cast<size_t>(state.range(0)); i++) {
+        db.insertRecord("", embeddings.data() + i * kDim, kDim);
+    }
+    runQueries(state, db, dataset);
+}
+
+static void
+BM_Int8(benchmark::State& state) {
+    runQueries(state, getQuantizedDB(state.range(0), VectorDBQuantization::Int8, state.range(1)),
+               getDataset(state.range(0)));
+}
+
+static void
+BM_Binary(benchmark::State& state) {
+    runQueries(state, getQuantizedDB(state.range(0), VectorDBQuantization::Binary, state.range(1)),
+               getDataset(state.range(0)));
+}
+
+// records (x re-rank factor), items_per_second is the number of queries/sec
+BENCHMARK(BM_Float32)->Arg(100000)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_Int8)->ArgsProduct({ { 100000 }, { 1, 2, 4 } })->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_Binary)->ArgsProduct({ { 100000 }, { 4, 8, 16, 32 } })->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,65 @@
+// Measures how an exhaustive search scales with the number of threads of the
+// VectorDB thread pool, for float32 and int8 embeddings and several corpus sizes.
+// Run on a device with as many cores as the largest thread count.
+#include "VectorDB.h"
+#include "datasets.h"
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <tuple>
+
+static constexpr int    kTopK = 10;
+static constexpr size_t kDim  = 384;
+
+// databases are built once per configuration
+static VectorDB&
+getDatabase(size_t numRecords, VectorDBQuantization quantization, size_t numThreads) {
+    static std::map<std::tuple<size_t, VectorDBQuantization, size_t>, std::unique_ptr<VectorDB>> databases;
+    auto& db = databases[{ numRecords, quantization, numThreads }];
+    if (!db) {
+        QuantizationParams params;
+        params.type              = quantization;
+        params.fullPrecisionPath = "/tmp/smolvectordb_threading_" + std::to_string(numRecords) + "_" +
+                                   std::to_string(numThreads) + ".f32";
+        db = std::make_unique<VectorDB>(kDim, VectorDBIndexType::Flat, HNSWParams{}, params, "", numThreads);
+        std::vector<float> embeddings = clusteredVectors(numRecords, kDim, 42);
+        for (size_t i = 0; i < numRecords; i++) {
+            db->insertRecord("", embeddings.data() + i * kDim, kDim);
+        }
+        // the file stays readable through the open descriptor
+        std::remove(params.fullPrecisionPath.c_str());
+    }
+    return *db;
+}
+
+static void
+BM_Search(benchmark::State& state) {
+    size_t                      numRecords   = static_cast<size_t>(state.range(0));
+    auto                        quantization = static_cast<VectorDBQuantization>(state.range(1));
+    size_t                      numThreads   = static_cast<size_t>(state.range(2));
+    VectorDB&                   db           = getDatabase(numRecords, quantization, numThreads);
+    std::vector<float>          queries      = clusteredVectors(16, kDim, 7);
+    std::vector<VectorDBResult> results;
+    size_t                      q = 0;
+    for (auto _ : state) {
+        db.nearestNeighbor(queries.data() + (q++ % 16) * kDim, kDim, kTopK, results);
+        benchmark::DoNotOptimize(results.data());
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["cores"] = static_cast<double>(std::thread::hardware_concurrency());
+}
+
+// records x quantization (0 = float32, 1 = int8) x threads, items_per_second is queries/sec
+BENCHMARK(BM_Search)
+    ->ArgsProduct({ { 10000, 100000, 1000000 },
+                    { static_cast<int>(VectorDBQuantization::None), static_cast<int>(VectorDBQuantization::Int8) },
+                    { 1, 2, 4, 8 } })
+    ->ArgNames({ "records", "int8", "threads" })
+    // the workers' time is not the calling thread's CPU time
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,185 @@
+// Measures queries/sec of VectorDB::nearestNeighbor against the original
+// array-of-records scalar loop, of batched queries, and the throughput of each
+// dot-product kernel.
+#include "VectorDB.h"
+#include "VectorKernels.h"
+#include "datasets.h"
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <cmath>
+#include <queue>
+
+static constexpr int kTopK = 10;
+
+// The previous implementation: array-of-records, single-accumulator scalar
+// dot product and a division by both magnitudes for every record
+class LegacyVectorDB {
+    struct Record {
+        std::string        text;
+        std::vector<float> embedding;
+        float              mag;
+    };
+    std::vector<Record> _records;
+    size_t              _dim;
+
+    static float
+    computeMagnitude(const float* vector, size_t dim) {
+        float vectorMag = 0.0f;
+        for (size_t i = 0; i < dim; i++) {
+            vectorMag += vector[i] * vector[i];
+        }
+        return sqrt(vectorMag);
+    }
+
+  public:
+    explicit LegacyVectorDB(size_t dim) : _dim(dim) {}
+
+    void
+    insertRecord(std::string text, const float* embedding) {
+        _records.push_back(
+            { std::move(text), std::vector<float>(embedding, embedding + _dim), computeMagnitude(embedding, _dim) });
+    }
+
+    std::vector<const Record*>
+    nearestNeighbor(const float* query, int k) {
+        float queryMag   = computeMagnitude(query, _dim);
+        auto  comparator = [](const std::pair<float, const Record*>& a, const std::pair<float, const Record*>& b) {
+            return a.first > b.first;
+        };
+        std::priority_queue<std::pair<float, const Record*>, std::vector<std::pair<float, const Record*>>,
+                            decltype(comparator)>
+            top_k(comparator);
+        for (const auto& record : _records) {
+            float dot_product = 0.0f;
+            for (size_t i = 0; i < _dim; i++) {
+                dot_product += query[i] * record.embedding[i];
+            }
+            float similarity = dot_product / (queryMag * record.mag);
+            if (top_k.size() < (size_t)k) {
+                top_k.push({ similarity, &record });
+            } else if (similarity > top_k.top().first) {
+                top_k.pop();
+                top_k.push({ similarity, &record });
+            }
+        }
+        std::vector<const Record*> result;
+        while (!top_k.empty()) {
+            result.push_back(top_k.top().second);
+            top_k.pop();
+        }
+        std::reverse(result.begin(), result.end());
+        return result;
+    }
+};
+
+static void
+populate(LegacyVectorDB& db, size_t numRecords, size_t dim) {
+    std::vector<float> embeddings = randomVectors(numRecords, dim, 42);
+    for (size_t i = 0; i < numRecords; i++) {
+        db.insertRecord("record " + std::to_string(i), embeddings.data() + i * dim);
+    }
+}
+
+static void
+populate(VectorDB& db, size_t numRecords, size_t dim) {
+    std::vector<float> embeddings = randomVectors(numRecords, dim, 42);
+    for (size_t i = 0; i < numRecords; i++) {
+        db.insertRecord("record " + std::to_string(i), embeddings.data() + i * dim, dim);
+    }
+}
+
+static void
+BM_LegacyNearestNeighbor(benchmark::State& state) {
+    size_t         numRecords = state.range(0);
+    size_t         dim        = state.range(1);
+    LegacyVectorDB db(dim);
+    populate(db, numRecords, dim);
+    std::vector<float> queries = randomVectors(16, dim, 7);
+    size_t             q       = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.nearestNeighbor(queries.data() + (q++ % 16) * dim, kTopK));
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["records/s"] =
+        benchmark::Counter(static_cast<double>(state.iterations() * numRecords), benchmark::Counter::kIsRate);
+}
+
+static void
+BM_NearestNeighbor(benchmark::State& state) {
+    size_t   numRecords = state.range(0);
+    size_t   dim        = state.range(1);
+    VectorDB db(dim);
+    populate(db, numRecords, dim);
+    std::vector<float>          queries = randomVectors(16, dim, 7);
+    std::vector<VectorDBResult> results;
+    size_t                      q = 0;
+    for (auto _ : state) {
+        db.nearestNeighbor(queries.data() + (q++ % 16) * dim, dim, kTopK, results);
+        benchmark::DoNotOptimize(results.data());
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["records/s"] =
+        benchmark::Counter(static_cast<double>(state.iterations() * numRecords), benchmark::Counter::kIsRate);
+    state.SetLabel(getVectorKernels().name);
+}
+
+// items_per_second is the number of queries/sec, compare with BM_NearestNeighbor
+static void
+BM_NearestNeighborBatch(benchmark::State& state) {
+    size_t   numRecords = state.range(0);
+    size_t   dim        = state.range(1);
+    size_t   numQueries = state.range(2);
+    VectorDB db(dim);
+    populate(db, numRecords, dim);
+    std::vector<float>          queries = randomVectors(numQueries, dim, 7);
+    std::vector<VectorDBResult> results;
+    for (auto _ : state) {
+        db.nearestNeighborBatch(queries.data(), numQueries, dim, kTopK, results);
+        benchmark::DoNotOptimize(results.data());
+    }
+    state.SetItemsProcessed(state.iterations() * numQueries);
+    state.SetLabel(getVectorKernels().name);
+}
+
+static void
+BM_DotProduct(benchmark::State& state, VectorKernels kernels) {
+    size_t             dim     = state.range(0);
+    std::vector<float> vectors = randomVectors(2, dim, 1);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(kernels.dotProduct(vectors.data(), vectors.data() + dim, dim));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// records x dimensions, items_per_second is the number of queries/sec
+static void
+DatabaseSizes(benchmark::internal::Benchmark* b) {
+    for (int64_t numRecords : { 10000, 100000, 1000000 }) {
+        b->Args({ numRecords, 384 });
+    }
+    b->Unit(benchmark::kMillisecond);
+}
+
+BENCHMARK(BM_LegacyNearestNeighbor)->Apply(DatabaseSizes);
+BENCHMARK(BM_NearestNeighbor)->Apply(DatabaseSizes);
+BENCHMARK(BM_NearestNeighborBatch)
+    ->ArgsProduct({ { 100000 }, { 384 }, { 1, 4, 16, 64 } })
+    ->ArgNames({ "records", "dim", "queries" })
+    ->Unit(benchmark::kMillisecond);
+
+int
+main(int argc, char** argv) {
+    for (const VectorKernels& kernels : getAvailableVectorKernels()) {
+        benchmark::RegisterBenchmark((std::string("BM_DotProduct/") + kernels.name).c_str(), BM_DotProduct, kernels)
+            ->Arg(384)
+            ->Arg(768)
+            ->Arg(1024);
+    }
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
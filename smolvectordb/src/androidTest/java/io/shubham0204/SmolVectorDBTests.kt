@@ -1,12 +1,21 @@
 package io.shubham0204
 
 import androidx.test.ext.junit.runners.AndroidJUnit4
+import androidx.test.platform.app.InstrumentationRegistry
 import io.shubham0204.smolvectordb.SmolVectorDB
 import org.junit.After
 import org.junit.Assert.assertEquals
+import org.junit.Assert.assertThrows
+import org.junit.Assert.assertTrue
 import org.junit.Before
 import org.junit.Test
 import org.junit.runner.RunWith
+import java.io.File
+import java.io.RandomAccessFile
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+import java.nio.FloatBuffer
+import kotlin.random.Random
 
 @RunWith(AndroidJUnit4::class)
 class SmolVectorDBTests {
@@ -43,4 +52,228 @@ class SmolVectorDBTests {
         assertEquals(1, results.size)
         assertEquals("one", results[0])
     }
+
+    @Test
+    fun testEmbeddingDimIsCheckedAtRuntime() {
+        val dim = 384
+        val embeddings =
+            Array(3) { index -> FloatArray(dim) { i -> if (i % 3 == index) 1.0f else 0.0f } }
+        val texts = arrayOf("one", "two", "three")
+        for (i in embeddings.indices) {
+            db.insertRecord(texts[i], embeddings[i])
+        }
+        assertEquals(dim, db.getEmbeddingDim())
+
+        // magnitudes should not affect the cosine similarity
+        val query = FloatArray(dim) { i -> if (i % 3 == 1) 5.0f else 0.1f }
+        assertEquals("two", db.nearestNeighbor(query, 1)[0])
+
+        assertThrows(IllegalArgumentException::class.java) {
+            db.insertRecord("four", FloatArray(dim + 1))
+        }
+        assertThrows(IllegalArgumentException::class.java) {
+            db.nearestNeighbor(FloatArray(dim - 1), 1)
+        }
+    }
+
+    @Test
+    fun testSearchReturnsIdsAndScores() {
+        val texts = arrayOf("one", "two", "three")
+        for (i in texts.indices) {
+            val id = db.insertRecord(texts[i], FloatArray(3) { j -> if (i == j) 2.0f else 0.0f })
+            assertEquals(i, id)
+        }
+        assertEquals(3, db.size())
+
+        val results = db.search(floatArrayOf(0.0f, 0.6f, 0.8f), 5)
+        assertEquals(3, results.size)
+        assertEquals(listOf(2, 1, 0), results.map { it.id })
+        assertEquals(0.8f, results[0].score, 1e-5f)
+        assertEquals(0.6f, results[1].score, 1e-5f)
+        assertEquals("three", db.getText(results[0].id))
+    }
+
+    @Test
+    fun testBatchInsertAndSearchMatchSingleCalls() {
+        val dim = 48
+        val random = Random(0)
+        val embeddings = Array(1000) { FloatArray(dim) { random.nextFloat() - 0.5f } }
+        val buffer =
+            ByteBuffer.allocateDirect(embeddings.size * dim * 4)
+                .order(ByteOrder.nativeOrder())
+                .asFloatBuffer()
+        embeddings.forEach { buffer.put(it) }
+        buffer.flip()
+        assertEquals(0, db.insertBatch(List(embeddings.size) { "record $it" }, buffer))
+        assertEquals(embeddings.size, db.size())
+        assertEquals("record 999", db.getText(999))
+
+        val k = 5
+        val numQueries = 7
+        val queries = Array(numQueries) { FloatArray(dim) { random.nextFloat() - 0.5f } }
+        val queryBuffer =
+            ByteBuffer.allocateDirect(numQueries * dim * 4).order(ByteOrder.nativeOrder()).asFloatBuffer()
+        queries.forEach { queryBuffer.put(it) }
+        queryBuffer.flip()
+        val ids = IntArray(numQueries * k)
+        val scores = FloatArray(numQueries * k)
+        db.searchBatch(queryBuffer, k, ids, scores)
+        for (q in 0 until numQueries) {
+            val expected = db.search(queries[q], k)
+            assertEquals(expected.map { it.id }, ids.slice(q * k until (q + 1) * k))
+            for (i in 0 until k) {
+                assertEquals(expected[i].score, scores[q * k + i], 1e-5f)
+            }
+        }
+        assertThrows(IllegalArgumentException::class.java) {
+            db.searchBatch(FloatBuffer.wrap(FloatArray(dim)), k, IntArray(k), FloatArray(k))
+        }
+    }
+
+    @Test
+    fun testMultiThreadedSearchMatchesSingleThreaded() {
+        val dim = 32
+        val random = Random(0)
+        val threadedDb = SmolVectorDB(numThreads = 4)
+        val int8Db = SmolVectorDB(quantization = SmolVectorDB.Quantization.Int8())
+        val threadedInt8Db =
+            SmolVectorDB(quantization = SmolVectorDB.Quantization.Int8(), numThreads = 4)
+        // large enough to be split into shards
+        repeat(20000) {
+            val embedding = FloatArray(dim) { random.nextFloat() - 0.5f }
+            for (target in listOf(db, threadedDb, int8Db, threadedInt8Db)) {
+                target.insertRecord("record $it", embedding)
+            }
+        }
+        repeat(20) {
+            val query = FloatArray(dim) { random.nextFloat() - 0.5f }
+            assertEquals(db.search(query, 10), threadedDb.search(query, 10))
+            assertEquals(int8Db.search(query, 10), threadedInt8Db.search(query, 10))
+        }
+        threadedDb.close()
+        int8Db.close()
+        threadedInt8Db.close()
+    }
+
+    @Test
+    fun testHNSWRecallAgainstFlat() {
+        val dim = 64
+        val random = Random(0)
+        val hnswDb = SmolVectorDB(dim, SmolVectorDB.Index.HNSW(m = 16, efConstruction = 100, efSearch = 64))
+        repeat(2000) {
+            val embedding = FloatArray(dim) { random.nextFloat() - 0.5f }
+            db.insertRecord("record $it", embedding)
+            hnswDb.insertRecord("record $it", embedding)
+        }
+
+        val k = 10
+        var found = 0
+        repeat(50) {
+            val query = FloatArray(dim) { random.nextFloat() - 0.5f }
+            val exact = db.search(query, k).map { it.id }.toSet()
+            found += hnswDb.search(query, k).count { it.id in exact }
+        }
+        hnswDb.close()
+        assertTrue("recall@$k = ${found / (50.0 * k)}", found >= 0.9 * 50 * k)
+    }
+
+    @Test
+    fun testQuantizedRecallAgainstFlat() {
+        val dim = 384
+        val random = Random(0)
+        val cacheDir = InstrumentationRegistry.getInstrumentation().targetContext.cacheDir
+        val int8Db =
+            SmolVectorDB(dim, quantization = SmolVectorDB.Quantization.Int8(File(cacheDir, "int8.f32")))
+        val binaryDb =
+            SmolVectorDB(dim, quantization = SmolVectorDB.Quantization.Binary(File(cacheDir, "binary.f32")))
+        // embeddings around a few topics, as produced by sentence embedding models
+        val topics = Array(16) { FloatArray(dim) { random.nextFloat() - 0.5f } }
+        repeat(2000) {
+            val topic = topics[random.nextInt(topics.size)]
+            val embedding = FloatArray(dim) { i -> topic[i] + 0.3f * (random.nextFloat() - 0.5f) }
+            db.insertRecord("record $it", embedding)
+            int8Db.insertRecord("record $it", embedding)
+            binaryDb.insertRecord("record $it", embedding)
+        }
+        assertTrue(int8Db.getMemoryUsage() * 3 < db.getMemoryUsage())
+        assertTrue(binaryDb.getMemoryUsage() * 16 < db.getMemoryUsage())
+
+        val k = 10
+        var int8Found = 0
+        var binaryFound = 0
+        repeat(50) {
+            val topic = topics[random.nextInt(topics.size)]
+            val query = FloatArray(dim) { i -> topic[i] + 0.3f * (random.nextFloat() - 0.5f) }
+            val exact = db.search(query, k).map { it.id }.toSet()
+            int8Found += int8Db.search(query, k).count { it.id in exact }
+            binaryFound += binaryDb.search(query, k).count { it.id in exact }
+        }
+        int8Db.close()
+        binaryDb.close()
+        assertTrue("int8 recall@$k = ${int8Found / (50.0 * k)}", int8Found >= 0.95 * 50 * k)
+        assertTrue("binary recall@$k = ${binaryFound / (50.0 * k)}", binaryFound >= 0.9 * 50 * k)
+    }
+
+    @Test
+    fun testPersistAndReopen() {
+        val file = File(InstrumentationRegistry.getInstrumentation().targetContext.cacheDir, "test.smolvdb")
+        file.delete()
+        val random = Random(0)
+        val embeddings = Array(3000) { FloatArray(64) { random.nextFloat() - 0.5f } }
+        val hnsw = SmolVectorDB.Index.HNSW()
+        val written = SmolVectorDB(index = hnsw, file = file)
+        embeddings.forEachIndexed { i, embedding -> written.insertRecord("record $i", embedding) }
+        val expected = written.search(embeddings[42], 5)
+        written.close()
+
+        val reopened = SmolVectorDB(index = hnsw, file = file)
+        assertEquals(3000, reopened.size())
+        assertEquals(64, reopened.getEmbeddingDim())
+        assertEquals("record 2999", reopened.getText(2999))
+        assertEquals(expected, reopened.search(embeddings[42], 5))
+        reopened.close()
+        assertThrows(IllegalArgumentException::class.java) { SmolVectorDB(embeddingDim = 32, file = file) }
+        file.delete()
+    }
+
+    @Test
+    fun testTruncatedFileIsRejected() {
+        val file = File(InstrumentationRegistry.getInstrumentation().targetContext.cacheDir, "truncated.smolvdb")
+        file.delete()
+        val written = SmolVectorDB(file = file)
+        repeat(100) { i -> written.insertRecord("record $i", FloatArray(8) { j -> (i + j).toFloat() }) }
+        written.close()
+
+        RandomAccessFile(file, "rw").use { it.setLength(it.length() - 1) }
+        assertThrows(IllegalStateException::class.java) { SmolVectorDB(file = file) }
+        file.delete()
+    }
+
+    @Test
+    fun testDeleteAndCompact() {
+        val file = File(InstrumentationRegistry.getInstrumentation().targetContext.cacheDir, "compact.smolvdb")
+        file.delete()
+        val fileDb = SmolVectorDB(file = file)
+        val embeddings = Array(100) { i -> FloatArray(8) { j -> if (j == i % 8) 1.0f else 0.1f * i / 100 } }
+        for (target in listOf(db, fileDb)) {
+            embeddings.forEachIndexed { i, embedding -> target.insertRecord("record $i", embedding) }
+            for (id in 0 until 100 step 2) {
+                target.deleteRecord(id)
+            }
+            assertEquals(50, target.getNumDeleted())
+            assertTrue(target.search(embeddings[0], 100).all { it.id % 2 == 1 })
+
+            target.compact()
+            assertEquals(50, target.size())
+            assertEquals(0, target.getNumDeleted())
+            assertEquals("record 1", target.getText(0))
+            assertEquals("record 99", target.getText(49))
+        }
+        fileDb.close()
+        val reopened = SmolVectorDB(file = file)
+        assertEquals(50, reopened.size())
+        assertEquals("record 99", reopened.getText(49))
+        reopened.close()
+        file.delete()
+    }
 }
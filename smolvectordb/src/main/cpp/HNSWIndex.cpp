@@ -0,0 +1,328 @@
+#include "HNSWIndex.h"
+#include <algorithm>
+#include <cmath>
+
+// min-heap on the score, the root is the farthest of the current results
+static bool
+worseFirst(const VectorDBResult& a, const VectorDBResult& b) {
+    return a.score > b.score;
+}
+
+// max-heap on the score, the root is the closest candidate
+static bool
+betterFirst(const VectorDBResult& a, const VectorDBResult& b) {
+    return a.score < b.score;
+}
+
+HNSWIndex::HNSWIndex(const HNSWParams& params, DotProductFn dotProduct)
+    : _M(std::max(params.M, 2)), _maxM0(2 * _M), _efConstruction(std::max(params.efConstruction, params.M)),
+      _efSearch(std::max(params.efSearch, 1)), _levelMult(1.0 / std::log(static_cast<double>(_M))),
+      _dotProduct(dotProduct), _rng(params.seed) {}
+
+void
+HNSWIndex::setEfSearch(size_t efSearch) {
+    _efSearch = std::max(efSearch, static_cast<size_t>(1));
+}
+
+size_t
+HNSWIndex::size() const {
+    return _levels.size();
+}
+
+size_t
+HNSWIndex::getMemoryUsage() const {
+    size_t bytes = _level0Links.capacity() * sizeof(uint32_t) + _levels.capacity() * sizeof(int) +
+                   _visited.capacity() * sizeof(uint32_t);
+    for (const auto& links : _upperLinks) {
+        bytes += sizeof(links) + links.capacity() * sizeof(uint32_t);
+    }
+    return bytes;
+}
+
+uint32_t*
+HNSWIndex::_links(uint32_t id, int level) {
+    if (level == 0) {
+        return _level0Links.data() + static_cast<size_t>(id) * (_maxM0 + 1);
+    }
+    return _upperLinks[id].data() + static_cast<size_t>(level - 1) * (_M + 1);
+}
+
+uint32_t
+HNSWIndex::_greedySearch(const float* query, uint32_t entryPoint, int level) {
+    uint32_t current      = entryPoint;
+    float    currentScore = _dotProduct(query, _row(current), _stride);
+    bool     changed      = true;
+    while (changed) {
+        changed         = false;
+        uint32_t* links = _links(current, level);
+        for (uint32_t i = 1; i <= links[0]; i++) {
+            float score = _dotProduct(query, _row(links[i]), _stride);
+            if (score > currentScore) {
+                currentScore = score;
+                current      = links[i];
+                changed      = true;
+            }
+        }
+    }
+    return current;
+}
+
+static bool
+isDeleted(const uint64_t* deleted, uint32_t id) {
+    return deleted != nullptr && ((deleted[id / 64] >> (id % 64)) & 1);
+}
+
+void
+HNSWIndex::_searchLayer(const float* query, uint32_t entryPoint, size_t ef, int level, const uint64_t* deleted) {
+    if (++_visitEpoch == 0) {
+        // the tags wrapped around, reset them so that stale tags are not mistaken as visited
+        std::fill(_visited.begin(), _visited.end(), 0);
+        _visitEpoch = 1;
+    }
+    _candidates.clear();
+    _results.clear();
+
+    float entryScore = _dotProduct(query, _row(entryPoint), _stride);
+    _visited[entryPoint] = _visitEpoch;
+    _candidates.push_back({ entryPoint, entryScore });
+    if (!isDeleted(deleted, entryPoint)) {
+        _results.push_back({ entryPoint, entryScore });
+    }
+
+    while (!_candidates.empty()) {
+        VectorDBResult candidate = _candidates.front();
+        if (_results.size() >= ef && candidate.score < _results.front().score) {
+            break;
+        }
+        std::pop_heap(_candidates.begin(), _candidates.end(), betterFirst);
+        _candidates.pop_back();
+
+        uint32_t* links = _links(candidate.id, level);
+        for (uint32_t i = 1; i <= links[0]; i++) {
+            uint32_t neighbor = links[i];
+            if (_visited[neighbor] == _visitEpoch) {
+                continue;
+            }
+            _visited[neighbor] = _visitEpoch;
+            float score        = _dotProduct(query, _row(neighbor), _stride);
+            if (_results.size() < ef || score > _results.front().score) {
+                _candidates.push_back({ neighbor, score });
+                std::push_heap(_candidates.begin(), _candidates.end(), betterFirst);
+                if (isDeleted(deleted, neighbor)) {
+                    continue;
+                }
+                _results.push_back({ neighbor, score });
+                std::push_heap(_results.begin(), _results.end(), worseFirst);
+                if (_results.size() > ef) {
+                    std::pop_heap(_results.begin(), _results.end(), worseFirst);
+                    _results.pop_back();
+                }
+            }
+        }
+    }
+}
+
+void
+HNSWIndex::_selectNeighbors(std::vector<VectorDBResult>& candidates, size_t maxLinks) {
+    if (candidates.size() <= maxLinks) {
+        return;
+    }
+    // a candidate is kept only if it is closer to the base node than to every kept neighbor,
+    // which spreads the links in different directions instead of one dense cluster
+    size_t numSelected = 0;
+    for (size_t i = 0; i < candidates.size() && numSelected < maxLinks; i++) {
+        bool keep = true;
+        for (size_t j = 0; j < numSelected; j++) {
+            if (_dotProduct(_row(candidates[i].id), _row(candidates[j].id), _stride) > candidates[i].score) {
+                keep = false;
+                break;
+            }
+        }
+        if (keep) {
+            candidates[numSelected++] = candidates[i];
+        }
+    }
+    candidates.resize(numSelected);
+}
+
+void
+HNSWIndex::_addLink(uint32_t from, uint32_t to, int level) {
+    uint32_t* links    = _links(from, level);
+    size_t    maxLinks = level == 0 ? _maxM0 : _M;
+    if (links[0] < maxLinks) {
+        links[++links[0]] = to;
+        return;
+    }
+    std::vector<VectorDBResult> candidates;
+    candidates.reserve(maxLinks + 1);
+    const float* base = _row(from);
+    candidates.push_back({ to, _dotProduct(base, _row(to), _stride) });
+    for (uint32_t i = 1; i <= links[0]; i++) {
+        candidates.push_back({ links[i], _dotProduct(base, _row(links[i]), _stride) });
+    }
+    std::sort(candidates.begin(), candidates.end(), worseFirst);
+    _selectNeighbors(candidates, maxLinks);
+    links[0] = static_cast<uint32_t>(candidates.size());
+    for (size_t i = 0; i < candidates.size(); i++) {
+        links[i + 1] = candidates[i].id;
+    }
+}
+
+void
+HNSWIndex::insert(const float* matrix, size_t stride, uint32_t id) {
+    _matrix = matrix;
+    _stride = stride;
+
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    int level = static_cast<int>(-std::log(1.0 - uniform(_rng)) * _levelMult);
+    _levels.push_back(level);
+    _level0Links.resize(_level0Links.size() + _maxM0 + 1, 0);
+    _upperLinks.emplace_back(static_cast<size_t>(level) * (_M + 1), 0);
+    _visited.push_back(0);
+
+    if (_maxLevel < 0) {
+        _entryPoint = id;
+        _maxLevel   = level;
+        return;
+    }
+
+    const float* query      = _row(id);
+    uint32_t     entryPoint = _entryPoint;
+    for (int l = _maxLevel; l > level; l--) {
+        entryPoint = _greedySearch(query, entryPoint, l);
+    }
+    std::vector<VectorDBResult> neighbors;
+    for (int l = std::min(level, _maxLevel); l >= 0; l--) {
+        _searchLayer(query, entryPoint, _efConstruction, l);
+        neighbors.assign(_results.begin(), _results.end());
+        std::sort(neighbors.begin(), neighbors.end(), worseFirst);
+        entryPoint = neighbors[0].id;
+
+        _selectNeighbors(neighbors, _M);
+        uint32_t* links = _links(id, l);
+        links[0]        = static_cast<uint32_t>(neighbors.size());
+        for (size_t i = 0; i < neighbors.size(); i++) {
+            links[i + 1] = neighbors[i].id;
+            _addLink(neighbors[i].id, id, l);
+        }
+    }
+    if (level > _maxLevel) {
+        _entryPoint = id;
+        _maxLevel   = level;
+    }
+}
+
+void
+HNSWIndex::search(const float* matrix, size_t stride, const float* query, size_t k, const uint64_t* deleted,
+                  std::vector<VectorDBResult>& results) {
+    results.clear();
+    if (_maxLevel < 0 || k == 0) {
+        return;
+    }
+    _matrix = matrix;
+    _stride = stride;
+
+    uint32_t entryPoint = _entryPoint;
+    for (int l = _maxLevel; l > 0; l--) {
+        entryPoint = _greedySearch(query, entryPoint, l);
+    }
+    _searchLayer(query, entryPoint, std::max(_efSearch, k), 0, deleted);
+    std::sort_heap(_results.begin(), _results.end(), worseFirst);
+    results.assign(_results.begin(), _results.begin() + std::min(k, _results.size()));
+}
+
+void
+HNSWIndex::clear() {
+    _level0Links.clear();
+    _upperLinks.clear();
+    _levels.clear();
+    _visited.clear();
+    _maxLevel   = -1;
+    _entryPoint = 0;
+}
+
+template <typename T>
+static void
+appendValues(std::vector<char>& data, const T* values, size_t count) {
+    const char* bytes = reinterpret_cast<const char*>(values);
+    data.insert(data.end(), bytes, bytes + count * sizeof(T));
+}
+
+template <typename T>
+static bool
+readValues(const std::vector<char>& data, size_t& offset, T* values, size_t count) {
+    if (offset + count * sizeof(T) > data.size()) {
+        return false;
+    }
+    std::copy(data.data() + offset, data.data() + offset + count * sizeof(T), reinterpret_cast<char*>(values));
+    offset += count * sizeof(T);
+    return true;
+}
+
+// layout: M, number of nodes, max. level, entry point, levels of the nodes,
+// level 0 links, then the links on the upper levels of every node
+void
+HNSWIndex::serialize(std::vector<char>& data) const {
+    uint32_t header[4] = { static_cast<uint32_t>(_M), static_cast<uint32_t>(_levels.size()),
+                           static_cast<uint32_t>(_maxLevel), _entryPoint };
+    appendValues(data, header, 4);
+    appendValues(data, _levels.data(), _levels.size());
+    appendValues(data, _level0Links.data(), _level0Links.size());
+    for (const auto& links : _upperLinks) {
+        appendValues(data, links.data(), links.size());
+    }
+}
+
+bool
+HNSWIndex::deserialize(const std::vector<char>& data, size_t numNodes) {
+    size_t   offset = 0;
+    uint32_t header[4];
+    if (!readValues(data, offset, header, 4) || header[0] != _M || header[1] != numNodes) {
+        return false;
+    }
+    std::vector<int>                   levels(numNodes);
+    std::vector<uint32_t>              level0Links(numNodes * (_maxM0 + 1));
+    std::vector<std::vector<uint32_t>> upperLinks(numNodes);
+    if (!readValues(data, offset, levels.data(), numNodes) ||
+        !readValues(data, offset, level0Links.data(), level0Links.size())) {
+        return false;
+    }
+    // the links are checked, so that a corrupted file cannot lead the search out of bounds
+    auto validLinks = [numNodes](const uint32_t* links, size_t maxLinks) {
+        if (links[0] > maxLinks) {
+            return false;
+        }
+        for (uint32_t i = 1; i <= links[0]; i++) {
+            if (links[i] >= numNodes) {
+                return false;
+            }
+        }
+        return true;
+    };
+    int maxLevel = static_cast<int>(header[2]);
+    for (size_t i = 0; i < numNodes; i++) {
+        if (levels[i] < 0 || levels[i] > maxLevel || !validLinks(level0Links.data() + i * (_maxM0 + 1), _maxM0)) {
+            return false;
+        }
+        upperLinks[i].resize(static_cast<size_t>(levels[i]) * (_M + 1));
+        if (!readValues(data, offset, upperLinks[i].data(), upperLinks[i].size())) {
+            return false;
+        }
+        for (int l = 0; l < levels[i]; l++) {
+            if (!validLinks(upperLinks[i].data() + static_cast<size_t>(l) * (_M + 1), _M)) {
+                return false;
+            }
+        }
+    }
+    if (numNodes > 0 ? header[3] >= numNodes || levels[header[3]] != maxLevel : maxLevel != -1) {
+        return false;
+    }
+    _levels      = std::move(levels);
+    _level0Links = std::move(level0Links);
+    _upperLinks  = std::move(upperLinks);
+    _maxLevel    = maxLevel;
+    _entryPoint  = header[3];
+    _visited.assign(numNodes, 0);
+    _visitEpoch = 0;
+    return true;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "VectorDB.h"
+#include <cstdint>
+#include <random>
+#include <vector>
+
+// Hierarchical Navigable Small World graph (Malkov & Yashunin, 2016) over the rows
+// of the VectorDB embedding matrix. The index only stores the graph, the vectors
+// are read from the matrix passed to each call, as it may be reallocated on insertion.
+class HNSWIndex {
+    size_t       _M;
+    size_t       _maxM0;
+    size_t       _efConstruction;
+    size_t       _efSearch;
+    double       _levelMult;
+    DotProductFn _dotProduct;
+
+    // links on level 0, `_maxM0 + 1` entries per node: the number of links followed by the links
+    std::vector<uint32_t> _level0Links;
+    // links on levels 1.._levels[id], `_M + 1` entries per node and level
+    std::vector<std::vector<uint32_t>> _upperLinks;
+    std::vector<int>                   _levels;
+    int                                _maxLevel   = -1;
+    uint32_t                           _entryPoint = 0;
+    std::mt19937                       _rng;
+
+    // a node is visited in the current search if its tag equals `_visitEpoch`
+    std::vector<uint32_t> _visited;
+    uint32_t              _visitEpoch = 0;
+
+    // scratch heaps reused across searches
+    std::vector<VectorDBResult> _candidates;
+    std::vector<VectorDBResult> _results;
+
+    const float* _matrix = nullptr;
+    size_t       _stride = 0;
+
+    const float*
+    _row(uint32_t id) const {
+        return _matrix + static_cast<size_t>(id) * _stride;
+    }
+
+    uint32_t* _links(uint32_t id, int level);
+
+    uint32_t _greedySearch(const float* query, uint32_t entryPoint, int level);
+
+    // leaves the `ef` nodes closest to `query` on `level` in `_results` (a min-heap on the score).
+    // Nodes set in `deleted` are traversed but not returned
+    void _searchLayer(const float* query, uint32_t entryPoint, size_t ef, int level,
+                      const uint64_t* deleted = nullptr);
+
+    // keeps at most `maxLinks` of `candidates` (sorted by descending score), preferring diverse neighbors
+    void _selectNeighbors(std::vector<VectorDBResult>& candidates, size_t maxLinks);
+
+    void _addLink(uint32_t from, uint32_t to, int level);
+
+  public:
+    HNSWIndex(const HNSWParams& params, DotProductFn dotProduct);
+
+    void setEfSearch(size_t efSearch);
+
+    // Adds the row `id` of `matrix` to the graph, rows must be inserted in order of their IDs
+    void insert(const float* matrix, size_t stride, uint32_t id);
+
+    // Writes the approximate `k` nearest neighbors of the normalized `query` to `results`, most similar
+    // first. The nodes set in the bitset `deleted` (if not null) are skipped
+    void search(const float* matrix, size_t stride, const float* query, size_t k, const uint64_t* deleted,
+                std::vector<VectorDBResult>& results);
+
+    // Appends the graph to `data`
+    void serialize(std::vector<char>& data) const;
+
+    // Replaces the graph with one read by serialize(), returns false if `data` is not a graph
+    // of `numNodes` nodes built with the same M
+    bool deserialize(const std::vector<char>& data, size_t numNodes);
+
+    size_t size() const;
+
+    // Returns the bytes of memory held by the graph
+    size_t getMemoryUsage() const;
+
+    void clear();
+};
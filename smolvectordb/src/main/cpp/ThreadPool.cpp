@@ -0,0 +1,75 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(size_t numThreads) {
+    for (size_t i = 1; i < numThreads; i++) {
+        _workers.emplace_back(&ThreadPool::_runWorker, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _workAvailable.notify_all();
+    for (std::thread& worker : _workers) {
+        worker.join();
+    }
+}
+
+size_t
+ThreadPool::size() const {
+    return _workers.size() + 1;
+}
+
+void
+ThreadPool::_runTasks() {
+    // tasks are claimed one at a time, so a slow thread does not hold back the others
+    for (size_t i = _nextTask++; i < _numTasks; i = _nextTask++) {
+        (*_task)(i);
+    }
+}
+
+void
+ThreadPool::_runWorker() {
+    uint64_t generation = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _workAvailable.wait(lock, [&] { return _stop || _generation != generation; });
+            if (_stop) {
+                return;
+            }
+            generation = _generation;
+        }
+        _runTasks();
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (--_numBusy == 0) {
+            _workDone.notify_one();
+        }
+    }
+}
+
+void
+ThreadPool::parallelFor(size_t numTasks, const std::function<void(size_t)>& task) {
+    if (_workers.empty() || numTasks <= 1) {
+        for (size_t i = 0; i < numTasks; i++) {
+            task(i);
+        }
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _task     = &task;
+        _numTasks = numTasks;
+        _nextTask = 0;
+        _numBusy  = _workers.size();
+        _generation++;
+    }
+    _workAvailable.notify_all();
+    _runTasks();
+    // the task and its captures must outlive every worker that may still run it
+    std::unique_lock<std::mutex> lock(_mutex);
+    _workDone.wait(lock, [this] { return _numBusy == 0; });
+    _task = nullptr;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads, started once and reused across parallelFor() calls so that
+// a query does not pay for creating threads. The calling thread works on the tasks too.
+// parallelFor() must not be called from several threads at once.
+class ThreadPool {
+    std::vector<std::thread> _workers;
+
+    std::mutex              _mutex;
+    std::condition_variable _workAvailable;
+    std::condition_variable _workDone;
+    // incremented for every parallelFor(), the workers wait for it to change
+    uint64_t _generation = 0;
+    bool     _stop       = false;
+    // workers that have not finished the current parallelFor()
+    size_t _numBusy = 0;
+
+    const std::function<void(size_t)>* _task     = nullptr;
+    size_t                             _numTasks = 0;
+    std::atomic<size_t>                _nextTask{ 0 };
+
+    void _runWorker();
+
+    void _runTasks();
+
+  public:
+    // Starts `numThreads - 1` workers, the calling thread is the last one
+    explicit ThreadPool(size_t numThreads);
+
+    ~ThreadPool();
+
+    // Returns the number of threads running tasks, including the calling thread
+    size_t size() const;
+
+    // Runs task(0) ... task(numTasks - 1) on the workers and the calling thread, and returns
+    // once all of them have finished
+    void parallelFor(size_t numTasks, const std::function<void(size_t)>& task);
+};
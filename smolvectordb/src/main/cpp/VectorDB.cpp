@@ -2,78 +2,652 @@
 // Created by Shubham Panchal on 16/11/25.
 //
 
+#include "VectorDB.h"
+#include "HNSWIndex.h"
+#include "ThreadPool.h"
+#include "VectorDBFile.h"
 #include <algorithm>
-#include <array>
-#include <cmath>
-#include <queue>
-#include <string>
-#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <limits>
+#include <stdexcept>
+#include <unistd.h>
 
-#define EMBEDDING_DIM 328
+// min-heap on the score, the root is the worst of the current top-k. Ties go to the lower ID,
+// so that a scan split into shards keeps the same results as a single scan
+static bool
+compareResults(const VectorDBResult& a, const VectorDBResult& b) {
+    return a.score > b.score || (a.score == b.score && a.id < b.id);
+}
 
-class VectorDBRecord {
-  public:
-    std::string                      text;
-    std::array<float, EMBEDDING_DIM> embedding;
-    float                            mag;
+// keeps the `k` best (id, score) pairs in the min-heap `topK`
+static void
+pushTopK(std::vector<VectorDBResult>& topK, uint32_t id, float score, size_t k) {
+    if (topK.size() < k) {
+        topK.push_back({ id, score });
+        std::push_heap(topK.begin(), topK.end(), compareResults);
+    } else if (compareResults({ id, score }, topK.front())) {
+        std::pop_heap(topK.begin(), topK.end(), compareResults);
+        topK.back() = { id, score };
+        std::push_heap(topK.begin(), topK.end(), compareResults);
+    }
+}
+
+// a shard is large enough for its scan to outweigh waking up a worker
+static constexpr size_t MIN_SHARD_ROWS = 2048;
+
+static size_t
+rerankFactor(const QuantizationParams& params) {
+    if (params.rerankFactor > 0) {
+        return static_cast<size_t>(params.rerankFactor);
+    }
+    // a binary code keeps only the signs, the true neighbors rank lower among its candidates
+    return params.type == VectorDBQuantization::Binary ? 32 : 4;
+}
+
+static bool
+isDeleted(const uint64_t* deleted, size_t id) {
+    return deleted != nullptr && ((deleted[id / 64] >> (id % 64)) & 1);
+}
+
+VectorDB::VectorDB(size_t dim, VectorDBIndexType indexType, const HNSWParams& hnswParams,
+                   const QuantizationParams& quantizationParams, const std::string& path, size_t numThreads)
+    : _dim(0), _stride(0), _textOffsets{ 0 }, _path(path), _dotProduct(getVectorKernels().dotProduct),
+      _dotProductBlock(getVectorKernels().dotProductBlock),
+      _quantization(quantizationParams.type),
+      _rerankFactor(rerankFactor(quantizationParams)),
+      _dotProductInt8(getVectorKernels().dotProductInt8), _hammingDistance(getVectorKernels().hammingDistance) {
+    _threadPool = std::make_unique<ThreadPool>(std::max(numThreads, static_cast<size_t>(1)));
+    if (indexType == VectorDBIndexType::HNSW) {
+        if (_quantization != VectorDBQuantization::None) {
+            // the graph is traversed with float32 distances, which would have to stay in memory
+            throw std::invalid_argument("quantization is only supported with a flat index");
+        }
+        _hnswIndex = std::make_unique<HNSWIndex>(hnswParams, _dotProduct);
+    }
+    if (!_path.empty()) {
+        // a new file is created once the dimension is known, see _checkDim()
+        if (access(_path.c_str(), F_OK) == 0) {
+            _file = VectorDBFile::open(_path);
+            if (dim > 0 && dim != _file->getDim()) {
+                throw std::invalid_argument("expected an embedding of dimension " + std::to_string(dim) + ", " +
+                                            _path + " has " + std::to_string(_file->getDim()));
+            }
+            _checkDim(_file->getDim());
+            _rebuildIndex();
+        }
+    } else if (_quantization != VectorDBQuantization::None) {
+        // the float32 embeddings are only read to re-rank candidates, keeping them in memory would
+        // take more memory than no quantization
+        if (quantizationParams.fullPrecisionPath.empty()) {
+            throw std::invalid_argument("quantization needs a file for the float32 embeddings");
+        }
+        _fullPrecisionFd = open(quantizationParams.fullPrecisionPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                                0600);
+        if (_fullPrecisionFd < 0) {
+            throw std::runtime_error("could not create " + quantizationParams.fullPrecisionPath + ": " +
+                                     std::strerror(errno));
+        }
+    }
+    if (dim > 0) {
+        _checkDim(dim);
+    }
+}
+
+VectorDB::~VectorDB() {
+    if (_file) {
+        try {
+            sync();
+        } catch (const std::runtime_error&) {
+            // the records are in the file already, a missing index is rebuilt when it is opened
+        }
+    }
+    if (_fullPrecisionFd >= 0) {
+        close(_fullPrecisionFd);
+    }
+}
+
+VectorDBIndexType
+VectorDB::getIndexType() const {
+    return _hnswIndex ? VectorDBIndexType::HNSW : VectorDBIndexType::Flat;
+}
+
+void
+VectorDB::setEfSearch(int efSearch) {
+    if (_hnswIndex) {
+        _hnswIndex->setEfSearch(std::max(efSearch, 1));
+    }
+}
+
+void
+VectorDB::setRerankFactor(int rerankFactor) {
+    _rerankFactor = static_cast<size_t>(std::max(rerankFactor, 1));
+}
+
+size_t
+VectorDB::getNumThreads() const {
+    return _threadPool->size();
+}
+
+size_t
+VectorDB::getDim() const {
+    return _dim;
+}
+
+size_t
+VectorDB::size() const {
+    return _file ? _file->size() : _textOffsets.size() - 1;
+}
+
+size_t
+VectorDB::getNumDeleted() const {
+    return _numDeleted;
+}
+
+void
+VectorDB::_checkDim(size_t dim) {
+    if (dim == 0) {
+        throw std::invalid_argument("embedding must not be empty");
+    }
+    if (_dim == 0) {
+        _dim        = dim;
+        _stride     = (dim + 15) / 16 * 16;
+        _codeStride = (dim + 63) / 64 * 64;
+        _query.assign(_stride, 0.0f);
+        _row.assign(_stride, 0.0f);
+        _queryInt8.assign(_codeStride, 0);
+        _queryBits.assign(_codeStride / 64, 0);
+        if (!_path.empty() && !_file) {
+            _file = VectorDBFile::create(_path, dim);
+        }
+    } else if (dim != _dim) {
+        throw std::invalid_argument("expected an embedding of dimension " + std::to_string(_dim) + ", got " +
+                                    std::to_string(dim));
+    }
+}
+
+void
+VectorDB::_prepareQuery(const float* query, size_t dim) {
+    _checkDim(dim);
+    std::copy(query, query + dim, _query.begin());
+    normalizeVector(_query.data(), dim);
+    if (_quantization == VectorDBQuantization::Int8) {
+        quantizeInt8(_query.data(), _dim, _queryInt8.data());
+    } else if (_quantization == VectorDBQuantization::Binary) {
+        quantizeBinary(_query.data(), _dim, _queryBits.data(), _queryBits.size());
+    }
+}
+
+const float*
+VectorDB::_matrix() const {
+    return _file ? _file->getEmbeddings() : _embeddings.data();
+}
+
+const uint64_t*
+VectorDB::_deletedBits() const {
+    if (_numDeleted == 0) {
+        return nullptr;
+    }
+    return _file ? _file->getDeletedBits() : _deleted.data();
+}
+
+const float*
+VectorDB::_fullPrecisionRow(uint32_t id) {
+    if (_fullPrecisionFd < 0) {
+        return _matrix() + static_cast<size_t>(id) * _stride;
+    }
+    size_t rowBytes = _stride * sizeof(float);
+    if (pread(_fullPrecisionFd, _row.data(), rowBytes, static_cast<off_t>(id) * rowBytes) !=
+        static_cast<ssize_t>(rowBytes)) {
+        throw std::runtime_error("could not read the embedding of record " + std::to_string(id));
+    }
+    return _row.data();
+}
+
+void
+VectorDB::_indexRow(uint32_t id) {
+    if (_quantization == VectorDBQuantization::Int8) {
+        _int8Codes.resize(_int8Codes.size() + _codeStride, 0);
+        int8_t* codes = _int8Codes.data() + static_cast<size_t>(id) * _codeStride;
+        _int8Factors.push_back(quantizeInt8(_row.data(), _dim, codes));
+    } else if (_quantization == VectorDBQuantization::Binary) {
+        size_t numWords = _codeStride / 64;
+        _binaryCodes.resize(_binaryCodes.size() + numWords, 0);
+        quantizeBinary(_row.data(), _dim, _binaryCodes.data() + static_cast<size_t>(id) * numWords, numWords);
+    }
+    if (_hnswIndex) {
+        _hnswIndex->insert(_matrix(), _stride, id);
+        _indexDirty = true;
+    }
+}
+
+void
+VectorDB::_rebuildIndex() {
+    _int8Codes.clear();
+    _int8Factors.clear();
+    _binaryCodes.clear();
+
+    size_t numRecords = size();
+    _numDeleted       = 0;
+    if (numRecords > 0) {
+        const uint64_t* deleted = _file ? _file->getDeletedBits() : _deleted.data();
+        for (size_t i = 0; i < (numRecords + 63) / 64; i++) {
+            _numDeleted += __builtin_popcountll(deleted[i]);
+        }
+    }
+
+    if (_hnswIndex) {
+        // the graph is only loaded if it was written after the last append, otherwise it is rebuilt
+        _hnswIndex->clear();
+        std::vector<char> data;
+        bool              loaded = _file && _file->readIndex(static_cast<uint32_t>(VectorDBIndexType::HNSW), data) &&
+                      _hnswIndex->deserialize(data, numRecords);
+        _indexDirty = !loaded;
+        if (loaded) {
+            return;
+        }
+    } else if (_quantization == VectorDBQuantization::None) {
+        return;
+    }
+    for (uint32_t id = 0; id < numRecords; id++) {
+        const float* row = _fullPrecisionRow(id);
+        if (row != _row.data()) {
+            std::copy(row, row + _stride, _row.begin());
+        }
+        _indexRow(id);
+    }
+}
+
+uint32_t
+VectorDB::insertRecord(std::string_view text, const float* embedding, size_t dim) {
+    _checkDim(dim);
+    uint32_t id = static_cast<uint32_t>(size());
+
+    // the padding after `_dim` stays zero, so the kernels can run over the whole row
+    std::fill(_row.begin(), _row.end(), 0.0f);
+    std::copy(embedding, embedding + dim, _row.begin());
+    normalizeVector(_row.data(), dim);
+
+    if (_file) {
+        _file->append(text, _row.data());
+    } else {
+        if (_fullPrecisionFd >= 0) {
+            size_t rowBytes = _stride * sizeof(float);
+            if (pwrite(_fullPrecisionFd, _row.data(), rowBytes, static_cast<off_t>(id) * rowBytes) !=
+                static_cast<ssize_t>(rowBytes)) {
+                throw std::runtime_error("could not write the embedding of record " + std::to_string(id));
+            }
+        } else {
+            // without quantization, the float32 embeddings are the matrix that is searched
+            _embeddings.insert(_embeddings.end(), _row.begin(), _row.end());
+        }
+        _textArena.insert(_textArena.end(), text.begin(), text.end());
+        _textOffsets.push_back(_textArena.size());
+        if (id % 64 == 0) {
+            _deleted.push_back(0);
+        }
+    }
+    _indexRow(id);
+    return id;
+}
+
+uint32_t
+VectorDB::insertRecords(const std::string_view* texts, size_t count, const float* embeddings, size_t dim) {
+    _checkDim(dim);
+    uint32_t firstId = static_cast<uint32_t>(size());
+    if (!_file) {
+        size_t textSize = 0;
+        for (size_t i = 0; i < count; i++) {
+            textSize += texts[i].size();
+        }
+        if (_fullPrecisionFd < 0) {
+            _embeddings.reserve(_embeddings.size() + count * _stride);
+        }
+        _textArena.reserve(_textArena.size() + textSize);
+        _textOffsets.reserve(_textOffsets.size() + count);
+    }
+    for (size_t i = 0; i < count; i++) {
+        insertRecord(texts[i], embeddings + i * dim, dim);
+    }
+    return firstId;
+}
+
+void
+VectorDB::deleteRecord(uint32_t id) {
+    if (id >= size()) {
+        throw std::out_of_range("invalid record ID " + std::to_string(id));
+    }
+    if (isDeleted(_file ? _file->getDeletedBits() : _deleted.data(), id)) {
+        return;
+    }
+    if (_file) {
+        _file->setDeleted(id);
+    } else {
+        _deleted[id / 64] |= uint64_t(1) << (id % 64);
+    }
+    _numDeleted++;
+}
+
+size_t
+VectorDB::_numShards(size_t numRows) const {
+    return std::min(_threadPool->size(), std::max(numRows / MIN_SHARD_ROWS, static_cast<size_t>(1)));
+}
+
+void
+VectorDB::_scanShards(size_t numRows, size_t k,
+                      const std::function<void(std::vector<VectorDBResult>& topK, size_t begin, size_t end)>& scan) {
+    size_t numShards = _numShards(numRows);
+    if (numShards == 1) {
+        _topK.clear();
+        _topK.reserve(k);
+        scan(_topK, 0, numRows);
+        return;
+    }
+    _shardTopK.resize(numShards);
+    _threadPool->parallelFor(numShards, [&](size_t shard) {
+        std::vector<VectorDBResult>& topK = _shardTopK[shard];
+        topK.clear();
+        topK.reserve(k);
+        scan(topK, numRows * shard / numShards, numRows * (shard + 1) / numShards);
+    });
+    // the global top-k is among the union of the top-k of every shard
+    _topK.clear();
+    _topK.reserve(k);
+    for (const std::vector<VectorDBResult>& topK : _shardTopK) {
+        for (const VectorDBResult& result : topK) {
+            pushTopK(_topK, result.id, result.score, k);
+        }
+    }
+}
+
+void
+VectorDB::_searchQuantized(size_t k, std::vector<VectorDBResult>& results) {
+    size_t          numRecords    = size();
+    size_t          numCandidates = std::min(k * _rerankFactor, numRecords - _numDeleted);
+    const uint64_t* deleted       = _deletedBits();
+
+    // pass 1: approximate scores from the codes
+    if (_quantization == VectorDBQuantization::Int8) {
+        _scanShards(numRecords, numCandidates, [&](std::vector<VectorDBResult>& topK, size_t begin, size_t end) {
+            const int8_t* codes = _int8Codes.data() + begin * _codeStride;
+            for (size_t id = begin; id < end; id++, codes += _codeStride) {
+                if (isDeleted(deleted, id)) {
+                    continue;
+                }
+                // the query factor is the same for every record and does not change the order
+                float score = static_cast<float>(_dotProductInt8(_queryInt8.data(), codes, _codeStride));
+                pushTopK(topK, static_cast<uint32_t>(id), score * _int8Factors[id], numCandidates);
+            }
+        });
+    } else {
+        size_t numWords = _codeStride / 64;
+        _scanShards(numRecords, numCandidates, [&](std::vector<VectorDBResult>& topK, size_t begin, size_t end) {
+            const uint64_t* bits = _binaryCodes.data() + begin * numWords;
+            for (size_t id = begin; id < end; id++, bits += numWords) {
+                if (isDeleted(deleted, id)) {
+                    continue;
+                }
+                float score = -static_cast<float>(_hammingDistance(_queryBits.data(), bits, numWords));
+                pushTopK(topK, static_cast<uint32_t>(id), score, numCandidates);
+            }
+        });
+    }
+
+    // pass 2: exact scores of the candidates, read in the order of the file
+    results.assign(_topK.begin(), _topK.end());
+    std::sort(results.begin(), results.end(),
+              [](const VectorDBResult& a, const VectorDBResult& b) { return a.id < b.id; });
+    _topK.clear();
+    for (const VectorDBResult& candidate : results) {
+        float score = _dotProduct(_query.data(), _fullPrecisionRow(candidate.id), _stride);
+        pushTopK(_topK, candidate.id, score, k);
+    }
+    std::sort_heap(_topK.begin(), _topK.end(), compareResults);
+    results.assign(_topK.begin(), _topK.end());
+}
+
+void
+VectorDB::nearestNeighbor(const float* query, size_t dim, int k, std::vector<VectorDBResult>& results) {
+    std::lock_guard<std::mutex> lock(_searchMutex);
+    _nearestNeighbor(query, dim, k, results);
+}
+
+void
+VectorDB::_nearestNeighbor(const float* query, size_t dim, int k, std::vector<VectorDBResult>& results) {
+    if (!_hnswIndex && _quantization == VectorDBQuantization::None) {
+        _exactNearestNeighbor(query, dim, k, results);
+        return;
+    }
+    results.clear();
+    if (size() == 0 || k <= 0) {
+        return;
+    }
+    _prepareQuery(query, dim);
+    if (_hnswIndex) {
+        _hnswIndex->search(_matrix(), _stride, _query.data(), k, _deletedBits(), results);
+    } else {
+        _searchQuantized(static_cast<size_t>(k), results);
+    }
+}
+
+void
+VectorDB::_searchBlock(size_t numQueries, size_t k, std::vector<VectorDBResult>& results) {
+    size_t          numRecords = size();
+    const uint64_t* deleted    = _deletedBits();
+    // a tile of ~128 KB stays in L2 while every block of queries passes over it
+    size_t tileRows  = std::min(std::max<size_t>(64, 131072 / (_stride * sizeof(float))), numRecords);
+    size_t numShards = _numShards(numRecords);
+    // every shard has its own scores and heaps, the heaps of shard s start at s * numQueries
+    _blockScores.resize(numShards * numQueries * tileRows);
+    if (_batchTopK.size() < numShards * numQueries) {
+        _batchTopK.resize(numShards * numQueries);
+    }
 
-    static float
-    computeMagnitude(const std::array<float, EMBEDDING_DIM>& vector) {
-        float vectorMag = 0.0f;
-        for (int i = 0; i < EMBEDDING_DIM; i++) {
-            vectorMag += vector[i] * vector[i];
+    const float* matrix = _matrix();
+    _threadPool->parallelFor(numShards, [&](size_t shard) {
+        float*                       blockScores = _blockScores.data() + shard * numQueries * tileRows;
+        std::vector<VectorDBResult>* topK        = _batchTopK.data() + shard * numQueries;
+        for (size_t q = 0; q < numQueries; q++) {
+            topK[q].clear();
+            topK[q].reserve(k);
+        }
+        size_t end = numRecords * (shard + 1) / numShards;
+        for (size_t first = numRecords * shard / numShards; first < end; first += tileRows) {
+            size_t numRows = std::min(tileRows, end - first);
+            _dotProductBlock(_queryBlock.data(), numQueries, matrix + first * _stride, numRows, _stride,
+                             blockScores);
+            for (size_t q = 0; q < numQueries; q++) {
+                const float* scores = blockScores + q * numRows;
+                for (size_t r = 0; r < numRows; r++) {
+                    if (!isDeleted(deleted, first + r)) {
+                        pushTopK(topK[q], static_cast<uint32_t>(first + r), scores[r], k);
+                    }
+                }
+            }
+        }
+    });
+    for (size_t shard = 1; shard < numShards; shard++) {
+        for (size_t q = 0; q < numQueries; q++) {
+            for (const VectorDBResult& result : _batchTopK[shard * numQueries + q]) {
+                pushTopK(_batchTopK[q], result.id, result.score, k);
+            }
         }
-        return sqrt(vectorMag);
     }
+    for (size_t q = 0; q < numQueries; q++) {
+        std::sort_heap(_batchTopK[q].begin(), _batchTopK[q].end(), compareResults);
+        std::copy(_batchTopK[q].begin(), _batchTopK[q].end(), results.begin() + q * k);
+    }
+}
 
-    VectorDBRecord(std::string text, std::array<float, EMBEDDING_DIM> embedding) : text(text), embedding(embedding) {
-        mag = computeMagnitude(embedding);
+void
+VectorDB::nearestNeighborBatch(const float* queries, size_t numQueries, size_t dim, int k,
+                               std::vector<VectorDBResult>& results) {
+    results.assign(numQueries * std::max(k, 0),
+                   { std::numeric_limits<uint32_t>::max(), -std::numeric_limits<float>::infinity() });
+    if (size() == 0 || k <= 0 || numQueries == 0) {
+        return;
+    }
+    _checkDim(dim);
+    std::lock_guard<std::mutex> lock(_searchMutex);
+    if (_hnswIndex || _quantization != VectorDBQuantization::None) {
+        std::vector<VectorDBResult> queryResults;
+        for (size_t q = 0; q < numQueries; q++) {
+            _nearestNeighbor(queries + q * dim, dim, k, queryResults);
+            std::copy(queryResults.begin(), queryResults.end(), results.begin() + q * k);
+        }
+        return;
     }
-};
+    _queryBlock.assign(numQueries * _stride, 0.0f);
+    for (size_t q = 0; q < numQueries; q++) {
+        float* query = _queryBlock.data() + q * _stride;
+        std::copy(queries + q * dim, queries + (q + 1) * dim, query);
+        normalizeVector(query, dim);
+    }
+    _searchBlock(numQueries, static_cast<size_t>(k), results);
+}
 
-class VectorDB {
-    std::vector<VectorDBRecord> _records;
+void
+VectorDB::exactNearestNeighbor(const float* query, size_t dim, int k, std::vector<VectorDBResult>& results) {
+    std::lock_guard<std::mutex> lock(_searchMutex);
+    _exactNearestNeighbor(query, dim, k, results);
+}
 
-  public:
-    void
-    insertRecord(VectorDBRecord&& record) {
-        _records.push_back(std::move(record));
+void
+VectorDB::_exactNearestNeighbor(const float* query, size_t dim, int k, std::vector<VectorDBResult>& results) {
+    results.clear();
+    if (size() == 0 || k <= 0) {
+        return;
     }
+    _prepareQuery(query, dim);
 
-    std::vector<VectorDBRecord>
-    nearestNeighbor(const std::array<float, EMBEDDING_DIM>& query, int k) {
-        float queryMag = VectorDBRecord::computeMagnitude(query);
+    size_t          numRecords = size();
+    size_t          topK       = std::min(static_cast<size_t>(k), numRecords);
+    const uint64_t* deleted    = _deletedBits();
 
-        auto comparator = [](const std::pair<float, const VectorDBRecord*>& a,
-                             const std::pair<float, const VectorDBRecord*>& b) { return a.first > b.first; };
+    if (_fullPrecisionFd >= 0) {
+        // the rows are read into the shared `_row`, the scan stays on this thread
+        _topK.clear();
+        _topK.reserve(topK);
+        for (size_t id = 0; id < numRecords; id++) {
+            if (!isDeleted(deleted, id)) {
+                float score = _dotProduct(_query.data(), _fullPrecisionRow(id), _stride);
+                pushTopK(_topK, static_cast<uint32_t>(id), score, topK);
+            }
+        }
+    } else {
+        _scanShards(numRecords, topK, [&](std::vector<VectorDBResult>& shardTopK, size_t begin, size_t end) {
+            const float* row = _matrix() + begin * _stride;
+            for (size_t id = begin; id < end; id++, row += _stride) {
+                // both vectors have unit norm, the dot product is the cosine similarity
+                if (!isDeleted(deleted, id)) {
+                    pushTopK(shardTopK, static_cast<uint32_t>(id), _dotProduct(_query.data(), row, _stride), topK);
+                }
+            }
+        });
+    }
+    // sorting the min-heap with the same comparator orders the results by descending score
+    std::sort_heap(_topK.begin(), _topK.end(), compareResults);
+    results.assign(_topK.begin(), _topK.end());
+}
+
+std::string_view
+VectorDB::getText(uint32_t id) const {
+    if (id >= size()) {
+        throw std::out_of_range("invalid record ID " + std::to_string(id));
+    }
+    if (_file) {
+        return _file->getText(id);
+    }
+    return std::string_view(_textArena.data() + _textOffsets[id], _textOffsets[id + 1] - _textOffsets[id]);
+}
+
+size_t
+VectorDB::getMemoryUsage() const {
+    size_t bytes = _embeddings.capacity() * sizeof(float) + _int8Codes.capacity() +
+                   _int8Factors.capacity() * sizeof(float) + _binaryCodes.capacity() * sizeof(uint64_t) +
+                   _deleted.capacity() * sizeof(uint64_t);
+    if (_hnswIndex) {
+        bytes += _hnswIndex->getMemoryUsage();
+    }
+    return bytes;
+}
 
-        std::priority_queue<std::pair<float, const VectorDBRecord*>,
-                            std::vector<std::pair<float, const VectorDBRecord*>>, decltype(comparator)>
-            top_k(comparator);
-        for (const auto& record : _records) {
-            float dot_product = 0.0f;
-            for (int i = 0; i < EMBEDDING_DIM; i++) {
-                dot_product += query[i] * record.embedding[i];
+void
+VectorDB::sync() {
+    if (!_file) {
+        return;
+    }
+    if (_hnswIndex && _indexDirty) {
+        std::vector<char> data;
+        _hnswIndex->serialize(data);
+        _file->writeIndex(static_cast<uint32_t>(VectorDBIndexType::HNSW), data);
+        _indexDirty = false;
+    }
+    _file->sync();
+}
+
+void
+VectorDB::compact() {
+    if (_numDeleted == 0) {
+        return;
+    }
+    if (_file) {
+        _file->compact();
+    } else {
+        AlignedVector<float>  embeddings;
+        std::vector<char>     textArena;
+        std::vector<uint64_t> textOffsets = { 0 };
+        size_t                rowBytes    = _stride * sizeof(float);
+        uint32_t              newId       = 0;
+        for (uint32_t id = 0; id < size(); id++) {
+            if (isDeleted(_deleted.data(), id)) {
+                continue;
             }
-            float similarity = dot_product / (queryMag * record.mag);
-            if (top_k.size() < (size_t)k) {
-                top_k.push({ similarity, &record });
-            } else if (similarity > top_k.top().first) {
-                top_k.pop();
-                top_k.push({ similarity, &record });
+            const float* row = _fullPrecisionRow(id);
+            if (_fullPrecisionFd >= 0) {
+                // rows only move towards the start of the file, so a row is read before it is overwritten
+                if (pwrite(_fullPrecisionFd, row, rowBytes, static_cast<off_t>(newId) * rowBytes) !=
+                    static_cast<ssize_t>(rowBytes)) {
+                    throw std::runtime_error("could not write the embedding of record " + std::to_string(newId));
+                }
+            } else {
+                embeddings.insert(embeddings.end(), row, row + _stride);
             }
+            std::string_view text = getText(id);
+            textArena.insert(textArena.end(), text.begin(), text.end());
+            textOffsets.push_back(textArena.size());
+            newId++;
         }
-        std::vector<VectorDBRecord> result;
-        while (!top_k.empty()) {
-            result.push_back(*top_k.top().second);
-            top_k.pop();
+        if (_fullPrecisionFd >= 0 && ftruncate(_fullPrecisionFd, static_cast<off_t>(newId) * rowBytes) != 0) {
+            throw std::runtime_error(std::string("could not truncate the embeddings file: ") + std::strerror(errno));
         }
-        std::reverse(result.begin(), result.end());
-        return result;
+        _embeddings.swap(embeddings);
+        _textArena.swap(textArena);
+        _textOffsets.swap(textOffsets);
+        _deleted.assign((newId + 63) / 64, 0);
     }
+    _rebuildIndex();
+}
 
-    void
-    clear() {
-        _records.clear();
+void
+VectorDB::clear() {
+    _embeddings.clear();
+    _int8Codes.clear();
+    _int8Factors.clear();
+    _binaryCodes.clear();
+    _textArena.clear();
+    _textOffsets.assign(1, 0);
+    _deleted.clear();
+    _numDeleted = 0;
+    if (_file) {
+        _file = VectorDBFile::create(_path, _dim);
+    }
+    if (_fullPrecisionFd >= 0 && ftruncate(_fullPrecisionFd, 0) != 0) {
+        throw std::runtime_error(std::string("could not truncate the embeddings file: ") + std::strerror(errno));
+    }
+    if (_hnswIndex) {
+        _hnswIndex->clear();
+        _indexDirty = true;
     }
-};
+}
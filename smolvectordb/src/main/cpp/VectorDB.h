@@ -0,0 +1,262 @@
+//
+// Created by Shubham Panchal on 16/11/25.
+//
+
+#pragma once
+
+#include "VectorKernels.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// allocates cache-line aligned storage, so that every row of the embedding matrix starts on a cache line
+template <typename T, size_t Alignment = 64> struct AlignedAllocator {
+    typedef T value_type;
+
+    AlignedAllocator() = default;
+
+    template <typename U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    template <typename U> struct rebind {
+        typedef AlignedAllocator<U, Alignment> other;
+    };
+
+    T*
+    allocate(size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+    }
+
+    void
+    deallocate(T* p, size_t) {
+        ::operator delete(p, std::align_val_t(Alignment));
+    }
+
+    bool
+    operator==(const AlignedAllocator&) const {
+        return true;
+    }
+
+    bool
+    operator!=(const AlignedAllocator&) const {
+        return false;
+    }
+};
+
+template <typename T> using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+struct VectorDBResult {
+    uint32_t id;
+    float    score;
+};
+
+enum class VectorDBIndexType { Flat, HNSW };
+
+struct HNSWParams {
+    // number of links per node on the upper levels, twice as many on level 0
+    int M = 16;
+    // size of the candidate list while inserting, higher values build a better graph slower
+    int efConstruction = 200;
+    // size of the candidate list while searching, higher values trade latency for recall
+    int          efSearch = 64;
+    unsigned int seed     = 42;
+};
+
+enum class VectorDBQuantization { None, Int8, Binary };
+
+struct QuantizationParams {
+    // None keeps float32 embeddings in memory. Int8 (4x smaller) and Binary (32x smaller) keep
+    // only the codes in memory and re-rank the best candidates with the float32 embeddings on disk
+    VectorDBQuantization type = VectorDBQuantization::None;
+    // number of candidates re-ranked per requested neighbor, 0 for the default of `type`:
+    // 4 for Int8 and 32 for Binary, which need as many for a recall@10 above 0.95
+    int rerankFactor = 0;
+    // file that holds the float32 embeddings for re-ranking, overwritten when the database is created.
+    // Required with quantization, unless the database has a file, which holds them
+    std::string fullPrecisionPath;
+};
+
+class HNSWIndex;
+class ThreadPool;
+class VectorDBFile;
+
+// Stores the records as a structure-of-arrays: L2-normalized embeddings in one contiguous
+// row-major matrix and the texts in a separate arena, both indexed by the record ID
+// (its insertion order). A flat query only streams through the matrix, a HNSW query
+// visits the rows along the graph. With quantization, a flat query streams through a
+// matrix of int8 or binary codes instead and reads only the best candidates in float32
+// from the disk.
+//
+// The matrix and the texts are either held in memory or memory-mapped from a
+// VectorDBFile, in which case records are appended to the file as they are inserted.
+//
+// Searches can be called from several threads at once, they are serialized as they share scratch
+// buffers. Updates (inserts, deletions, compact() and clear()) must not run concurrently with any
+// other call.
+class VectorDB {
+    // dimension of the embeddings, 0 if it is taken from the first inserted record
+    size_t _dim;
+    // length of a row in the matrix, `_dim` padded with zeros to a multiple of 16 floats (64 bytes)
+    size_t _stride;
+
+    // float32 embeddings, empty if they are stored in `_file` or `_fullPrecisionFd`
+    AlignedVector<float> _embeddings;
+    std::vector<char>    _textArena;
+    // _textOffsets[id] .. _textOffsets[id + 1] is the text of the record `id` in `_textArena`
+    std::vector<uint64_t> _textOffsets;
+    // bit `id` is set if the record `id` is deleted
+    std::vector<uint64_t> _deleted;
+    size_t                _numDeleted = 0;
+
+    // path of the database file, empty for an in-memory database
+    std::string                   _path;
+    std::unique_ptr<VectorDBFile> _file;
+    // true if the index changed since it was last written to `_file`
+    bool _indexDirty = false;
+
+    DotProductFn      _dotProduct;
+    DotProductBlockFn _dotProductBlock;
+
+    // null for an exhaustive (flat) search
+    std::unique_ptr<HNSWIndex> _hnswIndex;
+
+    VectorDBQuantization _quantization;
+    size_t               _rerankFactor;
+    // length of a row of codes, `_dim` padded to a multiple of 64 (int8 codes or bits)
+    size_t                  _codeStride = 0;
+    AlignedVector<int8_t>   _int8Codes;
+    std::vector<float>      _int8Factors;
+    AlignedVector<uint64_t> _binaryCodes;
+    int                     _fullPrecisionFd = -1;
+    Int8DotProductFn        _dotProductInt8;
+    HammingDistanceFn       _hammingDistance;
+
+    // serializes the searches, which share the scratch buffers below, the scratch of `_hnswIndex`
+    // and `_threadPool`
+    std::mutex _searchMutex;
+
+    // scratch buffers reused across queries
+    AlignedVector<float>        _query;
+    AlignedVector<int8_t>       _queryInt8;
+    AlignedVector<uint64_t>     _queryBits;
+    AlignedVector<float>        _row;
+    std::vector<VectorDBResult> _topK;
+    // batched queries, their scores against a tile of rows and one top-k heap per query
+    AlignedVector<float>                     _queryBlock;
+    std::vector<float>                       _blockScores;
+    std::vector<std::vector<VectorDBResult>> _batchTopK;
+
+    // runs exhaustive scans in shards, one top-k heap per shard
+    std::unique_ptr<ThreadPool>              _threadPool;
+    std::vector<std::vector<VectorDBResult>> _shardTopK;
+
+    void _checkDim(size_t dim);
+
+    void _prepareQuery(const float* query, size_t dim);
+
+    const float* _matrix() const;
+
+    const uint64_t* _deletedBits() const;
+
+    // Returns the float32 row of the record `id`, read from the disk into `_row` if needed
+    const float* _fullPrecisionRow(uint32_t id);
+
+    // adds the normalized row `_row` of the record `id` to the codes and the index
+    void _indexRow(uint32_t id);
+
+    // rebuilds the codes and the index from the stored rows, reading the index from `_file` if possible
+    void _rebuildIndex();
+
+    // number of shards a scan over `numRows` rows is split into
+    size_t _numShards(size_t numRows) const;
+
+    // calls `scan` for contiguous shards of rows on the thread pool, each with its own heap
+    // of the `k` best results, then merges the heaps into `_topK`
+    void _scanShards(size_t numRows, size_t k,
+                     const std::function<void(std::vector<VectorDBResult>& topK, size_t begin, size_t end)>& scan);
+
+    void _searchQuantized(size_t k, std::vector<VectorDBResult>& results);
+
+    // exhaustive search of the queries in `_queryBlock`, tile by tile over the matrix
+    void _searchBlock(size_t numQueries, size_t k, std::vector<VectorDBResult>& results);
+
+    // nearestNeighbor() and exactNearestNeighbor() with `_searchMutex` held
+    void _nearestNeighbor(const float* query, size_t dim, int k, std::vector<VectorDBResult>& results);
+
+    void _exactNearestNeighbor(const float* query, size_t dim, int k, std::vector<VectorDBResult>& results);
+
+  public:
+    // Opens the database file at `path` if it exists, creates it otherwise, or keeps the database
+    // in memory if `path` is empty. Throws std::invalid_argument if quantization is combined with a
+    // HNSW index or `dim` does not match the file, and std::runtime_error on I/O errors.
+    // Exhaustive scans are split across `numThreads` threads (including the calling thread)
+    explicit VectorDB(size_t dim = 0, VectorDBIndexType indexType = VectorDBIndexType::Flat,
+                      const HNSWParams& hnswParams = {}, const QuantizationParams& quantizationParams = {},
+                      const std::string& path = "", size_t numThreads = 1);
+
+    // Writes the index to the database file, if any
+    ~VectorDB();
+
+    VectorDBIndexType getIndexType() const;
+
+    // Sets the size of the candidate list of HNSW searches, no-op for a flat index
+    void setEfSearch(int efSearch);
+
+    // Sets the number of candidates re-ranked per requested neighbor, no-op without quantization
+    void setRerankFactor(int rerankFactor);
+
+    size_t getNumThreads() const;
+
+    size_t getDim() const;
+
+    // Returns the number of records, including the deleted ones
+    size_t size() const;
+
+    size_t getNumDeleted() const;
+
+    // Inserts a record with an embedding of `dim` floats and returns its ID, throws
+    // std::invalid_argument if `dim` does not match the dimension of the database
+    uint32_t insertRecord(std::string_view text, const float* embedding, size_t dim);
+
+    // Inserts `count` records with the row-major `count` x `dim` matrix `embeddings` and
+    // returns the ID of the first one, the others follow in order
+    uint32_t insertRecords(const std::string_view* texts, size_t count, const float* embeddings, size_t dim);
+
+    // Marks the record `id` as deleted, it is no longer returned by searches. Its storage
+    // is reclaimed by compact()
+    void deleteRecord(uint32_t id);
+
+    // Writes the IDs and cosine similarities of the `k` records most similar to `query`
+    // to `results`, most similar first. The results are approximate with a HNSW index or
+    // quantization. `results` is cleared but keeps its capacity, so repeated queries do not allocate
+    void nearestNeighbor(const float* query, size_t dim, int k, std::vector<VectorDBResult>& results);
+
+    // Searches the `numQueries` row-major queries of `dim` floats at once and writes `k` results
+    // per query to `results`, the results of query q start at q * k. A query with fewer than `k`
+    // neighbors is padded with results of ID UINT32_MAX. Without an index or quantization, the
+    // queries share each pass over the embeddings
+    void nearestNeighborBatch(const float* queries, size_t numQueries, size_t dim, int k,
+                              std::vector<VectorDBResult>& results);
+
+    // Exhaustive search regardless of the index type, the ground truth for HNSW searches
+    void exactNearestNeighbor(const float* query, size_t dim, int k, std::vector<VectorDBResult>& results);
+
+    // valid until the next insertRecord() or compact()
+    std::string_view getText(uint32_t id) const;
+
+    // Returns the bytes of memory held by the embeddings, codes and index, excluding the
+    // memory-mapped database file
+    size_t getMemoryUsage() const;
+
+    // Writes the index to the database file and flushes it to the disk, no-op in memory
+    void sync();
+
+    // Drops the deleted records and renumbers the remaining ones in their order of insertion
+    void compact();
+
+    void clear();
+};
@@ -0,0 +1,390 @@
+#include "VectorDBFile.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static constexpr char MAGIC[8] = { 'S', 'M', 'O', 'L', 'V', 'D', 'B', '\0' };
+
+// sections are aligned to 16 KB, so that they can be mapped on devices with 4 KB or 16 KB pages
+static constexpr size_t SECTION_ALIGNMENT = 16384;
+
+static size_t
+alignUp(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+static std::runtime_error
+ioError(const std::string& message, const std::string& path) {
+    return std::runtime_error(message + " " + path + ": " + std::strerror(errno));
+}
+
+static void
+writeFully(int fd, const void* data, size_t size, size_t offset, const std::string& path) {
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t written = pwrite(fd, bytes, size, static_cast<off_t>(offset));
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw ioError("could not write to", path);
+        }
+        bytes += written;
+        offset += written;
+        size -= written;
+    }
+}
+
+static void
+readFully(int fd, void* data, size_t size, size_t offset, const std::string& path) {
+    char* bytes = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t bytesRead = pread(fd, bytes, size, static_cast<off_t>(offset));
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead <= 0) {
+            throw std::runtime_error("could not read from " + path + ", the file may be truncated");
+        }
+        bytes += bytesRead;
+        offset += bytesRead;
+        size -= bytesRead;
+    }
+}
+
+// copies `size` bytes of the file from offset `from` to offset `to`, the ranges must not overlap
+static void
+copyRange(int fd, size_t from, size_t to, size_t size, const std::string& path) {
+    std::vector<char> buffer(std::min(size, static_cast<size_t>(1) << 20));
+    for (size_t copied = 0; copied < size; copied += buffer.size()) {
+        size_t chunkSize = std::min(buffer.size(), size - copied);
+        readFully(fd, buffer.data(), chunkSize, from + copied, path);
+        writeFully(fd, buffer.data(), chunkSize, to + copied, path);
+    }
+}
+
+// offsets of the sections of a file with `capacity` rows of `stride` floats
+struct SectionLayout {
+    size_t embeddingsOffset;
+    size_t textOffsetsOffset;
+    size_t deletedOffset;
+    size_t textArenaOffset;
+};
+
+static SectionLayout
+sectionLayout(size_t capacity, size_t stride) {
+    size_t        embeddingsSize  = capacity * stride * sizeof(float);
+    size_t        textOffsetsSize = (capacity + 1) * sizeof(uint64_t);
+    size_t        deletedSize     = (capacity + 63) / 64 * sizeof(uint64_t);
+    SectionLayout layout;
+    layout.embeddingsOffset  = SECTION_ALIGNMENT;
+    layout.textOffsetsOffset = alignUp(layout.embeddingsOffset + embeddingsSize, SECTION_ALIGNMENT);
+    layout.deletedOffset     = alignUp(layout.textOffsetsOffset + textOffsetsSize, SECTION_ALIGNMENT);
+    layout.textArenaOffset   = alignUp(layout.deletedOffset + deletedSize, SECTION_ALIGNMENT);
+    return layout;
+}
+
+std::unique_ptr<VectorDBFile>
+VectorDBFile::create(const std::string& path, size_t dim, size_t capacity) {
+    std::unique_ptr<VectorDBFile> file(new VectorDBFile());
+    file->_path = path;
+    file->_fd   = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (file->_fd < 0) {
+        throw ioError("could not create", path);
+    }
+    VectorDBFileHeader header = {};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version  = VERSION;
+    header.dim      = static_cast<uint32_t>(dim);
+    header.stride   = static_cast<uint32_t>((dim + 15) / 16 * 16);
+    header.capacity = capacity;
+    writeFully(file->_fd, &header, sizeof(header), 0, path);
+    // the file is extended to the fixed sections as a sparse file, the unused rows take no space
+    SectionLayout layout = sectionLayout(capacity, header.stride);
+    if (ftruncate(file->_fd, static_cast<off_t>(layout.textArenaOffset)) != 0) {
+        throw ioError("could not resize", path);
+    }
+    file->_map();
+    return file;
+}
+
+std::unique_ptr<VectorDBFile>
+VectorDBFile::open(const std::string& path) {
+    std::unique_ptr<VectorDBFile> file(new VectorDBFile());
+    file->_path = path;
+    file->_fd   = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (file->_fd < 0) {
+        throw ioError("could not open", path);
+    }
+    file->_map();
+    return file;
+}
+
+VectorDBFile::~VectorDBFile() {
+    _unmap();
+    if (_fd >= 0) {
+        close(_fd);
+    }
+}
+
+void
+VectorDBFile::_map() {
+    VectorDBFileHeader header;
+    readFully(_fd, &header, sizeof(header), 0, _path);
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+        throw std::runtime_error(_path + " is not a SmolVectorDB file");
+    }
+    if (header.version != VERSION) {
+        throw std::runtime_error(_path + " has the unsupported version " + std::to_string(header.version));
+    }
+    struct stat fileStat;
+    if (fstat(_fd, &fileStat) != 0) {
+        throw ioError("could not read the size of", _path);
+    }
+    // the header is checked against the size of the file before any section is mapped, so that a
+    // corrupted or truncated file cannot lead the reads out of the mapping
+    size_t fileSize = static_cast<size_t>(fileStat.st_size);
+    if (header.dim == 0 || header.stride != (static_cast<size_t>(header.dim) + 15) / 16 * 16) {
+        throw std::runtime_error(_path + " has an invalid embedding dimension or stride");
+    }
+    if (header.capacity == 0 || header.numRecords > header.capacity) {
+        throw std::runtime_error(_path + " has an invalid number of records or capacity");
+    }
+    if (header.capacity > fileSize / (header.stride * sizeof(float))) {
+        throw std::runtime_error(_path + " is truncated");
+    }
+    SectionLayout layout = sectionLayout(header.capacity, header.stride);
+    if (header.textArenaSize > fileSize || layout.textArenaOffset + header.textArenaSize > fileSize) {
+        throw std::runtime_error(_path + " is truncated");
+    }
+    if (header.indexSize > 0 &&
+        (header.indexSize > fileSize ||
+         layout.textArenaOffset + alignUp(header.textArenaSize, 8) + header.indexSize > fileSize)) {
+        throw std::runtime_error(_path + " is truncated");
+    }
+    _embeddingsOffset  = layout.embeddingsOffset;
+    _textOffsetsOffset = layout.textOffsetsOffset;
+    _deletedOffset     = layout.deletedOffset;
+    _textArenaOffset   = layout.textArenaOffset;
+    _fixedSize         = _textArenaOffset;
+
+    void* map = mmap(nullptr, _fixedSize, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (map == MAP_FAILED) {
+        throw ioError("could not map", _path);
+    }
+    _fixedMap = static_cast<uint8_t*>(map);
+    _header   = reinterpret_cast<VectorDBFileHeader*>(_fixedMap);
+
+    // the texts of the committed records must lie in the arena, in order
+    const uint64_t* offsets = _textOffsets();
+    bool            valid   = offsets[0] == 0;
+    for (size_t id = 0; valid && id < _header->numRecords; id++) {
+        valid = offsets[id] <= offsets[id + 1];
+    }
+    if (!valid || offsets[_header->numRecords] > _header->textArenaSize) {
+        _unmap();
+        throw std::runtime_error(_path + " has invalid text offsets");
+    }
+    // the text of a record that was not committed is dropped, the next one is written in its place
+    if (_header->textArenaSize != offsets[_header->numRecords]) {
+        _header->textArenaSize = offsets[_header->numRecords];
+        _header->indexSize     = 0;
+    }
+    _mapText(_header->textArenaSize);
+}
+
+void
+VectorDBFile::_unmap() {
+    if (_fixedMap != nullptr) {
+        munmap(_fixedMap, _fixedSize);
+        _fixedMap = nullptr;
+        _header   = nullptr;
+    }
+    if (_textMap != nullptr) {
+        munmap(const_cast<char*>(_textMap), _textMapSize);
+        _textMap     = nullptr;
+        _textMapSize = 0;
+    }
+}
+
+void
+VectorDBFile::_mapText(size_t minSize) {
+    if (_textMap != nullptr && minSize <= _textMapSize) {
+        return;
+    }
+    if (_textMap != nullptr) {
+        munmap(const_cast<char*>(_textMap), _textMapSize);
+        _textMap = nullptr;
+    }
+    // the mapping may extend past the end of the file, those pages are only read once written
+    size_t size = alignUp(std::max(minSize * 2, static_cast<size_t>(1) << 20), SECTION_ALIGNMENT);
+    void*  map  = mmap(nullptr, size, PROT_READ, MAP_SHARED, _fd, static_cast<off_t>(_textArenaOffset));
+    if (map == MAP_FAILED) {
+        throw ioError("could not map the texts of", _path);
+    }
+    _textMap     = static_cast<const char*>(map);
+    _textMapSize = size;
+}
+
+size_t
+VectorDBFile::getDim() const {
+    return _header->dim;
+}
+
+size_t
+VectorDBFile::getStride() const {
+    return _header->stride;
+}
+
+size_t
+VectorDBFile::size() const {
+    return _header->numRecords;
+}
+
+const float*
+VectorDBFile::getEmbeddings() const {
+    return reinterpret_cast<const float*>(_fixedMap + _embeddingsOffset);
+}
+
+const uint64_t*
+VectorDBFile::getDeletedBits() const {
+    return reinterpret_cast<const uint64_t*>(_fixedMap + _deletedOffset);
+}
+
+std::string_view
+VectorDBFile::getText(uint32_t id) const {
+    // the texts of all records are mapped, see append()
+    const uint64_t* offsets = _textOffsets();
+    return std::string_view(_textMap + offsets[id], offsets[id + 1] - offsets[id]);
+}
+
+uint32_t
+VectorDBFile::append(std::string_view text, const float* row) {
+    if (_header->numRecords == _header->capacity) {
+        _grow();
+    }
+    // the texts overwrite the index section
+    _header->indexSize = 0;
+
+    uint32_t id = static_cast<uint32_t>(_header->numRecords);
+    std::memcpy(_fixedMap + _embeddingsOffset + static_cast<size_t>(id) * _header->stride * sizeof(float), row,
+                _header->stride * sizeof(float));
+    writeFully(_fd, text.data(), text.size(), _textArenaOffset + _header->textArenaSize, _path);
+    _mapText(_header->textArenaSize + text.size());
+    _header->textArenaSize += text.size();
+    _textOffsets()[id + 1] = _header->textArenaSize;
+    // the record is committed last, a partially written record is ignored when the file is opened
+    _header->numRecords = id + 1;
+    return id;
+}
+
+void
+VectorDBFile::setDeleted(uint32_t id) {
+    uint64_t* deleted = reinterpret_cast<uint64_t*>(_fixedMap + _deletedOffset);
+    deleted[id / 64] |= uint64_t(1) << (id % 64);
+}
+
+bool
+VectorDBFile::readIndex(uint32_t indexType, std::vector<char>& data) const {
+    if (_header->indexSize == 0 || _header->indexType != indexType) {
+        return false;
+    }
+    data.resize(_header->indexSize);
+    readFully(_fd, data.data(), data.size(), _textArenaOffset + alignUp(_header->textArenaSize, 8), _path);
+    return true;
+}
+
+void
+VectorDBFile::writeIndex(uint32_t indexType, const std::vector<char>& data) {
+    _header->indexSize = 0;
+    writeFully(_fd, data.data(), data.size(), _textArenaOffset + alignUp(_header->textArenaSize, 8), _path);
+    _header->indexType = indexType;
+    _header->indexSize = data.size();
+}
+
+void
+VectorDBFile::sync() {
+    if (msync(_fixedMap, _fixedSize, MS_SYNC) != 0 || fdatasync(_fd) != 0) {
+        throw ioError("could not sync", _path);
+    }
+}
+
+void
+VectorDBFile::_grow() {
+    // the embeddings stay in place and the rows past the old capacity are appended to them. The
+    // sections after the embeddings are moved past the end of the file, the capacity is at least
+    // doubled until their new position does not overlap the old one, so that the file stays valid
+    // with the old header until the new capacity is committed
+    size_t        oldEnd   = _textArenaOffset + _header->textArenaSize;
+    size_t        capacity = _header->capacity * 2;
+    SectionLayout layout   = sectionLayout(capacity, _header->stride);
+    while (layout.textOffsetsOffset < oldEnd) {
+        capacity *= 2;
+        layout = sectionLayout(capacity, _header->stride);
+    }
+    // the index is not moved, append() invalidates it anyway. The file is cut after the texts before
+    // it is extended, so that the new sections start zeroed
+    _header->indexSize = 0;
+    sync();
+    if (ftruncate(_fd, static_cast<off_t>(oldEnd)) != 0 ||
+        ftruncate(_fd, static_cast<off_t>(layout.textArenaOffset + _header->textArenaSize)) != 0) {
+        throw ioError("could not resize", _path);
+    }
+    copyRange(_fd, _textOffsetsOffset, layout.textOffsetsOffset, (_header->numRecords + 1) * sizeof(uint64_t),
+              _path);
+    copyRange(_fd, _deletedOffset, layout.deletedOffset, (_header->numRecords + 63) / 64 * sizeof(uint64_t),
+              _path);
+    copyRange(_fd, _textArenaOffset, layout.textArenaOffset, _header->textArenaSize, _path);
+    sync();
+    _header->capacity = capacity;
+    sync();
+    _unmap();
+    _map();
+}
+
+void
+VectorDBFile::_rewrite(size_t capacity) {
+    std::string tmpPath = _path + ".tmp";
+    {
+        std::unique_ptr<VectorDBFile> tmp        = create(tmpPath, _header->dim, capacity);
+        const uint64_t*               deleted    = getDeletedBits();
+        size_t                        stride     = _header->stride;
+        const float*                  embeddings = getEmbeddings();
+        for (uint32_t id = 0; id < _header->numRecords; id++) {
+            if ((deleted[id / 64] >> (id % 64)) & 1) {
+                continue;
+            }
+            tmp->append(getText(id), embeddings + static_cast<size_t>(id) * stride);
+        }
+        tmp->sync();
+    }
+    if (rename(tmpPath.c_str(), _path.c_str()) != 0) {
+        throw ioError("could not replace", _path);
+    }
+    _unmap();
+    close(_fd);
+    _fd = ::open(_path.c_str(), O_RDWR | O_CLOEXEC);
+    if (_fd < 0) {
+        throw ioError("could not open", _path);
+    }
+    _map();
+}
+
+void
+VectorDBFile::compact() {
+    const uint64_t* deleted    = getDeletedBits();
+    size_t          numDeleted = 0;
+    for (size_t i = 0; i < (_header->numRecords + 63) / 64; i++) {
+        numDeleted += __builtin_popcountll(deleted[i]);
+    }
+    size_t capacity = 1024;
+    while (capacity < _header->numRecords - numDeleted) {
+        capacity *= 2;
+    }
+    _rewrite(capacity);
+}
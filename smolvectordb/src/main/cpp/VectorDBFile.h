@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// On-disk layout of a SmolVectorDB file. Every section starts on a page boundary,
+// the header, embeddings, text offsets and deleted bits have a fixed size for a
+// given capacity and are memory-mapped, the texts are appended after them.
+//
+//   header       | VectorDBFileHeader, padded to one page
+//   embeddings   | `capacity` rows of `stride` floats, L2-normalized and zero-padded
+//   text offsets | `capacity + 1` uint64, text `id` is [offsets[id], offsets[id + 1]) in the arena
+//   deleted      | `capacity` bits, set for deleted records
+//   text arena   | the texts in record order
+//   index        | optional serialized index, written after the texts by writeIndex()
+struct VectorDBFileHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t dim;
+    uint32_t stride;
+    // VectorDBIndexType of the index section
+    uint32_t indexType;
+    uint64_t capacity;
+    // number of committed records, incremented after a record is fully written
+    uint64_t numRecords;
+    uint64_t textArenaSize;
+    // size of the index section, 0 if there is none or it is stale
+    uint64_t indexSize;
+};
+
+class VectorDBFile {
+    std::string _path;
+    int         _fd = -1;
+
+    // header, embeddings, text offsets and deleted bits
+    uint8_t*            _fixedMap  = nullptr;
+    size_t              _fixedSize = 0;
+    VectorDBFileHeader* _header    = nullptr;
+    size_t              _embeddingsOffset;
+    size_t              _textOffsetsOffset;
+    size_t              _deletedOffset;
+    size_t              _textArenaOffset;
+
+    // text arena, mapped with room to grow beyond the end of the file so that
+    // appends rarely remap it. Only remapped by append(), so that concurrent reads
+    // never see it unmapped
+    const char* _textMap     = nullptr;
+    size_t      _textMapSize = 0;
+
+    VectorDBFile() = default;
+
+    void _map();
+
+    void _unmap();
+
+    void _mapText(size_t minSize);
+
+    uint64_t*
+    _textOffsets() const {
+        return reinterpret_cast<uint64_t*>(_fixedMap + _textOffsetsOffset);
+    }
+
+    // Grows the capacity of the file in place, without copying the embeddings
+    void _grow();
+
+    // Rewrites the file with `capacity` rows, without the deleted records
+    void _rewrite(size_t capacity);
+
+  public:
+    static constexpr uint32_t VERSION = 1;
+
+    // Creates (or truncates) `path` for embeddings of dimension `dim`, throws std::runtime_error on I/O errors
+    static std::unique_ptr<VectorDBFile> create(const std::string& path, size_t dim, size_t capacity = 1024);
+
+    // Maps an existing file, throws std::runtime_error if it cannot be read, is not a SmolVectorDB
+    // file of a supported version, or its header or text offsets do not match the size of the file
+    static std::unique_ptr<VectorDBFile> open(const std::string& path);
+
+    ~VectorDBFile();
+
+    size_t getDim() const;
+
+    size_t getStride() const;
+
+    size_t size() const;
+
+    // row-major matrix of size() rows of getStride() floats, valid until the next append()
+    const float* getEmbeddings() const;
+
+    // size() bits, set for deleted records
+    const uint64_t* getDeletedBits() const;
+
+    // valid until the next append() or compact()
+    std::string_view getText(uint32_t id) const;
+
+    // Appends a record with a normalized row of getStride() floats and returns its ID.
+    // The file grows in place by at least doubling its capacity when it is full
+    uint32_t append(std::string_view text, const float* row);
+
+    void setDeleted(uint32_t id);
+
+    // Reads the index section into `data`, returns false if there is none for `indexType`
+    bool readIndex(uint32_t indexType, std::vector<char>& data) const;
+
+    // Writes the index section after the texts, it is invalidated by the next append()
+    void writeIndex(uint32_t indexType, const std::vector<char>& data);
+
+    // Flushes the mapped sections to the disk
+    void sync();
+
+    // Rewrites the file without the deleted records, the remaining records are renumbered
+    // in their order of insertion
+    void compact();
+};
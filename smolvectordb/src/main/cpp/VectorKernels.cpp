@@ -0,0 +1,419 @@
+#include "VectorKernels.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VECTOR_KERNELS_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define VECTOR_KERNELS_NEON
+#endif
+
+static float
+dotProductScalar(const float* a, const float* b, size_t dim) {
+    // four independent accumulators let the compiler pipeline the multiply-adds
+    float  sum0 = 0.0f, sum1 = 0.0f, sum2 = 0.0f, sum3 = 0.0f;
+    size_t i    = 0;
+    for (; i + 4 <= dim; i += 4) {
+        sum0 += a[i] * b[i];
+        sum1 += a[i + 1] * b[i + 1];
+        sum2 += a[i + 2] * b[i + 2];
+        sum3 += a[i + 3] * b[i + 3];
+    }
+    for (; i < dim; i++) {
+        sum0 += a[i] * b[i];
+    }
+    return (sum0 + sum1) + (sum2 + sum3);
+}
+
+static void
+dotProductBlockScalar(const float* queries, size_t numQueries, const float* rows, size_t numRows, size_t dim,
+                      float* scores) {
+    for (size_t r = 0; r < numRows; r++) {
+        // the row stays in L1 while it is multiplied with every query
+        for (size_t q = 0; q < numQueries; q++) {
+            scores[q * numRows + r] = dotProductScalar(queries + q * dim, rows + r * dim, dim);
+        }
+    }
+}
+
+static int32_t
+dotProductInt8Scalar(const int8_t* a, const int8_t* b, size_t dim) {
+    int32_t sum = 0;
+    for (size_t i = 0; i < dim; i++) {
+        sum += static_cast<int32_t>(a[i]) * static_cast<int32_t>(b[i]);
+    }
+    return sum;
+}
+
+static uint32_t
+hammingDistanceScalar(const uint64_t* a, const uint64_t* b, size_t numWords) {
+    uint32_t distance = 0;
+    for (size_t i = 0; i < numWords; i++) {
+        distance += __builtin_popcountll(a[i] ^ b[i]);
+    }
+    return distance;
+}
+
+#if defined(VECTOR_KERNELS_X86)
+__attribute__((target("sse2"))) static float
+dotProductSSE(const float* a, const float* b, size_t dim) {
+    __m128 sum0 = _mm_setzero_ps();
+    __m128 sum1 = _mm_setzero_ps();
+    size_t i    = 0;
+    for (; i + 8 <= dim; i += 8) {
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    __m128 sum = _mm_add_ps(sum0, sum1);
+    sum        = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum        = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 0x55));
+    float result = _mm_cvtss_f32(sum);
+    for (; i < dim; i++) {
+        result += a[i] * b[i];
+    }
+    return result;
+}
+
+__attribute__((target("avx2,fma"))) static float
+dotProductAVX2(const float* a, const float* b, size_t dim) {
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    size_t i    = 0;
+    for (; i + 16 <= dim; i += 16) {
+        sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+        sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum1);
+    }
+    for (; i + 8 <= dim; i += 8) {
+        sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+    }
+    __m256 sum256 = _mm256_add_ps(sum0, sum1);
+    __m128 sum    = _mm_add_ps(_mm256_castps256_ps128(sum256), _mm256_extractf128_ps(sum256, 1));
+    sum           = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum           = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 0x55));
+    float result  = _mm_cvtss_f32(sum);
+    for (; i < dim; i++) {
+        result += a[i] * b[i];
+    }
+    return result;
+}
+
+// 4 queries x 1 row per step: every row load feeds four multiply-adds
+__attribute__((target("sse2"))) static void
+dotProductBlockSSE(const float* queries, size_t numQueries, const float* rows, size_t numRows, size_t dim,
+                   float* scores) {
+    size_t q = 0;
+    for (; q + 4 <= numQueries; q += 4) {
+        const float* q0 = queries + q * dim;
+        const float* q1 = q0 + dim;
+        const float* q2 = q1 + dim;
+        const float* q3 = q2 + dim;
+        for (size_t r = 0; r < numRows; r++) {
+            const float* row  = rows + r * dim;
+            __m128       sum0 = _mm_setzero_ps();
+            __m128       sum1 = _mm_setzero_ps();
+            __m128       sum2 = _mm_setzero_ps();
+            __m128       sum3 = _mm_setzero_ps();
+            for (size_t i = 0; i < dim; i += 4) {
+                __m128 v = _mm_loadu_ps(row + i);
+                sum0     = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(q0 + i), v));
+                sum1     = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(q1 + i), v));
+                sum2     = _mm_add_ps(sum2, _mm_mul_ps(_mm_loadu_ps(q2 + i), v));
+                sum3     = _mm_add_ps(sum3, _mm_mul_ps(_mm_loadu_ps(q3 + i), v));
+            }
+            // after the transpose, lane j of the sum is the dot product of query j
+            _MM_TRANSPOSE4_PS(sum0, sum1, sum2, sum3);
+            float results[4];
+            _mm_storeu_ps(results, _mm_add_ps(_mm_add_ps(sum0, sum1), _mm_add_ps(sum2, sum3)));
+            for (size_t j = 0; j < 4; j++) {
+                scores[(q + j) * numRows + r] = results[j];
+            }
+        }
+    }
+    for (; q < numQueries; q++) {
+        for (size_t r = 0; r < numRows; r++) {
+            scores[q * numRows + r] = dotProductSSE(queries + q * dim, rows + r * dim, dim);
+        }
+    }
+}
+
+__attribute__((target("avx2,fma"))) static void
+dotProductBlockAVX2(const float* queries, size_t numQueries, const float* rows, size_t numRows, size_t dim,
+                    float* scores) {
+    size_t q = 0;
+    for (; q + 4 <= numQueries; q += 4) {
+        const float* q0 = queries + q * dim;
+        const float* q1 = q0 + dim;
+        const float* q2 = q1 + dim;
+        const float* q3 = q2 + dim;
+        for (size_t r = 0; r < numRows; r++) {
+            const float* row  = rows + r * dim;
+            __m256       sum0 = _mm256_setzero_ps();
+            __m256       sum1 = _mm256_setzero_ps();
+            __m256       sum2 = _mm256_setzero_ps();
+            __m256       sum3 = _mm256_setzero_ps();
+            for (size_t i = 0; i < dim; i += 8) {
+                __m256 v = _mm256_loadu_ps(row + i);
+                sum0     = _mm256_fmadd_ps(_mm256_loadu_ps(q0 + i), v, sum0);
+                sum1     = _mm256_fmadd_ps(_mm256_loadu_ps(q1 + i), v, sum1);
+                sum2     = _mm256_fmadd_ps(_mm256_loadu_ps(q2 + i), v, sum2);
+                sum3     = _mm256_fmadd_ps(_mm256_loadu_ps(q3 + i), v, sum3);
+            }
+            // the horizontal adds leave the partial sums of query j in lanes j and j + 4
+            __m256 sum = _mm256_hadd_ps(_mm256_hadd_ps(sum0, sum1), _mm256_hadd_ps(sum2, sum3));
+            float  results[4];
+            _mm_storeu_ps(results, _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1)));
+            for (size_t j = 0; j < 4; j++) {
+                scores[(q + j) * numRows + r] = results[j];
+            }
+        }
+    }
+    for (; q < numQueries; q++) {
+        for (size_t r = 0; r < numRows; r++) {
+            scores[q * numRows + r] = dotProductAVX2(queries + q * dim, rows + r * dim, dim);
+        }
+    }
+}
+
+// _mm_maddubs_epi16 multiplies unsigned by signed bytes, so the sign of `a` is moved onto `b`.
+// The codes are in [-127, 127], a pair of products fits in int16 without saturating
+__attribute__((target("ssse3"))) static int32_t
+dotProductInt8SSSE3(const int8_t* a, const int8_t* b, size_t dim) {
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i       sum  = _mm_setzero_si128();
+    for (size_t i = 0; i < dim; i += 16) {
+        __m128i va       = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb       = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        __m128i products = _mm_maddubs_epi16(_mm_sign_epi8(va, va), _mm_sign_epi8(vb, va));
+        sum              = _mm_add_epi32(sum, _mm_madd_epi16(products, ones));
+    }
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+    return _mm_cvtsi128_si32(sum);
+}
+
+__attribute__((target("avx2"))) static int32_t
+dotProductInt8AVX2(const int8_t* a, const int8_t* b, size_t dim) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i       sum  = _mm256_setzero_si256();
+    for (size_t i = 0; i < dim; i += 32) {
+        __m256i va       = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vb       = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        __m256i products = _mm256_maddubs_epi16(_mm256_sign_epi8(va, va), _mm256_sign_epi8(vb, va));
+        sum              = _mm256_add_epi32(sum, _mm256_madd_epi16(products, ones));
+    }
+    __m128i sum128 = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    sum128         = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, 0x4E));
+    sum128         = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, 0xB1));
+    return _mm_cvtsi128_si32(sum128);
+}
+
+// same as the scalar kernel, compiled to use the POPCNT instruction
+__attribute__((target("popcnt"))) static uint32_t
+hammingDistancePopcnt(const uint64_t* a, const uint64_t* b, size_t numWords) {
+    uint32_t distance = 0;
+    for (size_t i = 0; i < numWords; i++) {
+        distance += __builtin_popcountll(a[i] ^ b[i]);
+    }
+    return distance;
+}
+#endif
+
+#if defined(VECTOR_KERNELS_NEON)
+static float
+dotProductNEON(const float* a, const float* b, size_t dim) {
+    float32x4_t sum0 = vdupq_n_f32(0.0f);
+    float32x4_t sum1 = vdupq_n_f32(0.0f);
+    float32x4_t sum2 = vdupq_n_f32(0.0f);
+    float32x4_t sum3 = vdupq_n_f32(0.0f);
+    size_t      i    = 0;
+#if defined(__aarch64__)
+    for (; i + 16 <= dim; i += 16) {
+        sum0 = vfmaq_f32(sum0, vld1q_f32(a + i), vld1q_f32(b + i));
+        sum1 = vfmaq_f32(sum1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+        sum2 = vfmaq_f32(sum2, vld1q_f32(a + i + 8), vld1q_f32(b + i + 8));
+        sum3 = vfmaq_f32(sum3, vld1q_f32(a + i + 12), vld1q_f32(b + i + 12));
+    }
+    for (; i + 4 <= dim; i += 4) {
+        sum0 = vfmaq_f32(sum0, vld1q_f32(a + i), vld1q_f32(b + i));
+    }
+    float result = vaddvq_f32(vaddq_f32(vaddq_f32(sum0, sum1), vaddq_f32(sum2, sum3)));
+#else
+    // armeabi-v7a does not guarantee VFPv4, use the non-fused multiply-accumulate
+    for (; i + 16 <= dim; i += 16) {
+        sum0 = vmlaq_f32(sum0, vld1q_f32(a + i), vld1q_f32(b + i));
+        sum1 = vmlaq_f32(sum1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+        sum2 = vmlaq_f32(sum2, vld1q_f32(a + i + 8), vld1q_f32(b + i + 8));
+        sum3 = vmlaq_f32(sum3, vld1q_f32(a + i + 12), vld1q_f32(b + i + 12));
+    }
+    for (; i + 4 <= dim; i += 4) {
+        sum0 = vmlaq_f32(sum0, vld1q_f32(a + i), vld1q_f32(b + i));
+    }
+    float32x4_t sum   = vaddq_f32(vaddq_f32(sum0, sum1), vaddq_f32(sum2, sum3));
+    float32x2_t sum64 = vadd_f32(vget_low_f32(sum), vget_high_f32(sum));
+    float       result = vget_lane_f32(vpadd_f32(sum64, sum64), 0);
+#endif
+    for (; i < dim; i++) {
+        result += a[i] * b[i];
+    }
+    return result;
+}
+
+static void
+dotProductBlockNEON(const float* queries, size_t numQueries, const float* rows, size_t numRows, size_t dim,
+                    float* scores) {
+    size_t q = 0;
+    for (; q + 4 <= numQueries; q += 4) {
+        const float* q0 = queries + q * dim;
+        const float* q1 = q0 + dim;
+        const float* q2 = q1 + dim;
+        const float* q3 = q2 + dim;
+        for (size_t r = 0; r < numRows; r++) {
+            const float* row  = rows + r * dim;
+            float32x4_t  sum0 = vdupq_n_f32(0.0f);
+            float32x4_t  sum1 = vdupq_n_f32(0.0f);
+            float32x4_t  sum2 = vdupq_n_f32(0.0f);
+            float32x4_t  sum3 = vdupq_n_f32(0.0f);
+            for (size_t i = 0; i < dim; i += 4) {
+                float32x4_t v = vld1q_f32(row + i);
+#if defined(__aarch64__)
+                sum0 = vfmaq_f32(sum0, vld1q_f32(q0 + i), v);
+                sum1 = vfmaq_f32(sum1, vld1q_f32(q1 + i), v);
+                sum2 = vfmaq_f32(sum2, vld1q_f32(q2 + i), v);
+                sum3 = vfmaq_f32(sum3, vld1q_f32(q3 + i), v);
+#else
+                sum0 = vmlaq_f32(sum0, vld1q_f32(q0 + i), v);
+                sum1 = vmlaq_f32(sum1, vld1q_f32(q1 + i), v);
+                sum2 = vmlaq_f32(sum2, vld1q_f32(q2 + i), v);
+                sum3 = vmlaq_f32(sum3, vld1q_f32(q3 + i), v);
+#endif
+            }
+            // lane j of the pairwise sums is the dot product of query j
+            float results[4];
+#if defined(__aarch64__)
+            vst1q_f32(results, vpaddq_f32(vpaddq_f32(sum0, sum1), vpaddq_f32(sum2, sum3)));
+#else
+            float32x2_t sum01 = vpadd_f32(vadd_f32(vget_low_f32(sum0), vget_high_f32(sum0)),
+                                          vadd_f32(vget_low_f32(sum1), vget_high_f32(sum1)));
+            float32x2_t sum23 = vpadd_f32(vadd_f32(vget_low_f32(sum2), vget_high_f32(sum2)),
+                                          vadd_f32(vget_low_f32(sum3), vget_high_f32(sum3)));
+            vst1q_f32(results, vcombine_f32(sum01, sum23));
+#endif
+            for (size_t j = 0; j < 4; j++) {
+                scores[(q + j) * numRows + r] = results[j];
+            }
+        }
+    }
+    for (; q < numQueries; q++) {
+        for (size_t r = 0; r < numRows; r++) {
+            scores[q * numRows + r] = dotProductNEON(queries + q * dim, rows + r * dim, dim);
+        }
+    }
+}
+
+static int32_t
+dotProductInt8NEON(const int8_t* a, const int8_t* b, size_t dim) {
+    int32x4_t sum = vdupq_n_s32(0);
+    for (size_t i = 0; i < dim; i += 16) {
+        int8x16_t va       = vld1q_s8(a + i);
+        int8x16_t vb       = vld1q_s8(b + i);
+        int16x8_t products = vmull_s8(vget_low_s8(va), vget_low_s8(vb));
+        products           = vmlal_s8(products, vget_high_s8(va), vget_high_s8(vb));
+        sum                = vpadalq_s16(sum, products);
+    }
+#if defined(__aarch64__)
+    return vaddvq_s32(sum);
+#else
+    int32x2_t sum64 = vadd_s32(vget_low_s32(sum), vget_high_s32(sum));
+    return vget_lane_s32(vpadd_s32(sum64, sum64), 0);
+#endif
+}
+
+static uint32_t
+hammingDistanceNEON(const uint64_t* a, const uint64_t* b, size_t numWords) {
+    const uint8_t* bytesA = reinterpret_cast<const uint8_t*>(a);
+    const uint8_t* bytesB = reinterpret_cast<const uint8_t*>(b);
+    size_t         i      = 0;
+    uint32x4_t     sum    = vdupq_n_u32(0);
+    for (; i + 2 <= numWords; i += 2) {
+        uint8x16_t bits = vcntq_u8(veorq_u8(vld1q_u8(bytesA + i * 8), vld1q_u8(bytesB + i * 8)));
+        sum             = vpadalq_u16(sum, vpaddlq_u8(bits));
+    }
+#if defined(__aarch64__)
+    uint32_t distance = vaddvq_u32(sum);
+#else
+    uint32x2_t sum64    = vadd_u32(vget_low_u32(sum), vget_high_u32(sum));
+    uint32_t   distance = vget_lane_u32(vpadd_u32(sum64, sum64), 0);
+#endif
+    for (; i < numWords; i++) {
+        distance += __builtin_popcountll(a[i] ^ b[i]);
+    }
+    return distance;
+}
+#endif
+
+std::vector<VectorKernels>
+getAvailableVectorKernels() {
+    std::vector<VectorKernels> kernels = {
+        { "scalar", dotProductScalar, dotProductBlockScalar, dotProductInt8Scalar, hammingDistanceScalar }
+    };
+#if defined(VECTOR_KERNELS_X86)
+    __builtin_cpu_init();
+    HammingDistanceFn hammingDistance =
+        __builtin_cpu_supports("popcnt") ? hammingDistancePopcnt : hammingDistanceScalar;
+    if (__builtin_cpu_supports("ssse3")) {
+        kernels.push_back({ "sse", dotProductSSE, dotProductBlockSSE, dotProductInt8SSSE3, hammingDistance });
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        kernels.push_back({ "avx2", dotProductAVX2, dotProductBlockAVX2, dotProductInt8AVX2, hammingDistance });
+    }
+#elif defined(VECTOR_KERNELS_NEON)
+    kernels.push_back({ "neon", dotProductNEON, dotProductBlockNEON, dotProductInt8NEON, hammingDistanceNEON });
+#endif
+    return kernels;
+}
+
+const VectorKernels&
+getVectorKernels() {
+    static const VectorKernels kernels = getAvailableVectorKernels().back();
+    return kernels;
+}
+
+void
+normalizeVector(float* vector, size_t dim) {
+    float norm = std::sqrt(getVectorKernels().dotProduct(vector, vector, dim));
+    if (norm == 0.0f) {
+        return;
+    }
+    for (size_t i = 0; i < dim; i++) {
+        vector[i] /= norm;
+    }
+}
+
+float
+quantizeInt8(const float* vector, size_t dim, int8_t* codes) {
+    float maxAbs = 0.0f;
+    for (size_t i = 0; i < dim; i++) {
+        maxAbs = std::max(maxAbs, std::fabs(vector[i]));
+    }
+    if (maxAbs == 0.0f) {
+        std::fill(codes, codes + dim, 0);
+        return 0.0f;
+    }
+    float scale = 127.0f / maxAbs;
+    for (size_t i = 0; i < dim; i++) {
+        codes[i] = static_cast<int8_t>(std::lround(vector[i] * scale));
+    }
+    return maxAbs / 127.0f;
+}
+
+void
+quantizeBinary(const float* vector, size_t dim, uint64_t* bits, size_t numWords) {
+    std::fill(bits, bits + numWords, 0);
+    for (size_t i = 0; i < dim; i++) {
+        if (vector[i] > 0.0f) {
+            bits[i / 64] |= uint64_t(1) << (i % 64);
+        }
+    }
+}
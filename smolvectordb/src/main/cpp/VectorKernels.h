@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// computes the dot product of two float vectors with `dim` elements
+typedef float (*DotProductFn)(const float* a, const float* b, size_t dim);
+
+// computes the dot products of `numQueries` queries with `numRows` rows, both row-major with
+// `dim` floats per row, into scores[q * numRows + r]. `dim` is a multiple of 16. Each row is
+// loaded once for a block of queries, so the queries share a pass over the rows
+typedef void (*DotProductBlockFn)(const float* queries, size_t numQueries, const float* rows, size_t numRows,
+                                  size_t dim, float* scores);
+
+// computes the dot product of two int8 vectors with `dim` elements, `dim` is a multiple of 64
+// and the elements are in [-127, 127]
+typedef int32_t (*Int8DotProductFn)(const int8_t* a, const int8_t* b, size_t dim);
+
+// computes the number of differing bits of two bit vectors with `numWords` 64-bit words
+typedef uint32_t (*HammingDistanceFn)(const uint64_t* a, const uint64_t* b, size_t numWords);
+
+struct VectorKernels {
+    const char*       name;
+    DotProductFn      dotProduct;
+    DotProductBlockFn dotProductBlock;
+    Int8DotProductFn  dotProductInt8;
+    HammingDistanceFn hammingDistance;
+};
+
+// Returns the fastest kernels supported by the CPU, selected once at runtime
+// (AVX2 > SSE on x86, NEON on ARM, scalar otherwise)
+const VectorKernels& getVectorKernels();
+
+// Returns all kernels supported by the CPU, slowest first
+std::vector<VectorKernels> getAvailableVectorKernels();
+
+// Scales `vector` to unit L2 norm, zero vectors are left unchanged
+void normalizeVector(float* vector, size_t dim);
+
+// Quantizes `vector` to int8 codes in [-127, 127] with a symmetric scale and returns the
+// factor that maps the codes back to floats (vector[i] ~ codes[i] * factor)
+float quantizeInt8(const float* vector, size_t dim, int8_t* codes);
+
+// Sets bit i of `bits` if vector[i] > 0, `bits` holds `numWords` 64-bit words
+void quantizeBinary(const float* vector, size_t dim, uint64_t* bits, size_t numWords);
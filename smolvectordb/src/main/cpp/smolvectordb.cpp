@@ -1,61 +1,287 @@
-#include "VectorDB.cpp"
+#include "VectorDB.h"
+#include <algorithm>
 #include <jni.h>
+#include <stdexcept>
 #include <string>
 
 extern "C" JNIEXPORT jlong JNICALL
-Java_io_shubham0204_smolvectordb_SmolVectorDB_initialize(JNIEnv* env, jobject thiz) {
-    VectorDB* db = new VectorDB();
-    return reinterpret_cast<jlong>(db);
+Java_io_shubham0204_smolvectordb_SmolVectorDB_initialize(JNIEnv* env, jobject thiz, jint embeddingDim,
+                                                         jboolean useHNSW, jint hnswM, jint hnswEfConstruction,
+                                                         jint hnswEfSearch, jint quantization, jint rerankFactor,
+                                                         jstring fullPrecisionPath, jstring path, jint numThreads) {
+    HNSWParams hnswParams;
+    hnswParams.M              = hnswM;
+    hnswParams.efConstruction = hnswEfConstruction;
+    hnswParams.efSearch       = hnswEfSearch;
+
+    // `quantization` is the ordinal of SmolVectorDB.Quantization: none, int8 or binary
+    QuantizationParams quantizationParams;
+    quantizationParams.type         = static_cast<VectorDBQuantization>(quantization);
+    quantizationParams.rerankFactor = rerankFactor;
+    if (fullPrecisionPath != nullptr) {
+        const char* path                     = env->GetStringUTFChars(fullPrecisionPath, 0);
+        quantizationParams.fullPrecisionPath = path;
+        env->ReleaseStringUTFChars(fullPrecisionPath, path);
+    }
+    std::string dbPath;
+    if (path != nullptr) {
+        const char* nativePath = env->GetStringUTFChars(path, 0);
+        dbPath                 = nativePath;
+        env->ReleaseStringUTFChars(path, nativePath);
+    }
+
+    try {
+        VectorDB* db = new VectorDB(embeddingDim, useHNSW ? VectorDBIndexType::HNSW : VectorDBIndexType::Flat,
+                                    hnswParams, quantizationParams, dbPath, std::max(numThreads, 1));
+        return reinterpret_cast<jlong>(db);
+    } catch (const std::invalid_argument& e) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), e.what());
+    } catch (const std::runtime_error& e) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), e.what());
+    }
+    return 0;
 }
 
 extern "C" JNIEXPORT void JNICALL
+Java_io_shubham0204_smolvectordb_SmolVectorDB_setEfSearch(JNIEnv* env, jobject thiz, jlong handle, jint efSearch) {
+    VectorDB* db = reinterpret_cast<VectorDB*>(handle);
+    db->setEfSearch(efSearch);
+}
+
+// reused across calls on the same thread, so searches do not allocate
+static thread_local std::vector<VectorDBResult> results;
+static thread_local std::vector<float>          embeddingBuffer;
+
+// copies the Java array into `embeddingBuffer` once, without pinning it
+static const float*
+copyEmbedding(JNIEnv* env, jfloatArray embedding, jsize dim) {
+    embeddingBuffer.resize(dim);
+    env->GetFloatArrayRegion(embedding, 0, dim, embeddingBuffer.data());
+    return embeddingBuffer.data();
+}
+
+// returns the address of `count` floats at `offset` in the direct `buffer`, or throws an
+// IllegalArgumentException and returns null if the buffer is not direct or too small
+static const float*
+getDirectFloats(JNIEnv* env, jobject buffer, jint offset, jlong count) {
+    const float* address  = static_cast<const float*>(env->GetDirectBufferAddress(buffer));
+    jlong        capacity = env->GetDirectBufferCapacity(buffer);
+    if (address == nullptr || offset < 0 || offset + count > capacity) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"),
+                      "expected a direct buffer with enough floats");
+        return nullptr;
+    }
+    return address + offset;
+}
+
+extern "C" JNIEXPORT jint JNICALL
 Java_io_shubham0204_smolvectordb_SmolVectorDB_insertRecord(JNIEnv* env, jobject thiz, jlong handle, jstring text,
                                                            jfloatArray embedding) {
-    VectorDB*   db              = reinterpret_cast<VectorDB*>(handle);
-    const char* nativeText      = env->GetStringUTFChars(text, 0);
-    jfloat*     nativeEmbedding = env->GetFloatArrayElements(embedding, 0);
+    VectorDB*    db              = reinterpret_cast<VectorDB*>(handle);
+    jsize        dim             = env->GetArrayLength(embedding);
+    const float* nativeEmbedding = copyEmbedding(env, embedding, dim);
+    const char*  nativeText      = env->GetStringUTFChars(text, 0);
 
-    std::array<float, EMBEDDING_DIM> embeddingArray;
-    for (int i = 0; i < EMBEDDING_DIM; ++i) {
-        embeddingArray[i] = nativeEmbedding[i];
+    jint id = -1;
+    try {
+        id = static_cast<jint>(db->insertRecord(nativeText, nativeEmbedding, dim));
+    } catch (const std::invalid_argument& e) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), e.what());
+    } catch (const std::runtime_error& e) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), e.what());
     }
 
-    db->insertRecord(VectorDBRecord(nativeText, embeddingArray));
-
     env->ReleaseStringUTFChars(text, nativeText);
-    env->ReleaseFloatArrayElements(embedding, nativeEmbedding, 0);
+    return id;
 }
 
-extern "C" JNIEXPORT jobject JNICALL
-Java_io_shubham0204_smolvectordb_SmolVectorDB_nearestNeighbor(JNIEnv* env, jobject thiz, jlong handle,
-                                                              jfloatArray query, jint k) {
-    VectorDB* db          = reinterpret_cast<VectorDB*>(handle);
-    jfloat*   nativeQuery = env->GetFloatArrayElements(query, 0);
+extern "C" JNIEXPORT jint JNICALL
+Java_io_shubham0204_smolvectordb_SmolVectorDB_insertBatch(JNIEnv* env, jobject thiz, jlong handle,
+                                                          jobjectArray texts, jobject embeddings, jint offset,
+                                                          jint dim) {
+    VectorDB*    db               = reinterpret_cast<VectorDB*>(handle);
+    jsize        count            = env->GetArrayLength(texts);
+    const float* nativeEmbeddings = getDirectFloats(env, embeddings, offset, static_cast<jlong>(count) * dim);
+    if (nativeEmbeddings == nullptr) {
+        return -1;
+    }
+    std::vector<std::string>      nativeTexts(count);
+    std::vector<std::string_view> textViews(count);
+    for (jsize i = 0; i < count; i++) {
+        jstring     text       = static_cast<jstring>(env->GetObjectArrayElement(texts, i));
+        const char* nativeText = env->GetStringUTFChars(text, 0);
+        nativeTexts[i]         = nativeText;
+        textViews[i]           = nativeTexts[i];
+        env->ReleaseStringUTFChars(text, nativeText);
+        env->DeleteLocalRef(text);
+    }
 
-    std::array<float, EMBEDDING_DIM> queryArray;
-    for (int i = 0; i < EMBEDDING_DIM; ++i) {
-        queryArray[i] = nativeQuery[i];
+    jint firstId = -1;
+    try {
+        firstId = static_cast<jint>(db->insertRecords(textViews.data(), count, nativeEmbeddings, dim));
+    } catch (const std::invalid_argument& e) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), e.what());
+    } catch (const std::runtime_error& e) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), e.what());
     }
+    return firstId;
+}
 
-    std::vector<VectorDBRecord> neighbors = db->nearestNeighbor(queryArray, k);
-    env->ReleaseFloatArrayElements(query, nativeQuery, 0);
+extern "C" JNIEXPORT void JNICALL
+Java_io_shubham0204_smolvectordb_SmolVectorDB_deleteRecord(JNIEnv* env, jobject thiz, jlong handle, jint id) {
+    VectorDB* db = reinterpret_cast<VectorDB*>(handle);
+    if (id < 0 || static_cast<size_t>(id) >= db->size()) {
+        env->ThrowNew(env->FindClass("java/lang/IndexOutOfBoundsException"), "invalid record ID");
+        return;
+    }
+    db->deleteRecord(id);
+}
 
-    jclass    listClass       = env->FindClass("java/util/ArrayList");
-    jmethodID listConstructor = env->GetMethodID(listClass, "<init>", "()V");
-    jobject   list            = env->NewObject(listClass, listConstructor);
-    jmethodID addMethod       = env->GetMethodID(listClass, "add", "(Ljava/lang/Object;)Z");
+extern "C" JNIEXPORT void JNICALL
+Java_io_shubham0204_smolvectordb_SmolVectorDB_compact(JNIEnv* env, jobject thiz, jlong handle) {
+    VectorDB* db = reinterpret_cast<VectorDB*>(handle);
+    try {
+        db->compact();
+    } catch (const std::runtime_error& e) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), e.what());
+    }
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_io_shubham0204_smolvectordb_SmolVectorDB_sync(JNIEnv* env, jobject thiz, jlong handle) {
+    VectorDB* db = reinterpret_cast<VectorDB*>(handle);
+    try {
+        db->sync();
+    } catch (const std::runtime_error& e) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), e.what());
+    }
+}
+
+// runs the query and stores the neighbors in `results`, returns false if an exception was thrown
+static bool
+search(JNIEnv* env, VectorDB* db, jfloatArray query, jint k) {
+    jsize        dim         = env->GetArrayLength(query);
+    const float* nativeQuery = copyEmbedding(env, query, dim);
+    bool         success     = true;
+    try {
+        db->nearestNeighbor(nativeQuery, dim, k, results);
+    } catch (const std::invalid_argument& e) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), e.what());
+        success = false;
+    } catch (const std::runtime_error& e) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), e.what());
+        success = false;
+    }
+    return success;
+}
 
-    for (const auto& neighbor : neighbors) {
-        jstring neighborText = env->NewStringUTF(neighbor.text.c_str());
-        env->CallBooleanMethod(list, addMethod, neighborText);
+extern "C" JNIEXPORT jobjectArray JNICALL
+Java_io_shubham0204_smolvectordb_SmolVectorDB_nearestNeighbor(JNIEnv* env, jobject thiz, jlong handle,
+                                                              jfloatArray query, jint k) {
+    VectorDB* db = reinterpret_cast<VectorDB*>(handle);
+    if (!search(env, db, query, k)) {
+        return nullptr;
+    }
+    jobjectArray texts = env->NewObjectArray(static_cast<jsize>(results.size()), env->FindClass("java/lang/String"),
+                                             nullptr);
+    for (size_t i = 0; i < results.size(); i++) {
+        jstring neighborText = env->NewStringUTF(std::string(db->getText(results[i].id)).c_str());
+        env->SetObjectArrayElement(texts, static_cast<jsize>(i), neighborText);
         env->DeleteLocalRef(neighborText);
     }
+    return texts;
+}
 
-    return list;
+extern "C" JNIEXPORT jint JNICALL
+Java_io_shubham0204_smolvectordb_SmolVectorDB_search(JNIEnv* env, jobject thiz, jlong handle, jfloatArray query,
+                                                     jint k, jintArray ids, jfloatArray scores) {
+    VectorDB* db = reinterpret_cast<VectorDB*>(handle);
+    k            = std::min(k, std::min(env->GetArrayLength(ids), env->GetArrayLength(scores)));
+    if (!search(env, db, query, k)) {
+        return 0;
+    }
+    jint    count        = static_cast<jint>(results.size());
+    jint*   nativeIds    = static_cast<jint*>(env->GetPrimitiveArrayCritical(ids, nullptr));
+    jfloat* nativeScores = static_cast<jfloat*>(env->GetPrimitiveArrayCritical(scores, nullptr));
+    for (jint i = 0; i < count; i++) {
+        nativeIds[i]    = static_cast<jint>(results[i].id);
+        nativeScores[i] = results[i].score;
+    }
+    env->ReleasePrimitiveArrayCritical(scores, nativeScores, 0);
+    env->ReleasePrimitiveArrayCritical(ids, nativeIds, 0);
+    return count;
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_io_shubham0204_smolvectordb_SmolVectorDB_searchBatch(JNIEnv* env, jobject thiz, jlong handle, jobject queries,
+                                                          jint offset, jint numQueries, jint dim, jint k,
+                                                          jintArray ids, jfloatArray scores) {
+    VectorDB*    db            = reinterpret_cast<VectorDB*>(handle);
+    const float* nativeQueries = getDirectFloats(env, queries, offset, static_cast<jlong>(numQueries) * dim);
+    if (nativeQueries == nullptr) {
+        return;
+    }
+    try {
+        db->nearestNeighborBatch(nativeQueries, numQueries, dim, k, results);
+    } catch (const std::invalid_argument& e) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), e.what());
+        return;
+    } catch (const std::runtime_error& e) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), e.what());
+        return;
+    }
+    // the padding ID UINT32_MAX becomes -1
+    jint*   nativeIds    = static_cast<jint*>(env->GetPrimitiveArrayCritical(ids, nullptr));
+    jfloat* nativeScores = static_cast<jfloat*>(env->GetPrimitiveArrayCritical(scores, nullptr));
+    for (size_t i = 0; i < results.size(); i++) {
+        nativeIds[i]    = static_cast<jint>(results[i].id);
+        nativeScores[i] = results[i].score;
+    }
+    env->ReleasePrimitiveArrayCritical(scores, nativeScores, 0);
+    env->ReleasePrimitiveArrayCritical(ids, nativeIds, 0);
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_io_shubham0204_smolvectordb_SmolVectorDB_getText(JNIEnv* env, jobject thiz, jlong handle, jint id) {
+    VectorDB* db = reinterpret_cast<VectorDB*>(handle);
+    if (id < 0 || static_cast<size_t>(id) >= db->size()) {
+        env->ThrowNew(env->FindClass("java/lang/IndexOutOfBoundsException"), "invalid record ID");
+        return nullptr;
+    }
+    return env->NewStringUTF(std::string(db->getText(id)).c_str());
+}
+
+extern "C" JNIEXPORT jlong JNICALL
+Java_io_shubham0204_smolvectordb_SmolVectorDB_getMemoryUsage(JNIEnv* env, jobject thiz, jlong handle) {
+    VectorDB* db = reinterpret_cast<VectorDB*>(handle);
+    return static_cast<jlong>(db->getMemoryUsage());
+}
+
+extern "C" JNIEXPORT jint JNICALL
+Java_io_shubham0204_smolvectordb_SmolVectorDB_size(JNIEnv* env, jobject thiz, jlong handle) {
+    VectorDB* db = reinterpret_cast<VectorDB*>(handle);
+    return static_cast<jint>(db->size());
+}
+
+extern "C" JNIEXPORT jint JNICALL
+Java_io_shubham0204_smolvectordb_SmolVectorDB_getNumDeleted(JNIEnv* env, jobject thiz, jlong handle) {
+    VectorDB* db = reinterpret_cast<VectorDB*>(handle);
+    return static_cast<jint>(db->getNumDeleted());
+}
+
+extern "C" JNIEXPORT jint JNICALL
+Java_io_shubham0204_smolvectordb_SmolVectorDB_getEmbeddingDim(JNIEnv* env, jobject thiz, jlong handle) {
+    VectorDB* db = reinterpret_cast<VectorDB*>(handle);
+    return static_cast<jint>(db->getDim());
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_io_shubham0204_smolvectordb_SmolVectorDB_getVectorKernelName(JNIEnv* env, jobject thiz) {
+    return env->NewStringUTF(getVectorKernels().name);
 }
 
 extern "C" JNIEXPORT void JNICALL
 Java_io_shubham0204_smolvectordb_SmolVectorDB_close(JNIEnv* env, jobject thiz, jlong handle) {
     VectorDB* db = reinterpret_cast<VectorDB*>(handle);
     delete db;
-}
\ No newline at end of file
+}
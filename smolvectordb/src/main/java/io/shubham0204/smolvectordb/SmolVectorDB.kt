@@ -1,6 +1,100 @@
 package io.shubham0204.smolvectordb
 
-class SmolVectorDB {
+import java.io.File
+import java.nio.ByteOrder
+import java.nio.FloatBuffer
+
+/**
+ * A vector database that retrieves the texts whose embeddings are the most similar
+ * (cosine similarity) to a query embedding.
+ *
+ * [search], [searchBatch], [nearestNeighbor] and [getText] can be called from several threads at
+ * once, the searches of a database share scratch buffers and are run one at a time. Inserting,
+ * deleting, [compact], [sync], [setEfSearch] and [close] must not run concurrently with any other
+ * call.
+ *
+ * @param embeddingDim dimension of the embeddings stored in the database. If 0, the dimension is
+ *   taken from the first inserted record. Embeddings and queries of any other dimension are
+ *   rejected with an [IllegalArgumentException]
+ * @param index index used to answer queries, see [Index]
+ * @param quantization compression of the embeddings held in memory, see [Quantization]. Only
+ *   supported with [Index.Flat]
+ * @param file database file, opened if it exists and created otherwise. The records are
+ *   memory-mapped from the file and appended to it as they are inserted, so reopening a database
+ *   does not re-insert them. If null, the database is kept in memory. The [index] and
+ *   [quantization] are not stored in the file and can differ between sessions
+ * @param numThreads number of threads an exhaustive search ([Index.Flat], with or without
+ *   quantization) is split across, including the calling thread. The worker threads are started
+ *   once and reused by every query. Small databases are searched on the calling thread only
+ */
+class SmolVectorDB(
+    embeddingDim: Int = 0,
+    index: Index = Index.Flat,
+    quantization: Quantization = Quantization.None,
+    file: File? = null,
+    numThreads: Int = 1,
+) {
+    /** The index used to find the nearest neighbors of a query */
+    sealed class Index {
+        /** Exhaustive search over all records, exact results with a latency linear in the records */
+        data object Flat : Index()
+
+        /**
+         * Approximate search over a Hierarchical Navigable Small World graph, built incrementally
+         * as records are inserted
+         *
+         * @property m number of links per node, higher values improve recall and use more memory
+         * @property efConstruction size of the candidate list while inserting, higher values build
+         *   a better graph at a slower insertion
+         * @property efSearch size of the candidate list while searching, higher values improve
+         *   recall at a higher latency. Can be changed later with [setEfSearch]
+         */
+        data class HNSW(val m: Int = 16, val efConstruction: Int = 200, val efSearch: Int = 64) :
+            Index()
+    }
+
+    /**
+     * A neighbor returned by [search]
+     *
+     * @property id ID of the record, assigned in insertion order starting from 0
+     * @property score cosine similarity between the record and the query
+     */
+    data class SearchResult(val id: Int, val score: Float)
+
+    /**
+     * Compression of the embeddings held in memory. With [Int8] or [Binary], a query scans the
+     * compressed codes and re-ranks the `k * rerankFactor` best candidates with the float32
+     * embeddings, which are read from the disk: from the database file if there is one, from
+     * [Int8.fullPrecisionFile] / [Binary.fullPrecisionFile] otherwise.
+     */
+    sealed class Quantization {
+        /** float32 embeddings, exact scores */
+        data object None : Quantization()
+
+        /**
+         * 8-bit codes with one scale per embedding, 4x less memory than float32
+         *
+         * @property fullPrecisionFile file that stores the float32 embeddings for re-ranking,
+         *   overwritten when the database is created. If null, a temporary file is created in
+         *   `java.io.tmpdir` (the cache directory of the app on Android). Unused with a database file
+         * @property rerankFactor number of candidates re-ranked per requested neighbor
+         */
+        data class Int8(val fullPrecisionFile: File? = null, val rerankFactor: Int = 4) :
+            Quantization()
+
+        /**
+         * 1 bit (the sign) per dimension compared with the Hamming distance, 32x less memory than
+         * float32. Needs a larger [rerankFactor] than [Int8] for the same recall
+         *
+         * @property fullPrecisionFile file that stores the float32 embeddings for re-ranking,
+         *   overwritten when the database is created. If null, a temporary file is created in
+         *   `java.io.tmpdir` (the cache directory of the app on Android). Unused with a database file
+         * @property rerankFactor number of candidates re-ranked per requested neighbor
+         */
+        data class Binary(val fullPrecisionFile: File? = null, val rerankFactor: Int = 32) :
+            Quantization()
+    }
+
     companion object {
         init {
             System.loadLibrary("smolvectordb")
@@ -10,26 +104,250 @@ class SmolVectorDB {
     private val handle: Long
 
     init {
-        handle = initialize()
+        require(embeddingDim >= 0) { "embeddingDim must be non-negative" }
+        val (quantizationType, rerankFactor, fullPrecisionFile) =
+            when (quantization) {
+                is Quantization.None -> Triple(0, 1, null)
+                is Quantization.Int8 ->
+                    Triple(1, quantization.rerankFactor, quantization.fullPrecisionFile)
+                is Quantization.Binary ->
+                    Triple(2, quantization.rerankFactor, quantization.fullPrecisionFile)
+            }
+        require(rerankFactor >= 1) { "rerankFactor must be positive" }
+        require(numThreads >= 1) { "numThreads must be positive" }
+        require(quantization is Quantization.None || index is Index.Flat) {
+            "quantization is only supported with Index.Flat"
+        }
+        // the native database keeps the temporary file open, it is deleted once the database is created
+        val tempFullPrecisionFile =
+            if (quantization !is Quantization.None && file == null && fullPrecisionFile == null) {
+                File.createTempFile("smolvectordb", ".f32")
+            } else {
+                null
+            }
+        val fullPrecisionPath = (fullPrecisionFile ?: tempFullPrecisionFile)?.absolutePath
+        handle =
+            try {
+                when (index) {
+                    is Index.Flat ->
+                        initialize(
+                            embeddingDim,
+                            false,
+                            0,
+                            0,
+                            0,
+                            quantizationType,
+                            rerankFactor,
+                            fullPrecisionPath,
+                            file?.absolutePath,
+                            numThreads,
+                        )
+                    is Index.HNSW -> {
+                        require(index.m >= 2 && index.efConstruction >= 1 && index.efSearch >= 1) {
+                            "invalid HNSW parameters: $index"
+                        }
+                        initialize(
+                            embeddingDim,
+                            true,
+                            index.m,
+                            index.efConstruction,
+                            index.efSearch,
+                            quantizationType,
+                            rerankFactor,
+                            null,
+                            file?.absolutePath,
+                            numThreads,
+                        )
+                    }
+                }
+            } finally {
+                tempFullPrecisionFile?.delete()
+            }
+    }
+
+    /** Inserts a record and returns its ID */
+    fun insertRecord(text: String, embedding: FloatArray): Int {
+        return insertRecord(handle, text, embedding)
+    }
+
+    /**
+     * Inserts `texts.size` records in one call and returns the ID of the first one, the others
+     * follow in order. [embeddings] is a direct buffer in native byte order (see
+     * [java.nio.ByteBuffer.allocateDirect]) holding the embeddings one after the other from its
+     * position to its limit, it is read without copying
+     */
+    fun insertBatch(texts: List<String>, embeddings: FloatBuffer): Int {
+        require(texts.isNotEmpty()) { "texts must not be empty" }
+        val dim = checkDirectBuffer(embeddings, texts.size)
+        return insertBatch(handle, texts.toTypedArray(), embeddings, embeddings.position(), dim)
+    }
+
+    /**
+     * Searches `ids.size / k` queries in one call. [queries] is a direct buffer in native byte
+     * order holding the queries one after the other from its position to its limit. The IDs and
+     * scores of the [k] neighbors of query q are written to [ids] and [scores] from index `q * k`,
+     * most similar first. If a query has fewer than [k] neighbors, the remaining IDs are -1.
+     * Without an index or quantization, the queries share each pass over the embeddings, which is
+     * faster than searching them one by one
+     */
+    fun searchBatch(queries: FloatBuffer, k: Int, ids: IntArray, scores: FloatArray) {
+        require(k >= 1 && ids.size == scores.size && ids.size % k == 0) {
+            "ids and scores must have the same size, a multiple of k"
+        }
+        val numQueries = ids.size / k
+        val dim = checkDirectBuffer(queries, numQueries)
+        searchBatch(handle, queries, queries.position(), numQueries, dim, k, ids, scores)
+    }
+
+    // returns the dimension of the `count` vectors in `buffer`
+    private fun checkDirectBuffer(buffer: FloatBuffer, count: Int): Int {
+        require(buffer.isDirect && buffer.order() == ByteOrder.nativeOrder()) {
+            "expected a direct buffer in native byte order"
+        }
+        require(count > 0 && buffer.remaining() % count == 0) {
+            "the buffer holds ${buffer.remaining()} floats, not a multiple of $count vectors"
+        }
+        return buffer.remaining() / count
+    }
+
+    /**
+     * Marks the record [id] as deleted, it is no longer returned by searches. The IDs of the other
+     * records do not change until [compact] is called
+     */
+    fun deleteRecord(id: Int) {
+        deleteRecord(handle, id)
+    }
+
+    /**
+     * Removes the deleted records from memory (and the database file) and renumbers the remaining
+     * records in their order of insertion
+     */
+    fun compact() {
+        compact(handle)
     }
 
-    fun insertRecord(text: String, embedding: FloatArray) {
-        insertRecord(handle, text, embedding)
+    /** Writes the index to the database file and flushes it to the disk, no-op without a file */
+    fun sync() {
+        sync(handle)
     }
 
     fun nearestNeighbor(query: FloatArray, k: Int): List<String> {
-        return nearestNeighbor(handle, query, k)
+        return nearestNeighbor(handle, query, k).asList()
     }
 
+    /**
+     * Returns the IDs and scores of the [k] records most similar to [query], most similar first.
+     * The texts can be fetched with [getText] only for the results that are needed.
+     */
+    fun search(query: FloatArray, k: Int): List<SearchResult> {
+        val ids = IntArray(k)
+        val scores = FloatArray(k)
+        val count = search(query, ids, scores)
+        return List(count) { SearchResult(ids[it], scores[it]) }
+    }
+
+    /**
+     * Writes the IDs and scores of the `ids.size` records most similar to [query] to the
+     * preallocated [ids] and [scores] arrays, most similar first. Returns the number of results
+     * written, which is less than `ids.size` if the database holds fewer records.
+     */
+    fun search(query: FloatArray, ids: IntArray, scores: FloatArray): Int {
+        require(ids.size == scores.size) { "ids and scores must have the same size" }
+        return search(handle, query, ids.size, ids, scores)
+    }
+
+    /** Sets the size of the candidate list of HNSW searches, has no effect with [Index.Flat] */
+    fun setEfSearch(efSearch: Int) {
+        require(efSearch >= 1) { "efSearch must be positive" }
+        setEfSearch(handle, efSearch)
+    }
+
+    /** Returns the text of the record [id] */
+    fun getText(id: Int): String = getText(handle, id)
+
+    /** Returns the bytes of native memory held by the embeddings and the index, excluding texts */
+    fun getMemoryUsage(): Long = getMemoryUsage(handle)
+
+    /** Returns the number of records in the database, including the deleted ones */
+    fun size(): Int = size(handle)
+
+    /** Returns the number of deleted records, which are removed by [compact] */
+    fun getNumDeleted(): Int = getNumDeleted(handle)
+
+    /** Returns the dimension of the embeddings, or 0 if no record has been inserted yet */
+    fun getEmbeddingDim(): Int = getEmbeddingDim(handle)
+
+    /** Returns the name of the similarity kernel selected for this CPU (scalar, sse, avx2 or neon) */
+    fun getKernelName(): String = getVectorKernelName()
+
+    /** Releases the database, the index is written to the database file if there is one */
     fun close() {
         close(handle)
     }
 
-    private external fun initialize(): Long
+    private external fun initialize(
+        embeddingDim: Int,
+        useHNSW: Boolean,
+        hnswM: Int,
+        hnswEfConstruction: Int,
+        hnswEfSearch: Int,
+        quantization: Int,
+        rerankFactor: Int,
+        fullPrecisionPath: String?,
+        path: String?,
+        numThreads: Int,
+    ): Long
+
+    private external fun setEfSearch(handle: Long, efSearch: Int)
+
+    private external fun insertRecord(handle: Long, text: String, embedding: FloatArray): Int
+
+    private external fun deleteRecord(handle: Long, id: Int)
+
+    private external fun compact(handle: Long)
+
+    private external fun sync(handle: Long)
+
+    private external fun insertBatch(
+        handle: Long,
+        texts: Array<String>,
+        embeddings: FloatBuffer,
+        offset: Int,
+        dim: Int,
+    ): Int
+
+    private external fun nearestNeighbor(handle: Long, query: FloatArray, k: Int): Array<String>
+
+    private external fun searchBatch(
+        handle: Long,
+        queries: FloatBuffer,
+        offset: Int,
+        numQueries: Int,
+        dim: Int,
+        k: Int,
+        ids: IntArray,
+        scores: FloatArray,
+    )
+
+    private external fun search(
+        handle: Long,
+        query: FloatArray,
+        k: Int,
+        ids: IntArray,
+        scores: FloatArray,
+    ): Int
+
+    private external fun getText(handle: Long, id: Int): String
+
+    private external fun getMemoryUsage(handle: Long): Long
+
+    private external fun size(handle: Long): Int
+
+    private external fun getNumDeleted(handle: Long): Int
 
-    private external fun insertRecord(handle: Long, text: String, embedding: FloatArray)
+    private external fun getEmbeddingDim(handle: Long): Int
 
-    private external fun nearestNeighbor(handle: Long, query: FloatArray, k: Int): List<String>
+    private external fun getVectorKernelName(): String
 
     private external fun close(handle: Long)
 }